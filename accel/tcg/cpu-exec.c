@@ -34,6 +34,7 @@
 #include "tcg/tcg.h"
 #include "qemu/atomic.h"
 #include "qemu/rcu.h"
+#include "qemu/timer.h"
 #include "exec/log.h"
 #include "qemu/main-loop.h"
 #include "exec/icount.h"
@@ -45,6 +46,7 @@
 #include "tb-hash.h"
 #include "tb-context.h"
 #include "tb-internal.h"
+#include "tb-spec.h"
 #include "internal-common.h"
 
 /**
@@ -239,21 +241,12 @@ static TranslationBlock *tb_htable_lookup(CPUState *cpu, TCGTBCPUState s)
 static inline TranslationBlock *tb_lookup(CPUState *cpu, TCGTBCPUState s)
 {
     TranslationBlock *tb;
-    CPUJumpCache *jc;
-    uint32_t hash;
 
     /* we should never be trying to look up an INVALID tb */
     tcg_debug_assert(!(s.cflags & CF_INVALID));
 
-    hash = tb_jmp_cache_hash_func(s.pc);
-    jc = cpu->tb_jmp_cache;
-
-    tb = qatomic_read(&jc->array[hash].tb);
-    if (likely(tb &&
-               jc->array[hash].pc == s.pc &&
-               tb->cs_base == s.cs_base &&
-               tb->flags == s.flags &&
-               tb_cflags(tb) == s.cflags)) {
+    tb = tb_jmp_cache_get(cpu->tb_jmp_cache, s);
+    if (likely(tb)) {
         goto hit;
     }
 
@@ -262,8 +255,8 @@ static inline TranslationBlock *tb_lookup(CPUState *cpu, TCGTBCPUState s)
         return NULL;
     }
 
-    jc->array[hash].pc = s.pc;
-    qatomic_set(&jc->array[hash].tb, tb);
+    /* A TLB flush in tb_htable_lookup() may have resized the cache. */
+    tb_jmp_cache_put(cpu->tb_jmp_cache, s.pc, tb);
 
 hit:
     /*
@@ -468,6 +461,7 @@ cpu_tb_exec(CPUState *cpu, TranslationBlock *itb, int *tb_exit)
 
     qemu_thread_jit_execute();
     ret = tcg_qemu_tb_exec(cpu_env(cpu), tb_ptr);
+    tb_spec_store_end();
     cpu->neg.can_do_io = true;
     qemu_plugin_disable_mem_helpers(cpu);
     /*
@@ -545,6 +539,7 @@ static void cpu_exec_longjmp_cleanup(CPUState *cpu)
 {
     /* Non-buggy compilers preserve this; assert the correct value. */
     g_assert(cpu == current_cpu);
+    tb_spec_store_end();
 
 #ifdef CONFIG_USER_ONLY
     clear_helper_retaddr();
@@ -1004,8 +999,9 @@ cpu_exec_loop(CPUState *cpu, SyncClocks *sc)
 
             tb = tb_lookup(cpu, s);
             if (tb == NULL) {
-                CPUJumpCache *jc;
-                uint32_t h;
+                unsigned room = qatomic_read(&tb_ctx.tb_flush_count) +
+                                qatomic_read(&tb_ctx.tb_evict_count);
+                int64_t stall = get_clock();
 
                 mmap_lock();
                 panda_callbacks_before_block_translate(cpu, s.pc);
@@ -1013,14 +1009,24 @@ cpu_exec_loop(CPUState *cpu, SyncClocks *sc)
                 panda_callbacks_after_block_translate(cpu, tb);
                 mmap_unlock();
 
+                /* What the vCPU spent waiting for code: see "info jit" */
+                qatomic_inc(&tb_ctx.tb_miss_count);
+                qatomic_add(&tb_ctx.tb_miss_ns, get_clock() - stall);
+
+                /*
+                 * In a serial context tb_gen_code() may have flushed or
+                 * evicted code to make room, last_tb's included.
+                 */
+                if (room != qatomic_read(&tb_ctx.tb_flush_count) +
+                            qatomic_read(&tb_ctx.tb_evict_count)) {
+                    last_tb = NULL;
+                }
+
                 /*
                  * We add the TB in the virtual pc hash table
                  * for the fast lookup
                  */
-                h = tb_jmp_cache_hash_func(s.pc);
-                jc = cpu->tb_jmp_cache;
-                jc->array[h].pc = s.pc;
-                qatomic_set(&jc->array[h].tb, tb);
+                tb_jmp_cache_put(cpu->tb_jmp_cache, s.pc, tb);
             }
 
 #ifndef CONFIG_USER_ONLY
@@ -1108,7 +1114,7 @@ bool tcg_exec_realizefn(CPUState *cpu, Error **errp)
         tcg_target_initialized = true;
     }
 
-    cpu->tb_jmp_cache = g_new0(CPUJumpCache, 1);
+    cpu->tb_jmp_cache = tb_jmp_cache_new(TB_JMP_CACHE_BITS);
     tlb_init(cpu);
 #ifndef CONFIG_USER_ONLY
     tcg_iommu_init_notifier_list(cpu);
@@ -1125,6 +1131,7 @@ void tcg_exec_unrealizefn(CPUState *cpu)
     tcg_iommu_free_notifier_list(cpu);
 #endif /* !CONFIG_USER_ONLY */
 
+    tb_spec_cpu_gone(cpu);
     tlb_destroy(cpu);
     g_free_rcu(cpu->tb_jmp_cache, rcu);
 }
@@ -43,8 +43,10 @@
 #include "qemu/atomic128.h"
 #include "tb-internal.h"
 #include "trace.h"
+#include "tb-jmp-cache.h"
 #include "tb-hash.h"
 #include "tb-internal.h"
+#include "tb-spec.h"
 #include "tlb-bounds.h"
 #include "internal-common.h"
 #ifdef CONFIG_PLUGIN
@@ -52,6 +54,7 @@
 #endif
 #include "tcg/tcg-ldst.h"
 #include "backend-ldst.h"
+#include "panda/v2p-cache.h"
 
 
 /* DEBUG defines, enable DEBUG_TLB_LOG to log to the CPU_LOG_MMU target */
@@ -149,16 +152,11 @@ static void tlb_window_reset(CPUTLBDesc *desc, int64_t ns,
 static void tb_jmp_cache_clear_page(CPUState *cpu, vaddr page_addr)
 {
     CPUJumpCache *jc = cpu->tb_jmp_cache;
-    int i, i0;
 
     if (unlikely(!jc)) {
         return;
     }
-
-    i0 = tb_jmp_cache_hash_page(page_addr);
-    for (i = 0; i < TB_JMP_PAGE_SIZE; i++) {
-        qatomic_set(&jc->array[i0 + i].tb, NULL);
-    }
+    tb_jmp_cache_inval_page(jc, page_addr);
 }
 
 /**
@@ -391,6 +389,7 @@ static void tlb_flush_by_mmuidx_async_work(CPUState *cpu, run_on_cpu_data data)
     qemu_spin_unlock(&cpu->neg.tlb.c.lock);
 
     tcg_flush_jmp_cache(cpu);
+    panda_v2p_cache_flush(cpu);
 
     if (to_clean == ALL_MMUIDX_BITS) {
         qatomic_set(&cpu->neg.tlb.c.full_flush_count,
@@ -551,6 +550,7 @@ static void tlb_flush_page_by_mmuidx_async_0(CPUState *cpu,
      */
     tb_jmp_cache_clear_page(cpu, addr - TARGET_PAGE_SIZE);
     tb_jmp_cache_clear_page(cpu, addr);
+    panda_v2p_cache_flush(cpu);
 }
 
 /**
@@ -735,11 +735,13 @@ static void tlb_flush_range_by_mmuidx_async_0(CPUState *cpu,
     }
     qemu_spin_unlock(&cpu->neg.tlb.c.lock);
 
+    panda_v2p_cache_flush(cpu);
+
     /*
      * If the length is larger than the jump cache size, then it will take
      * longer to clear each entry individually than it will to clear it all.
      */
-    if (d.len >= (TARGET_PAGE_SIZE * TB_JMP_CACHE_SIZE)) {
+    if (d.len >= ((vaddr)TARGET_PAGE_SIZE << cpu->tb_jmp_cache->bits)) {
         tcg_flush_jmp_cache(cpu);
         return;
     }
@@ -1341,6 +1343,7 @@ static void notdirty_write(CPUState *cpu, vaddr mem_vaddr, unsigned size,
     trace_memory_notdirty_write_access(mem_vaddr, ram_addr, size);
 
     if (!physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_CODE)) {
+        tb_spec_store_begin();
         tb_invalidate_phys_range_fast(cpu, ram_addr, size, retaddr);
     }
 
@@ -19,6 +19,8 @@ extern int64_t max_advance;
 
 extern bool one_insn_per_tb;
 
+extern bool tb_evict_enabled;
+
 extern bool icount_align_option;
 
 /*
@@ -48,6 +50,8 @@ static inline bool cpu_plugin_mem_cbs_enabled(const CPUState *cpu)
 }
 
 TranslationBlock *tb_gen_code(CPUState *cpu, TCGTBCPUState s);
+TranslationBlock *tb_gen_code_spec(CPUState *cpu, TCGTBCPUState s,
+                                   tb_page_addr_t phys_pc, void *host_pc);
 void page_init(void);
 void tb_htable_init(void);
 void tb_reset_jump(TranslationBlock *tb, int n);
@@ -10,10 +10,13 @@
 #include "qapi/error.h"
 #include "qapi/type-helpers.h"
 #include "qapi/qapi-commands-machine.h"
+#include "monitor/hmp.h"
 #include "monitor/monitor.h"
+#include "qobject/qdict.h"
 #include "system/tcg.h"
 #include "tcg/tcg.h"
 #include "internal-common.h"
+#include "panda/cb-profile.h"
 
 HumanReadableText *qmp_x_query_jit(Error **errp)
 {
@@ -29,9 +32,44 @@ HumanReadableText *qmp_x_query_jit(Error **errp)
     return human_readable_text_from_str(buf);
 }
 
+HumanReadableText *qmp_x_query_panda_profile(Error **errp)
+{
+    g_autoptr(GString) buf = g_string_new("");
+
+    tcg_dump_panda_profile(buf);
+
+    return human_readable_text_from_str(buf);
+}
+
+static void hmp_panda_profile(Monitor *mon, const QDict *qdict)
+{
+    const char *op = qdict_get_try_str(qdict, "op");
+
+    if (op == NULL) {
+        monitor_printf(mon, "panda-profile is %s\n",
+                       qatomic_read(&panda_cb_profiling) ? "on" : "off");
+        return;
+    }
+    if (!strcmp(op, "on")) {
+        panda_cb_profile_set(true);
+    } else if (!strcmp(op, "off")) {
+        panda_cb_profile_set(false);
+    } else if (!strcmp(op, "reset")) {
+        panda_cb_profile_reset();
+    } else {
+        Error *err = NULL;
+
+        error_setg(&err, "invalid parameter '%s',"
+                   " expecting 'on', 'off', or 'reset'", op);
+        hmp_handle_error(mon, err);
+    }
+}
+
 static void hmp_tcg_register(void)
 {
     monitor_register_hmp_info_hrt("jit", qmp_x_query_jit);
+    monitor_register_hmp_info_hrt("panda-profile", qmp_x_query_panda_profile);
+    monitor_register_hmp("panda-profile", false, hmp_panda_profile);
 }
 
 type_init(hmp_tcg_register);
@@ -36,7 +36,10 @@ enum plugin_gen_from {
     PLUGIN_GEN_AFTER_TB,
 };
 
-/* called before finishing a TB with exit_tb, goto_tb or goto_ptr */
+/*
+ * called before finishing a TB with exit_tb, goto_tb or goto_ptr; this is
+ * also where the TB exit callbacks go
+ */
 void plugin_gen_disable_mem_helpers(void)
 {
     if (tcg_ctx->plugin_insn) {
@@ -73,6 +76,7 @@ static void gen_enable_mem_helper(struct qemu_plugin_tb *ptb,
     }
     insn->mem_helper = true;
     ptb->mem_helper = true;
+    tcg_ctx->gen_tb->nocache = true;
 
     /*
      * TODO: It seems like we should be able to use ref/unref
@@ -248,6 +252,39 @@ static void gen_mem_cb(struct qemu_plugin_regular_cb *cb,
     tcg_temp_free_i32(clear_flags);
 }
 
+/*
+ * The ranges are tested in the helper rather than with a branch around
+ * the call: a label would end the extended basic block in the middle of
+ * the guest access, whose EBB temps, e.g. the old value of a non-atomic
+ * cmpxchg, must live across the callback.
+ */
+static void gen_mem_range_cb(struct qemu_plugin_mem_range_cb *cb,
+                             qemu_plugin_meminfo_t meminfo, TCGv_i64 addr)
+{
+    TCGv_i32 cpu_index = gen_cpu_index();
+    TCGv_ptr ranges = gen_plugin_u64_ptr(cb->ranges);
+    enum qemu_plugin_cb_flags cb_flags =
+        tcg_call_to_qemu_plugin_cb_flags(cb->info->flags);
+    TCGv_i32 flags = tcg_constant_i32(cb_flags);
+    TCGv_i32 clear_flags = tcg_constant_i32(QEMU_PLUGIN_CB_NO_REGS);
+    tcg_gen_st_i32(flags, tcg_env,
+           offsetof(CPUState, neg.plugin_cb_flags) - sizeof(CPUState));
+    tcg_gen_call7(plugin_vcpu_mem_range_cb, cb->info, NULL,
+                  tcgv_i32_temp(cpu_index),
+                  tcgv_i32_temp(tcg_constant_i32(meminfo)),
+                  tcgv_i64_temp(addr),
+                  tcgv_ptr_temp(tcg_constant_ptr(cb->userp)),
+                  tcgv_ptr_temp(tcg_constant_ptr(cb->f.vcpu_mem)),
+                  tcgv_ptr_temp(ranges),
+                  tcgv_i32_temp(tcg_constant_i32(cb->n)));
+    tcg_gen_st_i32(clear_flags, tcg_env,
+           offsetof(CPUState, neg.plugin_cb_flags) - sizeof(CPUState));
+    tcg_temp_free_i32(cpu_index);
+    tcg_temp_free_ptr(ranges);
+    tcg_temp_free_i32(flags);
+    tcg_temp_free_i32(clear_flags);
+}
+
 static void inject_cb(struct qemu_plugin_dyn_cb *cb)
 
 {
@@ -279,6 +316,11 @@ static void inject_mem_cb(struct qemu_plugin_dyn_cb *cb,
             gen_mem_cb(&cb->regular, meminfo, addr);
         }
         break;
+    case PLUGIN_CB_MEM_RANGE:
+        if (rw & cb->mem_range.rw) {
+            gen_mem_range_cb(&cb->mem_range, meminfo, addr);
+        }
+        break;
     case PLUGIN_CB_INLINE_ADD_U64:
     case PLUGIN_CB_INLINE_STORE_U64:
         if (rw & cb->inline_insn.rw) {
@@ -337,6 +379,12 @@ static void plugin_gen_inject(struct qemu_plugin_tb *plugin_tb)
                 if (plugin_tb->mem_helper) {
                     gen_disable_mem_helper();
                 }
+
+                cbs = plugin_tb->exit_cbs;
+                for (i = 0, n = (cbs ? cbs->len : 0); i < n; i++) {
+                    inject_cb(
+                        &g_array_index(cbs, struct qemu_plugin_dyn_cb, i));
+                }
                 break;
 
             case PLUGIN_GEN_AFTER_INSN:
@@ -394,7 +442,8 @@ static void plugin_gen_inject(struct qemu_plugin_tb *plugin_tb)
             tcg_ctx->emit_before_op = op;
 
             cbs = insn->mem_cbs;
-            for (i = 0, n = (cbs ? cbs->len : 0); i < n; i++) {
+            n = cbs ? cbs->len : 0;
+            for (i = 0; i < n; i++) {
                 inject_mem_cb(&g_array_index(cbs, struct qemu_plugin_dyn_cb, i),
                               rw, meminfo, addr);
             }
@@ -429,6 +478,9 @@ bool plugin_gen_tb_start(CPUState *cpu, const DisasContextBase *db)
         if (ptb->cbs) {
             g_array_set_size(ptb->cbs, 0);
         }
+        if (ptb->exit_cbs) {
+            g_array_set_size(ptb->exit_cbs, 0);
+        }
         ptb->n = 0;
         ptb->mem_helper = false;
     } else {
@@ -0,0 +1,507 @@
+/*
+ * Persistent TranslationBlock cache.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+/*
+ * Replaying one recording over and over translates the same guest code
+ * every time. With -accel tcg,tb-cache=FILE, QEMU writes the code buffer
+ * to FILE at exit. The next run maps its buffer at the same address and,
+ * just before it translates anything, copies the saved code back. A
+ * saved TB is then linked in the first time tb_gen_code() would have
+ * translated it, provided that the guest bytes it came from are the
+ * same and that translating it now would emit the same code: PANDA
+ * wants the same instrumentation and nobody watches translation.
+ *
+ * Generated code is full of absolute host addresses: helpers, the TB
+ * itself, plugin callbacks and scoreboards. So the file is only used by
+ * a process laid out exactly like the one that wrote it, which means the
+ * same binary, plugins and command line, with address space layout
+ * randomization off (setarch -R). The layout is checksummed; a file
+ * written by another layout is ignored and replaced at exit. TBs whose
+ * code points at memory allocated for them alone (plugin memory
+ * callbacks on helpers) are not saved.
+ *
+ * A flush drops the linked TBs with everything else; the saved code is
+ * copied back in on the next translation.
+ *
+ * Only single-threaded TCG is supported, as used by record/replay.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/cacheflush.h"
+#include "qemu/error-report.h"
+#include "qemu/notify.h"
+#include "qemu/plugin.h"
+#include "exec/target_page.h"
+#include "hw/core/cpu.h"
+#include "system/memory.h"
+#include "system/runstate.h"
+#include "system/system.h"
+#include "tcg/tcg.h"
+#include "tb-internal.h"
+#include "tb-hash.h"
+#include "tb-cache.h"
+#include "internal-common.h"
+#include "exec/tb-flush.h"
+#include "panda/panda_qemu_plugin_helpers.h"
+
+#define TB_CACHE_MAGIC "QEMUTBC1"
+
+/*
+ * File layout, host byte order:
+ *
+ *   TBCacheHeader
+ *   prologue_size bytes of prologue, compared with ours
+ *   { TBCacheRegion, size bytes of code } [nregions]
+ *   { TBCacheEntry, guest bytes padded to 8 } [nentries]
+ */
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint64_t buffer;            /* address of the code buffer */
+    uint8_t layout[32];         /* SHA-256 of the process layout */
+    uint64_t prologue_size;
+    uint64_t nregions;
+    uint64_t nentries;
+} TBCacheHeader;
+
+typedef struct TBCacheRegion {
+    uint64_t offset;            /* from the buffer start */
+    uint64_t size;              /* 0 for a region with no saved TBs */
+} TBCacheRegion;
+
+typedef struct TBCacheEntry {
+    uint64_t tb;                /* offset of the TranslationBlock */
+    uint64_t size;              /* guest bytes, as tb->size */
+} TBCacheEntry;
+
+/* A saved TB that can still be linked in */
+typedef struct TBCacheSlot {
+    TranslationBlock *tb;
+    const uint8_t *code;        /* guest bytes it was translated from */
+} TBCacheSlot;
+
+bool tb_cache_enabled;
+
+static struct {
+    char *path;
+    Notifier exit;
+
+    /* The file, mapped read-only; NULL if there is none we can use */
+    const uint8_t *map;
+    size_t map_size;
+
+    /* Saved code is in the buffer and @slots indexes it */
+    bool loaded;
+    bool load_queued;
+    TBCacheSlot *slot_array;
+    GHashTable *slots;
+
+    uint64_t hits;
+} tb_cache;
+
+static guint tb_cache_slot_hash(gconstpointer p)
+{
+    const TranslationBlock *tb = ((const TBCacheSlot *)p)->tb;
+
+    return tb_hash_func(tb_page_addr0(tb), tb->pc, tb->flags, tb->cs_base,
+                        tb->cflags);
+}
+
+static gboolean tb_cache_slot_equal(gconstpointer a, gconstpointer b)
+{
+    const TranslationBlock *x = ((const TBCacheSlot *)a)->tb;
+    const TranslationBlock *y = ((const TBCacheSlot *)b)->tb;
+
+    return tb_page_addr0(x) == tb_page_addr0(y) && x->pc == y->pc &&
+           x->cs_base == y->cs_base && x->flags == y->flags &&
+           x->cflags == y->cflags;
+}
+
+/* Everything the generated code depends on besides the guest. */
+static void tb_cache_layout(uint8_t digest[32])
+{
+    GChecksum *sum = g_checksum_new(G_CHECKSUM_SHA256);
+    size_t prologue_size, stride, n, total, len = 32;
+    uintptr_t addr[] = {
+        (uintptr_t)tb_gen_code,             /* text */
+        (uintptr_t)&tb_cache,               /* data */
+        (uintptr_t)first_cpu,               /* heap */
+        tcg_splitwx_diff,
+    };
+    struct stat st;
+
+    if (stat("/proc/self/exe", &st) == 0) {
+        uint64_t id[] = { st.st_dev, st.st_ino, st.st_size, st.st_mtime };
+        g_checksum_update(sum, (const guchar *)id, sizeof(id));
+    }
+    g_checksum_update(sum, (const guchar *)addr, sizeof(addr));
+    tcg_region_layout(&prologue_size, &stride, &n, &total);
+    {
+        uint64_t geom[] = { prologue_size, stride, n, total };
+        g_checksum_update(sum, (const guchar *)geom, sizeof(geom));
+    }
+    qemu_plugin_layout_checksum(sum);
+    g_checksum_get_digest(sum, digest, &len);
+    g_checksum_free(sum);
+}
+
+/* Take @len bytes at *@p from the mapped file, or NULL past its end. */
+static const void *tb_cache_take(const uint8_t **p, size_t len)
+{
+    const uint8_t *q = *p;
+
+    if (len > (size_t)(tb_cache.map + tb_cache.map_size - q)) {
+        return NULL;
+    }
+    *p = q + ROUND_UP(len, 8);
+    return q;
+}
+
+static void tb_cache_unmap(void)
+{
+    if (tb_cache.map) {
+        munmap((void *)tb_cache.map, tb_cache.map_size);
+        tb_cache.map = NULL;
+    }
+}
+
+/* Copy the saved code into the buffer and index its TBs. */
+static void tb_cache_load(void)
+{
+    const uint8_t *p = tb_cache.map;
+    const TBCacheHeader *h;
+    size_t prologue_size, stride, n, total;
+    uint8_t *buf = tcg_region_layout(&prologue_size, &stride, &n, &total);
+    uint8_t layout[32];
+    const void *prologue;
+
+    tb_cache.loaded = true;
+    if (!p) {
+        return;
+    }
+    h = tb_cache_take(&p, sizeof(*h));
+    if (h->buffer != (uintptr_t)buf || h->prologue_size != prologue_size) {
+        goto ignore;
+    }
+    tb_cache_layout(layout);
+    prologue = tb_cache_take(&p, prologue_size);
+    if (memcmp(layout, h->layout, sizeof(layout)) ||
+        !prologue || memcmp(prologue, buf, prologue_size)) {
+        goto ignore;
+    }
+    if (h->nregions > n || !tcg_region_reserve(h->nregions)) {
+        warn_report("tb-cache: %s holds too much code for the buffer",
+                    tb_cache.path);
+        goto drop;
+    }
+
+    for (uint64_t i = 0; i < h->nregions; i++) {
+        const TBCacheRegion *r = tb_cache_take(&p, sizeof(*r));
+        const void *code = r ? tb_cache_take(&p, r->size) : NULL;
+
+        if (!code || r->offset < prologue_size || r->offset > total ||
+            r->size > total - r->offset) {
+            goto corrupt;
+        }
+        memcpy(buf + r->offset, code, r->size);
+        flush_idcache_range((uintptr_t)tcg_splitwx_to_rx(buf + r->offset),
+                            (uintptr_t)(buf + r->offset), r->size);
+    }
+
+    tb_cache.slot_array = g_new(TBCacheSlot, h->nentries);
+    tb_cache.slots = g_hash_table_new(tb_cache_slot_hash, tb_cache_slot_equal);
+    for (uint64_t i = 0; i < h->nentries; i++) {
+        const TBCacheEntry *e = tb_cache_take(&p, sizeof(*e));
+        TBCacheSlot *slot = &tb_cache.slot_array[i];
+
+        if (!e || e->tb < prologue_size || e->tb > total - sizeof(*slot->tb)) {
+            goto corrupt;
+        }
+        slot->tb = (TranslationBlock *)(buf + e->tb);
+        slot->code = tb_cache_take(&p, e->size);
+        if (!slot->code || e->size != slot->tb->size) {
+            goto corrupt;
+        }
+        g_hash_table_add(tb_cache.slots, slot);
+    }
+    return;
+
+corrupt:
+    warn_report("tb-cache: %s is corrupt", tb_cache.path);
+    tb_cache_reset();
+    tb_cache.loaded = true;
+    goto drop;
+ignore:
+    warn_report("tb-cache: %s was written by a process laid out differently;"
+                " ignoring it", tb_cache.path);
+drop:
+    tb_cache_unmap();
+}
+
+/*
+ * tcg_region_reserve() hands the regions the saved code goes to back to
+ * no context, which is only safe with every vCPU out of the way and no
+ * code generated into them yet. Whatever was translated since the last
+ * flush is retranslated or found in the cache again.
+ */
+static void tb_cache_load_work(CPUState *cpu, run_on_cpu_data data)
+{
+    tb_flush__exclusive_or_serial();
+    tb_cache_load();
+    qatomic_set(&tb_cache.load_queued, false);
+}
+
+TranslationBlock *tb_cache_lookup_slow(CPUState *cpu, TCGTBCPUState s,
+                                       tb_page_addr_t phys_pc, void *host_pc)
+{
+    TranslationBlock key, *tb, *existing;
+    TBCacheSlot *slot, k = { .tb = &key };
+    tb_page_addr_t phys_p2 = -1;
+    size_t len0;
+
+    if (!tb_cache.loaded) {
+        if (!qatomic_xchg(&tb_cache.load_queued, true)) {
+            async_safe_run_on_cpu(cpu, tb_cache_load_work, RUN_ON_CPU_NULL);
+        }
+        return NULL;
+    }
+    if (!tb_cache.slots || phys_pc == -1) {
+        return NULL;
+    }
+
+    tb_set_page_addr0(&key, phys_pc);
+    key.pc = s.cflags & CF_PCREL ? 0 : s.pc;
+    key.cs_base = s.cs_base;
+    key.flags = s.flags;
+    key.cflags = s.cflags;
+    slot = g_hash_table_lookup(tb_cache.slots, &k);
+    if (!slot) {
+        return NULL;
+    }
+    /* One go only: once linked, the TB lives or dies like any other */
+    g_hash_table_remove(tb_cache.slots, slot);
+    tb = slot->tb;
+
+    if (!panda_tb_reusable(tb->panda_instr)) {
+        return NULL;
+    }
+    len0 = MIN(tb->size, -(phys_pc | TARGET_PAGE_MASK));
+    if (memcmp(host_pc, slot->code, len0)) {
+        return NULL;
+    }
+    if (len0 < tb->size) {
+        void *host_p2;
+
+        phys_p2 = get_page_addr_code_hostp(cpu_env(cpu), s.pc + len0,
+                                           &host_p2);
+        if (phys_p2 != tb_page_addr1(tb) ||
+            memcmp(host_p2, slot->code + len0, tb->size - len0)) {
+            return NULL;
+        }
+    }
+
+    /* From here on as at the end of tb_gen_code() */
+    tb_lock_pages(tb);
+    qemu_spin_init(&tb->jmp_lock);
+    tb->jmp_list_head = (uintptr_t)NULL;
+    tb->jmp_list_next[0] = (uintptr_t)NULL;
+    tb->jmp_list_next[1] = (uintptr_t)NULL;
+    tb->jmp_dest[0] = (uintptr_t)NULL;
+    tb->jmp_dest[1] = (uintptr_t)NULL;
+    if (tb->jmp_reset_offset[0] != TB_JMP_OFFSET_INVALID) {
+        tb_reset_jump(tb, 0);
+    }
+    if (tb->jmp_reset_offset[1] != TB_JMP_OFFSET_INVALID) {
+        tb_reset_jump(tb, 1);
+    }
+    tcg_tb_insert(tb);
+
+    existing = tb_link_page(tb);
+    if (unlikely(existing != tb)) {
+        tcg_tb_remove(tb);
+        return existing;
+    }
+    tb_cache.hits++;
+    return tb;
+}
+
+/* The translated code is gone; copy the saved code back in when needed. */
+void tb_cache_reset(void)
+{
+    if (!tb_cache_enabled) {
+        return;
+    }
+    tb_cache.loaded = false;
+    g_clear_pointer(&tb_cache.slots, g_hash_table_destroy);
+    g_clear_pointer(&tb_cache.slot_array, g_free);
+}
+
+typedef struct TBCacheRange {
+    const void *start;
+    const void *end;
+} TBCacheRange;
+
+static gboolean tb_cache_slot_in(gpointer key, gpointer value, gpointer data)
+{
+    const TBCacheSlot *slot = key;
+    const TBCacheRange *r = data;
+
+    return (const void *)slot->tb >= r->start && (const void *)slot->tb < r->end;
+}
+
+/* The code in [@start, @end) is gone; forget the saved TBs that were there. */
+void tb_cache_evict(const void *start, const void *end)
+{
+    TBCacheRange r = { start, end };
+
+    if (tb_cache.slots) {
+        g_hash_table_foreach_remove(tb_cache.slots, tb_cache_slot_in, &r);
+    }
+}
+
+static gboolean tb_cache_collect(gpointer key, gpointer value, gpointer data)
+{
+    TranslationBlock *tb = value;
+
+    if (!(tb_cflags(tb) & CF_INVALID) && !tb->nocache &&
+        tb_page_addr0(tb) != -1) {
+        g_ptr_array_add(data, tb);
+    }
+    return false;
+}
+
+static bool tb_cache_write(FILE *f, const void *p, size_t len)
+{
+    static const uint8_t pad[8];
+
+    return fwrite(p, 1, len, f) == len &&
+           fwrite(pad, 1, -len & 7, f) == (-len & 7);
+}
+
+/* Write the resident TBs and the code around them to @f. */
+static bool tb_cache_save_to(FILE *f)
+{
+    size_t prologue_size, stride, n, total;
+    uint8_t *buf = tcg_region_layout(&prologue_size, &stride, &n, &total);
+    g_autoptr(GPtrArray) tbs = g_ptr_array_new();
+    g_autofree bool *wanted = NULL;
+    TBCacheHeader h = {
+        .magic = TB_CACHE_MAGIC,
+        .buffer = (uintptr_t)buf,
+        .prologue_size = prologue_size,
+    };
+
+    tcg_tb_foreach(tb_cache_collect, tbs);
+    wanted = g_new0(bool, n);
+    for (guint i = 0; i < tbs->len; i++) {
+        size_t off = (uint8_t *)g_ptr_array_index(tbs, i) - buf;
+        size_t r = MIN(off / stride, n - 1);
+
+        wanted[r] = true;
+        h.nregions = MAX(h.nregions, r + 1);
+    }
+    h.nentries = tbs->len;
+    tb_cache_layout(h.layout);
+
+    if (!tb_cache_write(f, &h, sizeof(h)) ||
+        !tb_cache_write(f, buf, prologue_size)) {
+        return false;
+    }
+    for (size_t i = 0; i < h.nregions; i++) {
+        void *start;
+        size_t size;
+        TBCacheRegion r;
+
+        tcg_region_used(i, &start, &size);
+        r.offset = (uint8_t *)start - buf;
+        r.size = wanted[i] ? size : 0;
+        if (!tb_cache_write(f, &r, sizeof(r)) ||
+            !tb_cache_write(f, start, r.size)) {
+            return false;
+        }
+    }
+    for (guint i = 0; i < tbs->len; i++) {
+        TranslationBlock *tb = g_ptr_array_index(tbs, i);
+        tb_page_addr_t phys_pc = tb_page_addr0(tb);
+        size_t len0 = MIN(tb->size, -(phys_pc | TARGET_PAGE_MASK));
+        TBCacheEntry e = { .tb = (uint8_t *)tb - buf, .size = tb->size };
+        g_autofree uint8_t *code = g_malloc(tb->size);
+
+        /* Unchanged since translation, or the TB would be invalid */
+        memcpy(code, qemu_map_ram_ptr(NULL, phys_pc), len0);
+        if (len0 < tb->size) {
+            memcpy(code + len0, qemu_map_ram_ptr(NULL, tb_page_addr1(tb)),
+                   tb->size - len0);
+        }
+        if (!tb_cache_write(f, &e, sizeof(e)) ||
+            !tb_cache_write(f, code, tb->size)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void tb_cache_save(Notifier *n, void *data)
+{
+    g_autofree char *tmp = g_strdup_printf("%s.tmp", tb_cache.path);
+    FILE *f;
+    bool ok;
+
+    /* The vCPUs must be parked, or the code buffer is moving under us */
+    if (runstate_is_running()) {
+        return;
+    }
+    f = fopen(tmp, "wb");
+    if (!f) {
+        warn_report("tb-cache: can't create %s: %s", tmp, strerror(errno));
+        return;
+    }
+    ok = tb_cache_save_to(f);
+    if (fclose(f) != 0 || !ok || rename(tmp, tb_cache.path) != 0) {
+        warn_report("tb-cache: can't write %s: %s", tb_cache.path,
+                    strerror(errno));
+        unlink(tmp);
+    }
+}
+
+void tb_cache_init(const char *path)
+{
+    int fd;
+    struct stat st;
+
+    tb_cache.path = g_strdup(path);
+    tb_cache.exit.notify = tb_cache_save;
+    qemu_add_exit_notifier(&tb_cache.exit);
+    tb_cache_enabled = true;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            warn_report("tb-cache: can't open %s: %s", path, strerror(errno));
+        }
+        return;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size >= sizeof(TBCacheHeader)) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (map != MAP_FAILED) {
+            const TBCacheHeader *h = map;
+
+            if (memcmp(h->magic, TB_CACHE_MAGIC, sizeof(h->magic)) == 0) {
+                tb_cache.map = map;
+                tb_cache.map_size = st.st_size;
+                /* The code only works where it was generated */
+                tcg_region_request_addr((void *)(uintptr_t)h->buffer);
+            } else {
+                munmap(map, st.st_size);
+            }
+        }
+    }
+    close(fd);
+    if (!tb_cache.map) {
+        warn_report("tb-cache: %s is not a translation cache; it will be"
+                    " overwritten", path);
+    }
+}
@@ -0,0 +1,50 @@
+/*
+ * Persistent TranslationBlock cache.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#ifndef ACCEL_TCG_TB_CACHE_H
+#define ACCEL_TCG_TB_CACHE_H
+
+#include "exec/translation-block.h"
+#include "accel/tcg/tb-cpu-state.h"
+
+#ifdef CONFIG_USER_ONLY
+static inline TranslationBlock *tb_cache_lookup(CPUState *cpu,
+                                                TCGTBCPUState s,
+                                                tb_page_addr_t phys_pc,
+                                                void *host_pc)
+{
+    return NULL;
+}
+
+static inline void tb_cache_reset(void) { }
+static inline void tb_cache_evict(const void *start, const void *end) { }
+#else
+extern bool tb_cache_enabled;
+
+/* Use @path as cache file; call before tcg_init(). */
+void tb_cache_init(const char *path);
+TranslationBlock *tb_cache_lookup_slow(CPUState *cpu, TCGTBCPUState s,
+                                       tb_page_addr_t phys_pc, void *host_pc);
+void tb_cache_reset(void);
+void tb_cache_evict(const void *start, const void *end);
+
+/*
+ * Return a TB saved by an earlier run for @s, linked in as if it had
+ * just been generated, or NULL to translate it.
+ */
+static inline TranslationBlock *tb_cache_lookup(CPUState *cpu,
+                                                TCGTBCPUState s,
+                                                tb_page_addr_t phys_pc,
+                                                void *host_pc)
+{
+    if (likely(!tb_cache_enabled)) {
+        return NULL;
+    }
+    return tb_cache_lookup_slow(cpu, s, phys_pc, host_pc);
+}
+#endif
+
+#endif
@@ -34,6 +34,13 @@ struct TBContext {
 
     /* statistics */
     unsigned tb_flush_count;
+    unsigned tb_evict_count;
+    unsigned tb_hot_count;
+    unsigned tb_trace_count;
+    unsigned tb_miss_count;
+    uint64_t tb_miss_ns;
+    unsigned tb_spec_count;
+    unsigned tb_spec_drop_count;
     unsigned tb_phys_invalidate_count;
 };
 
@@ -38,10 +38,13 @@ static inline void tb_lock_page1(tb_page_addr_t p0, tb_page_addr_t p1)
 
 static inline void tb_unlock_page1(tb_page_addr_t p0, tb_page_addr_t p1) { }
 static inline void tb_unlock_pages(TranslationBlock *tb) { }
+static inline bool tb_page_code_settled(tb_page_addr_t p) { return true; }
 #else
 void tb_lock_page1(tb_page_addr_t, tb_page_addr_t);
 void tb_unlock_page1(tb_page_addr_t, tb_page_addr_t);
+void tb_lock_pages(TranslationBlock *);
 void tb_unlock_pages(TranslationBlock *);
+bool tb_page_code_settled(tb_page_addr_t);
 #endif
 
 #ifdef CONFIG_SOFTMMU
@@ -11,9 +11,25 @@
 
 #include "qemu/rcu.h"
 #include "exec/cpu-common.h"
+#include "exec/target_page.h"
+#include "exec/translation-block.h"
+#include "accel/tcg/tb-cpu-state.h"
 
-#define TB_JMP_CACHE_BITS 12
-#define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
+/*
+ * The cache is set associative, with TB_JMP_CACHE_WAYS entries per set,
+ * and has between 1 << TB_JMP_CACHE_MIN_BITS and 1 << TB_JMP_CACHE_MAX_BITS
+ * sets; see tb_jmp_cache_resize(). It starts with TB_JMP_CACHE_BITS, for
+ * as many entries as the direct-mapped cache it replaced.
+ */
+#define TB_JMP_CACHE_WAYS 4
+#define TB_JMP_CACHE_MIN_BITS 8
+#define TB_JMP_CACHE_MAX_BITS 14
+#define TB_JMP_CACHE_BITS 10
+
+typedef struct CPUJumpCacheEntry {
+    TranslationBlock *tb;
+    vaddr pc;
+} CPUJumpCacheEntry;
 
 /*
  * Invalidated in parallel; all accesses to 'tb' must be atomic.
@@ -21,13 +37,166 @@
  * no need for qatomic_rcu_read() and pc is always consistent with a
  * non-NULL value of 'tb'.  Strictly speaking pc is only needed for
  * CF_PCREL, but it's used always for simplicity.
+ *
+ * Only its CPU replaces the cache, and frees the old one with RCU, so
+ * other threads must read cpu->tb_jmp_cache with qatomic_rcu_read().
+ *
+ * The statistics are written by the CPU only, and carried over when the
+ * cache is resized.
  */
 typedef struct CPUJumpCache {
     struct rcu_head rcu;
-    struct {
-        TranslationBlock *tb;
-        vaddr pc;
-    } array[TB_JMP_CACHE_SIZE];
+    unsigned bits;              /* log2 of the number of sets */
+    unsigned resizes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;         /* of valid entries, to make room */
+    /* Since window_begin_ns; see tb_jmp_cache_resize() */
+    int64_t window_begin_ns;
+    size_t window_max_entries;
+    uint64_t window_lookups;
+    uint64_t window_evictions;
+    CPUJumpCacheEntry set[][TB_JMP_CACHE_WAYS];
 } CPUJumpCache;
 
+CPUJumpCache *tb_jmp_cache_new(unsigned bits);
+
+#ifdef CONFIG_SOFTMMU
+
+/*
+ * Only the bottom half of the set index bits vary for addresses on the
+ * same page.  The top bits are the same.  This allows TLB invalidation
+ * to quickly clear the sets of a page: see tb_jmp_cache_hash_page().
+ */
+static inline unsigned int tb_jmp_cache_page_bits(unsigned bits)
+{
+    return bits / 2;
+}
+
+static inline unsigned int tb_jmp_cache_hash_page(vaddr pc, unsigned bits)
+{
+    unsigned int pbits = tb_jmp_cache_page_bits(bits);
+    unsigned int page_mask = (1u << bits) - (1u << pbits);
+    vaddr tmp;
+
+    tmp = pc ^ (pc >> (TARGET_PAGE_BITS - pbits));
+    return (tmp >> (TARGET_PAGE_BITS - pbits)) & page_mask;
+}
+
+static inline unsigned int tb_jmp_cache_hash_func(vaddr pc, unsigned bits)
+{
+    unsigned int pbits = tb_jmp_cache_page_bits(bits);
+    unsigned int page_mask = (1u << bits) - (1u << pbits);
+    vaddr tmp;
+
+    tmp = pc ^ (pc >> (TARGET_PAGE_BITS - pbits));
+    return (((tmp >> (TARGET_PAGE_BITS - pbits)) & page_mask)
+           | (tmp & ((1u << pbits) - 1)));
+}
+
+#else
+
+/* In user-mode we can get better hashing because we do not have a TLB */
+static inline unsigned int tb_jmp_cache_hash_func(vaddr pc, unsigned bits)
+{
+    return (pc ^ (pc >> bits)) & ((1u << bits) - 1);
+}
+
+#endif /* CONFIG_SOFTMMU */
+
+/*
+ * Move the first @n entries of @set down one way, dropping entry @n,
+ * and put @tb for @pc in front of them.
+ */
+static inline void tb_jmp_cache_push(CPUJumpCacheEntry *set, int n,
+                                     vaddr pc, TranslationBlock *tb)
+{
+    for (int i = n; i > 0; i--) {
+        set[i].pc = set[i - 1].pc;
+        qatomic_set(&set[i].tb, qatomic_read(&set[i - 1].tb));
+    }
+    set[0].pc = pc;
+    qatomic_set(&set[0].tb, tb);
+}
+
+/*
+ * Look up @s in @jc; call from its CPU. A hit moves the entry to the
+ * front of its set, so that the set is kept in LRU order.
+ */
+static inline TranslationBlock *tb_jmp_cache_get(CPUJumpCache *jc,
+                                                 TCGTBCPUState s)
+{
+    CPUJumpCacheEntry *set = jc->set[tb_jmp_cache_hash_func(s.pc, jc->bits)];
+
+    jc->window_lookups++;
+    for (int i = 0; i < TB_JMP_CACHE_WAYS; i++) {
+        TranslationBlock *tb = qatomic_read(&set[i].tb);
+
+        if (tb &&
+            set[i].pc == s.pc &&
+            tb->cs_base == s.cs_base &&
+            tb->flags == s.flags &&
+            tb_cflags(tb) == s.cflags) {
+            if (i) {
+                tb_jmp_cache_push(set, i, s.pc, tb);
+            }
+            qatomic_set(&jc->hits, jc->hits + 1);
+            return tb;
+        }
+    }
+    qatomic_set(&jc->misses, jc->misses + 1);
+    return NULL;
+}
+
+/*
+ * Add @tb for @pc to the front of its set in @jc, in place of the first
+ * invalidated entry if there is one, else evicting the least recently
+ * used entry of the set; call from its CPU.
+ */
+static inline void tb_jmp_cache_put(CPUJumpCache *jc, vaddr pc,
+                                    TranslationBlock *tb)
+{
+    CPUJumpCacheEntry *set = jc->set[tb_jmp_cache_hash_func(pc, jc->bits)];
+    int n = TB_JMP_CACHE_WAYS - 1;
+
+    for (int i = 0; i < n; i++) {
+        if (!qatomic_read(&set[i].tb)) {
+            n = i;
+            break;
+        }
+    }
+    if (n == TB_JMP_CACHE_WAYS - 1 && qatomic_read(&set[n].tb)) {
+        qatomic_set(&jc->evictions, jc->evictions + 1);
+        jc->window_evictions++;
+    }
+    tb_jmp_cache_push(set, n, pc, tb);
+}
+
+/* Drop @tb, which was translated for @pc, from @jc; call from any thread. */
+static inline void tb_jmp_cache_inval(CPUJumpCache *jc, vaddr pc,
+                                      TranslationBlock *tb)
+{
+    CPUJumpCacheEntry *set = jc->set[tb_jmp_cache_hash_func(pc, jc->bits)];
+
+    for (int i = 0; i < TB_JMP_CACHE_WAYS; i++) {
+        if (qatomic_read(&set[i].tb) == tb) {
+            qatomic_set(&set[i].tb, NULL);
+        }
+    }
+}
+
+#ifdef CONFIG_SOFTMMU
+/* Drop every entry of @jc for a pc on the page at @page_addr. */
+static inline void tb_jmp_cache_inval_page(CPUJumpCache *jc, vaddr page_addr)
+{
+    unsigned int i0 = tb_jmp_cache_hash_page(page_addr, jc->bits);
+
+    for (int i = 0; i < 1 << tb_jmp_cache_page_bits(jc->bits); i++) {
+        for (int j = 0; j < TB_JMP_CACHE_WAYS; j++) {
+            qatomic_set(&jc->set[i0 + i][j].tb, NULL);
+        }
+    }
+}
+#endif
+
 #endif /* ACCEL_TCG_TB_JMP_CACHE_H */
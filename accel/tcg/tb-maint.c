@@ -30,9 +30,12 @@
 #include "tb-internal.h"
 #include "system/tcg.h"
 #include "tcg/tcg.h"
+#include "tb-jmp-cache.h"
 #include "tb-hash.h"
 #include "tb-context.h"
 #include "tb-internal.h"
+#include "tb-cache.h"
+#include "tb-spec.h"
 #include "internal-common.h"
 #ifdef CONFIG_USER_ONLY
 #include "user/page-protection.h"
@@ -410,6 +413,21 @@ void tb_lock_page0(tb_page_addr_t paddr)
     page_lock(page_find_alloc(paddr >> TARGET_PAGE_BITS, true));
 }
 
+/*
+ * May the background translator, with @paddr locked, read code from it?
+ * Only if the page has TBs, so that a store to it must go through
+ * notdirty_write() and wait for the lock to invalidate, and no store is
+ * between notdirty_write() and guest RAM: it has already invalidated
+ * and would land under the translation.
+ */
+bool tb_page_code_settled(tb_page_addr_t paddr)
+{
+    PageDesc *pd = page_find(paddr >> TARGET_PAGE_BITS);
+
+    assert_page_locked(pd);
+    return pd->first_tb && !tb_spec_stores_pending();
+}
+
 void tb_lock_page1(tb_page_addr_t paddr0, tb_page_addr_t paddr1)
 {
     tb_page_addr_t pindex0 = paddr0 >> TARGET_PAGE_BITS;
@@ -454,7 +472,7 @@ void tb_unlock_page1(tb_page_addr_t paddr0, tb_page_addr_t paddr1)
     }
 }
 
-static void tb_lock_pages(TranslationBlock *tb)
+void tb_lock_pages(TranslationBlock *tb)
 {
     tb_page_addr_t paddr0 = tb_page_addr0(tb);
     tb_page_addr_t paddr1 = tb_page_addr1(tb);
@@ -777,6 +795,7 @@ void tb_flush__exclusive_or_serial(void)
     assert(!runstate_is_running() ||
            (current_cpu && cpu_in_serial_context(current_cpu)));
 
+    tb_spec_pause();
     CPU_FOREACH(cpu) {
         tcg_flush_jmp_cache(cpu);
     }
@@ -785,6 +804,8 @@ void tb_flush__exclusive_or_serial(void)
     tb_remove_all();
 
     tcg_region_reset_all();
+    tb_cache_reset();
+    tb_spec_resume();
     /* XXX: flush processor icache at this point if cache flush is expensive */
     qatomic_inc(&tb_ctx.tb_flush_count);
     qemu_plugin_flush_cb();
@@ -807,6 +828,56 @@ void queue_tb_flush(CPUState *cs)
     }
 }
 
+typedef struct TBInvalidateMatching {
+    bool (*pred)(const TranslationBlock *tb, void *opaque);
+    void *opaque;
+    GPtrArray *victims;
+} TBInvalidateMatching;
+
+static void tb_invalidate_matching_collect(void *p, uint32_t hash, void *userp)
+{
+    TranslationBlock *tb = p;
+    TBInvalidateMatching *m = userp;
+
+    if (m->pred(tb, m->opaque)) {
+        g_ptr_array_add(m->victims, tb);
+    }
+}
+
+/*
+ * Invalidate every TB for which @pred returns true, leaving the rest of
+ * the code cache intact.  Victims are collected first since qht_iter()
+ * holds the bucket locks that tb_phys_invalidate() needs.
+ * Must be called from an exclusive or serial context.
+ */
+void tb_invalidate_matching__exclusive_or_serial(
+    bool (*pred)(const TranslationBlock *tb, void *opaque), void *opaque)
+{
+    TBInvalidateMatching m = {
+        .pred = pred,
+        .opaque = opaque,
+        .victims = g_ptr_array_new(),
+    };
+
+    assert(tcg_enabled());
+    assert(!runstate_is_running() ||
+           (current_cpu && cpu_in_serial_context(current_cpu)));
+
+    tb_spec_pause();
+    qht_iter(&tb_ctx.htable, tb_invalidate_matching_collect, &m);
+
+    mmap_lock();
+    qemu_thread_jit_write();
+    for (guint i = 0; i < m.victims->len; i++) {
+        tb_phys_invalidate(g_ptr_array_index(m.victims, i), -1);
+    }
+    qemu_thread_jit_execute();
+    mmap_unlock();
+    tb_spec_resume();
+
+    g_ptr_array_free(m.victims, true);
+}
+
 /* remove @orig from its @n_orig-th jump list */
 static inline void tb_remove_from_jmp_list(TranslationBlock *orig, int n_orig)
 {
@@ -901,14 +972,11 @@ static void tb_jmp_cache_inval_tb(TranslationBlock *tb)
             tcg_flush_jmp_cache(cpu);
         }
     } else {
-        uint32_t h = tb_jmp_cache_hash_func(tb->pc);
+        RCU_READ_LOCK_GUARD();
 
         CPU_FOREACH(cpu) {
-            CPUJumpCache *jc = cpu->tb_jmp_cache;
-
-            if (qatomic_read(&jc->array[h].tb) == tb) {
-                qatomic_set(&jc->array[h].tb, NULL);
-            }
+            tb_jmp_cache_inval(qatomic_rcu_read(&cpu->tb_jmp_cache),
+                               tb->pc, tb);
         }
     }
 }
@@ -917,8 +985,10 @@ static void tb_jmp_cache_inval_tb(TranslationBlock *tb)
  * In user-mode, call with mmap_lock held.
  * In !user-mode, if @rm_from_page_list is set, call with the TB's pages'
  * locks held.
+ * Callers that clear @inval_jmp_cache purge the jump caches themselves.
  */
-static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
+static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list,
+                                  bool inval_jmp_cache)
 {
     uint32_t h;
     tb_page_addr_t phys_pc;
@@ -945,7 +1015,9 @@ static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
     }
 
     /* remove the TB from the hash list */
-    tb_jmp_cache_inval_tb(tb);
+    if (inval_jmp_cache) {
+        tb_jmp_cache_inval_tb(tb);
+    }
 
     /* suppress this TB from the two jump lists */
     tb_remove_from_jmp_list(tb, 0);
@@ -961,7 +1033,7 @@ static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
 static void tb_phys_invalidate__locked(TranslationBlock *tb)
 {
     qemu_thread_jit_write();
-    do_tb_phys_invalidate(tb, true);
+    do_tb_phys_invalidate(tb, true, true);
     qemu_thread_jit_execute();
 }
 
@@ -973,10 +1045,145 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 {
     if (page_addr == -1 && tb_page_addr0(tb) != -1) {
         tb_lock_pages(tb);
-        do_tb_phys_invalidate(tb, true);
+        do_tb_phys_invalidate(tb, true, true);
         tb_unlock_pages(tb);
     } else {
-        do_tb_phys_invalidate(tb, false);
+        do_tb_phys_invalidate(tb, false, true);
+    }
+}
+
+/* Regions evicted at a time, as a fraction of all regions */
+#define TB_EVICT_FRACTION 8
+
+typedef struct TBEvictRange {
+    const void *start;
+    const void *end;
+} TBEvictRange;
+
+typedef struct TBEvict {
+    TBEvictRange *ranges;
+    size_t n;
+} TBEvict;
+
+static bool tb_evict_match(const TranslationBlock *tb, void *opaque)
+{
+    const TBEvict *ev = opaque;
+
+    for (size_t i = 0; i < ev->n; i++) {
+        if ((const void *)tb >= ev->ranges[i].start &&
+            (const void *)tb < ev->ranges[i].end) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static gboolean tb_evict_collect(gpointer key, gpointer value, gpointer data)
+{
+    g_ptr_array_add(data, value);
+    return false;
+}
+
+static void tb_evict_one(TranslationBlock *tb)
+{
+    if (tb_cflags(tb) & CF_INVALID) {
+        /* Unlinked when it was invalidated */
+        return;
+    }
+    if (tb_page_addr0(tb) == -1) {
+        /* One-shot TBs are not in the QHT, but can be jumped to */
+        qemu_spin_lock(&tb->jmp_lock);
+        qatomic_set(&tb->cflags, tb->cflags | CF_INVALID);
+        qemu_spin_unlock(&tb->jmp_lock);
+        tb_remove_from_jmp_list(tb, 0);
+        tb_remove_from_jmp_list(tb, 1);
+        tb_jmp_unlink(tb);
+        return;
+    }
+    tb_lock_pages(tb);
+    do_tb_phys_invalidate(tb, true, false);
+    tb_unlock_pages(tb);
+}
+
+/*
+ * Make room in a full code buffer by retiring its oldest regions, rather
+ * than all of it: the TBs in them are invalidated, jumps into them are
+ * unlinked and the jump caches forget them, so nothing can reach the
+ * code any more. Everything else stays translated and chained.
+ *
+ * Falls back to tb_flush__exclusive_or_serial() when eviction is off or
+ * no region can go, e.g. with one region per context.
+ * Must be called from an exclusive or serial context.
+ */
+void tb_evict__exclusive_or_serial(void)
+{
+    size_t max = MAX(1, tcg_region_count() / TB_EVICT_FRACTION);
+    g_autofree size_t *idx = g_new(size_t, max);
+    g_autofree TBEvictRange *ranges = g_new(TBEvictRange, max);
+    g_autoptr(GPtrArray) victims = g_ptr_array_new();
+    TBEvict ev = { .ranges = ranges };
+    CPUState *cpu;
+
+    assert(tcg_enabled());
+    assert(!runstate_is_running() ||
+           (current_cpu && cpu_in_serial_context(current_cpu)));
+
+    tb_spec_pause();
+    if (qatomic_read(&tb_evict_enabled)) {
+        ev.n = tcg_region_oldest(idx, max);
+    }
+    if (ev.n == 0) {
+        tb_spec_resume();
+        tb_flush__exclusive_or_serial();
+        return;
+    }
+    trace_tb_evict(ev.n);
+
+    for (size_t i = 0; i < ev.n; i++) {
+        void *start;
+        size_t size;
+
+        tcg_region_used(idx[i], &start, &size);
+        ranges[i].start = start;
+        ranges[i].end = start + size;
+        tcg_region_tb_foreach(idx[i], tb_evict_collect, victims);
+    }
+
+    mmap_lock();
+    qemu_thread_jit_write();
+    for (guint i = 0; i < victims->len; i++) {
+        tb_evict_one(g_ptr_array_index(victims, i));
+    }
+    qemu_thread_jit_execute();
+    mmap_unlock();
+
+    /* One pass over the jump caches instead of one per TB */
+    CPU_FOREACH(cpu) {
+        tcg_jmp_cache_drop(cpu, tb_evict_match, &ev);
+    }
+    for (size_t i = 0; i < ev.n; i++) {
+        tb_cache_evict(ranges[i].start, ranges[i].end);
+        tcg_region_free(idx[i]);
+    }
+    tb_spec_resume();
+    qatomic_inc(&tb_ctx.tb_evict_count);
+}
+
+static void do_tb_evict(CPUState *cpu, run_on_cpu_data tb_evict_count)
+{
+    /* If another CPU already made room, just retry. */
+    if (tb_ctx.tb_evict_count + tb_ctx.tb_flush_count ==
+        tb_evict_count.host_int) {
+        tb_evict__exclusive_or_serial();
+    }
+}
+
+void queue_tb_evict(CPUState *cs)
+{
+    if (tcg_enabled()) {
+        unsigned count = qatomic_read(&tb_ctx.tb_evict_count) +
+                         qatomic_read(&tb_ctx.tb_flush_count);
+        async_safe_run_on_cpu(cs, do_tb_evict, RUN_ON_CPU_HOST_INT(count));
     }
 }
 
@@ -988,6 +1195,8 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
  * Note that in !user-mode, another thread might have already added a TB
  * for the same block of guest code that @tb corresponds to. In that case,
  * the caller should discard the original @tb, and use instead the returned TB.
+ * On the background translator, returns NULL if @tb may be stale; the
+ * caller discards it the same way.
  */
 TranslationBlock *tb_link_page(TranslationBlock *tb)
 {
@@ -997,6 +1206,15 @@ TranslationBlock *tb_link_page(TranslationBlock *tb)
     assert_memory_lock();
     tcg_debug_assert(!(tb->cflags & CF_INVALID));
 
+    /*
+     * The background translator held the page lock, but a store that had
+     * invalidated before it took the lock may have landed meanwhile.
+     */
+    if (tb_spec_thread() && tb_spec_stores_pending()) {
+        tb_unlock_pages(tb);
+        return NULL;
+    }
+
     tb_record(tb);
 
     /* add in the hash table */
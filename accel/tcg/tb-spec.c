@@ -0,0 +1,337 @@
+/*
+ * Speculative translation of successor blocks.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+/*
+ * A vCPU that looks up a TB nobody has translated yet stops to translate
+ * it, which is where the first run of a replay or of a fuzzing input over
+ * fresh code spends its time. With -accel tcg,tb-spec=on, translating a
+ * TB also queues the destinations of its direct jumps, as passed to
+ * translator_use_goto_tb(), and a background thread translates them into
+ * the QHT ahead of the vCPU, which then finds them there. The background
+ * thread queues the successors of what it translates in turn, up to
+ * TB_SPEC_MAX_DEPTH blocks ahead.
+ *
+ * The thread has a TCGContext and code regions of its own, but no TLB:
+ * successors are on the page of the TB that jumps to them, so they are
+ * found from its ram address, and a translation that would need another
+ * page is abandoned (see translator_ld()). A successor is assumed to run
+ * with the same cs_base and flags as its predecessor; when it doesn't,
+ * the vCPU translates it as before and the speculative TB is unused.
+ * The vCPU keeps running meanwhile, so the thread must not look at its
+ * registers: only targets whose translation follows from the TB alone
+ * (TCGCPUOps::translate_from_tb) are translated for.
+ *
+ * The thread reads guest code while the vCPUs run, so a vCPU can store to
+ * it in the middle. Holding the page lock from the first read to
+ * tb_link_page() makes a store that starts meanwhile wait in its
+ * invalidation, but a store that has invalidated already still lands
+ * after notdirty_write() returns, possibly after the thread has read the
+ * old code. Comparing per-page invalidation generations misses that, so
+ * notdirty_write() counts its stores until the end of the TB that made
+ * them, and the thread drops its TB if any is pending when it starts or
+ * links, or if the page has no TBs and so no write protection; see
+ * tb_page_code_settled().
+ *
+ * Translating on another thread leaves out everything that watches
+ * translation from the vCPU. TCG plugins, PANDA's bridge among them,
+ * would have every translation abandoned, so tb-spec=on refuses -plugin;
+ * nothing is speculated while PANDA has block translation callbacks of
+ * its own. Neither does the thread make room in a full code buffer;
+ * it drops its requests until the vCPUs have. Flushes and evictions pause
+ * it with tb_spec_pause().
+ *
+ * "info jit" reports how many TBs the vCPUs had to translate themselves
+ * and how long that took them, to compare runs with and without it.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "accel/tcg/cpu-ops.h"
+#include "exec/target_page.h"
+#include "hw/core/cpu.h"
+#include "system/memory.h"
+#include "system/ramblock.h"
+#include "tcg/tcg.h"
+#include "tb-internal.h"
+#include "tb-hash.h"
+#include "tb-context.h"
+#include "tb-spec.h"
+#include "internal-common.h"
+#include "panda/panda_qemu_plugin_helpers.h"
+
+/* Requests waiting for the thread; more are dropped */
+#define TB_SPEC_RING 256
+
+/* How many blocks ahead of the vCPU to translate */
+#define TB_SPEC_MAX_DEPTH 2
+
+/* Successors noted per TB: a TB has at most two chained exits */
+#define TB_SPEC_MAX_NEXT 2
+
+typedef struct TBSpecRequest {
+    CPUState *cpu;              /* NULL once the cpu is gone */
+    TCGTBCPUState s;
+    tb_page_addr_t phys_pc;
+    void *host_pc;
+    int depth;
+} TBSpecRequest;
+
+typedef struct TBSpecNext {
+    int n;
+    vaddr dest[TB_SPEC_MAX_NEXT];
+} TBSpecNext;
+
+static struct {
+    QemuMutex lock;
+    QemuCond work;
+    QemuCond idle;
+    QemuThread thread;
+    bool started;
+    bool busy;
+    unsigned paused;
+    unsigned head, tail;
+    TBSpecRequest ring[TB_SPEC_RING];
+} tb_spec;
+
+bool tb_spec_enabled;
+__thread bool tb_spec_self;
+__thread bool tb_spec_storing;
+
+/* Threads with a store between notdirty_write() and guest RAM */
+static unsigned tb_spec_stores;
+
+/* Successors noted by the translation in progress on this thread */
+static __thread TBSpecNext tb_spec_next;
+
+/* Depth of the request the background thread is translating */
+static __thread int tb_spec_depth;
+
+void tb_spec_note_reset_slow(void)
+{
+    tb_spec_next.n = 0;
+}
+
+void tb_spec_note_slow(vaddr dest)
+{
+    TBSpecNext *nx = &tb_spec_next;
+
+    for (int i = 0; i < nx->n; i++) {
+        if (nx->dest[i] == dest) {
+            return;
+        }
+    }
+    if (nx->n < TB_SPEC_MAX_NEXT) {
+        nx->dest[nx->n++] = dest;
+    }
+}
+
+static bool tb_spec_cmp(const void *p, const void *d)
+{
+    const TranslationBlock *tb = p;
+    const TBSpecRequest *r = d;
+
+    return (tb_cflags(tb) & CF_PCREL || tb->pc == r->s.pc) &&
+           tb_page_addr0(tb) == r->phys_pc &&
+           tb->cs_base == r->s.cs_base &&
+           tb->flags == r->s.flags &&
+           tb_cflags(tb) == r->s.cflags;
+}
+
+/* Is there a TB for @r already? */
+static bool tb_spec_present(const TBSpecRequest *r)
+{
+    uint32_t h = tb_hash_func(r->phys_pc,
+                              r->s.cflags & CF_PCREL ? 0 : r->s.pc,
+                              r->s.flags, r->s.cs_base, r->s.cflags);
+
+    return qht_lookup_custom(&tb_ctx.htable, r, h, tb_spec_cmp) != NULL;
+}
+
+static void tb_spec_run(const TBSpecRequest *r)
+{
+    tb_page_addr_t page = r->phys_pc & TARGET_PAGE_MASK;
+    void *host_page = r->host_pc - (r->phys_pc - page);
+
+    RCU_READ_LOCK_GUARD();
+    if (!r->cpu || tb_spec_present(r)) {
+        return;
+    }
+    /*
+     * The vCPU found @host_pc inside its own RCU critical section; make
+     * sure the RAM is still there, and still the same, before using it.
+     */
+    if (qemu_ram_addr_from_host(host_page) != page) {
+        return;
+    }
+    tb_spec_depth = r->depth;
+    if (tb_gen_code_spec(r->cpu, r->s, r->phys_pc, r->host_pc)) {
+        qatomic_inc(&tb_ctx.tb_spec_count);
+    } else {
+        qatomic_inc(&tb_ctx.tb_spec_drop_count);
+    }
+}
+
+static void *tb_spec_thread_fn(void *arg)
+{
+    rcu_register_thread();
+    tcg_register_thread();
+    tb_spec_self = true;
+
+    qemu_mutex_lock(&tb_spec.lock);
+    while (true) {
+        TBSpecRequest r;
+
+        /* Also ends the registration of our TCGContext, see below */
+        tb_spec.busy = false;
+        qemu_cond_broadcast(&tb_spec.idle);
+
+        while (tb_spec.head == tb_spec.tail || tb_spec.paused) {
+            qemu_cond_wait(&tb_spec.work, &tb_spec.lock);
+        }
+        r = tb_spec.ring[tb_spec.tail++ % TB_SPEC_RING];
+        tb_spec.busy = true;
+        qemu_mutex_unlock(&tb_spec.lock);
+
+        tb_spec_run(&r);
+
+        qemu_mutex_lock(&tb_spec.lock);
+    }
+    return NULL;
+}
+
+void tb_spec_queue(CPUState *cpu, const TranslationBlock *tb,
+                   vaddr pc, void *host_pc)
+{
+    TBSpecNext *nx = &tb_spec_next;
+    int depth = tb_spec_self ? tb_spec_depth + 1 : 1;
+    tb_page_addr_t phys_pc = tb_page_addr0(tb);
+
+    if (nx->n == 0) {
+        return;
+    }
+    /*
+     * The background thread starts from what vCPUs run, which it only
+     * knows for their usual cflags, and keeps to the flags it got.
+     */
+    if (depth > TB_SPEC_MAX_DEPTH || phys_pc == -1 ||
+        !cpu->cc->tcg_ops->translate_from_tb ||
+        (!tb_spec_self && (tb_cflags(tb) != curr_cflags(cpu) ||
+                           panda_translate_watched()))) {
+        nx->n = 0;
+        return;
+    }
+
+    qemu_mutex_lock(&tb_spec.lock);
+    if (!tb_spec.started) {
+        /*
+         * Only now are the target's TCG globals set up, which
+         * tcg_register_thread() copies. A flush must not look at the
+         * TCGContexts while it adds its own, so it starts busy.
+         */
+        tb_spec.started = true;
+        tb_spec.busy = true;
+        qemu_thread_create(&tb_spec.thread, "TCG spec", tb_spec_thread_fn,
+                           NULL, QEMU_THREAD_DETACHED);
+    }
+    host_pc -= pc & ~TARGET_PAGE_MASK;
+    phys_pc &= TARGET_PAGE_MASK;
+    for (int i = 0; i < nx->n; i++) {
+        vaddr off = nx->dest[i] & ~TARGET_PAGE_MASK;
+
+        if (((nx->dest[i] ^ pc) & TARGET_PAGE_MASK) != 0) {
+            continue;
+        }
+        if (tb_spec.head - tb_spec.tail == TB_SPEC_RING) {
+            qatomic_inc(&tb_ctx.tb_spec_drop_count);
+            continue;
+        }
+        tb_spec.ring[tb_spec.head++ % TB_SPEC_RING] = (TBSpecRequest) {
+            .cpu = cpu,
+            .s = {
+                .pc = nx->dest[i],
+                .cs_base = tb->cs_base,
+                .flags = tb->flags,
+                .cflags = tb_cflags(tb),
+            },
+            .phys_pc = phys_pc + off,
+            .host_pc = host_pc + off,
+            .depth = depth,
+        };
+    }
+    qemu_cond_signal(&tb_spec.work);
+    qemu_mutex_unlock(&tb_spec.lock);
+    nx->n = 0;
+}
+
+void tb_spec_pause(void)
+{
+    if (!tb_spec_enabled) {
+        return;
+    }
+    qemu_mutex_lock(&tb_spec.lock);
+    tb_spec.paused++;
+    while (tb_spec.busy) {
+        qemu_cond_wait(&tb_spec.idle, &tb_spec.lock);
+    }
+    qemu_mutex_unlock(&tb_spec.lock);
+}
+
+void tb_spec_resume(void)
+{
+    if (!tb_spec_enabled) {
+        return;
+    }
+    qemu_mutex_lock(&tb_spec.lock);
+    assert(tb_spec.paused);
+    if (--tb_spec.paused == 0) {
+        qemu_cond_signal(&tb_spec.work);
+    }
+    qemu_mutex_unlock(&tb_spec.lock);
+}
+
+void tb_spec_cpu_gone(CPUState *cpu)
+{
+    tb_spec_pause();
+    if (tb_spec_enabled) {
+        qemu_mutex_lock(&tb_spec.lock);
+        for (unsigned i = tb_spec.tail; i != tb_spec.head; i++) {
+            TBSpecRequest *r = &tb_spec.ring[i % TB_SPEC_RING];
+
+            if (r->cpu == cpu) {
+                r->cpu = NULL;
+            }
+        }
+        qemu_mutex_unlock(&tb_spec.lock);
+    }
+    tb_spec_resume();
+}
+
+void tb_spec_store_begin_slow(void)
+{
+    tb_spec_storing = true;
+    qatomic_inc(&tb_spec_stores);
+}
+
+void tb_spec_store_end_slow(void)
+{
+    tb_spec_storing = false;
+    qatomic_dec(&tb_spec_stores);
+}
+
+bool tb_spec_stores_pending(void)
+{
+    smp_mb();
+    return qatomic_read(&tb_spec_stores) != 0;
+}
+
+void tb_spec_init(void)
+{
+    qemu_mutex_init(&tb_spec.lock);
+    qemu_cond_init(&tb_spec.work);
+    qemu_cond_init(&tb_spec.idle);
+    tb_spec_enabled = true;
+}
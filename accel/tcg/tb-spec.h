@@ -0,0 +1,104 @@
+/*
+ * Speculative translation of successor blocks.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#ifndef ACCEL_TCG_TB_SPEC_H
+#define ACCEL_TCG_TB_SPEC_H
+
+#include "exec/translation-block.h"
+#include "exec/vaddr.h"
+
+#ifdef CONFIG_USER_ONLY
+static inline void tb_spec_note_reset(void) { }
+static inline void tb_spec_note(vaddr dest) { }
+static inline void tb_spec_queue(CPUState *cpu, const TranslationBlock *tb,
+                                 vaddr pc, void *host_pc) { }
+static inline bool tb_spec_thread(void) { return false; }
+static inline void tb_spec_pause(void) { }
+static inline void tb_spec_resume(void) { }
+static inline void tb_spec_cpu_gone(CPUState *cpu) { }
+static inline void tb_spec_store_begin(void) { }
+static inline void tb_spec_store_end(void) { }
+static inline bool tb_spec_stores_pending(void) { return false; }
+#else
+extern bool tb_spec_enabled;
+extern __thread bool tb_spec_self;
+extern __thread bool tb_spec_storing;
+
+/* Set up the background translator; call before tcg_init(). */
+void tb_spec_init(void);
+
+void tb_spec_note_reset_slow(void);
+void tb_spec_note_slow(vaddr dest);
+
+/*
+ * Queue the successors noted while translating @tb, which starts at @pc
+ * and whose code is at @host_pc, for translation in the background.
+ */
+void tb_spec_queue(CPUState *cpu, const TranslationBlock *tb,
+                   vaddr pc, void *host_pc);
+
+/*
+ * Keep the background translator away from the code buffer, waiting for
+ * the TB it is translating, if any; for flushes and evictions.
+ */
+void tb_spec_pause(void);
+void tb_spec_resume(void);
+
+/* Forget the requests of @cpu, which is going away. */
+void tb_spec_cpu_gone(CPUState *cpu);
+
+void tb_spec_store_begin_slow(void);
+void tb_spec_store_end_slow(void);
+
+/*
+ * Is a store between notdirty_write() and guest RAM?  Such a store has
+ * invalidated the TBs it overwrites, but not landed yet.
+ */
+bool tb_spec_stores_pending(void);
+
+/* This thread stores to a page with TBs, from notdirty_write(). */
+static inline void tb_spec_store_begin(void)
+{
+    if (unlikely(tb_spec_enabled) && !tb_spec_storing) {
+        tb_spec_store_begin_slow();
+    }
+}
+
+/*
+ * The stores this thread began have landed: at the end of the TB that
+ * made them, or when it exits with cpu_loop_exit().
+ */
+static inline void tb_spec_store_end(void)
+{
+    if (unlikely(tb_spec_storing)) {
+        tb_spec_store_end_slow();
+    }
+}
+
+/* Is this the background translator? */
+static inline bool tb_spec_thread(void)
+{
+    return tb_spec_self;
+}
+
+/* Forget what the previous translation attempt noted. */
+static inline void tb_spec_note_reset(void)
+{
+    if (unlikely(tb_spec_enabled)) {
+        tb_spec_note_reset_slow();
+    }
+}
+
+/* Note that the TB being translated chains directly to @dest. */
+static inline void tb_spec_note(vaddr dest)
+{
+    if (unlikely(tb_spec_enabled)) {
+        tb_spec_note_slow(dest);
+    }
+}
+#endif
+
+#endif
@@ -0,0 +1,231 @@
+/*
+ * Hot trace superblocks and tiered translation.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+/*
+ * With -accel tcg,tb-trace=on or tb-tiers=on, each TB starts by bumping
+ * an execution counter. The counters are a table indexed by a hash of
+ * the physical address of the TB, so they need no freeing and cost one
+ * load and one store; TBs that collide just get hot sooner. Updates are
+ * not atomic: under MTTCG a few counts get lost, which only delays
+ * things.
+ *
+ * When the counter of a TB reaches TB_TRACE_THRESHOLD, tb_trace_hot()
+ * follows the chained jumps out of it, taking the hotter destination
+ * each time, for as long as they stay on its page. If that finds a
+ * chain, the TB is invalidated and the next translation of its pc by
+ * this thread continues through the chain instead of stopping at the
+ * end of the first block: see translator_trace_follow(). The resulting
+ * superblock gives tcg/optimize.c and the register allocator the whole
+ * hot path at once, and leaves it through side exits when execution
+ * goes another way.
+ *
+ * A trace stays on the page of its first block, above its start, so
+ * tb->size, which it extends to cover everything translated, still
+ * describes the guest code it depends on and self-modifying code
+ * invalidates it like any other TB. A backward branch below the start
+ * ends the trace.
+ *
+ * With -accel tcg,tb-tiers=on, the counter also splits code generation
+ * in two tiers. A TB that has a counter is tier 0: tcg_gen_code() skips
+ * the work that only improves the code, most of tcg_optimize() included
+ * (see TCGContext::fast_gen), as most TBs only ever run a few times. When it gets hot, it is replaced
+ * the same way as for a trace, by a tier 1 TB that has the full
+ * pipeline and no counter, and that is a trace if tb-trace is on and a
+ * chain was found.
+ *
+ * Traces are not formed with icount, because the budget of a TB is
+ * charged for all of its instructions on entry and a side exit would
+ * then overcharge it. Tiers don't change what a TB executes, so they
+ * work with icount, and thus in replays, too.
+ */
+
+#include "qemu/osdep.h"
+#include "exec/helper-proto-common.h"
+#include "exec/mmap-lock.h"
+#include "exec/target_page.h"
+#include "hw/core/cpu.h"
+#include "tcg/tcg.h"
+#include "tcg/tcg-op-common.h"
+#include "tb-context.h"
+#include "tb-trace.h"
+#include "internal-common.h"
+
+/* Executions after which a TB is considered for a trace */
+#define TB_TRACE_THRESHOLD 4096
+
+#define TB_TRACE_COUNTER_BITS 16
+
+typedef struct TBTraceRequest {
+    tb_page_addr_t phys_pc;
+    uint64_t cs_base;
+    uint32_t flags;
+    uint32_t cflags;
+    TBTrace trace;
+} TBTraceRequest;
+
+bool tb_trace_enabled;
+bool tb_tiers_enabled;
+
+static uint32_t tb_trace_counters[1 << TB_TRACE_COUNTER_BITS];
+
+/* The trace tb_trace_hot() found last, until tb_trace_take() claims it */
+static __thread TBTraceRequest tb_trace_request = { .phys_pc = -1 };
+
+/* The trace, or tier 1 TB if it has no blocks, being translated */
+static __thread TBTrace tb_trace_gen;
+static __thread bool tb_trace_gen_valid;
+
+static uint32_t *tb_trace_counter(tb_page_addr_t phys_pc)
+{
+    uint64_t h = phys_pc ^ (phys_pc >> TB_TRACE_COUNTER_BITS);
+
+    return &tb_trace_counters[h & ((1 << TB_TRACE_COUNTER_BITS) - 1)];
+}
+
+bool tb_trace_gen_counter(TranslationBlock *tb)
+{
+    uint32_t cflags = tb_cflags(tb);
+    TCGv_ptr counter;
+    TCGv_i32 count;
+    TCGLabel *skip;
+
+    if (!qatomic_read(&tb_tiers_enabled) &&
+        (!qatomic_read(&tb_trace_enabled) || (cflags & CF_USE_ICOUNT))) {
+        return false;
+    }
+    if (tb_page_addr0(tb) == -1 ||
+        (cflags & (CF_NO_GOTO_TB | CF_COUNT_MASK))) {
+        return false;
+    }
+
+    counter = tcg_constant_ptr(tb_trace_counter(tb_page_addr0(tb)));
+    count = tcg_temp_new_i32();
+    skip = gen_new_label();
+    tcg_gen_ld_i32(count, counter, 0);
+    tcg_gen_addi_i32(count, count, 1);
+    tcg_gen_st_i32(count, counter, 0);
+    tcg_gen_brcondi_i32(TCG_COND_NE, count, TB_TRACE_THRESHOLD, skip);
+    gen_helper_tb_trace_hot(tcg_env, tcg_constant_ptr(tb));
+    gen_set_label(skip);
+    return true;
+}
+
+/*
+ * Can a trace starting with @tb, on @page, continue with @dest? Only
+ * above the start of @tb: the trace must lie within [pc, pc + size).
+ */
+static bool tb_trace_joins(const TranslationBlock *tb, tb_page_addr_t page,
+                           const TranslationBlock *dest)
+{
+    return dest != tb &&
+           (tb_page_addr0(dest) & TARGET_PAGE_MASK) == page &&
+           tb_page_addr0(dest) > tb_page_addr0(tb) &&
+           tb_cflags(dest) == tb_cflags(tb) &&
+           dest->flags == tb->flags &&
+           dest->cs_base == tb->cs_base;
+}
+
+/*
+ * Called from the start of @tb when it gets hot. The TBs it reaches are
+ * not freed while it runs, so their fields can be read without locks;
+ * at worst the chain is out of date.
+ */
+void HELPER(tb_trace_hot)(CPUArchState *env, void *ptr)
+{
+    TranslationBlock *tb = ptr;
+    tb_page_addr_t page = tb_page_addr0(tb) & TARGET_PAGE_MASK;
+    TBTraceRequest *r = &tb_trace_request;
+    const TranslationBlock *cur = tb;
+    int n = 0;
+
+    if (tb_cflags(tb) & CF_INVALID) {
+        return;
+    }
+    while (qatomic_read(&tb_trace_enabled) &&
+           !(tb_cflags(tb) & CF_USE_ICOUNT) && n < TB_TRACE_MAX_BLOCKS) {
+        const TranslationBlock *next = NULL;
+        /* A successor must be about as hot to be worth including. */
+        uint32_t best = TB_TRACE_THRESHOLD / 2;
+
+        for (int i = 0; i < 2; i++) {
+            TranslationBlock *dest =
+                (TranslationBlock *)(qatomic_read(&cur->jmp_dest[i]) & ~1);
+            uint32_t count;
+
+            if (!dest || !tb_trace_joins(tb, page, dest)) {
+                continue;
+            }
+            count = qatomic_read(tb_trace_counter(tb_page_addr0(dest)));
+            if (count >= best) {
+                best = count;
+                next = dest;
+            }
+        }
+        if (!next) {
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (r->trace.off[i] == (tb_page_addr0(next) & ~TARGET_PAGE_MASK)) {
+                next = NULL;
+                break;
+            }
+        }
+        if (!next) {
+            break;
+        }
+        r->trace.off[n++] = tb_page_addr0(next) & ~TARGET_PAGE_MASK;
+        cur = next;
+    }
+
+    /*
+     * With nothing to improve, the counter carries on past the threshold
+     * and @tb is left alone.
+     */
+    if (n == 0 && !qatomic_read(&tb_tiers_enabled)) {
+        return;
+    }
+    r->trace.n = n;
+    r->phys_pc = tb_page_addr0(tb);
+    r->cs_base = tb->cs_base;
+    r->flags = tb->flags;
+    r->cflags = tb_cflags(tb);
+    qatomic_set(tb_trace_counter(r->phys_pc), 0);
+
+    /*
+     * Let the next lookup of the pc miss and translate tier 1; until
+     * then, jumps to @tb go back to the main loop.
+     */
+    mmap_lock();
+    qemu_thread_jit_write();
+    tb_phys_invalidate(tb, -1);
+    qemu_thread_jit_execute();
+    mmap_unlock();
+}
+
+const TBTrace *tb_trace_take(TCGTBCPUState s, tb_page_addr_t phys_pc)
+{
+    TBTraceRequest *r = &tb_trace_request;
+
+    tb_trace_gen_valid = false;
+    if (r->phys_pc == -1 || r->phys_pc != phys_pc ||
+        r->cs_base != s.cs_base || r->flags != s.flags ||
+        r->cflags != s.cflags) {
+        return NULL;
+    }
+    tb_trace_gen = r->trace;
+    tb_trace_gen_valid = true;
+    r->phys_pc = -1;
+    qatomic_inc(&tb_ctx.tb_hot_count);
+    if (tb_trace_gen.n) {
+        qatomic_inc(&tb_ctx.tb_trace_count);
+    }
+    return &tb_trace_gen;
+}
+
+const TBTrace *tb_trace_current(void)
+{
+    return tb_trace_gen_valid ? &tb_trace_gen : NULL;
+}
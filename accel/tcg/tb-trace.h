@@ -0,0 +1,44 @@
+/*
+ * Hot trace superblocks and tiered translation.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#ifndef ACCEL_TCG_TB_TRACE_H
+#define ACCEL_TCG_TB_TRACE_H
+
+#include "exec/translation-block.h"
+#include "accel/tcg/tb-cpu-state.h"
+
+/* Most blocks a trace strings together after its first one */
+#define TB_TRACE_MAX_BLOCKS 8
+
+/*
+ * The blocks a trace continues with, in order, as offsets into the page
+ * of its first block. See translator_trace_follow(). A tier 1 TB that
+ * is not a trace has none.
+ */
+typedef struct TBTrace {
+    int n;
+    uint16_t off[TB_TRACE_MAX_BLOCKS];
+} TBTrace;
+
+extern bool tb_trace_enabled;
+extern bool tb_tiers_enabled;
+
+/*
+ * Return the trace to translate for @s, or NULL to translate a tier 0
+ * TB. The trace is valid until the next call on this thread.
+ */
+const TBTrace *tb_trace_take(TCGTBCPUState s, tb_page_addr_t phys_pc);
+
+/* Return the trace being translated by this thread, or NULL. */
+const TBTrace *tb_trace_current(void);
+
+/*
+ * Emit the execution counter at the start of @tb, if it should have one,
+ * and return whether it does.
+ */
+bool tb_trace_gen_counter(TranslationBlock *tb);
+
+#endif
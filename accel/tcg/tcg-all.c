@@ -40,11 +40,14 @@
 #include "hw/core/boards.h"
 #include "exec/tb-flush.h"
 #include "system/runstate.h"
+#include "tb-cache.h"
+#include "tb-spec.h"
 #endif
 #include "accel/accel-ops.h"
 #include "accel/accel-cpu-ops.h"
 #include "accel/tcg/cpu-ops.h"
 #include "internal-common.h"
+#include "tb-trace.h"
 
 
 struct TCGState {
@@ -52,8 +55,13 @@ struct TCGState {
 
     OnOffAuto mttcg_enabled;
     bool one_insn_per_tb;
+    bool tb_evict;
+    bool tb_trace;
+    bool tb_tiers;
+    bool tb_spec;
     int splitwx_enabled;
     unsigned long tb_size;
+    char *tb_cache;
 };
 typedef struct TCGState TCGState;
 
@@ -80,9 +88,11 @@ static void tcg_accel_instance_init(Object *obj)
 #else
     s->splitwx_enabled = 0;
 #endif
+    s->tb_evict = true;
 }
 
 bool one_insn_per_tb;
+bool tb_evict_enabled = true;
 
 #ifndef CONFIG_USER_ONLY
 static void tcg_vm_change_state(void *opaque, bool running, RunState state)
@@ -151,6 +161,27 @@ static int tcg_init_machine(AccelState *as, MachineState *ms)
 
     page_init();
     tb_htable_init();
+#ifndef CONFIG_USER_ONLY
+    if (s->tb_cache) {
+        if (s->mttcg_enabled == ON_OFF_AUTO_ON) {
+            warn_report("tb-cache needs thread=single; not using %s",
+                        s->tb_cache);
+        } else {
+            /* Before tcg_init(), which maps the code buffer */
+            tb_cache_init(s->tb_cache);
+        }
+    }
+    if (s->tb_spec) {
+        if (tb_cache_enabled) {
+            warn_report("tb-spec would change the layout tb-cache needs; "
+                        "not translating in the background");
+        } else {
+            /* The background translator has a TCGContext of its own */
+            tb_spec_init();
+            max_threads++;
+        }
+    }
+#endif
     tcg_init(s->tb_size * MiB, s->splitwx_enabled, max_threads);
 
 #if defined(CONFIG_SOFTMMU)
@@ -216,6 +247,35 @@ static void tcg_set_tb_size(Object *obj, Visitor *v,
     s->tb_size = value;
 }
 
+#ifndef CONFIG_USER_ONLY
+static char *tcg_get_tb_cache(Object *obj, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+
+    return g_strdup(s->tb_cache);
+}
+
+static void tcg_set_tb_cache(Object *obj, const char *value, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+
+    g_free(s->tb_cache);
+    s->tb_cache = g_strdup(value);
+}
+
+static bool tcg_get_tb_spec(Object *obj, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    return s->tb_spec;
+}
+
+static void tcg_set_tb_spec(Object *obj, bool value, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    s->tb_spec = value;
+}
+#endif
+
 static bool tcg_get_splitwx(Object *obj, Error **errp)
 {
     TCGState *s = TCG_STATE(obj);
@@ -242,6 +302,45 @@ static void tcg_set_one_insn_per_tb(Object *obj, bool value, Error **errp)
     qatomic_set(&one_insn_per_tb, value);
 }
 
+static bool tcg_get_tb_evict(Object *obj, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    return s->tb_evict;
+}
+
+static void tcg_set_tb_evict(Object *obj, bool value, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    s->tb_evict = value;
+    qatomic_set(&tb_evict_enabled, value);
+}
+
+static bool tcg_get_tb_trace(Object *obj, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    return s->tb_trace;
+}
+
+static void tcg_set_tb_trace(Object *obj, bool value, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    s->tb_trace = value;
+    qatomic_set(&tb_trace_enabled, value);
+}
+
+static bool tcg_get_tb_tiers(Object *obj, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    return s->tb_tiers;
+}
+
+static void tcg_set_tb_tiers(Object *obj, bool value, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    s->tb_tiers = value;
+    qatomic_set(&tb_tiers_enabled, value);
+}
+
 static int tcg_gdbstub_supported_sstep_flags(AccelState *as)
 {
     /*
@@ -278,6 +377,38 @@ static void tcg_accel_class_init(ObjectClass *oc, const void *data)
     object_class_property_set_description(oc, "tb-size",
         "TCG translation block cache size");
 
+#ifndef CONFIG_USER_ONLY
+    object_class_property_add_str(oc, "tb-cache",
+                                  tcg_get_tb_cache,
+                                  tcg_set_tb_cache);
+    object_class_property_set_description(oc, "tb-cache",
+        "File to keep translated code in between runs");
+
+    object_class_property_add_bool(oc, "tb-spec",
+                                   tcg_get_tb_spec,
+                                   tcg_set_tb_spec);
+    object_class_property_set_description(oc, "tb-spec",
+        "Translate the successors of new blocks on a background thread");
+#endif
+
+    object_class_property_add_bool(oc, "tb-evict",
+                                   tcg_get_tb_evict,
+                                   tcg_set_tb_evict);
+    object_class_property_set_description(oc, "tb-evict",
+        "Evict the oldest translated code, not all of it, when the cache fills");
+
+    object_class_property_add_bool(oc, "tb-trace",
+                                   tcg_get_tb_trace,
+                                   tcg_set_tb_trace);
+    object_class_property_set_description(oc, "tb-trace",
+        "Retranslate hot chains of translation blocks as superblocks");
+
+    object_class_property_add_bool(oc, "tb-tiers",
+                                   tcg_get_tb_tiers,
+                                   tcg_set_tb_tiers);
+    object_class_property_set_description(oc, "tb-tiers",
+        "Translate quickly at first, and fully once code gets hot");
+
     object_class_property_add_bool(oc, "split-wx",
         tcg_get_splitwx, tcg_set_splitwx);
     object_class_property_set_description(oc, "split-wx",
@@ -9,6 +9,7 @@
 #include "qemu/osdep.h"
 #include "qemu/accel.h"
 #include "qemu/qht.h"
+#include "qemu/timer.h"
 #include "qapi/error.h"
 #include "system/cpu-timers.h"
 #include "exec/icount.h"
@@ -16,6 +17,8 @@
 #include "tcg/tcg.h"
 #include "internal-common.h"
 #include "tb-context.h"
+#include "tb-jmp-cache.h"
+#include "panda/cb-profile.h"
 #include <math.h>
 
 static void dump_drift_info(GString *buf)
@@ -150,9 +153,26 @@ static void tlb_flush_counts(size_t *pfull, size_t *ppart, size_t *pelide)
 static void tcg_dump_flush_info(GString *buf)
 {
     size_t flush_full, flush_part, flush_elide;
+    unsigned misses = qatomic_read(&tb_ctx.tb_miss_count);
+    uint64_t miss_ns = qatomic_read(&tb_ctx.tb_miss_ns);
 
     g_string_append_printf(buf, "TB flush count      %u\n",
                            qatomic_read(&tb_ctx.tb_flush_count));
+    g_string_append_printf(buf, "TB evict count      %u\n",
+                           qatomic_read(&tb_ctx.tb_evict_count));
+    g_string_append_printf(buf, "Regions evicted     %zu/%zu\n",
+                           tcg_region_nb_evicted(), tcg_region_count());
+    g_string_append_printf(buf, "TB hot count        %u\n",
+                           qatomic_read(&tb_ctx.tb_hot_count));
+    g_string_append_printf(buf, "TB trace count      %u\n",
+                           qatomic_read(&tb_ctx.tb_trace_count));
+    g_string_append_printf(buf, "TB miss count       %u\n", misses);
+    g_string_append_printf(buf, "TB miss stall       %" PRIu64 " us "
+                           "(avg %" PRIu64 " ns)\n", miss_ns / SCALE_US,
+                           misses ? miss_ns / misses : 0);
+    g_string_append_printf(buf, "TB spec count       %u (%u dropped)\n",
+                           qatomic_read(&tb_ctx.tb_spec_count),
+                           qatomic_read(&tb_ctx.tb_spec_drop_count));
     g_string_append_printf(buf, "TB invalidate count %u\n",
                            qatomic_read(&tb_ctx.tb_phys_invalidate_count));
 
@@ -162,6 +182,33 @@ static void tcg_dump_flush_info(GString *buf)
     g_string_append_printf(buf, "TLB elided flushes  %zu\n", flush_elide);
 }
 
+static void tcg_dump_jmp_cache_info(GString *buf)
+{
+    CPUState *cpu;
+
+    RCU_READ_LOCK_GUARD();
+    CPU_FOREACH(cpu) {
+        CPUJumpCache *jc = qatomic_rcu_read(&cpu->tb_jmp_cache);
+        uint64_t hits, misses;
+
+        if (!jc) {
+            continue;
+        }
+        hits = qatomic_read(&jc->hits);
+        misses = qatomic_read(&jc->misses);
+        g_string_append_printf(buf, "CPU %-3d jump cache  %u sets x %d ways "
+                               "(%u resizes)\n", cpu->cpu_index,
+                               1u << jc->bits, TB_JMP_CACHE_WAYS,
+                               jc->resizes);
+        g_string_append_printf(buf, "  hits %" PRIu64 " misses %" PRIu64
+                               " (%0.1f%% hit) evictions %" PRIu64 "\n",
+                               hits, misses,
+                               hits + misses ?
+                               hits * 100.0 / (hits + misses) : 0,
+                               qatomic_read(&jc->evictions));
+    }
+}
+
 static void dump_exec_info(GString *buf)
 {
     struct tb_tree_stats tst = {};
@@ -204,6 +251,7 @@ static void dump_exec_info(GString *buf)
 
     g_string_append_printf(buf, "\nStatistics:\n");
     tcg_dump_flush_info(buf);
+    tcg_dump_jmp_cache_info(buf);
 }
 
 void tcg_get_stats(AccelState *accel, GString *buf)
@@ -217,3 +265,8 @@ void tcg_dump_stats(GString *buf)
 {
     tcg_get_stats(current_accel(), buf);
 }
+
+void tcg_dump_panda_profile(GString *buf)
+{
+    panda_cb_profile_dump(buf);
+}
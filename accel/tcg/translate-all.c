@@ -26,6 +26,7 @@
 #include "tb-internal.h"
 #include "exec/tb-flush.h"
 #include "qemu/cacheinfo.h"
+#include "qemu/timer.h"
 #include "qemu/target-info.h"
 #include "exec/log.h"
 #include "exec/icount.h"
@@ -34,6 +35,9 @@
 #include "tb-hash.h"
 #include "tb-context.h"
 #include "tb-internal.h"
+#include "tb-cache.h"
+#include "tb-trace.h"
+#include "tb-spec.h"
 #include "internal-common.h"
 #include "tcg/perf.h"
 #include "tcg/insn-start-words.h"
@@ -245,6 +249,7 @@ static int setjmp_gen_code(CPUArchState *env, TranslationBlock *tb,
     }
 
     tcg_func_start(tcg_ctx);
+    tb_spec_note_reset();
 
     CPUState *cs = env_cpu(env);
     tcg_ctx->cpu = cs;
@@ -257,15 +262,17 @@ static int setjmp_gen_code(CPUArchState *env, TranslationBlock *tb,
     return tcg_gen_code(tcg_ctx, tb, pc);
 }
 
+static TranslationBlock *tb_translate(CPUState *cpu, TCGTBCPUState s,
+                                      tb_page_addr_t phys_pc, void *host_pc,
+                                      const TBTrace *trace);
+
 /* Called with mmap_lock held for user mode emulation.  */
 TranslationBlock *tb_gen_code(CPUState *cpu, TCGTBCPUState s)
 {
     CPUArchState *env = cpu_env(cpu);
-    TranslationBlock *tb, *existing_tb;
-    tb_page_addr_t phys_pc, phys_p2;
-    tcg_insn_unit *gen_code_buf;
-    int gen_code_size, search_size, max_insns;
-    int64_t ti;
+    TranslationBlock *tb;
+    const TBTrace *trace;
+    tb_page_addr_t phys_pc;
     void *host_pc;
 
     assert_memory_lock();
@@ -278,6 +285,39 @@ TranslationBlock *tb_gen_code(CPUState *cpu, TCGTBCPUState s)
         s.cflags = (s.cflags & ~CF_COUNT_MASK) | 1;
     }
 
+    trace = tb_trace_take(s, phys_pc);
+    if (!trace) {
+        tb = tb_cache_lookup(cpu, s, phys_pc, host_pc);
+        if (tb) {
+            return tb;
+        }
+    }
+    return tb_translate(cpu, s, phys_pc, host_pc, trace);
+}
+
+/*
+ * Translate @s for @cpu on the background translator, from the code at
+ * @host_pc, without the help of @cpu's TLB. Return NULL if that is not
+ * possible; see tb-spec.c.
+ */
+TranslationBlock *tb_gen_code_spec(CPUState *cpu, TCGTBCPUState s,
+                                   tb_page_addr_t phys_pc, void *host_pc)
+{
+    qemu_thread_jit_write();
+    return tb_translate(cpu, s, phys_pc, host_pc, NULL);
+}
+
+static TranslationBlock *tb_translate(CPUState *cpu, TCGTBCPUState s,
+                                      tb_page_addr_t phys_pc, void *host_pc,
+                                      const TBTrace *trace)
+{
+    CPUArchState *env = cpu_env(cpu);
+    TranslationBlock *tb, *existing_tb;
+    tb_page_addr_t phys_p2;
+    tcg_insn_unit *gen_code_buf;
+    int gen_code_size, search_size, max_insns;
+    int64_t ti;
+
     max_insns = s.cflags & CF_COUNT_MASK;
     if (max_insns == 0) {
         max_insns = TCG_MAX_INSNS;
@@ -288,15 +328,18 @@ TranslationBlock *tb_gen_code(CPUState *cpu, TCGTBCPUState s)
     assert_no_pages_locked();
     tb = tcg_tb_alloc(tcg_ctx);
     if (unlikely(!tb)) {
-        /* flush must be done */
+        /* room must be made, by the vCPUs */
+        if (tb_spec_thread()) {
+            return NULL;
+        }
         if (cpu_in_serial_context(cpu)) {
             trace_tb_gen_code_buffer_overflow("tcg_tb_alloc");
-            tb_flush__exclusive_or_serial();
+            tb_evict__exclusive_or_serial();
             goto buffer_overflow;
         }
-        queue_tb_flush(cpu);
+        queue_tb_evict(cpu);
         mmap_unlock();
-        /* Make the execution loop process the flush as soon as possible.  */
+        /* Make the execution loop process the eviction as soon as possible. */
         cpu->exception_index = EXCP_INTERRUPT;
         cpu_loop_exit(cpu);
     }
@@ -309,10 +352,18 @@ TranslationBlock *tb_gen_code(CPUState *cpu, TCGTBCPUState s)
     tb->cs_base = s.cs_base;
     tb->flags = s.flags;
     tb->cflags = s.cflags;
+    tb->panda_instr = 0;
+    tb->panda_pc_lo = 0;
+    tb->panda_pc_hi = 0;
+    tb->nocache = trace && trace->n;
     tb_set_page_addr0(tb, phys_pc);
     tb_set_page_addr1(tb, -1);
     if (phys_pc != -1) {
         tb_lock_page0(phys_pc);
+        if (tb_spec_thread() && !tb_page_code_settled(phys_pc)) {
+            tb_unlock_pages(tb);
+            return NULL;
+        }
     }
 
     tcg_ctx->gen_tb = tb;
@@ -383,6 +434,15 @@ TranslationBlock *tb_gen_code(CPUState *cpu, TCGTBCPUState s)
                           "Restarting code generation with re-locked pages");
             goto restart_translate;
 
+        case -4:
+            /*
+             * The background translator cannot translate this TB without
+             * the vCPU: see translator_loop() and translator_ld().
+             */
+            tb_unlock_pages(tb);
+            tcg_ctx->gen_tb = NULL;
+            return NULL;
+
         default:
             g_assert_not_reached();
         }
@@ -528,6 +588,9 @@ TranslationBlock *tb_gen_code(CPUState *cpu, TCGTBCPUState s)
      */
     existing_tb = tb_link_page(tb);
     assert_no_pages_locked();
+    if (existing_tb) {
+        tb_spec_queue(cpu, tb, s.pc, host_pc);
+    }
 
     /* if the TB already exists, discard what we just translated */
     if (unlikely(existing_tb != tb)) {
@@ -621,20 +684,129 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
 
 #endif /* CONFIG_USER_ONLY */
 
+CPUJumpCache *tb_jmp_cache_new(unsigned bits)
+{
+    CPUJumpCache *jc;
+
+    jc = g_malloc0(sizeof(*jc) + sizeof(jc->set[0]) * ((size_t)1 << bits));
+    jc->bits = bits;
+    jc->window_begin_ns = get_clock_realtime();
+    return jc;
+}
+
+/**
+ * tb_jmp_cache_resize() - resize @cpu's jump cache if necessary
+ * @cpu: the CPU, which must be the current one
+ * @jc: its jump cache, just flushed
+ * @n_used: how many entries were in use before the flush
+ * @now: the current time
+ *
+ * Like the TLB (see tlb_mmu_resize_locked()), the jump cache is only
+ * resized when it is flushed, so that nothing needs rehashing: it doubles
+ * when the flush finds it mostly full, or finds that it had to evict
+ * entries to make room during the window, and halves once a window of
+ * 100ms expires without either. Misses alone are no reason to grow it,
+ * since most of them come right after a flush and happen at any size.
+ */
+static void tb_jmp_cache_resize(CPUState *cpu, CPUJumpCache *jc,
+                                size_t n_used, int64_t now)
+{
+    const int64_t window_len_ns = 100 * 1000 * 1000;
+    size_t n_entries = (size_t)TB_JMP_CACHE_WAYS << jc->bits;
+    bool window_expired = now > jc->window_begin_ns + window_len_ns;
+    bool thrashing;
+    size_t rate;
+    unsigned bits = jc->bits;
+    CPUJumpCache *new;
+
+    if (n_used > jc->window_max_entries) {
+        jc->window_max_entries = n_used;
+    }
+    rate = jc->window_max_entries * 100 / n_entries;
+
+    /* Evictions count once they are a fair share of lookups and of size */
+    thrashing = jc->window_evictions > jc->window_lookups / 16 &&
+                jc->window_evictions > n_entries / 16;
+
+    if (rate > 70 || thrashing) {
+        bits = MIN(bits + 1, TB_JMP_CACHE_MAX_BITS);
+    } else if (window_expired && rate < 30) {
+        bits = MAX(bits - 1, TB_JMP_CACHE_MIN_BITS);
+    }
+
+    if (bits == jc->bits) {
+        if (window_expired) {
+            jc->window_begin_ns = now;
+            jc->window_max_entries = n_used;
+            jc->window_lookups = 0;
+            jc->window_evictions = 0;
+        }
+        return;
+    }
+
+    new = tb_jmp_cache_new(bits);
+    new->window_begin_ns = now;
+    new->resizes = jc->resizes + 1;
+    new->hits = jc->hits;
+    new->misses = jc->misses;
+    new->evictions = jc->evictions;
+    qatomic_rcu_set(&cpu->tb_jmp_cache, new);
+    g_free_rcu(jc, rcu);
+}
+
 /*
  * Called by generic code at e.g. cpu reset after cpu creation,
  * therefore we must be prepared to allocate the jump cache.
  */
 void tcg_flush_jmp_cache(CPUState *cpu)
 {
-    CPUJumpCache *jc = cpu->tb_jmp_cache;
+    CPUJumpCache *jc;
+    size_t n_used = 0;
+
+    RCU_READ_LOCK_GUARD();
+    jc = qatomic_rcu_read(&cpu->tb_jmp_cache);
 
     /* During early initialization, the cache may not yet be allocated. */
     if (unlikely(jc == NULL)) {
         return;
     }
 
-    for (int i = 0; i < TB_JMP_CACHE_SIZE; i++) {
-        qatomic_set(&jc->array[i].tb, NULL);
+    for (size_t i = 0; i < (size_t)1 << jc->bits; i++) {
+        for (int j = 0; j < TB_JMP_CACHE_WAYS; j++) {
+            if (qatomic_read(&jc->set[i][j].tb)) {
+                qatomic_set(&jc->set[i][j].tb, NULL);
+                n_used++;
+            }
+        }
+    }
+
+    /* Only its CPU may replace the cache, see CPUJumpCache. */
+    if (cpu == current_cpu) {
+        tb_jmp_cache_resize(cpu, jc, n_used, get_clock_realtime());
+    }
+}
+
+/* Drop the entries of @cpu's jump cache whose TB satisfies @pred. */
+void tcg_jmp_cache_drop(CPUState *cpu,
+                        bool (*pred)(const TranslationBlock *tb, void *opaque),
+                        void *opaque)
+{
+    CPUJumpCache *jc;
+
+    RCU_READ_LOCK_GUARD();
+    jc = qatomic_rcu_read(&cpu->tb_jmp_cache);
+
+    if (unlikely(jc == NULL)) {
+        return;
+    }
+
+    for (size_t i = 0; i < (size_t)1 << jc->bits; i++) {
+        for (int j = 0; j < TB_JMP_CACHE_WAYS; j++) {
+            TranslationBlock *tb = qatomic_read(&jc->set[i][j].tb);
+
+            if (tb && pred(tb, opaque)) {
+                qatomic_set(&jc->set[i][j].tb, NULL);
+            }
+        }
     }
 }
@@ -20,6 +20,8 @@
 #include "internal-common.h"
 #include "disas/disas.h"
 #include "tb-internal.h"
+#include "tb-trace.h"
+#include "tb-spec.h"
 
 static void set_can_do_io(DisasContextBase *db, bool val)
 {
@@ -115,8 +117,40 @@ bool translator_use_goto_tb(DisasContextBase *db, vaddr dest)
         return false;
     }
 
+    /*
+     * A trace has only two chained exits, like any TB: keep them for its
+     * last block, which is where execution normally leaves it.
+     */
+    if (db->trace && !db->plugin_enabled && db->trace_pos < db->trace->n) {
+        return false;
+    }
+
     /* Check for the dest on the same page as the start of the TB.  */
-    return translator_is_same_page(db, dest);
+    if (!translator_is_same_page(db, dest)) {
+        return false;
+    }
+    if (!db->plugin_enabled) {
+        tb_spec_note(dest);
+    }
+    return true;
+}
+
+bool translator_trace_follow(DisasContextBase *db, vaddr dest)
+{
+    const TBTrace *trace = db->trace;
+
+    /*
+     * Plugins expect the insns of a TB to be contiguous. The TB must not
+     * reach below pc_first, or tb->size would not cover it.
+     */
+    if (!trace || db->plugin_enabled ||
+        db->trace_follow || db->trace_pos >= trace->n ||
+        dest <= db->pc_first || !translator_is_same_page(db, dest) ||
+        (dest & ~TARGET_PAGE_MASK) != trace->off[db->trace_pos]) {
+        return false;
+    }
+    db->trace_follow = true;
+    return true;
 }
 
 void translator_loop(CPUState *cpu, TranslationBlock *tb, int *max_insns,
@@ -141,19 +175,31 @@ void translator_loop(CPUState *cpu, TranslationBlock *tb, int *max_insns,
     db->host_addr[1] = NULL;
     db->record_start = 0;
     db->record_len = 0;
-    db->code_mmuidx = cpu_mmu_index(cpu, true);
+    /* The background translator has host_pc and must not look at env */
+    db->code_mmuidx = tb_spec_thread() ? 0 : cpu_mmu_index(cpu, true);
+    db->trace = tb_trace_current();
+    db->trace_pos = 0;
+    db->trace_follow = false;
+    db->code_end = pc;
 
     ops->init_disas_context(db, cpu);
     tcg_debug_assert(db->is_jmp == DISAS_NEXT);  /* no early exit */
 
     /* Start translating.  */
     icount_start_insn = gen_tb_start(db, cflags);
+    tcg_ctx->fast_gen = !db->trace && tb_trace_gen_counter(tb) &&
+                        qatomic_read(&tb_tiers_enabled);
     ops->tb_start(db, cpu);
     tcg_debug_assert(db->is_jmp == DISAS_NEXT);  /* no early exit */
 
     plugin_enabled = plugin_gen_tb_start(cpu, db);
     db->plugin_enabled = plugin_enabled;
 
+    /* Plugin callbacks run on the vCPU: leave this TB to it. */
+    if (plugin_enabled && tb_spec_thread()) {
+        siglongjmp(tcg_ctx->jmp_trans, -4);
+    }
+
     while (true) {
         *max_insns = ++db->num_insns;
         ops->insn_start(db, cpu);
@@ -188,6 +234,11 @@ void translator_loop(CPUState *cpu, TranslationBlock *tb, int *max_insns,
             plugin_gen_insn_end();
         }
 
+        if (db->trace_follow) {
+            db->trace_follow = false;
+            db->trace_pos++;
+        }
+
         /* Stop translation if translate_insn so indicated.  */
         if (db->is_jmp != DISAS_NEXT) {
             break;
@@ -220,8 +271,15 @@ void translator_loop(CPUState *cpu, TranslationBlock *tb, int *max_insns,
     set_can_do_io(db, true);
     tcg_ctx->emit_before_op = NULL;
 
-    /* May be used by disas_log or plugin callbacks. */
-    tb->size = db->pc_next - db->pc_first;
+    /*
+     * May be used by disas_log or plugin callbacks.  A trace covers all
+     * the code it was translated from, including what it jumped over.
+     */
+    if (db->trace_pos) {
+        tb->size = MAX(db->code_end, db->pc_next) - db->pc_first;
+    } else {
+        tb->size = db->pc_next - db->pc_first;
+    }
     tb->icount = db->num_insns;
 
     if (plugin_enabled) {
@@ -253,6 +311,8 @@ static bool translator_ld(CPUArchState *env, DisasContextBase *db,
     void *host;
     vaddr base;
 
+    db->code_end = MAX(db->code_end, pc + len);
+
     /* Use slow path if first page is MMIO. */
     if (unlikely(tb_page_addr0(tb) == -1)) {
         /* We capped translation with first page MMIO in tb_gen_code. */
@@ -298,6 +358,10 @@ static bool translator_ld(CPUArchState *env, DisasContextBase *db,
     if (host == NULL) {
         tb_page_addr_t page0, old_page1, new_page1;
 
+        /* The background translator has no TLB to find the page with. */
+        if (tb_spec_thread()) {
+            siglongjmp(tcg_ctx->jmp_trans, -4);
+        }
         new_page1 = get_page_addr_code_hostp(env, base, &db->host_addr[1]);
 
         /*
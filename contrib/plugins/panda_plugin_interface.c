@@ -33,66 +33,143 @@ static void end_block_exec_cb(unsigned int cpu_index, void *udata)
     panda_callbacks_end_block_exec(cpu, (TranslationBlock*) udata);
 }
 
+/* counter sets that may watch the same PC */
+#define PANDA_MAX_INSN_COUNTERS 8
+
 static void insn_exec(unsigned int cpu_index, void *udata)
 {
-    // CPUState *cpu = panda_cpu_by_index(cpu_index);
-    // panda_callbacks_insn_exec(cpu, (uint64_t) udata);
+    CPUState *cpu = panda_cpu_by_index(cpu_index);
+    panda_callbacks_insn_exec(cpu, (uint64_t) udata);
 }
 
-#ifdef TODO_LATER
-static void vcpu_mem(unsigned int cpu_index, qemu_plugin_meminfo_t info,
-                     uint64_t vaddr, void *udata){
-    CPUState *cpu = panda_cpu_by_index(cpu_index);
-    struct qemu_plugin_hwaddr* hwaddr_info = qemu_plugin_get_hwaddr(info, vaddr);
-    uint64_t hwaddr;
-    if (hwaddr_info){
-        hwaddr = qemu_plugin_hwaddr_phys_addr(hwaddr_info);
-    }
-    bool is_store = qemu_plugin_mem_is_store(info);
+static uint64_t mem_value(qemu_plugin_meminfo_t info)
+{
     qemu_plugin_mem_value m = qemu_plugin_mem_get_value(info);
-    size_t size;
-    void *data;
 
     switch (m.type){
         case QEMU_PLUGIN_MEM_VALUE_U8:
-            size = 1;
-            data = &m.data.u8;
-            break;
+            return m.data.u8;
         case QEMU_PLUGIN_MEM_VALUE_U16:
-            size = 2;
-            data = &m.data.u16;
-            break;
+            return m.data.u16;
         case QEMU_PLUGIN_MEM_VALUE_U32:
-            size = 4;
-            data = &m.data.u32;
-            break;
+            return m.data.u32;
         case QEMU_PLUGIN_MEM_VALUE_U64:
-            size = 8;
-            data = &m.data.u64;
-            break;
+            return m.data.u64;
         case QEMU_PLUGIN_MEM_VALUE_U128:
-            size = 16;
-            data = &m.data.u128;
-            break;
+            return m.data.u128.low;
         default:
             assert(false);
+            return 0;
+    }
+}
+
+/*
+ * Memory accesses for PANDA_CB_MEM_BATCH are appended to a per-vCPU ring
+ * and handed to subscribers in bulk instead of walking the callback list
+ * on every load/store. Each ring is only ever touched by its own vCPU
+ * thread, so no locking is needed. The fill count lives in the
+ * scoreboard too, letting the flushes at TB exit and, for TBs left early
+ * by an exception, at the next TB entry be conditional callbacks that
+ * cost nothing while the ring is empty.
+ */
+#define PANDA_MEM_RING_SIZE 1024
+
+typedef struct {
+    uint64_t count;
+    panda_mem_access ring[PANDA_MEM_RING_SIZE];
+} PandaMemRing;
+
+static struct qemu_plugin_scoreboard *mem_rings;
+static qemu_plugin_u64 mem_ring_count;
+
+static void mem_ring_drain(unsigned int cpu_index)
+{
+    PandaMemRing *r = qemu_plugin_scoreboard_find(mem_rings, cpu_index);
+    size_t n = r->count;
+
+    if (n == 0) {
+        return;
+    }
+    r->count = 0;
+    panda_callbacks_mem_batch(panda_cpu_by_index(cpu_index), r->ring, n);
+}
+
+static void mem_ring_flush_cb(unsigned int cpu_index, void *udata)
+{
+    mem_ring_drain(cpu_index);
+}
+
+static void mem_ring_record(unsigned int cpu_index, qemu_plugin_meminfo_t info,
+                            uint64_t vaddr, void *udata)
+{
+    PandaMemRing *r = qemu_plugin_scoreboard_find(mem_rings, cpu_index);
+    struct qemu_plugin_hwaddr *hwaddr = qemu_plugin_get_hwaddr(info, vaddr);
+    panda_mem_access *a = &r->ring[r->count];
+
+    a->pc = (uint64_t)udata;
+    a->vaddr = vaddr;
+    a->paddr = hwaddr ? qemu_plugin_hwaddr_phys_addr(hwaddr) : (uint64_t)-1;
+    a->size = 1u << qemu_plugin_mem_size_shift(info);
+    a->is_write = qemu_plugin_mem_is_store(info);
+    a->value = mem_value(info);
+
+    if (++r->count == PANDA_MEM_RING_SIZE) {
+        mem_ring_drain(cpu_index);
+    }
+}
+
+/*
+ * Per-access PANDA_CB_{VIRT,PHYS}_MEM_AFTER_* dispatch. The callback is
+ * registered as a range callback: accesses outside the table of ranges
+ * the core derives from the plugins' address filters are rejected inline
+ * and never get here. The table is per-vCPU scoreboard data, so the core
+ * can change it at any time without retranslation.
+ */
+typedef struct {
+    panda_mem_range r[PANDA_MEM_RANGE_SLOTS];
+} PandaMemRanges;
+
+static struct qemu_plugin_scoreboard *mem_ranges;
+static qemu_plugin_u64 mem_ranges_table;
+
+static void mem_ranges_store(unsigned int vcpu_index,
+                             const panda_mem_range *ranges)
+{
+    PandaMemRanges *t = qemu_plugin_scoreboard_find(mem_ranges, vcpu_index);
+
+    for (int i = 0; i < PANDA_MEM_RANGE_SLOTS; i++) {
+        t->r[i] = ranges[i];
     }
+}
 
-    if (hwaddr_info && qemu_plugin_hwaddr_is_io(hwaddr_info)){
-        // panda_callbacks_mmio_after_read(cpu, hwaddr, vaddr, size, data);
+static void mem_ranges_set(const panda_mem_range *ranges)
+{
+    for (int i = 0; i < qemu_plugin_num_vcpus(); i++) {
+        mem_ranges_store(i, ranges);
     }
+}
+
+static void mem_ranges_vcpu_init(qemu_plugin_id_t id, unsigned int vcpu_index)
+{
+    panda_mem_range ranges[PANDA_MEM_RANGE_SLOTS];
+
+    panda_get_mem_ranges(ranges);
+    mem_ranges_store(vcpu_index, ranges);
+}
+
+static void vcpu_mem(unsigned int cpu_index, qemu_plugin_meminfo_t info,
+                     uint64_t vaddr, void *udata){
+    CPUState *cpu = panda_cpu_by_index(cpu_index);
+    struct qemu_plugin_hwaddr* hwaddr_info = qemu_plugin_get_hwaddr(info, vaddr);
+    uint64_t hwaddr = -1;
 
-    if (is_store){
-        if (hwaddr_info)
-            panda_callbacks_phys_mem_after_write(cpu, hwaddr, size, data);
-        panda_callbacks_virt_mem_after_write(cpu, vaddr, size, data);
-    }else{
-        if (hwaddr_info)
-            panda_callbacks_phys_mem_after_read(cpu, hwaddr, size, data);
-        panda_callbacks_virt_mem_after_read(cpu, vaddr, size, data);
+    if (hwaddr_info && !qemu_plugin_hwaddr_is_io(hwaddr_info)){
+        hwaddr = qemu_plugin_hwaddr_phys_addr(hwaddr_info);
     }
+    panda_callbacks_mem_access(cpu, (uint64_t)udata, vaddr, hwaddr,
+                               1u << qemu_plugin_mem_size_shift(info),
+                               mem_value(info), qemu_plugin_mem_is_store(info));
 }
-#endif
 
 
 static void vcpu_tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb *tb)
@@ -101,37 +178,78 @@ static void vcpu_tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb *tb)
     size_t n_insns;
     struct qemu_plugin_insn *insn;
     CPUState *cpu = panda_cpu_in_translate();
+    TranslationBlock *real_tb = panda_get_tb(tb);
+    /* only emit instrumentation somebody is subscribed to */
+    uint32_t wanted = panda_instr_wanted();
+    uint64_t pc_lo = UINT64_MAX, pc_hi = 0;
 
-    uint64_t pc = qemu_plugin_tb_vaddr(tb);
-    // printf("tb_trans %" PRIu64 "\n", pc);
+    // printf("tb_trans %" PRIu64 "\n", qemu_plugin_tb_vaddr(tb));
 
     n_insns = qemu_plugin_tb_n_insns(tb);
     for (size_t i=0; i<n_insns; i++){
         insn = qemu_plugin_tb_get_insn(tb, i);
-        if (unlikely(panda_callbacks_insn_translate(cpu, pc))){
-            qemu_plugin_register_vcpu_insn_exec_cb(insn, insn_exec, QEMU_PLUGIN_CB_NO_REGS, (void*)qemu_plugin_insn_vaddr(insn));
+        uint64_t insn_pc = qemu_plugin_insn_vaddr(insn);
+        // a trace may jump back, so don't assume the insns are in order
+        pc_lo = MIN(pc_lo, insn_pc);
+        pc_hi = MAX(pc_hi, insn_pc + qemu_plugin_insn_size(insn));
+        if (wanted & PANDA_INSTR_INSN_EXEC){
+            if (unlikely(panda_insn_exec_instrument(cpu, insn_pc))){
+                qemu_plugin_register_vcpu_insn_exec_cb(insn, insn_exec, QEMU_PLUGIN_CB_NO_REGS, (void*)insn_pc);
+            }
+        } else {
+            panda_callbacks_insn_translate(cpu, insn_pc);
+        }
+        // inline counters, no helper call
+        qemu_plugin_u64 counters[PANDA_MAX_INSN_COUNTERS];
+        size_t n_counters = panda_insn_counters_at(insn_pc, counters, PANDA_MAX_INSN_COUNTERS);
+        for (size_t c = 0; c < n_counters && c < PANDA_MAX_INSN_COUNTERS; c++){
+            qemu_plugin_register_vcpu_insn_exec_inline_per_vcpu(insn, QEMU_PLUGIN_INLINE_ADD_U64,
+                                                                counters[c], 1);
         }
-#ifdef TODO_LATER
-        int memcb_status =  panda_get_memcb_status();
-        if (memcb_status){
-            qemu_plugin_register_vcpu_mem_cb(insn, vcpu_mem,
+        if (wanted & PANDA_INSTR_MEM_BATCH){
+            qemu_plugin_register_vcpu_mem_cb(insn, mem_ring_record,
                                              QEMU_PLUGIN_CB_NO_REGS,
-                                             (enum qemu_plugin_mem_rw) memcb_status, NULL);
+                                             QEMU_PLUGIN_MEM_RW,
+                                             (void*)qemu_plugin_insn_vaddr(insn));
+        }
+        if (wanted & (PANDA_INSTR_MEM_READ | PANDA_INSTR_MEM_WRITE)){
+            qemu_plugin_register_vcpu_mem_range_cb(insn, vcpu_mem,
+                                                   QEMU_PLUGIN_CB_NO_REGS,
+                                                   (enum qemu_plugin_mem_rw) panda_get_memcb_status(),
+                                                   mem_ranges_table,
+                                                   PANDA_MEM_RANGE_SLOTS,
+                                                   (void*)qemu_plugin_insn_vaddr(insn));
         }
-#endif
+    }
+
+    // hand over this TB's memory accesses as it ends, and at entry those
+    // of a TB that an exception cut short
+    if (wanted & PANDA_INSTR_MEM_BATCH){
+        qemu_plugin_register_vcpu_tb_exit_cond_cb(tb, mem_ring_flush_cb,
+                                                  QEMU_PLUGIN_CB_NO_REGS,
+                                                  QEMU_PLUGIN_COND_NE,
+                                                  mem_ring_count, 0, NULL);
+        qemu_plugin_register_vcpu_tb_exec_cond_cb(tb, mem_ring_flush_cb,
+                                                  QEMU_PLUGIN_CB_NO_REGS,
+                                                  QEMU_PLUGIN_COND_NE,
+                                                  mem_ring_count, 0, NULL);
     }
 
     // install before_block_exec
-    TranslationBlock *real_tb = panda_get_tb(tb);
-    qemu_plugin_register_vcpu_tb_exec_cb(tb, start_block_exec_cb,
-                                        QEMU_PLUGIN_CB_NO_REGS,
-                                         (void *)real_tb);
-    
+    if (wanted & PANDA_INSTR_START_BLOCK_EXEC){
+        qemu_plugin_register_vcpu_tb_exec_cb(tb, start_block_exec_cb,
+                                             QEMU_PLUGIN_CB_NO_REGS,
+                                             (void *)real_tb);
+    }
+
     // install after_block_exec
-    last_instr = qemu_plugin_tb_get_insn(tb, n_insns - 1);
-    qemu_plugin_register_vcpu_insn_exec_cb(last_instr, end_block_exec_cb,
-                                QEMU_PLUGIN_CB_NO_REGS, (void *)real_tb);
+    if (wanted & PANDA_INSTR_END_BLOCK_EXEC){
+        last_instr = qemu_plugin_tb_get_insn(tb, n_insns - 1);
+        qemu_plugin_register_vcpu_insn_exec_cb(last_instr, end_block_exec_cb,
+                                    QEMU_PLUGIN_CB_NO_REGS, (void *)real_tb);
+    }
 
+    panda_set_tb_instr(real_tb, wanted, pc_lo, MAX(pc_lo, pc_hi));
     panda_callbacks_block_translate(cpu, tb);
 }
 
@@ -148,6 +266,15 @@ static void vcpu_tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb *tb)
 QEMU_PLUGIN_EXPORT int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t *info,
                         int argc, char **argv)
 {
+    mem_rings = qemu_plugin_scoreboard_new(sizeof(PandaMemRing));
+    mem_ring_count = qemu_plugin_scoreboard_u64_in_struct(mem_rings,
+                                                          PandaMemRing, count);
+    mem_ranges = qemu_plugin_scoreboard_new(sizeof(PandaMemRanges));
+    mem_ranges_table = qemu_plugin_scoreboard_u64_in_struct(mem_ranges,
+                                                            PandaMemRanges, r);
+    panda_set_mem_ranges_hook(mem_ranges_set);
+    panda_set_bridge_id(id);
+    qemu_plugin_register_vcpu_init_cb(id, mem_ranges_vcpu_init);
     qemu_plugin_register_vcpu_tb_trans_cb(id, vcpu_tb_trans);
     // qemu_plugin_register_vcpu_init_cb(id, vcpu_init);
     // qemu_plugin_register_vcpu_exit_cb(id, vcpu_exit);
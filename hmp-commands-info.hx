@@ -256,6 +256,21 @@ SRST
     Show dynamic compiler info.
 ERST
 
+#if defined(CONFIG_TCG)
+    {
+        .name       = "panda-profile",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show calls and time per PANDA plugin callback",
+    },
+#endif
+
+SRST
+  ``info panda-profile``
+    Show how often each PANDA plugin callback and PPP callback was called
+    and how much host time it took, while ``panda-profile`` was on.
+ERST
+
     {
         .name       = "sync-profile",
         .args_type  = "mean:-m,no_coalesce:-n,max:i?",
@@ -639,6 +639,22 @@ SRST
   whether profiling is on or off.
 ERST
 
+#if defined(CONFIG_TCG)
+    {
+        .name       = "panda-profile",
+        .args_type  = "op:s?",
+        .params     = "[on|off|reset]",
+        .help       = "enable, disable or reset PANDA callback profiling. "
+                      "With no arguments, prints whether profiling is on or off.",
+    },
+#endif
+
+SRST
+``panda-profile [on|off|reset]``
+  Enable, disable or reset PANDA callback profiling. With no arguments, prints
+  whether profiling is on or off. Results are shown by ``info panda-profile``.
+ERST
+
     {
         .name       = "system_reset",
         .args_type  = "",
@@ -36,6 +36,15 @@ struct TCGCPUOps {
      */
     bool precise_smc;
 
+    /**
+     * @translate_from_tb: @translate_code depends on the CPU only through
+     *                     the pc, cs_base and flags of the TB, and state
+     *                     that is fixed once the CPU is realized; so the
+     *                     TB can be translated on another thread while
+     *                     the CPU runs (-accel tcg,tb-spec=on).
+     */
+    bool translate_from_tb;
+
     /**
      * @guest_default_memory_order: default barrier that is required
      *                              for the guest memory ordering.
@@ -33,6 +33,42 @@ void tb_flush__exclusive_or_serial(void);
  */
 void queue_tb_flush(CPUState *cs);
 
+/**
+ * tb_evict__exclusive_or_serial()
+ *
+ * Make room in a full code generation buffer by invalidating the
+ * translation blocks of its oldest regions only, or by flushing all of
+ * them when that is not possible.
+ *
+ * Same calling context requirements as tb_flush__exclusive_or_serial().
+ */
+void tb_evict__exclusive_or_serial(void);
+
+/**
+ * queue_tb_evict() - add eviction to the cpu work queue
+ * @cs: CPUState
+ *
+ * Like queue_tb_flush(), for tb_evict__exclusive_or_serial().
+ */
+void queue_tb_evict(CPUState *cs);
+
+/**
+ * tb_invalidate_matching__exclusive_or_serial()
+ * @pred: predicate selecting the translation blocks to drop
+ * @opaque: passed through to @pred
+ *
+ * Invalidate only the translation blocks for which @pred returns true.
+ * Unlike tb_flush__exclusive_or_serial() the code buffer is not reset,
+ * so all other translations stay resident and chained.
+ *
+ * Same calling context requirements as tb_flush__exclusive_or_serial().
+ */
+void tb_invalidate_matching__exclusive_or_serial(
+    bool (*pred)(const TranslationBlock *tb, void *opaque), void *opaque);
+
 void tcg_flush_jmp_cache(CPUState *cs);
+void tcg_jmp_cache_drop(CPUState *cs,
+                        bool (*pred)(const TranslationBlock *tb, void *opaque),
+                        void *opaque);
 
 #endif /* _TB_FLUSH_H_ */
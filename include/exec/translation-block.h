@@ -146,6 +146,27 @@ struct TranslationBlock {
     uintptr_t jmp_list_head;
     uintptr_t jmp_list_next[2];
     uintptr_t jmp_dest[2];
+
+    /*
+     * PANDA: PANDA_INSTR_* bits for the callback types whose
+     * instrumentation was emitted into this TB.  Compared against the
+     * currently subscribed set to find TBs that need retranslation.
+     */
+    uint32_t panda_instr;
+
+    /*
+     * PANDA: virtual addresses [panda_pc_lo, panda_pc_hi) spanned by the
+     * guest instructions the bridge plugin saw, so that a PC filter
+     * change retranslates only the TBs it can affect.
+     */
+    vaddr panda_pc_lo;
+    vaddr panda_pc_hi;
+
+    /*
+     * The code points at memory allocated for this TB alone, so it can't
+     * be reused by another process through the persistent TB cache.
+     */
+    bool nocache;
 };
 
 /* The alignment given to TranslationBlock during allocation. */
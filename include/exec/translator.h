@@ -88,6 +88,16 @@ struct DisasContextBase {
     int record_start;
     int record_len;
     uint8_t record[32];
+
+    /*
+     * The hot trace being translated, if any, and how many of its blocks
+     * have been followed; see translator_trace_follow().  code_end is
+     * the end of the guest code read so far.
+     */
+    const struct TBTrace *trace;
+    int trace_pos;
+    bool trace_follow;
+    vaddr code_end;
 };
 
 /**
@@ -159,6 +169,20 @@ void translator_loop(CPUState *cpu, TranslationBlock *tb, int *max_insns,
  */
 bool translator_use_goto_tb(DisasContextBase *db, vaddr dest);
 
+/**
+ * translator_trace_follow
+ * @db: Disassembly context
+ * @dest: a direct branch target of the current insn
+ *
+ * Return true if the hot trace being translated continues at @dest.
+ * The target should then emit the other way out of the branch as a side
+ * exit, and carry on translating at @dest, with db->is_jmp left at
+ * DISAS_NEXT, as if the branch were not there.  At most one target of
+ * an insn may be followed, and never one at or below the start of the
+ * TB, which tb->size could not cover.
+ */
+bool translator_trace_follow(DisasContextBase *db, vaddr dest);
+
 /**
  * translator_io_start
  * @db: Disassembly context
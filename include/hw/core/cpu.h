@@ -463,6 +463,15 @@ struct qemu_work_item;
  * @work_mutex: Lock to prevent multiple access to @work_list.
  * @work_list: List of pending asynchronous work.
  * @plugin_state: per-CPU plugin state
+ * @panda_break_exec: A PANDA plugin asked this vCPU to leave the current
+ *    TB at the end of start_block_exec dispatch.
+ * @panda_v2p: PANDA's virt->phys translation cache for this vCPU, allocated
+ *    on first use by panda_virtual_memory_rw() and panda_virt_to_phys().
+ * @panda_cb_view: The PANDA callbacks in scope for this vCPU's ASID, built
+ *    on first dispatch of an ASID-scoped callback type, followed by those
+ *    of the last few ASIDs before it.
+ * @panda_cb_asid_dirty: The ASID may have changed since @panda_cb_view was
+ *    built.
  * @ignore_memory_transaction_failures: Cached copy of the MachineState
  *    flag of the same name: allows the board to suppress calling of the
  *    CPU do_transaction_failed hook function.
@@ -560,6 +569,11 @@ struct CPUState {
     CPUPluginState *plugin_state;
 #endif
 
+    bool panda_break_exec;
+    struct PandaV2PCache *panda_v2p;
+    struct PandaCbView *panda_cb_view;
+    bool panda_cb_asid_dirty;
+
     /* TODO Move common fields from CPUArchState here. */
     int cpu_index;
     int cluster_index;
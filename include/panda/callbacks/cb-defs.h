@@ -100,6 +100,7 @@ typedef enum panda_cb_type {
     PANDA_CB_BEFORE_HANDLE_INTERRUPT, // ditto, for interrupts
     PANDA_CB_START_BLOCK_EXEC,
     PANDA_CB_END_BLOCK_EXEC,
+    PANDA_CB_MEM_BATCH,             // Batch of recorded memory accesses
 
     PANDA_CB_LAST
 } panda_cb_type;
@@ -1080,6 +1081,30 @@ typedef union panda_cb {
     */
     void (*end_block_exec)(CPUState *cpu, TranslationBlock* tb);
 
+    /* Callback ID: PANDA_CB_MEM_BATCH
+
+       mem_batch:
+        Called with a batch of guest memory accesses recorded on one vCPU.
+        Accesses are buffered in a per-vCPU ring and handed over in order
+        at the end of the TB that made them, or when the ring fills up.
+        The accesses of a TB left early by an exception are handed over
+        at the start of the next TB.
+
+       Arguments:
+        CPUState *cpu:                    the CPU that made the accesses
+        const panda_mem_access *accesses: the recorded accesses
+        size_t n:                         number of entries in accesses
+
+       Helper call location: panda_plugin_interface.c
+
+       Return value:
+        none
+
+       Notes:
+        The array is only valid for the duration of the callback.
+    */
+    void (*mem_batch)(CPUState *cpu, const panda_mem_access *accesses, size_t n);
+
     /* cbaddr is a dummy union member.
 
        This union only contains function pointers.
@@ -2068,6 +2093,30 @@ typedef union panda_cb_with_context {
     */
     void (*end_block_exec)(void* context, CPUState *cpu, TranslationBlock* tb);
 
+    /* Callback ID: PANDA_CB_MEM_BATCH
+
+       mem_batch:
+        Called with a batch of guest memory accesses recorded on one vCPU.
+        Accesses are buffered in a per-vCPU ring and handed over in order
+        at the end of the TB that made them, or when the ring fills up.
+        The accesses of a TB left early by an exception are handed over
+        at the start of the next TB.
+
+       Arguments:
+        CPUState *cpu:                    the CPU that made the accesses
+        const panda_mem_access *accesses: the recorded accesses
+        size_t n:                         number of entries in accesses
+
+       Helper call location: panda_plugin_interface.c
+
+       Return value:
+        none
+
+       Notes:
+        The array is only valid for the duration of the callback.
+    */
+    void (*mem_batch)(void* context, CPUState *cpu, const panda_mem_access *accesses, size_t n);
+
     /* cbaddr is a dummy union member.
 
        This union only contains function pointers.
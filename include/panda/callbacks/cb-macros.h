@@ -44,32 +44,31 @@
 #define ENTRY_NAME0(name) name ()
 
 // TODO: These require name and name_upper so we can both use entry.name(...) and
-//       panda_cbs[NAME]. Unfortunately the preprocessor can't do the case conversion
+//       panda_cb_tables[NAME]. Unfortunately the preprocessor can't do the case conversion
 //       for us. Is there a better way than taking in both as arguments?
 
+// The guard argument is either empty or RCU_READ_LOCK_GUARD();. Dispatchers
+// that only run on vCPU threads are already inside cpu_exec's RCU read-side
+// critical section and must not open another one: a callback that longjmps
+// back into cpu_exec would leave it unbalanced.
+
 // Call all enabled & registered functions for this callback. Return void
-#define MAKE_CALLBACK_void(name_upper, name, ...) \
+#define MAKE_CALLBACK_void(guard, name_upper, name, ...) \
     void panda_callbacks_ ## name(COMBINE_TYPES(__VA_ARGS__)) { \
-        panda_cb_list *plist; \
-        for (plist = panda_cbs[PANDA_CB_ ## name_upper]; \
-             plist != NULL; \
-             plist = panda_cb_list_next(plist)) { \
-              if (plist->enabled) \
-                plist->entry. ENTRY_NAME(name, plist->context, EVERY_SECOND(__VA_ARGS__)); \
+        guard \
+        PANDA_CB_FOREACH(PANDA_CB_ ## name_upper, e) { \
+            PANDA_CB_INVOKE(e, name, EVERY_SECOND(__VA_ARGS__)); \
         } \
     } \
     void panda_cb_trampoline_ ## name(void* context, COMBINE_TYPES(__VA_ARGS__)) {\
         (*(panda_cb*)context) . ENTRY_NAME(name, EVERY_SECOND(__VA_ARGS__)); \
     }
 
-#define MAKE_CALLBACK_int(name_upper, name, ...) \
+#define MAKE_CALLBACK_int(guard, name_upper, name, ...) \
     int panda_callbacks_ ## name(COMBINE_TYPES(__VA_ARGS__)) { \
-        panda_cb_list *plist; \
-        for (plist = panda_cbs[PANDA_CB_ ## name_upper]; \
-             plist != NULL; \
-             plist = panda_cb_list_next(plist)) { \
-              if (plist->enabled) \
-                plist->entry. ENTRY_NAME(name, plist->context, EVERY_SECOND(__VA_ARGS__)); \
+        guard \
+        PANDA_CB_FOREACH(PANDA_CB_ ## name_upper, e) { \
+            PANDA_CB_INVOKE(e, name, EVERY_SECOND(__VA_ARGS__)); \
         } \
         return 0; \
     } \
@@ -80,15 +79,12 @@
 // Call all enabled & registered functions for this callback. Return
 // all results together OR'd together.
 // XXX: double underscore in name is intentional
-#define MAKE_CALLBACK__Bool(name_upper, name, ...) \
+#define MAKE_CALLBACK__Bool(guard, name_upper, name, ...) \
     bool panda_callbacks_ ## name(COMBINE_TYPES(__VA_ARGS__)) { \
-        panda_cb_list *plist; \
         bool any_true = false; \
-        for (plist = panda_cbs[PANDA_CB_ ## name_upper]; \
-             plist != NULL; \
-             plist = panda_cb_list_next(plist)) { \
-              if (plist->enabled) \
-                any_true |= plist->entry. ENTRY_NAME(name, plist->context, EVERY_SECOND(__VA_ARGS__)); \
+        guard \
+        PANDA_CB_FOREACH(PANDA_CB_ ## name_upper, e) { \
+            any_true |= PANDA_CB_INVOKE(e, name, EVERY_SECOND(__VA_ARGS__)); \
         } \
         return any_true; \
     } \
@@ -104,34 +100,33 @@
 // arg1type, arg1, arg2type, arg2.... Generate the code to call the registered
 // and enabled functions and return the correct result.
 // Supports up to 5 arguments and return types of void or bool
-#define MAKE_CALLBACK(rettype, ...) _GET_CB_NAME(rettype)(__VA_ARGS__)
+#define MAKE_CALLBACK(rettype, ...) _GET_CB_NAME(rettype)(, __VA_ARGS__)
+
+// Same as MAKE_CALLBACK, for callbacks dispatched outside of cpu_exec (main
+// loop, monitor, machine init). These enter an RCU read-side critical
+// section themselves.
+#define MAKE_RCU_CALLBACK(rettype, ...) _GET_CB_NAME(rettype)(RCU_READ_LOCK_GUARD();, __VA_ARGS__)
 
 // Callback only to be checked if in replay. These are all void because they can't change execution
 #define MAKE_REPLAY_ONLY_CALLBACK(name_upper, name, ...) \
     void panda_callbacks_ ## name(COMBINE_TYPES(__VA_ARGS__)) { \
         if (rr_in_replay()) { \
-          panda_cb_list *plist; \
-          for (plist = panda_cbs[PANDA_CB_ ## name_upper]; \
-               plist != NULL; \
-               plist = panda_cb_list_next(plist)) { \
-                if (plist->enabled) \
-                  plist->entry. ENTRY_NAME(name, plist->context, EVERY_SECOND(__VA_ARGS__)); \
-          } \
+            PANDA_CB_FOREACH(PANDA_CB_ ## name_upper, e) { \
+                PANDA_CB_INVOKE(e, name, EVERY_SECOND(__VA_ARGS__)); \
+            } \
         } \
     } \
     void panda_cb_trampoline_ ## name(void* context, COMBINE_TYPES(__VA_ARGS__)) {\
         (*(panda_cb*)context) . ENTRY_NAME(name, EVERY_SECOND(__VA_ARGS__)); \
     }
 
-
+// No-argument callbacks are all dispatched from the main loop, so they
+// always take the RCU read lock.
 #define MAKE_CALLBACK_NO_ARGS_void(name_upper, name) \
     void panda_callbacks_ ## name(void) { \
-        panda_cb_list *plist; \
-        for (plist = panda_cbs[PANDA_CB_ ## name_upper]; \
-             plist != NULL; \
-             plist = panda_cb_list_next(plist)) { \
-              if (plist->enabled) \
-                plist->entry. ENTRY_NAME(name, plist->context); \
+        RCU_READ_LOCK_GUARD(); \
+        PANDA_CB_FOREACH(PANDA_CB_ ## name_upper, e) { \
+            PANDA_CB_INVOKE0(e, name); \
         } \
     } \
     void panda_cb_trampoline_ ## name(void* context) {\
@@ -140,13 +135,10 @@
 
 #define MAKE_CALLBACK_NO_ARGS__Bool(name_upper, name) \
     bool panda_callbacks_ ## name(void) { \
-        panda_cb_list *plist; \
         bool any_true = false; \
-        for (plist = panda_cbs[PANDA_CB_ ## name_upper]; \
-             plist != NULL; \
-             plist = panda_cb_list_next(plist)) { \
-              if (plist->enabled) \
-                any_true |= plist->entry. ENTRY_NAME(name, plist->context); \
+        RCU_READ_LOCK_GUARD(); \
+        PANDA_CB_FOREACH(PANDA_CB_ ## name_upper, e) { \
+            any_true |= PANDA_CB_INVOKE0(e, name); \
         } \
         return any_true; \
     } \
@@ -70,8 +70,10 @@ void panda_callbacks_mem_after_read(CPUState *env, uint64_t pc, uint64_t addr, s
 void panda_callbacks_mem_before_write(CPUState *env, uint64_t pc, uint64_t addr, size_t data_size, uint64_t val, void *ram_ptr);
 void panda_callbacks_mem_after_write(CPUState *env, uint64_t pc, uint64_t addr, size_t data_size, uint64_t val, void *ram_ptr);
 
+/* per-access virt/phys after read/write dispatch with address filters */
+void panda_callbacks_mem_access(CPUState *env, uint64_t pc, uint64_t vaddr, uint64_t paddr, size_t size, uint64_t value, bool is_write);
+
 /* invoked from cpu-exec.c */
-void panda_callbacks_before_find_fast(void);
 bool panda_callbacks_after_find_fast(CPUState *cpu, TranslationBlock *tb, bool bb_invalidate_done, bool *invalidate);
 
 /***************************************************************************
@@ -146,5 +148,6 @@ void panda_callbacks_cpu_restore_state(CPUState *env, TranslationBlock *tb);
 void panda_callbacks_before_tcg_codegen(CPUState *env, TranslationBlock *tb);
 void panda_callbacks_start_block_exec(CPUState *env, TranslationBlock *tb);
 void panda_callbacks_end_block_exec(CPUState *env, TranslationBlock *tb);
+void panda_callbacks_mem_batch(CPUState *env, const panda_mem_access *accesses, size_t n);
 
 void panda_install_block_callbacks(CPUState* cpu, TranslationBlock* tb);
@@ -0,0 +1,75 @@
+/*!
+ * @file panda/cb-profile.h
+ * @brief Call counts and host time per plugin and callback.
+ *
+ * Every PANDA callback and PPP callback is charged to a site, the pair
+ * (plugin, callback name). Dispatch only looks at the counters when
+ * profiling is on; otherwise it reads the flag once per dispatch.
+ *
+ * Each thread counts into a block of its own, so vCPU threads never
+ * share a cache line; readers add up the blocks of all threads.
+ *
+ * From the monitor: ``panda-profile on|off|reset`` and
+ * ``info panda-profile`` (QMP: x-query-panda-profile).
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Sites beyond this many are all charged to site 0, "(other)". */
+#define PANDA_CB_PROFILE_MAX_SITES 1024
+
+extern bool panda_cb_profiling;
+
+/**
+ * panda_cb_profile_set() - Start or stop timing callbacks.
+ * @on: Whether dispatch should time callbacks from now on.
+ *
+ * Counters are kept when profiling stops. Once turned on, the totals
+ * are printed to stderr when QEMU exits.
+ */
+void panda_cb_profile_set(bool on);
+
+/**
+ * panda_cb_profile_reset() - Zero all counters.
+ *
+ * Calls in flight on other threads may still be charged afterwards.
+ */
+void panda_cb_profile_reset(void);
+
+/**
+ * panda_cb_profile_site() - Get the site for a callback of a plugin.
+ * @plugin: Plugin name.
+ * @cb: Callback type or PPP point name.
+ *
+ * Return: The same id for the same pair for the rest of the run.
+ */
+uint32_t panda_cb_profile_site(const char *plugin, const char *cb);
+
+/* Used by the dispatch macros; only called while profiling. */
+int64_t panda_cb_profile_start(void);
+void panda_cb_profile_stop(uint32_t site, int64_t start);
+
+/**
+ * panda_cb_profile_totals() - Sum the counters of a site over all threads.
+ * @site: Site, from panda_cb_profile_site().
+ * @calls: Set to the number of calls.
+ * @ns: Set to the host nanoseconds they took.
+ */
+void panda_cb_profile_totals(uint32_t site, uint64_t *calls, uint64_t *ns);
+
+/**
+ * panda_cb_profile_dump() - Print a table of every site that was called.
+ * @buf: Appended to, most expensive site first.
+ */
+void panda_cb_profile_dump(GString *buf);
+
+#ifdef __cplusplus
+}
+#endif
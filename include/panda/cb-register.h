@@ -0,0 +1,322 @@
+/*!
+ * @file panda/cb-register.h
+ * @brief Registering, enabling and scoping PANDA callbacks.
+ *
+ * The target independent part of the plugin API: every change made here
+ * republishes the dispatch tables of panda/cb-table.h.
+ */
+#pragma once
+
+#include "panda/cb-table.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// BEGIN_PYPANDA_NEEDS_THIS -- do not delete this comment bc pypanda
+// api autogen needs it.  And don't put any compiler directives
+// between this and END_PYPANDA_NEEDS_THIS except includes of other
+// files in this directory that contain subsections like this one.
+
+// Doubly linked list that stores a callback, along with its owner
+typedef struct _panda_cb_list panda_cb_list;
+struct _panda_cb_list {
+    panda_cb_with_context entry;
+    void *owner;
+    panda_cb_list *next;
+    panda_cb_list *prev;
+    bool enabled;
+    void* context;
+    struct panda_addr_filter *filter; // NULL if not address filtered
+    struct panda_addr_filter *asids;  // NULL if not ASID scoped
+    panda_cb_mode mode;
+};
+panda_cb_list *panda_cb_list_next(panda_cb_list *plist);
+
+// Array of pointers to PANDA callback lists, one per callback type
+extern panda_cb_list *panda_cbs[PANDA_CB_LAST];
+
+
+/**
+ * panda_enable_plugin() - Enable this plugin.
+ * @plugin: Pointer to the plugin (handle).
+ *
+ * Mark plugin as enabled so that its callbacks will run in future.
+ */
+void panda_enable_plugin(void *plugin);
+
+
+/**
+ * panda_disable_plugin() - Disable this plugin.
+ * @plugin: Pointer to the plugin (handle).
+ *
+ * Mark plugin as disabled so that its callbacks will NOT run in future.
+ */
+void panda_disable_plugin(void *plugin);
+
+
+// XXX Not sure what this is exactly or howt to doc.  Is it really an API fn?
+// If so, that's concerning...
+panda_cb_with_context panda_get_cb_trampoline(panda_cb_type type);
+
+
+/**
+ * panda_register_callback() - Register a callback for a plugin, and enable it.
+ * @plugin: Pointer to plugin.
+ * @type: Type of callback, indicating when cb function will run.
+ * @cb: The callback function itself and other info.
+ *
+ * This function will register a callback to run in panda and is
+ * typically called from plugin code.  
+ *
+ * The order of callback registration will determine the order in which
+ * callbacks of the same type will be invoked.
+ *
+ * NB: Registering a callback function twice from the same plugin will
+ * trigger an assertion error.
+ * 
+ * type is number. See typedef panda_cb_type.
+ * cb is a pointer to a struct. See typedef panda_cb.
+ */
+void panda_register_callback(void *plugin, panda_cb_type type, panda_cb cb);
+
+
+/**
+ * panda_register_callback_with_context() - Register a callback for a plugin with context.
+ * @plugin: Pointer to plugin.
+ * @type: Type of callback, indicating when cb function will run.
+ * @cb: The callback function itself and other info.
+ * @context: Pointer to context.
+ *
+ * Same as panda_register_callback, but with context.
+ */
+void panda_register_callback_with_context(void *plugin, panda_cb_type type, panda_cb_with_context cb, void* context);
+
+
+/**
+ * panda_disable_callback() - Disable callback for this plugin from running.
+ * @plugin: Pointer to plugin.
+ * @type: Type of callback, indicating when cb function will run.
+ * @cb: The callback function itself and other info.
+ * 
+ * Mark this callback as disabled so that it stops running. 
+ * 
+ * NB: enable/disable are faster than register/unregister since they
+ * set a flag rather than adding/removing something from a list.
+ */
+void panda_disable_callback(void *plugin, panda_cb_type type, panda_cb cb);
+
+
+/**
+ * panda_disable_callback_with_context() - Disable callback for this plugin from running (with context).
+ * @plugin: Pointer to plugin.
+ * @type: Type of callback, indicating when cb function will run.
+ * @cb: The callback function itself and other info.
+ * @context: Pointer to context.
+ * 
+ * Same as padna_disable_callback, but with context.
+ */
+void panda_disable_callback_with_context(void *plugin, panda_cb_type type, panda_cb_with_context cb, void* context);
+
+
+/**
+ * panda_enable_callback() - Enable callback for this plugin so that it can run.
+ * @plugin: Pointer to plugin.
+ * @type: Type of callback, indicating when cb function will run.
+ * @cb: The callback function itself and other info.
+ * 
+ * Mark this callback as enabled so that it will run from now on. 
+ *
+ * NB: enable/disable are faster than register/unregister since they
+ * set a flag rather than adding/removing something from a list.
+ */
+void panda_enable_callback(void *plugin, panda_cb_type type, panda_cb cb);
+
+
+/**
+ * panda_enable_callback_with_context() - Enable this callback for this plugin so that it can run (with context)/
+ * @plugin: Pointer to plugin.
+ * @type: Type of callback, indicating when cb function will run.
+ * @cb: The callback function itself and other info.
+ * @context: Pointer to context.
+ * 
+ * Same as panda_enable_callback, but with context.
+ */
+void panda_enable_callback_with_context(void *plugin, panda_cb_type type, panda_cb_with_context cb, void* context);
+
+
+/**
+ * panda_unregister_callbacks() - Unregister all callbacks for this plugin.
+ * @plugin: Pointer to plugin.
+ * 
+ */
+void panda_unregister_callbacks(void *plugin);
+
+
+/**
+ * panda_is_callback_enabled() - Determine if this plugin is loaded and enabled.
+ * @plugin: Pointer to plugin (handle).
+ * @type: Type of callback
+ * @cb: The callback fn.
+ *
+ * Oddly, this function requires not the name of the plugin but
+ * handle. Given that and callback type and fn, search the list of
+ * callbacks and return true iff that one is both registered and
+ * enabled.
+ * 
+ * See panda_cb_type. 
+ * See panda_cb. 
+ *
+ * Return: True if enabled, false otherwise. 
+*/
+bool panda_is_callback_enabled(void *plugin, panda_cb_type type, panda_cb cb);
+
+
+/**
+ * panda_set_callback_ranges() - Restrict a memory callback to address ranges.
+ * @plugin: Pointer to plugin.
+ * @type: One of PANDA_CB_{VIRT,PHYS}_MEM_AFTER_{READ,WRITE} or PANDA_CB_INSN_EXEC.
+ * @cb: The (already registered) callback.
+ * @ranges: Address ranges to watch; virtual or physical according to @type.
+ * @n: Number of ranges; 0 removes the filter.
+ *
+ * The callback will only fire for accesses starting inside one of the
+ * ranges. Ranges can be changed at any time without flushing translated
+ * code: virtual address filters are checked by the plugin core before the
+ * bridge plugin's memory callback is called.
+ *
+ * For PANDA_CB_INSN_EXEC the ranges are guest PCs. Exactly the matching
+ * instructions are instrumented, without consulting insn_translate.
+ * Changing a PC filter retranslates all code, so set it once right after
+ * registering the callback.
+ */
+void panda_set_callback_ranges(void *plugin, panda_cb_type type, panda_cb cb,
+                               const panda_addr_range *ranges, size_t n);
+
+
+/**
+ * panda_set_callback_ranges_with_context() - Restrict a memory callback to address ranges (with context).
+ * @plugin: Pointer to plugin.
+ * @type: One of PANDA_CB_{VIRT,PHYS}_MEM_AFTER_{READ,WRITE} or PANDA_CB_INSN_EXEC.
+ * @cb: The (already registered) callback.
+ * @context: Pointer to context.
+ * @ranges: Address ranges to watch.
+ * @n: Number of ranges; 0 removes the filter.
+ *
+ * Same as panda_set_callback_ranges, but with context.
+ */
+void panda_set_callback_ranges_with_context(void *plugin, panda_cb_type type,
+                                            panda_cb_with_context cb, void *context,
+                                            const panda_addr_range *ranges, size_t n);
+
+
+/**
+ * panda_register_callback_asids() - Register a callback that only fires in some processes.
+ * @plugin: Pointer to plugin.
+ * @type: Type of callback.
+ * @cb: The callback fn.
+ * @asids: ASIDs, as returned by panda_current_asid(), to fire in.
+ * @n: Number of ASIDs; 0 fires in every address space.
+ * @mode: Further restrict the callback to kernel or user mode.
+ *
+ * Same as panda_register_callback(), but the callback is scoped from the
+ * start; see panda_set_callback_asids().
+ */
+void panda_register_callback_asids(void *plugin, panda_cb_type type, panda_cb cb,
+                                   const uint64_t *asids, size_t n,
+                                   panda_cb_mode mode);
+
+
+/**
+ * panda_register_callback_asids_with_context() - Register a callback that only fires in some processes (with context).
+ * @plugin: Pointer to plugin.
+ * @type: Type of callback.
+ * @cb: The callback fn.
+ * @context: Pointer to context.
+ * @asids: ASIDs to fire in.
+ * @n: Number of ASIDs; 0 fires in every address space.
+ * @mode: Further restrict the callback to kernel or user mode.
+ *
+ * Same as panda_register_callback_asids, but with context.
+ */
+void panda_register_callback_asids_with_context(void *plugin, panda_cb_type type,
+                                                panda_cb_with_context cb, void *context,
+                                                const uint64_t *asids, size_t n,
+                                                panda_cb_mode mode);
+
+
+/**
+ * panda_set_callback_asids() - Restrict a callback to some address spaces.
+ * @plugin: Pointer to plugin.
+ * @type: Type of callback.
+ * @cb: The (already registered) callback.
+ * @asids: ASIDs, as returned by panda_current_asid(), to fire in.
+ * @n: Number of ASIDs; 0 fires in every address space.
+ * @mode: Further restrict the callback to kernel or user mode.
+ *
+ * The scope is checked by the core, not by the callback: each vCPU
+ * dispatches from its own copy of the callback tables holding only the
+ * callbacks in scope for its current ASID, and switches copies when the
+ * guest changes address space. A callback out of scope costs nothing.
+ * Scopes only apply to callbacks that fire on a vCPU; others ignore them.
+ *
+ * Scopes can be changed at any time, e.g. once the process of interest
+ * has been found, without flushing translated code.
+ */
+void panda_set_callback_asids(void *plugin, panda_cb_type type, panda_cb cb,
+                              const uint64_t *asids, size_t n,
+                              panda_cb_mode mode);
+
+
+/**
+ * panda_set_callback_asids_with_context() - Restrict a callback to some address spaces (with context).
+ * @plugin: Pointer to plugin.
+ * @type: Type of callback.
+ * @cb: The (already registered) callback.
+ * @context: Pointer to context.
+ * @asids: ASIDs to fire in.
+ * @n: Number of ASIDs; 0 fires in every address space.
+ * @mode: Further restrict the callback to kernel or user mode.
+ *
+ * Same as panda_set_callback_asids, but with context.
+ */
+void panda_set_callback_asids_with_context(void *plugin, panda_cb_type type,
+                                           panda_cb_with_context cb, void *context,
+                                           const uint64_t *asids, size_t n,
+                                           panda_cb_mode mode);
+
+// END_PYPANDA_NEEDS_THIS -- do not delete this comment!
+
+/*
+ * Look up the trampoline that calls a panda_cb of @type through its
+ * context; false if @type has none.
+ */
+bool panda_lookup_cb_trampoline(panda_cb_type type,
+                                panda_cb_with_context *trampoline_cb);
+
+/* Name of the plugin whose handle is @owner, for profiling output */
+const char *panda_cb_owner_name(void *owner);
+
+/*
+ * Retranslate the TBs whose emitted instrumentation is stale after @type
+ * gained its first or lost its last subscriber.
+ */
+void panda_instr_subscribers_changed(panda_cb_type type);
+
+/*
+ * Recompute the address range table of the memory callbacks after
+ * the subscribers or filters of a PANDA_CB_*_MEM_AFTER_* type changed.
+ */
+void panda_mem_filters_changed(void);
+
+/*
+ * Retranslate the TBs spanning a PC in @old or @new after the filter of an
+ * INSN_EXEC callback changed. NULL is no filter: then every TB with
+ * INSN_EXEC instrumentation goes.
+ */
+void panda_insn_filters_changed(const panda_addr_filter *old,
+                                const panda_addr_filter *new);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,214 @@
+/*!
+ * @file panda/cb-table.h
+ * @brief Published PANDA callback tables and the dispatch loop over them.
+ *
+ * The target independent part of callback dispatch; registration is in
+ * panda/cb-register.h.
+ */
+#pragma once
+
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "exec/hwaddr.h"
+#include "panda/cb-profile.h"
+
+/* Used by cb-defs.h; panda_mem_access is defined in panda/types.h */
+struct qemu_plugin_tb;
+typedef struct panda_mem_access panda_mem_access;
+
+#include "panda/callbacks/cb-defs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// BEGIN_PYPANDA_NEEDS_THIS -- do not delete this comment bc pypanda
+// api autogen needs it.  And don't put any compiler directives
+// between this and END_PYPANDA_NEEDS_THIS except includes of other
+// files in this directory that contain subsections like this one.
+
+/* Privilege levels an ASID-scoped callback fires in */
+typedef enum panda_cb_mode {
+    PANDA_CB_MODE_ANY,
+    PANDA_CB_MODE_KERNEL,
+    PANDA_CB_MODE_USER,
+} panda_cb_mode;
+
+/* Guest address range [start, end) */
+typedef struct panda_addr_range {
+    uint64_t start;
+    uint64_t end;
+} panda_addr_range;
+
+// END_PYPANDA_NEEDS_THIS -- do not delete this comment!
+
+/*
+ * Dispatch tables.
+ *
+ * panda_cbs holds every registered callback and is the authoritative
+ * record used by register/enable/disable/unregister. The hot path never
+ * walks it. Instead, every change to panda_cbs[type] recompiles a flat
+ * array holding only the *enabled* callbacks of that type, in
+ * registration order, and publishes it with qatomic_rcu_set(). Dispatch
+ * is a bounds-checked loop over that array.
+ *
+ * Callbacks registered with panda_register_callback() are stored
+ * directly (context == PANDA_CB_DIRECT) so the trampoline is bypassed.
+ *
+ * A table holding ASID-scoped callbacks is marked scoped. vCPUs don't
+ * dispatch from it directly but from a per-vCPU view: the entries in
+ * scope for the vCPU's ASID, split by privilege level where a callback
+ * asks for one. Each vCPU keeps the views of the last few ASIDs it ran,
+ * so switching back and forth between processes doesn't rebuild them; a
+ * view is rebuilt when a published table it came from changes.
+ *
+ * Tables must be read inside an RCU read-side critical section. cpu_exec()
+ * already holds one for everything that runs on a vCPU thread; dispatchers
+ * that run elsewhere take their own (see MAKE_RCU_CALLBACK).
+ */
+/*
+ * Sorted, non-overlapping address ranges; immutable once published.
+ * No half-open range holds UINT64_MAX, so @top says whether it matches.
+ */
+typedef struct panda_addr_filter {
+    struct rcu_head rcu;
+    size_t n;
+    bool top;
+    panda_addr_range ranges[];
+} panda_addr_filter;
+
+/* Sort and coalesce @ranges into a filter; NULL if nothing is left. */
+panda_addr_filter *panda_addr_filter_new(const panda_addr_range *ranges,
+                                         size_t n);
+
+static inline bool panda_addr_filter_match(const panda_addr_filter *f,
+                                           uint64_t addr)
+{
+    size_t lo = 0, hi = f->n;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (addr < f->ranges[mid].start) {
+            hi = mid;
+        } else if (addr >= f->ranges[mid].end) {
+            lo = mid + 1;
+        } else {
+            return true;
+        }
+    }
+    return addr == UINT64_MAX && f->top;
+}
+
+/*
+ * What dispatch calls: one (function, context) pair per callback, so the
+ * loop over a table touches 16 bytes per entry. Callbacks stored directly
+ * have PANDA_CB_DIRECT as their context.
+ */
+typedef struct panda_cb_entry {
+    union {
+        panda_cb cb;                          // context == PANDA_CB_DIRECT
+        panda_cb_with_context cb_with_context; // otherwise
+    };
+    void *context;
+} panda_cb_entry;
+
+extern const char panda_cb_direct;
+#define PANDA_CB_DIRECT ((void *)&panda_cb_direct)
+
+/* Everything else about an entry, parallel to panda_cb_table::entries */
+typedef struct panda_cb_meta {
+    const panda_addr_filter *filter;          // NULL matches everything
+    const panda_addr_filter *asids;           // NULL matches every ASID
+    uint32_t prof_site;                       // see panda/cb-profile.h
+    uint8_t mode;                             // panda_cb_mode
+} panda_cb_meta;
+
+typedef struct panda_cb_table {
+    struct rcu_head rcu;
+    size_t n;
+    bool scoped;                              // some entry has an ASID scope
+    panda_cb_meta *meta;                      // n entries, after entries[]
+    panda_cb_entry entries[];
+} panda_cb_table;
+
+/* A zeroed table of @n entries; entries and meta share one allocation. */
+panda_cb_table *panda_cb_table_new(size_t n);
+
+extern panda_cb_table *panda_cb_tables[PANDA_CB_LAST];
+
+/*
+ * Held to change the registered callbacks and whatever is published from
+ * them: panda_cb_tables, the memory range table, the instruction counters.
+ */
+extern QemuRecMutex panda_cb_lock;
+
+/*
+ * The part of @tbl, the published table of @type, that is in scope on
+ * the current vCPU. Returns @tbl itself off vCPU threads.
+ */
+panda_cb_table *panda_cb_table_scoped(panda_cb_type type, panda_cb_table *tbl);
+
+/*
+ * Table to dispatch @type from. Tables without ASID-scoped callbacks,
+ * the common case, are used as published.
+ */
+static inline panda_cb_table *panda_cb_table_get(panda_cb_type type)
+{
+    panda_cb_table *tbl = qatomic_rcu_read(&panda_cb_tables[type]);
+
+    if (unlikely(tbl && tbl->scoped)) {
+        tbl = panda_cb_table_scoped(type, tbl);
+    }
+    return tbl;
+}
+
+/*
+ * Iterate over the enabled callbacks of @type that are in scope.
+ * @e is declared by the macro as a const panda_cb_entry pointer; its
+ * metadata is PANDA_CB_META(e).
+ *
+ * Whether profiling is on is read once per dispatch. With it on, the
+ * loop times each entry from one step to the next and charges the time
+ * to @e's site if PANDA_CB_INVOKE called @e; with it off, each step only
+ * tests a local that stays zero. A body that leaves the loop right after
+ * invoking (break, return, cpu_loop_exit) loses that one sample.
+ */
+#define PANDA_CB_FOREACH(type, e)                                          \
+    for (panda_cb_table *_tbl = panda_cb_table_get(type);                 \
+         _tbl != NULL; _tbl = NULL)                                        \
+        for (int64_t _pcb_t0 = unlikely(qatomic_read(&panda_cb_profiling)) \
+                               ? panda_cb_profile_start() : 0,             \
+                     *_pcb_once = &_pcb_t0;                                \
+             _pcb_once; _pcb_once = NULL)                                  \
+            for (const panda_cb_entry *e = _tbl->entries, *_pcb_hit = NULL; \
+                 e < _tbl->entries + _tbl->n;                              \
+                 (unlikely(_pcb_t0) ?                                      \
+                  (_pcb_hit == e ?                                         \
+                   panda_cb_profile_stop(PANDA_CB_META(e)->prof_site,      \
+                                         _pcb_t0) : (void)0),              \
+                  _pcb_t0 = panda_cb_profile_start() : 0), e++)
+
+/*
+ * The panda_cb_meta of table entry @e. Only valid inside
+ * PANDA_CB_FOREACH.
+ */
+#define PANDA_CB_META(e) (&_tbl->meta[(e) - _tbl->entries])
+
+/*
+ * Invoke callback member @name of table entry @e with the given
+ * arguments. Only valid inside PANDA_CB_FOREACH.
+ */
+#define PANDA_CB_INVOKE(e, name, ...)                                      \
+    (_pcb_hit = (e),                                                       \
+     (e)->context == PANDA_CB_DIRECT                                       \
+         ? (e)->cb.name(__VA_ARGS__)                                       \
+         : (e)->cb_with_context.name((e)->context, __VA_ARGS__))
+
+#define PANDA_CB_INVOKE0(e, name)                                          \
+    (_pcb_hit = (e),                                                       \
+     (e)->context == PANDA_CB_DIRECT                                       \
+         ? (e)->cb.name() : (e)->cb_with_context.name((e)->context))
+
+#ifdef __cplusplus
+}
+#endif
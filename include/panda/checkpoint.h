@@ -1,31 +1,50 @@
-#include "panda/rr/rr_log.h"
+/*!
+ * @file panda/checkpoint.h
+ * @brief In-memory checkpoints of a running guest.
+ *
+ * A checkpoint holds guest RAM and device state. The first one copies
+ * all of RAM. Each later one stores only the pages dirtied since the
+ * checkpoint the guest last came from (its parent), found through the
+ * migration dirty bitmap. Pages live in a sparse memfd at their
+ * ram_addr_t offset. Device state is a vmstate stream kept in memory.
+ *
+ * Restoring copies back only pages that differ between the current
+ * state and the target, so it costs about as much as the guest dirtied
+ * since the two diverged, not the size of RAM.
+ *
+ * In record/replay mode the device state includes the replay log
+ * position, so restoring rewinds replay as well.
+ *
+ * Checkpoints cannot be combined with migration; the first one adds a
+ * migration blocker, which also makes savevm fail. A loadvm or system
+ * reset makes the next restore rewrite all of RAM.
+ */
+#pragma once
 
 typedef struct Checkpoint {
-    uint64_t guest_instr_count;
-    size_t nondet_log_position;
-
-    unsigned long long number_of_log_entries[RR_LAST];
-    unsigned long long size_of_log_entries[RR_LAST];
-    unsigned long long max_num_queue_entries;
-
-    unsigned next_progress;
+    uint64_t guest_instr_count; /**< icount when taken, or 0 without icount */
+    int num;                    /**< index in checkpoints[] */
+    int parent;                 /**< checkpoint the pages are a delta to, or -1 */
+    bool ready;                 /**< false until a deferred checkpoint is taken */
 
-    int memfd;
+    int memfd;                  /**< RAM pages at their ram_addr_t offset */
+    size_t memfd_usage;         /**< bytes of page data in memfd */
+    unsigned long **dirty;      /**< per RAM block: pages in memfd; NULL for a full copy */
 
-    size_t memfd_usage;
-
-    QLIST_ENTRY(Checkpoint) next;
+    uint8_t *devstate;          /**< vmstate stream of every device but RAM */
+    size_t devstate_len;
 } Checkpoint;
 
 #define MAX_CHECKPOINTS 256
 extern Checkpoint* checkpoints[MAX_CHECKPOINTS];
 
-/*void* search_checkpoints(uint64_t target_instr);*/
-
 /**
- * get_num_checkpoints() - Get number of checkpoints in current checkpointed recording.
- * 
- * Return: Number of checkpoints.
+ * get_num_checkpoints() - Get number of checkpoint slots in use.
+ *
+ * Slots of deleted checkpoints are NULL until a new checkpoint reuses
+ * them.
+ *
+ * Return: One more than the highest checkpoint number.
  */
 size_t get_num_checkpoints(void);
 
@@ -33,7 +52,8 @@ size_t get_num_checkpoints(void);
  * get_closest_checkpoint_num() - Determine checkpoint closest to this instruction count.
  * @instr_count: Instruction count we'd like to get closest to.
  *
- * Return: Checkpoint number.
+ * Return: Number of the latest checkpoint taken at or before
+ * @instr_count, or -1 if there is none.
  */
 int get_closest_checkpoint_num(uint64_t instr_count);
 
@@ -41,15 +61,19 @@ int get_closest_checkpoint_num(uint64_t instr_count);
  * get_checkpoint() - Get this checkpoint, by number.
  * @num: The number.
  *
- * Return: Pointer to the checkpoint.
+ * Return: Pointer to the checkpoint, or NULL.
  */
 Checkpoint* get_checkpoint(int num);
 
-/** 
+/**
  * panda_checkpoint() - Take a checkpoint.
  *
- * This has to happen whilst we are in replay.  Take a checkpoint
- * we'll later be able to return to using panda_restore_by_num.
+ * From the main loop (BQL held) the vCPUs are paused and the checkpoint
+ * is taken at once. From a vCPU thread, e.g. a callback, it is taken
+ * when the vCPUs next leave cpu_exec, i.e. at the end of the current
+ * TB; ready stays false until then.
+ *
+ * Return: The checkpoint, or NULL if it could not be taken.
  */
 void* panda_checkpoint(void);
 
@@ -57,9 +81,44 @@ void* panda_checkpoint(void);
  * panda_restore_by_num() - Restore to a particular checkpoint
  * @num: Checkpoint number.
  *
- * Restore to this numbered checkpoint. 
+ * Restore to this numbered checkpoint. Deferred like panda_checkpoint()
+ * when called from a vCPU thread.
  */
 void panda_restore_by_num(int num);
 
-// Not an API fn I think.
+/**
+ * panda_restore() - Restore to a checkpoint.
+ * @opaque: Checkpoint returned by panda_checkpoint().
+ */
 void panda_restore(void *opaque);
+
+/**
+ * panda_checkpoint_delete() - Drop a checkpoint and free its memory.
+ * @num: Checkpoint number.
+ *
+ * Checkpoints that were deltas to it absorb the pages they need. The
+ * checkpoint the guest last came from can't be deleted. Call with the
+ * BQL held.
+ *
+ * Return: true if the checkpoint is gone.
+ */
+bool panda_checkpoint_delete(int num);
+
+/**
+ * panda_checkpoint_path() - Find the deltas between two checkpoints.
+ * @ckpts: Checkpoints by number, like checkpoints[].
+ * @head: Checkpoint the guest is a delta to, or -1 if unknown.
+ * @target: Checkpoint to go to.
+ * @path: Filled with checkpoint numbers; room for MAX_CHECKPOINTS.
+ *
+ * The deltas are those of the checkpoints from @head up to the common
+ * ancestor of @head and @target, and from @target up to it, the
+ * ancestor itself excluded. Their pages, together with the pages dirtied
+ * since @head, are all that can differ from @target.
+ *
+ * Return: The number of checkpoints in @path, or -1 if there is no
+ * common ancestor: @head is unknown, or the two are under different
+ * roots.
+ */
+int panda_checkpoint_path(Checkpoint *const *ckpts, int head, int target,
+                          int *path);
@@ -21,6 +21,7 @@
 #include "exec/target_page.h"
 #include "system/memory.h"
 #include "panda/types.h"
+#include "panda/v2p-cache.h"
 #include "gdbstub/internals.h"
 
 /*
@@ -78,6 +79,21 @@ int panda_virtual_memory_read(CPUState * env, target_ulong addr,
 int panda_virtual_memory_write(CPUState * env, target_ulong addr,
                                uint8_t * buf, int len);
 void *panda_map_virt_to_host(CPUState * env, target_ulong addr, int len);
+int panda_physical_memory_spans(hwaddr addr, size_t len,
+                                panda_mem_spans *spans);
+int panda_virtual_memory_spans(CPUState *env, target_ulong addr, size_t len,
+                               panda_mem_spans *spans);
+void panda_mem_spans_release(panda_mem_spans *spans);
+int panda_virtual_memory_read_iov(CPUState *env, panda_mem_iov *iov, size_t n);
+int panda_virtual_memory_read_string(CPUState *env, target_ulong addr,
+                                     char *buf, size_t size);
+size_t panda_virtual_memory_read_array(CPUState *env, target_ulong addr,
+                                       void *buf, size_t elem_size,
+                                       size_t count);
+
+typedef struct PandaV2PCache PandaV2PCache;
+void panda_v2p_cache_drop_asid(CPUState *cpu, target_ulong asid);
+void panda_v2p_cache_stats(CPUState *cpu, panda_v2p_stats *stats);
 // MemTxResult PandaPhysicalAddressToRamOffset(ram_addr_t* out, hwaddr addr, bool is_write);
 // MemTxResult PandaVirtualAddressToRamOffset(ram_addr_t* out, CPUState* cpu, target_ulong addr, bool is_write);
 
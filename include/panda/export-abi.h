@@ -0,0 +1,96 @@
+/*!
+ * @file panda/export-abi.h
+ * @brief Layout of the shared-memory event export, for consumers.
+ *
+ * This header only needs <stdint.h>, so that programs outside QEMU can
+ * include it. See panda/export.h for the QEMU side.
+ *
+ * The export is a memfd laid out as:
+ *
+ *   PandaExportHeader                  (PANDA_EXPORT_HEADER_SIZE bytes)
+ *   PandaExportRing [nrings]           (ring_stride bytes apart)
+ *
+ * There is one ring per vCPU, indexed by cpu_index. Each ring is a
+ * single-producer, single-consumer queue of fixed-size records. QEMU
+ * writes the record at rec[head % ring_records], then publishes it by
+ * storing head + 1 with release semantics. The consumer reads head with
+ * acquire semantics, processes rec[tail % ring_records] up to head and
+ * then stores the new tail, which frees the slots. head and tail only
+ * grow, and live in cache lines of their own.
+ *
+ * A consumer attaches by atomically incrementing consumers in the
+ * header, and detaches by decrementing it. While a consumer is attached
+ * and PANDA_EXPORT_BLOCK is set, a ring three quarters full stalls its
+ * vCPU at the end of the current TB until the consumer catches up.
+ * Records that don't fit, with PANDA_EXPORT_BLOCK before the vCPU
+ * stalls, are counted in dropped. QEMU sets closed when it stops exporting; nothing is written
+ * after that.
+ */
+#ifndef PANDA_EXPORT_ABI_H
+#define PANDA_EXPORT_ABI_H
+
+#include <stdint.h>
+
+#define PANDA_EXPORT_MAGIC       0x50584541444e4150ULL  /* "PANDAEXP" */
+#define PANDA_EXPORT_VERSION     1
+#define PANDA_EXPORT_HEADER_SIZE 4096
+
+/* Event types; also the bits of PandaExportHeader::events */
+enum {
+    PANDA_EXPORT_BLOCK_EXEC = 0,   /* about to execute a TB */
+    PANDA_EXPORT_TRANSLATE  = 1,   /* translated a TB */
+    PANDA_EXPORT_ASID       = 2,   /* the ASID is about to change */
+    PANDA_EXPORT_SYSCALL    = 3,   /* reported by a plugin */
+    PANDA_EXPORT_NB_TYPES
+};
+
+#define PANDA_EXPORT_EVENT(type) (1u << (type))
+#define PANDA_EXPORT_ALL         ((1u << PANDA_EXPORT_NB_TYPES) - 1)
+
+/* PandaExportHeader::flags */
+#define PANDA_EXPORT_BLOCK       (1u << 0)
+
+/*
+ * One event. pc, asid and icount (the guest instruction count, 0
+ * without icount) are those of the vCPU when the event happened.
+ *
+ *   type         size            arg[0]      arg[1]      arg[2..3]
+ *   BLOCK_EXEC   guest bytes     guest insns
+ *   TRANSLATE    guest bytes     guest insns ram_addr of pc, or -1
+ *   ASID         0               old ASID    new ASID
+ *   SYSCALL      syscall number  first four arguments
+ */
+typedef struct PandaExportRecord {
+    uint32_t type;
+    uint32_t size;
+    uint64_t icount;
+    uint64_t pc;
+    uint64_t asid;
+    uint64_t arg[4];
+} PandaExportRecord;
+
+typedef struct PandaExportHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t record_size;       /* sizeof(PandaExportRecord) */
+    uint32_t nrings;
+    uint32_t ring_records;      /* slots per ring, a power of two */
+    uint64_t ring_stride;       /* bytes from one ring to the next */
+    uint32_t events;            /* PANDA_EXPORT_EVENT() bits produced */
+    uint32_t flags;
+    uint32_t consumers;         /* attached consumers, see above */
+    uint32_t closed;
+} PandaExportHeader;
+
+typedef struct PandaExportRing {
+    uint64_t head;              /* written by QEMU */
+    uint8_t pad0[56];
+    uint64_t tail;              /* written by the consumer */
+    uint8_t pad1[56];
+    uint64_t dropped;           /* written by QEMU */
+    uint32_t cpu_index;
+    uint8_t pad2[52];
+    PandaExportRecord rec[];
+} PandaExportRing;
+
+#endif
@@ -0,0 +1,50 @@
+/*!
+ * @file panda/export.h
+ * @brief Export guest events to other processes through shared memory.
+ *
+ * Analyses in another process (Python, say) can consume events in bulk
+ * from rings in a memfd instead of taking a callback, and crossing the
+ * FFI, per event. The layout of the memfd is in panda/export-abi.h.
+ *
+ * The core produces block exec, translation and ASID change events.
+ * It doesn't decode system calls; a plugin that does (syscalls2)
+ * reports them with panda_export_syscall().
+ */
+#pragma once
+
+#include "panda/export-abi.h"
+
+/**
+ * panda_export_start() - Start exporting events.
+ * @ring_records: Slots per vCPU ring, rounded up to a power of two.
+ * @events: PANDA_EXPORT_EVENT() bits of the events to produce.
+ * @block: Stall a vCPU whose ring is full while a consumer is attached,
+ *    rather than drop events.
+ *
+ * Call with the BQL held, after the machine is created. Another process
+ * can map the memfd through /proc/<QEMU pid>/fd/<fd>, or receive it over
+ * a UNIX socket.
+ *
+ * Return: The memfd, or -1 on error or if an export is running.
+ */
+int panda_export_start(uint32_t ring_records, uint32_t events, bool block);
+
+/**
+ * panda_export_stop() - Stop exporting and close the memfd.
+ *
+ * Sets closed in the header. Consumers keep their mapping. Call with the
+ * BQL held, not from a callback.
+ */
+void panda_export_stop(void);
+
+/**
+ * panda_export_syscall() - Report a system call.
+ * @cpu: vCPU making it.
+ * @no: System call number.
+ * @args: Its first @nargs arguments.
+ * @nargs: Up to 4; extra arguments are not exported.
+ *
+ * Does nothing unless PANDA_EXPORT_SYSCALL events are being exported.
+ */
+void panda_export_syscall(CPUState *cpu, uint64_t no, const uint64_t *args,
+                          unsigned nargs);
@@ -1,4 +1,60 @@
 CPUState *panda_cpu_by_index(int index);
 CPUState *panda_cpu_in_translate(void);
 TranslationBlock *panda_get_tb(struct qemu_plugin_tb *tb);
-int panda_get_memcb_status(void);
\ No newline at end of file
+int panda_get_memcb_status(void);
+
+/*
+ * Instrumentation the PANDA bridge plugin emits into a TB, recorded in
+ * TranslationBlock::panda_instr.  A callback type with no subscribers
+ * costs nothing at execution time; when one gains or loses its first
+ * subscriber only the TBs translated under the old set are retranslated.
+ */
+#define PANDA_INSTR_START_BLOCK_EXEC (1u << 0)
+#define PANDA_INSTR_END_BLOCK_EXEC   (1u << 1)
+#define PANDA_INSTR_INSN_EXEC        (1u << 2)
+#define PANDA_INSTR_MEM_BATCH        (1u << 3)
+#define PANDA_INSTR_MEM_READ         (1u << 4)
+#define PANDA_INSTR_MEM_WRITE        (1u << 5)
+
+uint32_t panda_instr_wanted(void);
+/* Also records the span [@pc_lo, @pc_hi) of the TB's guest instructions. */
+void panda_set_tb_instr(TranslationBlock *tb, uint32_t instr,
+                       uint64_t pc_lo, uint64_t pc_hi);
+
+/* Tells the core which TCG plugin is the PANDA bridge */
+void panda_set_bridge_id(qemu_plugin_id_t id);
+
+/* May a TB translated with @instr be reused instead of retranslated? */
+bool panda_tb_reusable(uint32_t instr);
+
+/* Are there callbacks around block translation, which must run on the vCPU? */
+bool panda_translate_watched(void);
+
+/*
+ * Table of virtual address ranges [lo, hi) that PANDA memory callbacks
+ * care about, checked by the plugin core before the bridge plugin's
+ * memory callback is called. Unused slots have lo == hi. The bridge
+ * installs a hook that copies the table into its per-vCPU scoreboard.
+ */
+#define PANDA_MEM_RANGE_SLOTS 4
+
+typedef struct panda_mem_range {
+    uint64_t lo;
+    uint64_t hi;
+} panda_mem_range;
+
+typedef void (*panda_mem_ranges_hook_t)(const panda_mem_range *ranges);
+void panda_set_mem_ranges_hook(panda_mem_ranges_hook_t hook);
+void panda_get_mem_ranges(panda_mem_range *ranges);
+
+/*
+ * Should the instruction at @pc get an INSN_EXEC callback? Consults
+ * insn_translate only if an unfiltered INSN_EXEC callback is in scope.
+ */
+bool panda_insn_exec_instrument(CPUState *cpu, uint64_t pc);
+
+/*
+ * Fill @entries with the inline counters of every panda_insn_counter
+ * watching @pc. Returns the number of counters, which may exceed @max.
+ */
+size_t panda_insn_counters_at(uint64_t pc, qemu_plugin_u64 *entries, size_t max);
@@ -0,0 +1,96 @@
+/*!
+ * @file panda/pandalog.h
+ * @brief Streaming structured log for PANDA plugins.
+ *
+ * Plugins append typed records with pandalog_write(). Each vCPU fills
+ * its own chunk buffer without locking. Full chunks go to a background
+ * thread that compresses them (zstd, when QEMU is built with it) and
+ * appends them to the log file, so logging costs the vCPU a memcpy.
+ *
+ * File layout, all integers little-endian:
+ *
+ *   pandalog_file_header
+ *   { pandalog_chunk_header, stored_len bytes of chunk data } ...
+ *   pandalog_index_entry[nchunks]
+ *   pandalog_trailer
+ *
+ * Chunk data decompresses to raw_len bytes of records. Each record is
+ * a pandalog_record followed by len payload bytes, padded to 8 bytes.
+ * Chunks appear in the order they filled up, so records from different
+ * vCPUs interleave at chunk granularity. Every chunk's index entry
+ * holds its instruction-count range, so a reader can go straight to
+ * the chunks covering the range it wants; see pandalog_reader_seek().
+ */
+#pragma once
+
+#include "qemu/compiler.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PANDALOG_MAGIC          "PANDALG2"
+#define PANDALOG_INDEX_MAGIC    "PLOGIDX2"
+#define PANDALOG_VERSION        2
+
+#define PANDALOG_CODEC_NONE     0
+#define PANDALOG_CODEC_ZSTD     1
+
+/** @brief vcpu value of chunks written from outside a vCPU thread. */
+#define PANDALOG_NO_VCPU        UINT32_MAX
+
+typedef struct QEMU_PACKED pandalog_file_header {
+    char magic[8];          /**< PANDALOG_MAGIC */
+    uint32_t version;       /**< PANDALOG_VERSION */
+    uint32_t chunk_size;    /**< maximum raw_len of any chunk */
+} pandalog_file_header;
+
+typedef struct QEMU_PACKED pandalog_chunk_header {
+    uint32_t codec;         /**< PANDALOG_CODEC_* */
+    uint32_t vcpu;          /**< writer's cpu_index, or PANDALOG_NO_VCPU */
+    uint32_t nrecords;
+    uint32_t raw_len;       /**< bytes of records after decompression */
+    uint64_t stored_len;    /**< bytes following this header */
+    uint64_t first_instr;   /**< lowest record instr in the chunk */
+    uint64_t last_instr;    /**< highest record instr in the chunk */
+} pandalog_chunk_header;
+
+typedef struct QEMU_PACKED pandalog_index_entry {
+    uint64_t offset;        /**< file offset of the pandalog_chunk_header */
+    uint64_t first_instr;
+    uint64_t last_instr;
+    uint32_t vcpu;
+    uint32_t nrecords;
+} pandalog_index_entry;
+
+typedef struct QEMU_PACKED pandalog_trailer {
+    uint64_t index_offset;  /**< file offset of the first index entry */
+    uint64_t nchunks;
+    char magic[8];          /**< PANDALOG_INDEX_MAGIC */
+} pandalog_trailer;
+
+typedef struct pandalog_record {
+    uint64_t instr;         /**< guest instruction count, as given by the writer */
+    uint32_t type;          /**< plugin-defined record type */
+    uint32_t len;           /**< payload bytes in data */
+    uint8_t data[];
+} pandalog_record;
+
+/** @brief True while a log is open; cheap to test before building a record. */
+extern bool pandalog;
+
+bool pandalog_open(const char *path);
+void pandalog_write(CPUState *cpu, uint64_t instr, uint32_t type,
+                    const void *data, uint32_t len);
+void pandalog_close(void);
+
+typedef struct PandaLogReader PandaLogReader;
+
+PandaLogReader *pandalog_reader_open(const char *path);
+void pandalog_reader_seek(PandaLogReader *r, uint64_t instr);
+const pandalog_record *pandalog_reader_next(PandaLogReader *r);
+void pandalog_reader_close(PandaLogReader *r);
+
+#ifdef __cplusplus
+}
+#endif
@@ -19,6 +19,8 @@ PANDAENDCOMMENT */
 #define MAX_PANDA_PLUGIN_ARGS 32
 
 #include "panda/callbacks/cb-defs.h"
+#include "panda/cb-table.h"
+#include "panda/cb-register.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -29,37 +31,6 @@ extern "C" {
 // between this and END_PYPANDA_NEEDS_THIS except includes of other
 // files in this directory that contain subsections like this one.
 
-// Doubly linked list that stores a callback, along with its owner
-typedef struct _panda_cb_list panda_cb_list;
-struct _panda_cb_list {
-    panda_cb_with_context entry;
-    void *owner;
-    panda_cb_list *next;
-    panda_cb_list *prev;
-    bool enabled;
-    void* context;
-};
-panda_cb_list *panda_cb_list_next(panda_cb_list *plist);
-
-
-/**
- * panda_enable_plugin() - Enable this plugin.
- * @plugin: Pointer to the plugin (handle).
- *
- * Mark plugin as enabled so that its callbacks will run in future.
- */
-void panda_enable_plugin(void *plugin);
-
-
-/**
- * panda_disable_plugin() - Disable this plugin.
- * @plugin: Pointer to the plugin (handle).
- *
- * Mark plugin as disabled so that its callbacks will NOT run in future.
- */
-void panda_disable_plugin(void *plugin);
-
-
 // Structure to store metadata about a plugin
 typedef struct panda_plugin {
     char *name;            // Plugin name: basename(filename)
@@ -69,104 +40,6 @@ typedef struct panda_plugin {
 } panda_plugin;
 
 
-// XXX Not sure what this is exactly or howt to doc.  Is it really an API fn?
-// If so, that's concerning...
-panda_cb_with_context panda_get_cb_trampoline(panda_cb_type type);
-
-
-/**
- * panda_register_callback() - Register a callback for a plugin, and enable it.
- * @plugin: Pointer to plugin.
- * @type: Type of callback, indicating when cb function will run.
- * @cb: The callback function itself and other info.
- *
- * This function will register a callback to run in panda and is
- * typically called from plugin code.  
- *
- * The order of callback registration will determine the order in which
- * callbacks of the same type will be invoked.
- *
- * NB: Registering a callback function twice from the same plugin will
- * trigger an assertion error.
- * 
- * type is number. See typedef panda_cb_type.
- * cb is a pointer to a struct. See typedef panda_cb.
- */
-void panda_register_callback(void *plugin, panda_cb_type type, panda_cb cb);
-
-
-/**
- * panda_register_callback_with_context() - Register a callback for a plugin with context.
- * @plugin: Pointer to plugin.
- * @type: Type of callback, indicating when cb function will run.
- * @cb: The callback function itself and other info.
- * @context: Pointer to context.
- *
- * Same as panda_register_callback, but with context.
- */
-void panda_register_callback_with_context(void *plugin, panda_cb_type type, panda_cb_with_context cb, void* context);
-
-
-/**
- * panda_disable_callback() - Disable callback for this plugin from running.
- * @plugin: Pointer to plugin.
- * @type: Type of callback, indicating when cb function will run.
- * @cb: The callback function itself and other info.
- * 
- * Mark this callback as disabled so that it stops running. 
- * 
- * NB: enable/disable are faster than register/unregister since they
- * set a flag rather than adding/removing something from a list.
- */
-void panda_disable_callback(void *plugin, panda_cb_type type, panda_cb cb);
-
-
-/**
- * panda_disable_callback_with_context() - Disable callback for this plugin from running (with context).
- * @plugin: Pointer to plugin.
- * @type: Type of callback, indicating when cb function will run.
- * @cb: The callback function itself and other info.
- * @context: Pointer to context.
- * 
- * Same as padna_disable_callback, but with context.
- */
-void panda_disable_callback_with_context(void *plugin, panda_cb_type type, panda_cb_with_context cb, void* context);
-
-
-/**
- * panda_enable_callback() - Enable callback for this plugin so that it can run.
- * @plugin: Pointer to plugin.
- * @type: Type of callback, indicating when cb function will run.
- * @cb: The callback function itself and other info.
- * 
- * Mark this callback as enabled so that it will run from now on. 
- *
- * NB: enable/disable are faster than register/unregister since they
- * set a flag rather than adding/removing something from a list.
- */
-void panda_enable_callback(void *plugin, panda_cb_type type, panda_cb cb);
-
-
-/**
- * panda_enable_callback_with_context() - Enable this callback for this plugin so that it can run (with context)/
- * @plugin: Pointer to plugin.
- * @type: Type of callback, indicating when cb function will run.
- * @cb: The callback function itself and other info.
- * @context: Pointer to context.
- * 
- * Same as panda_enable_callback, but with context.
- */
-void panda_enable_callback_with_context(void *plugin, panda_cb_type type, panda_cb_with_context cb, void* context);
-
-
-/**
- * panda_unregister_callbacks() - Unregister all callbacks for this plugin.
- * @plugin: Pointer to plugin.
- * 
- */
-void panda_unregister_callbacks(void *plugin);
-
-
 /**
  * panda_load_plugin() - Load this plugin into panda.
  * @filename: The path to the shared object plugin code.
@@ -220,7 +93,6 @@ void panda_unload_plugins(void);
 
 extern bool panda_update_pc;
 extern bool panda_use_memcb;
-extern panda_cb_list *panda_cbs[PANDA_CB_LAST];
 extern bool panda_tb_chaining;
 
 // this stuff is used by the new qemu cmd-line arg '-os os_name'
@@ -355,12 +227,25 @@ void panda_enable_tb_chaining(void);
  * panda_memsavep() - Save RAM to a file.
  * @file: An open and writeable file pointer.
  *
- * This function should simply copy the contents of RAM to the
- * provided file pointer. One possible use is to provide this file to
- * memory forensic tools like Volatility.
+ * Copies guest RAM to the provided file pointer as a sparse image in
+ * which file offset (from the current position) equals guest physical
+ * address. One possible use is to provide this file to memory forensic
+ * tools like Volatility.
  */
 void panda_memsavep(FILE *file);
 
+/**
+ * panda_memdump() - Save RAM to a sparse, mmap-able image.
+ * @path: Image file. The guest-physical layout of the RAM in it is
+ *    written to @path.layout, one "start size name" line per range.
+ * @nthreads: Writer threads, or 0 for a default.
+ *
+ * Zero pages are left as holes. Stop the guest first.
+ *
+ * Return: 0 on success, or a negative errno.
+ */
+int panda_memdump(const char *path, unsigned nthreads);
+
 int panda_vm_quit(void);
 
 // Not and API function.
@@ -720,26 +605,59 @@ void panda_require(const char *name);
  */
 void panda_require_from_library(const char *plugin_name, char **plugin_args, uint32_t num_args);
 
+
+typedef struct panda_insn_counter panda_insn_counter;
+
 /**
- * panda_is_callback_enabled() - Determine if this plugin is loaded and enabled.
- * @plugin: Pointer to plugin (handle).
- * @type: Type of callback
- * @cb: The callback fn.
- *
- * Oddly, this function requires not the name of the plugin but
- * handle. Given that and callback type and fn, search the list of
- * callbacks and return true iff that one is both registered and
- * enabled.
- * 
- * See panda_cb_type. 
- * See panda_cb. 
+ * panda_insn_counter_new() - Count executions of a set of guest PCs.
+ * @pcs: Guest PCs to count.
+ * @n: Number of PCs.
+ *
+ * Every instruction at one of @pcs gets an inline per-vCPU counter
+ * increment emitted into its translation; no helper or callback is ever
+ * called. Creating a counter retranslates all code.
  *
- * Return: True if enabled, false otherwise. 
-*/
-bool panda_is_callback_enabled(void *plugin, panda_cb_type type, panda_cb cb);
+ * Return: a new counter set, to be released with panda_insn_counter_free().
+ */
+panda_insn_counter *panda_insn_counter_new(const uint64_t *pcs, size_t n);
+
+
+/**
+ * panda_insn_counter_read() - Read the execution count of a PC.
+ * @c: Counter set.
+ * @pc: Guest PC, which must be part of the set.
+ *
+ * Return: the number of executions of @pc summed over all vCPUs.
+ */
+uint64_t panda_insn_counter_read(panda_insn_counter *c, uint64_t pc);
+
+
+/**
+ * panda_insn_counter_free() - Stop counting and release a counter set.
+ * @c: Counter set.
+ */
+void panda_insn_counter_free(panda_insn_counter *c);
 
 // END_PYPANDA_NEEDS_THIS -- do not delete this comment!
 
+/*
+ * Callback threading contract.
+ *
+ * With MTTCG every vCPU runs on its own thread, and callbacks fired from
+ * guest execution (block/insn/mem/asid/exception...) run on the thread of
+ * the vCPU passed to them, concurrently with the same callback on other
+ * vCPUs. Plugins must keep such state per vCPU (indexed by
+ * cpu->cpu_index) or protect it themselves. Main loop, monitor and
+ * machine-init callbacks run on the main thread with the BQL held.
+ *
+ * Registering, enabling, disabling and filtering callbacks is safe from
+ * any thread, including from inside a callback; the change is seen by
+ * each vCPU no later than its next TB. Plugins are loaded and unloaded
+ * while no vCPU is executing guest code. panda_unload_plugin() may be
+ * called from a callback; the unload happens once the callback returns.
+ * panda_do_break_exec() applies to the calling vCPU only.
+ */
+
 #ifdef __cplusplus
 }
 #endif
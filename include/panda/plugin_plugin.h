@@ -3,6 +3,7 @@
 #define __PANDA_PLUGIN_PLUGIN_H_
 
 #include <dlfcn.h>
+#include "qemu/rcu.h"
 
 /*
 
@@ -28,171 +29,202 @@
 
 
 /****************************************************************
-This stuff gets used in "plugin A", i.e., the plugin inside of which
-we want to be able to register callbacks.  Thus, there are facilities
-for adding callbacks to an array but also for calling all the callbacks
-in the list at the right point.
+Registry. Every PPP point ("plugin A" callback site) and the callbacks
+attached to it live in a registry in the PANDA core. Attaching,
+detaching and enabling take a lock in the core; dispatch does not. It
+walks an RCU-published, priority-ordered snapshot, so it is safe from
+vCPU threads while other threads change registrations. Threads that
+dispatch PPP callbacks must be registered with RCU (vCPU and main loop
+threads are).
+
+Entries run in ascending priority, ties in registration order. The
+registry also records which plugin provides each point and which
+plugin each callback belongs to. Calls are profiled like PANDA
+callbacks (see panda/cb-profile.h), charged to (consumer, point).
 ****************************************************************/
 
+#ifdef __cplusplus
+extern "C" {
+#endif
 
+typedef struct panda_ppp_entry {
+    struct rcu_head rcu;
+    void *fn;               // cb_name##_t or cb_name##_with_context_t
+    void *context;
+    bool with_context;
+    bool enabled;
+    int priority;
+    uint64_t seq;           // registration order, breaks priority ties
+    uint32_t prof_site;     // see panda/cb-profile.h
+    void *consumer_base;    // load address of the object that owns fn
+    char *consumer;         // ... and its basename
+} panda_ppp_entry;
 
+typedef struct panda_ppp_table {
+    struct rcu_head rcu;
+    size_t n;
+    panda_ppp_entry *e[];
+} panda_ppp_table;
 
-  
+typedef struct panda_ppp_point {
+    const char *name;
+    panda_ppp_table *table;         // RCU; NULL when nothing is attached
+    struct panda_ppp_point *next;   // registry list, once first used
+    bool listed;
+    void *provider_base;
+    char *provider;
+} panda_ppp_point;
+
+#define PANDA_PPP_POINT_INIT(cb_name_str) { cb_name_str, NULL, NULL, false, NULL, NULL }
+
+// Priority given to callbacks added without an explicit slot. Slots are
+// priorities, so callbacks placed in a slot run before unslotted ones.
 #define PPP_MAX_CB 256
+#define PPP_DEFAULT_PRIORITY PPP_MAX_CB
 
+void panda_ppp_add(panda_ppp_point *point, void *fn, void *context,
+                   bool with_context, int priority);
+bool panda_ppp_remove(panda_ppp_point *point, void *fn, void *context,
+                      bool with_context);
+bool panda_ppp_set_enabled(panda_ppp_point *point, void *fn, void *context,
+                           bool with_context, bool enabled);
+void panda_ppp_set_profiling(bool on);
+
+/*
+ * Dispatch state for PPP_RUN_CB. panda_ppp_iter_next() moves @e to the
+ * next enabled entry and returns false, leaving the read-side section,
+ * after the last one. Kept out of line so that the macros also build as
+ * C++ and don't depend on the RCU and profiling internals.
+ */
+typedef struct panda_ppp_iter {
+    panda_ppp_entry *e;
+    panda_ppp_table *tab;
+    size_t i;
+    int64_t t0;
+    bool prof;
+    bool locked;
+} panda_ppp_iter;
+
+panda_ppp_iter panda_ppp_iter_start(panda_ppp_point *point);
+bool panda_ppp_iter_next(panda_ppp_iter *it);
+bool panda_ppp_attached(panda_ppp_point *point);
+void panda_ppp_dump(FILE *out);
+void panda_ppp_forget_plugin(void *plugin);
 
-// use this at head of A plugin
 #ifdef __cplusplus
-#define PPP_PROT_REG_CB(cb_name) \
-extern "C" { \
+}
+#endif
+
+/****************************************************************
+This stuff gets used in "plugin A", i.e., the plugin inside of which
+we want to be able to register callbacks.  Thus, there are facilities
+for adding callbacks to the registry but also for calling all the
+callbacks attached at the right point.
+****************************************************************/
+
+#define PPP_PROT_REG_CB_(cb_name) \
 void ppp_add_cb_##cb_name(cb_name##_t fptr) ;                \
 void ppp_add_cb_##cb_name##_slot(cb_name##_t fptr, int slot_num) ; \
 bool ppp_remove_cb_##cb_name(cb_name##_t fptr) ; \
+bool ppp_enable_cb_##cb_name(cb_name##_t fptr, bool enabled) ; \
 \
 void ppp_add_cb_##cb_name##_with_context(cb_name##_with_context_t fptr, void* context) ;                \
 void ppp_add_cb_##cb_name##_slot_with_context(cb_name##_with_context_t fptr, int slot_num, void* context) ; \
 bool ppp_remove_cb_##cb_name##_with_context(cb_name##_with_context_t fptr, void* context) ; \
+bool ppp_enable_cb_##cb_name##_with_context(cb_name##_with_context_t fptr, void* context, bool enabled) ;
+
+// use this at head of A plugin
+#ifdef __cplusplus
+#define PPP_PROT_REG_CB(cb_name) \
+extern "C" { \
+PPP_PROT_REG_CB_(cb_name) \
 }
 #else
-#define PPP_PROT_REG_CB(cb_name) \
-void ppp_add_cb_##cb_name(cb_name##_t fptr) ;                \
-void ppp_add_cb_##cb_name##_slot(cb_name##_t fptr, int slot_num) ; \
-bool ppp_remove_cb_##cb_name(cb_name##_t fptr) ;\
-\
-void ppp_add_cb_##cb_name##_with_context(cb_name##_with_context_t fptr, void* context) ;                \
-void ppp_add_cb_##cb_name##_slot_with_context(cb_name##_with_context_t fptr, int slot_num, void* context) ; \
-bool ppp_remove_cb_##cb_name##_with_context(cb_name##_with_context_t fptr, void* context) ;
+#define PPP_PROT_REG_CB(cb_name) PPP_PROT_REG_CB_(cb_name)
 #endif
 
 /*
   employ this somewhere in the plugin near the top.
-  1. creates global array of fn pointers for this plugin
-  2. creates global int tracking the number of plugins
-  3. create fn for registering a callback
-  4. creates a fn for registering a callback in a particlular slot.  Since the
-  callbacks are in an array and we will call them in order, one may want to
-  take advantage of that fact by ordering them carefully.  However, be careful
-  as there isnt any attempt, here, to detect if you leave a slot empty
+  1. creates the registry point for this callback
+  2. creates fns for attaching a callback, either at the default
+  priority or in a particular slot. Slots are priorities: lower slots
+  run first, and several callbacks may share one.
+  3. creates fns for detaching a callback and for enabling or disabling
+  it without detaching it
 */
 
 #define PPP_CB_BOILERPLATE(cb_name)                                               \
-cb_name##_t ppp_##cb_name##_cb[PPP_MAX_CB];                                       \
-int ppp_##cb_name##_num_cb = 0;                                                   \
+panda_ppp_point ppp_##cb_name##_point = PANDA_PPP_POINT_INIT(#cb_name);           \
                                                                                   \
 void ppp_add_cb_##cb_name(cb_name##_t fptr) {                                     \
-  assert (ppp_##cb_name##_num_cb < PPP_MAX_CB);                                   \
-  ppp_##cb_name##_cb[ppp_##cb_name##_num_cb] = fptr;                              \
-  ppp_##cb_name##_num_cb += 1;                                                    \
+  panda_ppp_add(&ppp_##cb_name##_point, (void *)fptr, NULL, false,                \
+                PPP_DEFAULT_PRIORITY);                                            \
 }                                                                                 \
                                                                                   \
 void ppp_add_cb_##cb_name##_slot(cb_name##_t fptr, int slot_num) {                \
-  assert (slot_num < PPP_MAX_CB);                                                 \
-  ppp_##cb_name##_cb[slot_num] = fptr;                                            \
-  ppp_##cb_name##_num_cb = MAX(slot_num, ppp_##cb_name##_num_cb);                 \
+  panda_ppp_add(&ppp_##cb_name##_point, (void *)fptr, NULL, false, slot_num);     \
 }                                                                                 \
 bool ppp_remove_cb_##cb_name(cb_name##_t fptr) {                                  \
-  int i = 0;                                                                      \
-  bool found = false;                                                             \
-  for (; i<MIN(PPP_MAX_CB,ppp_##cb_name##_num_cb); i++){                          \
-    if (!found && fptr == ppp_##cb_name##_cb[i]) {                                \
-        found = true;                                                             \
-        ppp_##cb_name##_num_cb--;                                                 \
-    }                                                                             \
-    if (found && i < PPP_MAX_CB -2 ){                                             \
-        ppp_##cb_name##_cb[i] = ppp_##cb_name##_cb[i+1];                          \
-    }                                                                             \
-  }                                                                               \
-  return found;                                                                   \
+  return panda_ppp_remove(&ppp_##cb_name##_point, (void *)fptr, NULL, false);     \
+}                                                                                 \
+bool ppp_enable_cb_##cb_name(cb_name##_t fptr, bool enabled) {                    \
+  return panda_ppp_set_enabled(&ppp_##cb_name##_point, (void *)fptr, NULL,        \
+                               false, enabled);                                   \
 }                                                                                 \
-cb_name##_with_context_t ppp_##cb_name##_cb_with_context[PPP_MAX_CB];             \
-void* ppp_##cb_name##_cb_context[PPP_MAX_CB];                                     \
-int ppp_##cb_name##_num_cb_with_context = 0;                                      \
                                                                                   \
-void ppp_add_cb_##cb_name##_with_context(                                           \
+void ppp_add_cb_##cb_name##_with_context(                                         \
     cb_name##_with_context_t fptr,                                                \
     void* context                                                                 \
 ) {                                                                               \
-  assert (ppp_##cb_name##_num_cb_with_context < PPP_MAX_CB);                      \
-  ppp_##cb_name##_cb_with_context[ppp_##cb_name##_num_cb_with_context] = fptr;    \
-  ppp_##cb_name##_cb_context[ppp_##cb_name##_num_cb_with_context] = context;      \
-  ppp_##cb_name##_num_cb_with_context += 1;                                       \
+  panda_ppp_add(&ppp_##cb_name##_point, (void *)fptr, context, true,              \
+                PPP_DEFAULT_PRIORITY);                                            \
 }                                                                                 \
                                                                                   \
 void ppp_add_cb_##cb_name##_slot_with_context(                                    \
     cb_name##_with_context_t fptr, int slot_num, void* context                    \
 ) {                                                                               \
-  assert (slot_num < PPP_MAX_CB);                                                 \
-  ppp_##cb_name##_cb_with_context[slot_num] = fptr;                               \
-  ppp_##cb_name##_cb_context[slot_num] = context;                                 \
-  ppp_##cb_name##_num_cb_with_context = MAX(                                      \
-          slot_num, ppp_##cb_name##_num_cb_with_context                           \
-  );                                                                              \
+  panda_ppp_add(&ppp_##cb_name##_point, (void *)fptr, context, true, slot_num);   \
 }                                                                                 \
-bool ppp_remove_cb_##cb_name##_with_context(                                        \
+bool ppp_remove_cb_##cb_name##_with_context(                                      \
     cb_name##_with_context_t fptr, void* context                                  \
 ) {                                                                               \
-  int i = 0;                                                                      \
-  bool found = false;                                                             \
-  for (; i<MIN(PPP_MAX_CB,ppp_##cb_name##_num_cb_with_context); i++){             \
-    if (                                                                          \
-        !found && fptr == ppp_##cb_name##_cb_with_context[i]                      \
-        && ppp_##cb_name##_cb_context[i] == context                               \
-    ) {                                                                           \
-        found = true;                                                             \
-        ppp_##cb_name##_num_cb_with_context--;                                    \
-    }                                                                             \
-    if (found && i < PPP_MAX_CB -2 ){                                             \
-        ppp_##cb_name##_cb_with_context[i] = ppp_##cb_name##_cb_with_context[i+1];\
-        ppp_##cb_name##_cb_context[i] = ppp_##cb_name##_cb_context[i+1];          \
-    }                                                                             \
-  }                                                                               \
-  return found;                                                                   \
+  return panda_ppp_remove(&ppp_##cb_name##_point, (void *)fptr, context, true);   \
+}                                                                                 \
+bool ppp_enable_cb_##cb_name##_with_context(                                      \
+    cb_name##_with_context_t fptr, void* context, bool enabled                    \
+) {                                                                               \
+  return panda_ppp_set_enabled(&ppp_##cb_name##_point, (void *)fptr, context,     \
+                               true, enabled);                                    \
 }
 
 #define PPP_CB_EXTERN(cb_name) \
-extern cb_name##_t ppp_##cb_name##_cb[PPP_MAX_CB]; \
-extern int ppp_##cb_name##_num_cb;\
-extern cb_name##_with_context_t ppp_##cb_name##_cb_with_context[PPP_MAX_CB]; \
-extern void* ppp_##cb_name##_cb_context[PPP_MAX_CB]; \
-extern int ppp_##cb_name##_num_cb_with_context;
+extern panda_ppp_point ppp_##cb_name##_point;
 
 /*
   And employ this where you want the callback functions to be called 
 */
- 
-#define PPP_RUN_CB(cb_name, ...)                                              \
-  {                                                                           \
-    int ppp_cb_ind;                                                           \
-    for (ppp_cb_ind = 0; ppp_cb_ind < ppp_##cb_name##_num_cb; ppp_cb_ind++) { \
-      if (ppp_##cb_name##_cb[ppp_cb_ind] != NULL) {                           \
-    ppp_##cb_name##_cb[ppp_cb_ind]( __VA_ARGS__ ) ;                           \
-      }                                                                       \
-    }                                                                         \
-    for (ppp_cb_ind = 0;                                                      \
-            ppp_cb_ind < ppp_##cb_name##_num_cb_with_context;                 \
-            ppp_cb_ind++) {                                                   \
-      if (ppp_##cb_name##_cb_with_context[ppp_cb_ind] != NULL) {              \
-        void* context = ppp_##cb_name##_cb_context[ppp_cb_ind];               \
-        ppp_##cb_name##_cb_with_context[ppp_cb_ind](context, __VA_ARGS__ ) ;  \
-      }                                                                       \
+
+// acc is either empty or an accumulator such as `ret |=`
+#define PPP_DISPATCH_(cb_name, acc, ...)                                      \
+  for (panda_ppp_iter ppp_it = panda_ppp_iter_start(&ppp_##cb_name##_point);  \
+       panda_ppp_iter_next(&ppp_it);) {                                       \
+    if (ppp_it.e->with_context) {                                             \
+      acc ((cb_name##_with_context_t)ppp_it.e->fn)(ppp_it.e->context, __VA_ARGS__); \
+    } else {                                                                  \
+      acc ((cb_name##_t)ppp_it.e->fn)(__VA_ARGS__);                           \
     }                                                                         \
   }
 
+#define PPP_RUN_CB(cb_name, ...) PPP_DISPATCH_(cb_name, , __VA_ARGS__)
+
 // If any of the registered functions returns true, take the if body
 // Usage: IF_PPP_RUN_BOOL_CB(...) { printf("True"); }
 #define IF_PPP_RUN_BOOL_CB(cb_name, ...)                                      \
   bool __ret = false;                                                         \
-  {                                                                           \
-    int ppp_cb_ind;                                                           \
-    for (ppp_cb_ind = 0; ppp_cb_ind < ppp_##cb_name##_num_cb; ppp_cb_ind++) { \
-      if (ppp_##cb_name##_cb[ppp_cb_ind] != NULL) {                           \
-        __ret |= ppp_##cb_name##_cb[ppp_cb_ind]( __VA_ARGS__ ) ;              \
-      }                                                                       \
-    }                                                                         \
-  }; if (__ret)
+  PPP_DISPATCH_(cb_name, __ret |=, __VA_ARGS__); if (__ret)
 
 #define PPP_CHECK_CB(cb_name) \
-    ((ppp_##cb_name##_num_cb > 0) || (ppp_##cb_name##_num_cb_with_context > 0))
+    panda_ppp_attached(&ppp_##cb_name##_point)
 
 /****************************************************************
 This stuff gets used in "plugin B", i.e., the plugin that wants
@@ -258,4 +290,34 @@ to add a callback to be run inside of plugin A.
     rm_cb (cb_func, context);                                                                                \
   }
 
+// Use to pause or resume a ppp-callback without detaching it
+#define PPP_ENABLE_CB(other_plugin, cb_name, cb_func, enabled)                                      \
+  {                                                                                                 \
+    dlerror();                                                                                      \
+    void *op = panda_get_plugin_by_name(other_plugin);                                              \
+    if (!op) {                                                                                      \
+      printf("In trying to enable plugin callback, couldn't load %s plugin\n", other_plugin);       \
+      assert (op);                                                                                  \
+    }                                                                                               \
+    bool (*en_cb)(cb_name##_t fptr, bool en) = \
+      (bool (*)(cb_name##_t, bool)) dlsym(op, "ppp_enable_cb_" #cb_name);                          \
+    assert (en_cb != 0);                                                                            \
+    en_cb (cb_func, enabled);                                                                       \
+  }
+
+#define PPP_ENABLE_CB_WITH_CONTEXT(other_plugin, cb_name, cb_func, context, enabled)                \
+  {                                                                                                 \
+    dlerror();                                                                                      \
+    void *op = panda_get_plugin_by_name(other_plugin);                                              \
+    if (!op) {                                                                                      \
+      printf("In trying to enable plugin callback, couldn't load %s plugin\n", other_plugin);       \
+      assert (op);                                                                                  \
+    }                                                                                               \
+    bool (*en_cb)(cb_name##_with_context_t fptr, void* context, bool en) = \
+      (bool (*)(cb_name##_with_context_t, void*, bool)) \
+      dlsym(op, "ppp_enable_cb_" #cb_name "_with_context");                                        \
+    assert (en_cb != 0);                                                                            \
+    en_cb (cb_func, context, enabled);                                                              \
+  }
+
 #endif // __PANDA_PLUGIN_PLUGIN_H_
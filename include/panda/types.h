@@ -61,6 +61,60 @@ typedef int32_t target_pid_t;
     typedef ret_type (*cb_name##_t)(__VA_ARGS__); \
     typedef ret_type (*cb_name##_with_context_t)(void* context, __VA_ARGS__);
 
+/**
+ * @brief One guest memory access, as delivered in bulk to
+ * PANDA_CB_MEM_BATCH subscribers.
+ */
+typedef struct panda_mem_access {
+    uint64_t pc;        /**< guest PC of the accessing instruction */
+    uint64_t vaddr;     /**< guest virtual address */
+    uint64_t paddr;     /**< guest physical address, or -1 if unknown */
+    uint64_t value;     /**< value loaded/stored (low 64 bits) */
+    uint32_t size;      /**< access size in bytes */
+    bool is_write;      /**< true for stores */
+} panda_mem_access;
+
+/**
+ * @brief One contiguous run of guest memory visible from the host, as
+ * returned by panda_physical_memory_spans() and
+ * panda_virtual_memory_spans().
+ */
+typedef struct panda_mem_span {
+    const uint8_t *ptr; /**< host pointer to the first byte; read-only */
+    size_t len;         /**< number of bytes at ptr */
+    bool bounce;        /**< ptr is a private copy (MMIO), not guest RAM */
+} panda_mem_span;
+
+/**
+ * @brief A list of panda_mem_span covering one guest range, in guest
+ * address order. Release with panda_mem_spans_release().
+ */
+typedef struct panda_mem_spans {
+    panda_mem_span *span;   /**< the spans */
+    size_t n;               /**< number of valid entries in span */
+    size_t alloc;           /**< allocated entries in span (internal) */
+} panda_mem_spans;
+
+/**
+ * @brief One request of a panda_virtual_memory_read_iov() batch.
+ */
+typedef struct panda_mem_iov {
+    uint64_t addr;      /**< guest virtual address to read from */
+    void *buf;          /**< host buffer of at least len bytes */
+    size_t len;         /**< number of bytes to read */
+    int ret;            /**< out: 0 on success, -1 if any byte failed */
+} panda_mem_iov;
+
+/**
+ * @brief Counters of a vCPU's virt->phys translation cache, as returned
+ * by panda_v2p_cache_stats().
+ */
+typedef struct panda_v2p_stats {
+    uint64_t hits;      /**< lookups answered from the cache */
+    uint64_t misses;    /**< lookups that walked the guest page tables */
+    uint64_t flushes;   /**< full invalidations (TLB flushes) */
+} panda_v2p_stats;
+
 /** @brief Print format for guest VM pids. */
 #define TARGET_PID_FMT "%u"
 
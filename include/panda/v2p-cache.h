@@ -0,0 +1,13 @@
+/*!
+ * @file panda/v2p-cache.h
+ * @brief Per-vCPU virtual to physical translation cache.
+ *
+ * The target independent part of the interface, so that the softmmu TLB
+ * can drop the cache whenever it is flushed. The rest is in
+ * panda/common.h.
+ */
+#pragma once
+
+#include "qemu/typedefs.h"
+
+void panda_v2p_cache_flush(CPUState *cpu);
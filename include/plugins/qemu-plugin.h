@@ -449,6 +449,30 @@ void qemu_plugin_register_vcpu_tb_exec_cond_cb(struct qemu_plugin_tb *tb,
                                                uint64_t imm,
                                                void *userdata);
 
+/**
+ * qemu_plugin_register_vcpu_tb_exit_cond_cb() - register TB exit callback
+ * @tb: the opaque qemu_plugin_tb handle for the translation
+ * @cb: callback function
+ * @cond: condition to enable callback
+ * @entry: first operand for condition
+ * @imm: second operand for condition
+ * @flags: does the plugin read or write the CPU's registers?
+ * @userdata: any plugin data to pass to the @cb?
+ *
+ * Like qemu_plugin_register_vcpu_tb_exec_cond_cb(), but the @cb function
+ * is called when the translated unit ends, after its last instruction
+ * executed and before control passes to the next one. A unit left in
+ * the middle, e.g. by an exception, does not call @cb.
+ */
+QEMU_PLUGIN_API
+void qemu_plugin_register_vcpu_tb_exit_cond_cb(struct qemu_plugin_tb *tb,
+                                               qemu_plugin_vcpu_udata_cb_t cb,
+                                               enum qemu_plugin_cb_flags flags,
+                                               enum qemu_plugin_cond cond,
+                                               qemu_plugin_u64 entry,
+                                               uint64_t imm,
+                                               void *userdata);
+
 /**
  * enum qemu_plugin_op - describes an inline op
  *
@@ -771,6 +795,34 @@ void qemu_plugin_register_vcpu_mem_cb(struct qemu_plugin_insn *insn,
                                       enum qemu_plugin_mem_rw rw,
                                       void *userdata);
 
+/**
+ * qemu_plugin_register_vcpu_mem_range_cb() - address filtered memory callback
+ * @insn: handle for instruction to instrument
+ * @cb: callback of type qemu_plugin_vcpu_mem_cb_t
+ * @flags: (currently unused) callback flags
+ * @rw: monitor reads, writes or both
+ * @ranges: scoreboard entry of the first range of the table
+ * @n_ranges: number of ranges in the table
+ * @userdata: opaque pointer for userdata
+ *
+ * Like qemu_plugin_register_vcpu_mem_cb() but the callback is only made
+ * when the virtual address of the access falls in one of the ranges of a
+ * per-vCPU table. The table is @n_ranges consecutive pairs of uint64_t
+ * starting at @ranges, each an inclusive lower and an exclusive upper
+ * bound; a pair with lo >= hi is unused. The check is made by the core
+ * before the callback, so @cb never sees the other accesses. As the table
+ * is read at run time, the ranges can be changed by updating the
+ * scoreboard without retranslating.
+ */
+QEMU_PLUGIN_API
+void qemu_plugin_register_vcpu_mem_range_cb(struct qemu_plugin_insn *insn,
+                                            qemu_plugin_vcpu_mem_cb_t cb,
+                                            enum qemu_plugin_cb_flags flags,
+                                            enum qemu_plugin_mem_rw rw,
+                                            qemu_plugin_u64 ranges,
+                                            size_t n_ranges,
+                                            void *userdata);
+
 /**
  * qemu_plugin_register_vcpu_mem_inline_per_vcpu() - inline op for mem access
  * @insn: handle for instruction to instrument
@@ -72,6 +72,7 @@ enum plugin_dyn_cb_type {
     PLUGIN_CB_REGULAR,
     PLUGIN_CB_COND,
     PLUGIN_CB_MEM_REGULAR,
+    PLUGIN_CB_MEM_RANGE,
     PLUGIN_CB_INLINE_ADD_U64,
     PLUGIN_CB_INLINE_STORE_U64,
 };
@@ -98,6 +99,16 @@ struct qemu_plugin_conditional_cb {
     uint64_t imm;
 };
 
+/* memory callback only made when vaddr is in one of n [lo, hi) ranges */
+struct qemu_plugin_mem_range_cb {
+    union qemu_plugin_cb_sig f;
+    TCGHelperInfo *info;
+    void *userp;
+    enum qemu_plugin_mem_rw rw;
+    qemu_plugin_u64 ranges;
+    size_t n;
+};
+
 /*
  * A dynamic callback has an insertion point that is determined at run-time.
  * Usually the insertion point is somewhere in the code cache; think for
@@ -108,6 +119,7 @@ struct qemu_plugin_dyn_cb {
     union {
         struct qemu_plugin_regular_cb regular;
         struct qemu_plugin_conditional_cb cond;
+        struct qemu_plugin_mem_range_cb mem_range;
         struct qemu_plugin_inline_cb inline_insn;
     };
 };
@@ -139,6 +151,8 @@ struct qemu_plugin_tb {
     bool mem_helper;
 
     GArray *cbs;
+    /* injected at each exit of the TB, see plugin_gen_disable_mem_helpers */
+    GArray *exit_cbs;
 };
 
 /**
@@ -180,6 +194,9 @@ void qemu_plugin_vcpu_mem_cb(CPUState *cpu, uint64_t vaddr,
                              uint64_t value_low,
                              uint64_t value_high,
                              MemOpIdx oi, enum qemu_plugin_mem_rw rw);
+void plugin_vcpu_mem_range_cb(uint32_t cpu_index, qemu_plugin_meminfo_t info,
+                              uint64_t vaddr, void *userp, void *f,
+                              const uint64_t *ranges, uint32_t n);
 
 void qemu_plugin_flush_cb(void);
 
@@ -187,6 +204,14 @@ void qemu_plugin_atexit_cb(void);
 
 void qemu_plugin_add_dyn_cb_arr(GArray *arr);
 
+void qemu_plugin_layout_checksum(GChecksum *sum);
+
+/*
+ * qemu_plugin_tb_trans_others(): does a plugin other than @id watch TB
+ * translation? Call inside an RCU read-side section.
+ */
+bool qemu_plugin_tb_trans_others(qemu_plugin_id_t id);
+
 static inline void qemu_plugin_disable_mem_helpers(CPUState *cpu)
 {
     cpu->neg.plugin_mem_cbs = NULL;
@@ -254,6 +279,11 @@ static inline int qemu_plugin_load_list(QemuPluginList *head, Error **errp)
 static inline void qemu_plugin_vcpu_init_hook(CPUState *cpu)
 { }
 
+static inline bool qemu_plugin_tb_trans_others(qemu_plugin_id_t id)
+{
+    return false;
+}
+
 static inline void qemu_plugin_vcpu_exit_hook(CPUState *cpu)
 { }
 
@@ -312,6 +342,9 @@ static inline
 void qemu_plugin_add_dyn_cb_arr(GArray *arr)
 { }
 
+static inline void qemu_plugin_layout_checksum(GChecksum *sum)
+{ }
+
 static inline void qemu_plugin_disable_mem_helpers(CPUState *cpu)
 { }
 
@@ -0,0 +1,20 @@
+/*
+ * Choice of the code regions to evict when the buffer is full.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#ifndef TCG_REGION_EVICT_H
+#define TCG_REGION_EVICT_H
+
+/*
+ * Pick up to @max of the @n regions to evict, oldest first, into @idx.
+ * @gen holds the sequence number each region was allocated at, or 0 if it
+ * is not allocated; the @n_busy regions in @busy, which contexts are
+ * generating code into, are never picked. Returns the number picked.
+ */
+size_t tcg_region_pick_oldest(const uint64_t *gen, size_t n,
+                              const size_t *busy, size_t n_busy,
+                              size_t *idx, size_t max);
+
+#endif /* TCG_REGION_EVICT_H */
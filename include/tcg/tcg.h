@@ -390,6 +390,15 @@ struct TCGContext {
 
     TCGLabel *exitreq_label;
 
+    /*
+     * Generate code quickly rather than well: skip the optimizations
+     * the backends don't depend on. tcg_optimize() only visits ops with
+     * a constant input, and forwards no loads and stores of env;
+     * TEMP_TB temps that don't outlive an EBB are not narrowed.
+     * Set for tier 0 TBs, see accel/tcg/tb-trace.c.
+     */
+    bool fast_gen;
+
 #ifdef CONFIG_PLUGIN
     /*
      * We keep one plugin_tb struct per TCGContext. Note that on every TB
@@ -632,6 +641,19 @@ void tcg_region_reset_all(void);
 size_t tcg_code_size(void);
 size_t tcg_code_capacity(void);
 
+/* Persistent translation cache support, see accel/tcg/tb-cache.c */
+void tcg_region_request_addr(void *addr);
+void *tcg_region_layout(size_t *prologue_size, size_t *stride,
+                        size_t *n, size_t *total_size);
+void tcg_region_used(size_t i, void **start, size_t *size);
+bool tcg_region_reserve(size_t n);
+
+/* Region-granular eviction support, see tb_evict__exclusive_or_serial() */
+size_t tcg_region_count(void);
+size_t tcg_region_oldest(size_t *idx, size_t max);
+void tcg_region_free(size_t i);
+size_t tcg_region_nb_evicted(void);
+
 /**
  * tcg_tb_insert:
  * @tb: translation block to insert
@@ -672,6 +694,16 @@ TranslationBlock *tcg_tb_lookup(uintptr_t tc_ptr);
  */
 void tcg_tb_foreach(GTraverseFunc func, gpointer user_data);
 
+/**
+ * tcg_region_tb_foreach:
+ * @i: region index
+ * @func: callback
+ * @user_data: opaque value to pass to @callback
+ *
+ * Call @func for each translation block inserted into the tree of region @i.
+ */
+void tcg_region_tb_foreach(size_t i, GTraverseFunc func, gpointer user_data);
+
 /**
  * tcg_nb_tbs:
  *
@@ -984,5 +1016,7 @@ bool tcg_can_emit_vecop_list(const TCGOpcode *, TCGType, unsigned);
 void tcg_dump_ops(TCGContext *s, FILE *f, bool have_prefs);
 /* tcg_dump_stats: Append TCG statistics to @buf */
 void tcg_dump_stats(GString *buf);
+/* tcg_dump_panda_profile: Append PANDA callback profiling results to @buf */
+void tcg_dump_panda_profile(GString *buf);
 
 #endif /* TCG_H */
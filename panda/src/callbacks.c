@@ -29,7 +29,14 @@ PANDAENDCOMMENT */
 #endif
 
 #include "panda/common.h"
+#include "panda/callbacks/cb-support.h"
 #include "panda/callbacks/cb-trampolines.h"
+#include "exec/tb-flush.h"
+#include "hw/core/cpu.h"
+#include "system/tcg.h"
+#include "system/cpus.h"
+#include "qemu/main-loop.h"
+#include "block/aio.h"
 
 #define SOFTMMU_DIR "/" TARGET_NAME "-softmmu"
 #define LIBRARY_NAME "/libpanda-" TARGET_NAME ".so"
@@ -41,15 +48,6 @@ PANDAENDCOMMENT */
 const gchar *panda_bool_true_strings[] =  {"y", "yes", "true", "1", NULL};
 const gchar *panda_bool_false_strings[] = {"n", "no", "false", "0", NULL};
 
-#if 0
-###########################################################
-WARNING: This is all gloriously thread-unsafe!!!
-###########################################################
-#endif
-
-// Array of pointers to PANDA callback lists, one per callback type
-panda_cb_list *panda_cbs[PANDA_CB_LAST];
-
 // Storage for command line options
 gchar *panda_argv[MAX_PANDA_PLUGIN_ARGS];
 int panda_argc;
@@ -60,7 +58,6 @@ panda_plugin panda_plugins[MAX_PANDA_PLUGINS];
 bool panda_plugin_to_unload = false;
 
 bool panda_please_flush_tb = false;
-bool panda_please_break_exec = false;
 bool panda_update_pc = false;
 bool panda_use_memcb = false;
 bool panda_tb_chaining = true;
@@ -213,7 +210,96 @@ static void do_check_export_symbols(panda_plugin *panda_plugin, const char *file
     g_free(export_symbol);
 }
 
+/*
+ * Plugin init/uninit may register callbacks and require other plugins,
+ * so exclusive sections nest. The main loop (or a library-mode caller)
+ * pauses the vCPUs; a vCPU thread must already be in safe work, where
+ * every vCPU is out of cpu_exec, and otherwise defers through
+ * async_safe_run_on_cpu.
+ */
+static thread_local int panda_exclusive_depth;
+static thread_local bool panda_exclusive_paused;
+static thread_local bool panda_exclusive_took_bql;
+
+static void panda_plugins_begin_exclusive(void)
+{
+    if (panda_exclusive_depth++ > 0) {
+        return;
+    }
+    if (current_cpu != NULL) {
+        assert(cpu_in_exclusive_context(current_cpu));
+        return;
+    }
+    if (first_cpu == NULL) {
+        return;
+    }
+    panda_exclusive_took_bql = !bql_locked();
+    if (panda_exclusive_took_bql) {
+        bql_lock();
+    }
+    pause_all_vcpus();
+    panda_exclusive_paused = true;
+}
+
+static void panda_plugins_end_exclusive(void)
+{
+    assert(panda_exclusive_depth > 0);
+    if (--panda_exclusive_depth > 0 || !panda_exclusive_paused) {
+        return;
+    }
+    panda_exclusive_paused = false;
+    resume_all_vcpus();
+    if (panda_exclusive_took_bql) {
+        bql_unlock();
+    }
+}
+
+static bool _panda_load_plugin_locked(const char *filename, const char *plugin_name, bool library_mode);
+
+typedef struct PandaDeferredLoad {
+    char *filename;
+    char *plugin_name;
+    bool library_mode;
+} PandaDeferredLoad;
+
+static void panda_do_deferred_load(CPUState *cpu, run_on_cpu_data data)
+{
+    PandaDeferredLoad *load = data.host_ptr;
+
+    panda_plugins_begin_exclusive();
+    if (!_panda_load_plugin_locked(load->filename, load->plugin_name,
+                                   load->library_mode)) {
+        LOG_ERROR(PANDA_MSG_FMT "Deferred load of %s failed\n",
+                  PANDA_CORE_NAME, load->plugin_name);
+    }
+    panda_plugins_end_exclusive();
+    g_free(load->filename);
+    g_free(load->plugin_name);
+    g_free(load);
+}
+
 static bool _panda_load_plugin(const char *filename, const char *plugin_name, bool library_mode) {
+    bool ret;
+
+    // From a callback inside cpu_exec: load once every vCPU is out
+    if (panda_exclusive_depth == 0 && current_cpu != NULL &&
+        !cpu_in_exclusive_context(current_cpu)) {
+        PandaDeferredLoad *load = g_new(PandaDeferredLoad, 1);
+
+        load->filename = g_strdup(filename);
+        load->plugin_name = g_strdup(plugin_name);
+        load->library_mode = library_mode;
+        async_safe_run_on_cpu(current_cpu, panda_do_deferred_load,
+                              RUN_ON_CPU_HOST_PTR(load));
+        return true;
+    }
+    panda_plugins_begin_exclusive();
+    ret = _panda_load_plugin_locked(filename, plugin_name, library_mode);
+    panda_plugins_end_exclusive();
+    return ret;
+}
+
+static bool _panda_load_plugin_locked(const char *filename, const char *plugin_name, bool library_mode) {
 
     // static bool libpanda_loaded = false;
 
@@ -451,8 +537,27 @@ void panda_require(const char *plugin_name) {
     _panda_require(plugin_name, NULL, 0, false);
 }
 
+typedef struct PandaDlclose {
+    struct rcu_head rcu;
+    void *plugin;
+    bool exported_symbols;
+} PandaDlclose;
+
+static void panda_dlclose_rcu(PandaDlclose *d)
+{
+    dlclose(d->plugin);
+    if (d->exported_symbols) {
+        // This plugin was dlopened twice.  dlclose it twice to fully unload it.
+        dlclose(d->plugin);
+    }
+    g_free(d);
+}
+
 void panda_do_unload_plugin(int plugin_idx)
 {
+    PandaDlclose *d = g_new0(PandaDlclose, 1);
+
+    panda_plugins_begin_exclusive();
     void *plugin = panda_plugins[plugin_idx].plugin;
     void (*uninit_fn)(void *) = dlsym(plugin, "uninit_plugin");
     if (!uninit_fn) {
@@ -462,7 +567,35 @@ void panda_do_unload_plugin(int plugin_idx)
         uninit_fn(plugin);
     }
     panda_unregister_callbacks(plugin);
-    dlclose_plugin(plugin_idx);
+    panda_ppp_forget_plugin(plugin);
+    d->plugin = plugin;
+    d->exported_symbols = panda_plugins[plugin_idx].exported_symbols;
+    panda_delete_plugin(plugin_idx);
+    panda_plugins_end_exclusive();
+
+    // Dispatchers outside cpu_exec may still be running this plugin's
+    // code from the old tables; unmap it once they are done.
+    call_rcu(d, panda_dlclose_rcu, rcu);
+}
+
+/* Unload everything marked by panda_unload_plugin_idx(). */
+static void panda_do_pending_unloads(CPUState *cpu, run_on_cpu_data data)
+{
+    if (!qatomic_xchg(&panda_plugin_to_unload, false)) {
+        return;
+    }
+    for (int i = 0; i < nb_panda_plugins;) {
+        if (panda_plugins[i].unload) {
+            panda_do_unload_plugin(i);
+        } else {
+            i++;
+        }
+    }
+}
+
+static void panda_do_pending_unloads_bh(void *opaque)
+{
+    panda_do_pending_unloads(NULL, RUN_ON_CPU_NULL);
 }
 
 void panda_unload_plugin(void *plugin)
@@ -490,8 +623,20 @@ void panda_unload_plugin_idx(int plugin_idx)
     if (plugin_idx >= nb_panda_plugins || plugin_idx < 0) {
         return;
     }
-    panda_plugin_to_unload = true;
     panda_plugins[plugin_idx].unload = true;
+    if (qatomic_xchg(&panda_plugin_to_unload, true)) {
+        return; // already scheduled
+    }
+    // The plugin may be unloading itself from one of its callbacks, so
+    // defer until its code is off the stack: on a vCPU until every vCPU is
+    // out of cpu_exec, elsewhere until the main loop runs again.
+    if (current_cpu != NULL) {
+        async_safe_run_on_cpu(current_cpu, panda_do_pending_unloads,
+                              RUN_ON_CPU_NULL);
+    } else {
+        aio_bh_schedule_oneshot(qemu_get_aio_context(),
+                                panda_do_pending_unloads_bh, NULL);
+    }
 }
 
 void panda_unload_plugins(void)
@@ -501,6 +646,8 @@ void panda_unload_plugins(void)
     while (nb_panda_plugins > 0) {
         panda_do_unload_plugin(nb_panda_plugins - 1);
     }
+    // A library-mode caller may load the same plugins again right away
+    drain_call_rcu();
 }
 
 void *panda_get_plugin_by_name(const char *plugin_name)
@@ -514,11 +661,10 @@ void *panda_get_plugin_by_name(const char *plugin_name)
 
 #define CASE_CB_TRAMPOLINE(kind,name) \
     case PANDA_CB_ ## kind: \
-        trampoline_cb. name = panda_cb_trampoline_ ## name; \
+        trampoline_cb-> name = panda_cb_trampoline_ ## name; \
         break;
 
-panda_cb_with_context panda_get_cb_trampoline(panda_cb_type type) {
-    panda_cb_with_context trampoline_cb;
+bool panda_lookup_cb_trampoline(panda_cb_type type, panda_cb_with_context *trampoline_cb) {
     switch (type) {
         CASE_CB_TRAMPOLINE(BEFORE_BLOCK_TRANSLATE,before_block_translate)
         CASE_CB_TRAMPOLINE(AFTER_BLOCK_TRANSLATE,after_block_translate)
@@ -573,317 +719,247 @@ panda_cb_with_context panda_get_cb_trampoline(panda_cb_type type) {
         CASE_CB_TRAMPOLINE(BEFORE_HANDLE_INTERRUPT,before_handle_interrupt)
         CASE_CB_TRAMPOLINE(START_BLOCK_EXEC,start_block_exec)
         CASE_CB_TRAMPOLINE(END_BLOCK_EXEC,end_block_exec)
+        CASE_CB_TRAMPOLINE(MEM_BATCH,mem_batch)
 
-        default: assert(false);
+        default: return false;
     }
 
-    return trampoline_cb;
-}
-
-/**
- * @brief Adds callback to the tail of the callback list and enables it.
- *
- * The order of callback registration will determine the order in which
- * callbacks of the same type will be invoked.
- *
- * @note Registering a callback function twice from the same plugin will trigger
- * an assertion error.
- */
-void panda_register_callback(void *plugin, panda_cb_type type, panda_cb cb)
-{
-    panda_cb_with_context trampoline = panda_get_cb_trampoline(type);
-    panda_cb* cb_context = malloc(sizeof(panda_cb));
-    *cb_context = cb;
-
-    panda_register_callback_with_context(plugin, type, trampoline, cb_context);
+    return true;
 }
 
-/**
- * @brief Adds callback to the tail of the callback list and enables it.
- *
- * The order of callback registration will determine the order in which
- * callbacks of the same type will be invoked. Each callback will recieve the
- * context variable it was passed.
- *
- * @note Registering a callback function twice from the same plugin will trigger
- * an assertion error.
- */
-void panda_register_callback_with_context(void *plugin, panda_cb_type type, panda_cb_with_context cb, void* context)
+/* Name of the plugin whose handle is @owner, for profiling output */
+const char *panda_cb_owner_name(void *owner)
 {
-    panda_cb_list *plist_last = NULL;
-
-    panda_cb_list *new_list = g_new0(panda_cb_list, 1);
-    new_list->entry = cb;
-    new_list->owner = plugin;
-    new_list->enabled = true;
-    new_list->context = context;
-    assert(type < PANDA_CB_LAST);
-
-    if (panda_cbs[type] != NULL) {
-        for (panda_cb_list *plist = panda_cbs[type]; plist != NULL;
-             plist = plist->next) {
-            // the same plugin can register the same callback function only once
-            assert(!(plist->owner == plugin &&
-                     (plist->entry.cbaddr) == cb.cbaddr &&
-                     plist->context == context));
-            plist_last = plist;
+    for (int i = 0; i < nb_panda_plugins; i++) {
+        if (panda_plugins[i].plugin == owner) {
+            return panda_plugins[i].name;
         }
-        plist_last->next = new_list;
-        new_list->prev = plist_last;
-    } else {
-        panda_cbs[type] = new_list;
     }
+    return "(unknown)";
 }
 
-/**
- * @brief Determine if the specified callback is enabled
+/*
+ * Per-vCPU views of the scoped tables.
  *
- * @note Querying an unregistered callback returns false
+ * A vCPU keeps the views of the last PANDA_CB_VIEWS ASIDs it ran in a
+ * list, most recently used first; cpu->panda_cb_view is the head. A view
+ * is only ever used by the vCPU that owns it, but it is freed after a
+ * grace period all the same: a callback may register another one while
+ * its vCPU is still iterating over the view.
  */
-bool panda_is_callback_enabled(void *plugin, panda_cb_type type, panda_cb cb) {
-    assert(type < PANDA_CB_LAST);
-    if (panda_cbs[type] != NULL) {
-        for (panda_cb_list *plist = panda_cbs[type]; plist != NULL; plist = plist->next) {
-            if (plist->owner == plugin && (plist->entry.cbaddr) == cb.cbaddr) {
-                return plist->enabled;
-            }
+#define PANDA_CB_VIEWS 8
+
+typedef struct PandaCbView {
+    struct rcu_head rcu;
+    struct PandaCbView *next;
+    target_ulong asid;
+    panda_cb_table *src[PANDA_CB_LAST];       /* published table it came from */
+    panda_cb_table *tables[PANDA_CB_LAST][2]; /* [type][in kernel mode] */
+    bool split[PANDA_CB_LAST];                /* tables[type][] differ */
+} PandaCbView;
+
+static void panda_cb_view_free(PandaCbView *v)
+{
+    for (int i = 0; i < PANDA_CB_LAST; i++) {
+        if (v->tables[i][1] != v->tables[i][0]) {
+            g_free(v->tables[i][1]);
         }
+        g_free(v->tables[i][0]);
     }
-    return false;
-}
-
-#define TRAMP_CTXT(context) \
-    (*(panda_cb*)context).cbaddr
-
-/**
- * @brief Disables the execution of the specified callback.
- *
- * This is done by setting the `enabled` flag to `false`. The callback remains
- * in the callback list, so when it is enabled again it will execute in the same
- * relative order.
- *
- * @note Disabling an unregistered callback will trigger an assertion error.
- */
-void panda_disable_callback(void *plugin, panda_cb_type type, panda_cb cb) {
-    panda_cb_with_context trampoline = panda_get_cb_trampoline(type);
-    panda_disable_callback_with_context(plugin, type, trampoline, &cb);
+    g_free(v);
 }
 
-/**
- * @brief Disables the execution of the specified callback.
- *
- * This is done by setting the `enabled` flag to `false`. The callback remains
- * in the callback list, so when it is enabled again it will execute in the same
- * relative order.
- *
- * @note Disabling an unregistered callback will trigger an assertion error.
- */
-void panda_disable_callback_with_context(void *plugin, panda_cb_type type, panda_cb_with_context cb, void* context)
+static bool panda_cb_entry_in_scope(const panda_cb_meta *m, target_ulong asid,
+                                    int kernel)
 {
-    bool found = false;
-    assert(type < PANDA_CB_LAST);
-    if (panda_cbs[type] != NULL) {
-        panda_cb_with_context trampoline = panda_get_cb_trampoline(type);
-        for (panda_cb_list *plist = panda_cbs[type]; plist != NULL;
-             plist = plist->next) {
-            if (plist->owner == plugin &&
-                ((((plist->entry.cbaddr) == cb.cbaddr) && plist->context == context) ||
-                 (
-                     // if and only if it's a trampoline, it's safe to dereference the
-                     // context in order to do an equality check
-                     plist->entry.cbaddr == trampoline.cbaddr
-                     && TRAMP_CTXT(context) == TRAMP_CTXT(plist->context)
-                ))
-            ) {
-                found = true;
-                plist->enabled = false;
-
-                // break out of the loop - the same plugin can register the same
-                // callback only once
-                break;
-            }
-        }
+    if (m->asids && !panda_addr_filter_match(m->asids, asid)) {
+        return false;
+    }
+    switch (m->mode) {
+    case PANDA_CB_MODE_KERNEL:
+        return kernel != 0;
+    case PANDA_CB_MODE_USER:
+        return kernel != 1;
+    default:
+        return true;
     }
-    // no callback found to disable
-    assert(found);
-}
-
-/**
- * @brief Enables the execution of the specified callback.
- *
- * This is done by setting the `enabled` flag to `true`. After enabling the
- * callback, it will execute in the same relative order as before having it
- * disabled.
- *
- * @note Enabling an unregistered callback will trigger an assertion error.
- */
-void panda_enable_callback(void *plugin, panda_cb_type type, panda_cb cb) {
-    panda_cb_with_context trampoline = panda_get_cb_trampoline(type);
-    panda_enable_callback_with_context(plugin, type, trampoline, &cb);
 }
 
-/**
- * @brief Enables the execution of the specified callback.
- *
- * This is done by setting the `enabled` flag to `true`. After enabling the
- * callback, it will execute in the same relative order as before having it
- * disabled.
- *
- * @note Enabling an unregistered callback will trigger an assertion error.
+/*
+ * Entries of @src in scope for @asid and privilege level @kernel (-1 for
+ * either); NULL if there are none.
  */
-void panda_enable_callback_with_context(void *plugin, panda_cb_type type, panda_cb_with_context cb, void* context)
+static panda_cb_table *panda_cb_table_select(const panda_cb_table *src,
+                                             target_ulong asid, int kernel)
 {
-    bool found = false;
-    if (panda_cbs[type] != NULL) {
-        panda_cb_with_context trampoline = panda_get_cb_trampoline(type);
-        for (panda_cb_list *plist = panda_cbs[type]; plist != NULL; plist = plist->next)
-        {
-            if (plist->owner == plugin && ((
-                    (plist->entry.cbaddr) == cb.cbaddr && plist->context == context
-                ) ||
-                (
-                    // if and only if it's a trampoline, it's safe to dereference the
-                    // context in order to do an equality check
-                    plist->entry.cbaddr == trampoline.cbaddr
-                        && TRAMP_CTXT(plist->context) == TRAMP_CTXT(context)
-                ))
-            ) {
-                found = true;
-                plist->enabled = true;
-
-                // break out of the loop - the same plugin can register the same
-                // callback only once
-                break;
-            }
+    panda_cb_table *tbl;
+    size_t n = 0;
+
+    for (size_t i = 0; i < src->n; i++) {
+        n += panda_cb_entry_in_scope(&src->meta[i], asid, kernel);
+    }
+    if (n == 0) {
+        return NULL;
+    }
+    tbl = panda_cb_table_new(n);
+    for (size_t i = 0; i < src->n; i++) {
+        if (panda_cb_entry_in_scope(&src->meta[i], asid, kernel)) {
+            tbl->meta[tbl->n] = src->meta[i];
+            tbl->entries[tbl->n++] = src->entries[i];
         }
     }
-    // no callback found to enable
-    assert(found);
+    return tbl;
 }
 
-/**
- * @brief Unregisters all callbacks owned by this plugin.
- *
- * The register callbacks are removed from their respective callback lists.
- * This means that if they are registered again, their execution order may be
- * different.
- */
-void panda_unregister_callbacks(void *plugin)
+static bool panda_cb_view_stale(const PandaCbView *v)
 {
     for (int i = 0; i < PANDA_CB_LAST; i++) {
-        panda_cb_list *plist;
-        plist = panda_cbs[i];
-        panda_cb_list *plist_head = plist;
-        while (plist != NULL) {
-            panda_cb_list *plist_next = plist->next;
-            if (plist->owner == plugin) {
-                // delete this entry -- it belongs to our plugin
-                panda_cb_list *del_plist = plist;
-                if (plist->next == NULL && plist->prev == NULL) {
-                    // its the only thing in the list -- list is now empty
-                    plist_head = NULL;
-                } else {
-                    // Unlink this entry
-                    if (plist->prev)
-                        plist->prev->next = plist->next;
-                    if (plist->next)
-                        plist->next->prev = plist->prev;
-                    // new head
-                    if (plist == plist_head)
-                        plist_head = plist->next;
-                }
-                // Free the entry we just unlinked
-                g_free(del_plist);
-            }
-            plist = plist_next;
+        panda_cb_table *tbl = qatomic_rcu_read(&panda_cb_tables[i]);
+
+        if (v->src[i] != (tbl && tbl->scoped ? tbl : NULL)) {
+            return true;
         }
-        // update head
-        panda_cbs[i] = plist_head;
     }
+    return false;
 }
 
-/**
- * @brief Enables the specified plugin.
- *
- * This works by enabling all the callbacks previously registered by
- * the plugin. This means that when execution order of the callbacks
- * is preserved.
- */
-void panda_enable_plugin(void *plugin)
+static PandaCbView *panda_cb_view_new(target_ulong asid)
 {
+    PandaCbView *v = g_new0(PandaCbView, 1);
+
+    v->asid = asid;
     for (int i = 0; i < PANDA_CB_LAST; i++) {
-        panda_cb_list *plist;
-        plist = panda_cbs[i];
-        while (plist != NULL) {
-            if (plist->owner == plugin) {
-                plist->enabled = true;
+        panda_cb_table *tbl = qatomic_rcu_read(&panda_cb_tables[i]);
+
+        if (!tbl || !tbl->scoped) {
+            continue;
+        }
+        v->src[i] = tbl;
+        for (size_t j = 0; j < tbl->n; j++) {
+            const panda_cb_meta *m = &tbl->meta[j];
+            if (m->mode != PANDA_CB_MODE_ANY &&
+                (!m->asids || panda_addr_filter_match(m->asids, asid))) {
+                v->split[i] = true;
+                break;
             }
-            plist = plist->next;
+        }
+        if (v->split[i]) {
+            v->tables[i][0] = panda_cb_table_select(tbl, asid, 0);
+            v->tables[i][1] = panda_cb_table_select(tbl, asid, 1);
+        } else {
+            v->tables[i][0] = panda_cb_table_select(tbl, asid, -1);
+            v->tables[i][1] = v->tables[i][0];
         }
     }
+    return v;
 }
 
-/**
- * @brief Disables the specified plugin.
- *
- * This works by disabling all the callbacks registered by the plugin.
- * This means that when the plugin is re-enabled, the callback order
- * is preserved.
- */
-void panda_disable_plugin(void *plugin)
+static PandaCbView *panda_cb_view_update(CPUState *cpu)
 {
-    for (int i = 0; i < PANDA_CB_LAST; i++) {
-        panda_cb_list *plist;
-        plist = panda_cbs[i];
-        while (plist != NULL) {
-            if (plist->owner == plugin) {
-                plist->enabled = false;
-            }
-            plist = plist->next;
+    target_ulong asid = panda_current_asid(cpu);
+    PandaCbView **link = &cpu->panda_cb_view, **last = NULL;
+    PandaCbView *v = NULL;
+    int n = 0;
+
+    cpu->panda_cb_asid_dirty = false;
+    for (PandaCbView *it = *link; it; it = *link) {
+        if (it->asid == asid) {
+            *link = it->next;
+            v = it;
+            break;
         }
+        n++;
+        last = link;
+        link = &it->next;
+    }
+    if (v == NULL && n == PANDA_CB_VIEWS) {
+        /* Make room for @asid's view by dropping the least recent one */
+        call_rcu(*last, panda_cb_view_free, rcu);
+        *last = NULL;
     }
+
+    if (v && panda_cb_view_stale(v)) {
+        call_rcu(v, panda_cb_view_free, rcu);
+        v = NULL;
+    }
+    if (v == NULL) {
+        v = panda_cb_view_new(asid);
+    }
+    v->next = cpu->panda_cb_view;
+    cpu->panda_cb_view = v;
+    return v;
 }
 
-/**
- * @brief Allows to navigate the callback linked list skipping disabled
- * callbacks.
- */
-panda_cb_list *panda_cb_list_next(panda_cb_list *plist)
+panda_cb_table *panda_cb_table_scoped(panda_cb_type type, panda_cb_table *tbl)
 {
-    for (panda_cb_list *node = plist->next; node != NULL;
-         node = node->next) {
-        if (!node || node->enabled)
-            return node;
+    CPUState *cpu = current_cpu;
+    PandaCbView *v;
+
+    if (cpu == NULL) {
+        return tbl;
+    }
+    v = cpu->panda_cb_view;
+    if (unlikely(v == NULL || cpu->panda_cb_asid_dirty || v->src[type] != tbl)) {
+        v = panda_cb_view_update(cpu);
+        if (v->src[type] == NULL) {
+            /* @type lost its last scope since the caller looked */
+            return qatomic_rcu_read(&panda_cb_tables[type]);
+        }
     }
-    return NULL;
+    return v->tables[type][v->split[type] && panda_in_kernel_mode(cpu)];
 }
 
+/**
+ * @brief Asks the calling vCPU to stop executing the current TB.
+ *
+ * Checked at the end of start_block_exec dispatch, so a plugin can change
+ * the PC from a start_block_exec callback and have it take effect at once.
+ * Outside a vCPU thread, the request goes to every vCPU.
+ */
 void panda_do_break_exec(void) {
-  panda_please_break_exec = true;
-}
-
-bool panda_break_exec(void) {
-    if (panda_please_break_exec) {
-        panda_please_break_exec = false;
-        return true;
+    if (current_cpu) {
+        qatomic_set(&current_cpu->panda_break_exec, true);
     } else {
-        return false;
+        CPUState *cpu;
+        CPU_FOREACH(cpu) {
+            qatomic_set(&cpu->panda_break_exec, true);
+        }
     }
+}
 
+bool panda_break_exec(void) {
+    return current_cpu && qatomic_read(&current_cpu->panda_break_exec) &&
+           qatomic_xchg(&current_cpu->panda_break_exec, false);
 }
 
+/* True while a flush requested by panda_do_flush_tb() is pending. */
 bool panda_flush_tb(void)
 {
-    if (panda_please_flush_tb) {
-        panda_please_flush_tb = false;
-        return true;
-    } else
-        return false;
+    return qatomic_read(&panda_please_flush_tb);
 }
 
+static void panda_do_flush_tb_work(CPUState *cpu, run_on_cpu_data data)
+{
+    qatomic_set(&panda_please_flush_tb, false);
+    tb_flush__exclusive_or_serial();
+}
+
+/**
+ * @brief Requests that all translated code be thrown away.
+ *
+ * The flush runs once all vCPUs have left cpu_exec; requests made while
+ * one is pending are merged.
+ */
 void panda_do_flush_tb(void)
 {
-    panda_please_flush_tb = true;
+    if (!tcg_enabled() || first_cpu == NULL) {
+        return; // nothing translated yet
+    }
+    if (qatomic_xchg(&panda_please_flush_tb, true)) {
+        return;
+    }
+    async_safe_run_on_cpu(current_cpu ? current_cpu : first_cpu,
+                          panda_do_flush_tb_work, RUN_ON_CPU_NULL);
 }
 
 void panda_enable_precise_pc(void)
@@ -971,26 +1047,6 @@ uintptr_t panda_get_current_llvm_module(void) {
 #endif
 
 #ifdef DO_LATER
-void panda_memsavep(FILE *f) {
-#ifdef CONFIG_SOFTMMU
-    if (!f) return;
-    uint8_t mem_buf[TARGET_PAGE_SIZE];
-    uint8_t zero_buf[TARGET_PAGE_SIZE];
-    memset(zero_buf, 0, TARGET_PAGE_SIZE);
-    int res;
-    ram_addr_t addr;
-    for (addr = 0; addr < ram_size; addr += TARGET_PAGE_SIZE) {
-        res = panda_physical_memory_rw(addr, mem_buf, TARGET_PAGE_SIZE, 0);
-        if (res == -1) { // I/O. Just fill page with zeroes.
-            fwrite(zero_buf, TARGET_PAGE_SIZE, 1, f);
-        }
-        else {
-            fwrite(mem_buf, TARGET_PAGE_SIZE, 1, f);
-        }
-    }
-#endif
-}
-
 /**
  * @brief Stop and then quit the PANDA VM. Wraps QMP functions for plugins,
  * without having them to pull QMP headers.
@@ -1548,13 +1604,8 @@ void hmp_panda_list_plugins(Monitor *mon, const QDict *qdict) {
 }
 
 void hmp_panda_plugin_cmd(Monitor *mon, const QDict *qdict) {
-    panda_cb_list *plist;
     const char *cmd = qdict_get_try_str(qdict, "cmd");
-    for(plist = panda_cbs[PANDA_CB_MONITOR]; plist != NULL; plist = panda_cb_list_next(plist)) {
-        if (plist->enabled){
-            plist->entry.monitor(plist->context, mon, cmd);
-        }
-    }
+    panda_callbacks_monitor(mon, cmd);
 }
 
 #endif // CONFIG_SOFTMMU
@@ -0,0 +1,202 @@
+/* PANDABEGINCOMMENT
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+/*
+ * Callback profiling; see include/panda/cb-profile.h.
+ *
+ * Counters live in one block per thread that ever dispatched a callback
+ * with profiling on. Only the owning thread writes its block, with
+ * plain read-modify-write and atomic stores so that readers on other
+ * threads never see torn values. Blocks are never freed: a thread that
+ * exits leaves its counts behind for the totals.
+ *
+ * Once profiling has been on, the table is printed to stderr at exit.
+ */
+#include "qemu/osdep.h"
+#include "qemu/lockable.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qemu/notify.h"
+#include "system/system.h"
+#include "panda/cb-profile.h"
+
+typedef struct PandaCbCounters {
+    struct PandaCbCounters *next;
+    uint64_t calls[PANDA_CB_PROFILE_MAX_SITES];
+    uint64_t ns[PANDA_CB_PROFILE_MAX_SITES];
+} PandaCbCounters;
+
+typedef struct PandaCbSite {
+    char *plugin;
+    char *cb;
+} PandaCbSite;
+
+bool panda_cb_profiling = false;
+
+static QemuMutex panda_cb_profile_lock;
+static GHashTable *panda_cb_profile_ids;    /* "plugin\ncb" -> site + 1 */
+static PandaCbSite panda_cb_sites[PANDA_CB_PROFILE_MAX_SITES] = {
+    [0] = { (char *)"(other)", (char *)"(other)" },
+};
+static uint32_t panda_cb_nb_sites = 1;
+static PandaCbCounters *panda_cb_counters;  /* all threads' blocks */
+static __thread PandaCbCounters *panda_cb_counters_local;
+
+static void __attribute__((__constructor__)) panda_cb_profile_lock_init(void)
+{
+    qemu_mutex_init(&panda_cb_profile_lock);
+}
+
+static void panda_cb_profile_exit(Notifier *n, void *data)
+{
+    g_autoptr(GString) buf = g_string_new("");
+
+    panda_cb_profile_dump(buf);
+    fputs(buf->str, stderr);
+}
+
+static Notifier panda_cb_profile_exit_notifier = {
+    .notify = panda_cb_profile_exit,
+};
+
+void panda_cb_profile_set(bool on)
+{
+    static bool exit_registered;
+
+    if (on && !qatomic_xchg(&exit_registered, true)) {
+        qemu_add_exit_notifier(&panda_cb_profile_exit_notifier);
+    }
+    qatomic_set(&panda_cb_profiling, on);
+}
+
+void panda_cb_profile_reset(void)
+{
+    QEMU_LOCK_GUARD(&panda_cb_profile_lock);
+    for (PandaCbCounters *c = panda_cb_counters; c; c = c->next) {
+        for (uint32_t i = 0; i < PANDA_CB_PROFILE_MAX_SITES; i++) {
+            qatomic_set(&c->calls[i], 0);
+            qatomic_set(&c->ns[i], 0);
+        }
+    }
+}
+
+uint32_t panda_cb_profile_site(const char *plugin, const char *cb)
+{
+    g_autofree char *key = g_strdup_printf("%s\n%s", plugin, cb);
+    uint32_t site;
+
+    QEMU_LOCK_GUARD(&panda_cb_profile_lock);
+    if (!panda_cb_profile_ids) {
+        panda_cb_profile_ids = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                     g_free, NULL);
+    }
+    site = GPOINTER_TO_UINT(g_hash_table_lookup(panda_cb_profile_ids, key));
+    if (site) {
+        return site - 1;
+    }
+    if (panda_cb_nb_sites == PANDA_CB_PROFILE_MAX_SITES) {
+        return 0;
+    }
+    site = panda_cb_nb_sites;
+    panda_cb_sites[site].plugin = g_strdup(plugin);
+    panda_cb_sites[site].cb = g_strdup(cb);
+    qatomic_store_release(&panda_cb_nb_sites, site + 1);
+    g_hash_table_insert(panda_cb_profile_ids, g_steal_pointer(&key),
+                        GUINT_TO_POINTER(site + 1));
+    return site;
+}
+
+int64_t panda_cb_profile_start(void)
+{
+    return get_clock();
+}
+
+static PandaCbCounters *panda_cb_counters_new(void)
+{
+    PandaCbCounters *c = g_new0(PandaCbCounters, 1);
+
+    QEMU_LOCK_GUARD(&panda_cb_profile_lock);
+    c->next = panda_cb_counters;
+    qatomic_store_release(&panda_cb_counters, c);
+    panda_cb_counters_local = c;
+    return c;
+}
+
+void panda_cb_profile_stop(uint32_t site, int64_t start)
+{
+    PandaCbCounters *c = panda_cb_counters_local;
+    int64_t ns = get_clock() - start;
+
+    if (unlikely(!c)) {
+        c = panda_cb_counters_new();
+    }
+    qatomic_set(&c->calls[site], c->calls[site] + 1);
+    qatomic_set(&c->ns[site], c->ns[site] + ns);
+}
+
+void panda_cb_profile_totals(uint32_t site, uint64_t *calls, uint64_t *ns)
+{
+    PandaCbCounters *c = qatomic_load_acquire(&panda_cb_counters);
+
+    *calls = 0;
+    *ns = 0;
+    /* The list only ever grows at the head, so walking it is safe. */
+    for (; c; c = c->next) {
+        *calls += qatomic_read(&c->calls[site]);
+        *ns += qatomic_read(&c->ns[site]);
+    }
+}
+
+typedef struct PandaCbTotal {
+    uint32_t site;
+    uint64_t calls;
+    uint64_t ns;
+} PandaCbTotal;
+
+static gint panda_cb_total_cmp(gconstpointer a, gconstpointer b)
+{
+    const PandaCbTotal *x = a, *y = b;
+
+    return x->ns < y->ns ? 1 : x->ns > y->ns ? -1 : 0;
+}
+
+void panda_cb_profile_dump(GString *buf)
+{
+    g_autoptr(GArray) totals = g_array_new(false, false, sizeof(PandaCbTotal));
+    uint32_t n = qatomic_load_acquire(&panda_cb_nb_sites);
+    uint64_t all_ns = 0;
+
+    for (uint32_t i = 0; i < n; i++) {
+        PandaCbTotal t = { .site = i };
+
+        panda_cb_profile_totals(i, &t.calls, &t.ns);
+        if (t.calls) {
+            g_array_append_val(totals, t);
+            all_ns += t.ns;
+        }
+    }
+    g_array_sort(totals, panda_cb_total_cmp);
+
+    g_string_append_printf(buf, "PANDA callback profiling is %s\n",
+                           qatomic_read(&panda_cb_profiling) ? "on" : "off");
+    if (totals->len == 0) {
+        return;
+    }
+    g_string_append_printf(buf, "%-24s %-32s %14s %16s %10s %6s\n",
+                           "plugin", "callback", "calls", "ns", "ns/call",
+                           "%");
+    for (guint i = 0; i < totals->len; i++) {
+        PandaCbTotal *t = &g_array_index(totals, PandaCbTotal, i);
+        PandaCbSite *s = &panda_cb_sites[t->site];
+
+        g_string_append_printf(buf, "%-24s %-32s %14" PRIu64 " %16" PRIu64
+                               " %10" PRIu64 " %5.1f%%\n",
+                               s->plugin, s->cb, t->calls, t->ns,
+                               t->ns / t->calls,
+                               all_ns ? 100.0 * t->ns / all_ns : 0.0);
+    }
+}
@@ -0,0 +1,669 @@
+/* PANDABEGINCOMMENT
+ *
+ * Authors:
+ *  Tim Leek               tleek@ll.mit.edu
+ *  Ryan Whelan            rwhelan@ll.mit.edu
+ *  Joshua Hodosh          josh.hodosh@ll.mit.edu
+ *  Michael Zhivich        mzhivich@ll.mit.edu
+ *  Brendan Dolan-Gavitt   brendandg@gatech.edu
+ *  Luke Craig             luke.craig@ll.mit.edu
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+/*
+ * Registering, enabling and scoping callbacks, and publishing the
+ * dispatch tables built from them; see include/panda/cb-register.h.
+ * Nothing here depends on the target, so unit tests can link it.
+ */
+#include "qemu/osdep.h"
+#include "qemu/lockable.h"
+#include "qemu/thread.h"
+#include "panda/cb-register.h"
+
+/*
+ * Locking: panda_cbs, panda_cb_tables and the per-callback filters are
+ * only modified with panda_cb_lock held. vCPU threads never take it; they
+ * read the RCU-published tables. Loading and unloading plugins, which
+ * also dlopen()s/dlclose()s code that vCPUs may be running, happens with
+ * all vCPUs outside cpu_exec (paused, or in async_safe_run_on_cpu work),
+ * and the code is only unmapped after an RCU grace period.
+ * Break requests are per vCPU; see CPUState::panda_break_exec.
+ */
+QemuRecMutex panda_cb_lock;
+
+static void __attribute__((__constructor__)) panda_cb_lock_init(void)
+{
+    qemu_rec_mutex_init(&panda_cb_lock);
+}
+
+// Array of pointers to PANDA callback lists, one per callback type
+panda_cb_list *panda_cbs[PANDA_CB_LAST];
+
+// Compiled dispatch tables, one per callback type. See cb-table.h.
+panda_cb_table *panda_cb_tables[PANDA_CB_LAST];
+
+panda_cb_with_context panda_get_cb_trampoline(panda_cb_type type) {
+    panda_cb_with_context trampoline_cb;
+    bool found = panda_lookup_cb_trampoline(type, &trampoline_cb);
+    assert(found);
+    return trampoline_cb;
+}
+
+/* Callback names, as in panda_cb, for profiling output */
+static const char *const panda_cb_names[PANDA_CB_LAST] = {
+    [PANDA_CB_BEFORE_BLOCK_TRANSLATE] = "before_block_translate",
+    [PANDA_CB_AFTER_BLOCK_TRANSLATE] = "after_block_translate",
+    [PANDA_CB_BLOCK_TRANSLATE] = "block_translate",
+    [PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT] = "before_block_exec_invalidate_opt",
+    [PANDA_CB_BEFORE_TCG_CODEGEN] = "before_tcg_codegen",
+    [PANDA_CB_BEFORE_BLOCK_EXEC] = "before_block_exec",
+    [PANDA_CB_AFTER_BLOCK_EXEC] = "after_block_exec",
+    [PANDA_CB_INSN_TRANSLATE] = "insn_translate",
+    [PANDA_CB_INSN_EXEC] = "insn_exec",
+    [PANDA_CB_AFTER_INSN_TRANSLATE] = "after_insn_translate",
+    [PANDA_CB_AFTER_INSN_EXEC] = "after_insn_exec",
+    [PANDA_CB_VIRT_MEM_BEFORE_READ] = "virt_mem_before_read",
+    [PANDA_CB_VIRT_MEM_BEFORE_WRITE] = "virt_mem_before_write",
+    [PANDA_CB_PHYS_MEM_BEFORE_READ] = "phys_mem_before_read",
+    [PANDA_CB_PHYS_MEM_BEFORE_WRITE] = "phys_mem_before_write",
+    [PANDA_CB_VIRT_MEM_AFTER_READ] = "virt_mem_after_read",
+    [PANDA_CB_VIRT_MEM_AFTER_WRITE] = "virt_mem_after_write",
+    [PANDA_CB_PHYS_MEM_AFTER_READ] = "phys_mem_after_read",
+    [PANDA_CB_PHYS_MEM_AFTER_WRITE] = "phys_mem_after_write",
+    [PANDA_CB_MMIO_AFTER_READ] = "mmio_after_read",
+    [PANDA_CB_MMIO_BEFORE_WRITE] = "mmio_before_write",
+    [PANDA_CB_HD_READ] = "hd_read",
+    [PANDA_CB_HD_WRITE] = "hd_write",
+    [PANDA_CB_GUEST_HYPERCALL] = "guest_hypercall",
+    [PANDA_CB_MONITOR] = "monitor",
+    [PANDA_CB_QMP] = "qmp",
+    [PANDA_CB_CPU_RESTORE_STATE] = "cpu_restore_state",
+    [PANDA_CB_BEFORE_LOADVM] = "before_loadvm",
+    [PANDA_CB_ASID_CHANGED] = "asid_changed",
+    [PANDA_CB_REPLAY_HD_TRANSFER] = "replay_hd_transfer",
+    [PANDA_CB_REPLAY_NET_TRANSFER] = "replay_net_transfer",
+    [PANDA_CB_REPLAY_SERIAL_RECEIVE] = "replay_serial_receive",
+    [PANDA_CB_REPLAY_SERIAL_READ] = "replay_serial_read",
+    [PANDA_CB_REPLAY_SERIAL_SEND] = "replay_serial_send",
+    [PANDA_CB_REPLAY_SERIAL_WRITE] = "replay_serial_write",
+    [PANDA_CB_REPLAY_BEFORE_DMA] = "replay_before_dma",
+    [PANDA_CB_REPLAY_AFTER_DMA] = "replay_after_dma",
+    [PANDA_CB_REPLAY_HANDLE_PACKET] = "replay_handle_packet",
+    [PANDA_CB_AFTER_CPU_EXEC_ENTER] = "after_cpu_exec_enter",
+    [PANDA_CB_BEFORE_CPU_EXEC_EXIT] = "before_cpu_exec_exit",
+    [PANDA_CB_AFTER_MACHINE_INIT] = "after_machine_init",
+    [PANDA_CB_AFTER_LOADVM] = "after_loadvm",
+    [PANDA_CB_TOP_LOOP] = "top_loop",
+    [PANDA_CB_DURING_MACHINE_INIT] = "during_machine_init",
+    [PANDA_CB_MAIN_LOOP_WAIT] = "main_loop_wait",
+    [PANDA_CB_PRE_SHUTDOWN] = "pre_shutdown",
+    [PANDA_CB_UNASSIGNED_IO_READ] = "unassigned_io_read",
+    [PANDA_CB_UNASSIGNED_IO_WRITE] = "unassigned_io_write",
+    [PANDA_CB_BEFORE_HANDLE_EXCEPTION] = "before_handle_exception",
+    [PANDA_CB_BEFORE_HANDLE_INTERRUPT] = "before_handle_interrupt",
+    [PANDA_CB_START_BLOCK_EXEC] = "start_block_exec",
+    [PANDA_CB_END_BLOCK_EXEC] = "end_block_exec",
+    [PANDA_CB_MEM_BATCH] = "mem_batch",
+};
+
+/**
+ * @brief Recompiles and publishes the dispatch table for a callback type.
+ *
+ * Must be called after any change to panda_cbs[type] or to the enabled flag
+ * of one of its entries. Callbacks registered through a trampoline are
+ * unwrapped so that dispatch calls the plugin function directly. The old
+ * table is freed once all RCU readers are done with it.
+ */
+static void panda_cb_table_rebuild(panda_cb_type type)
+{
+    panda_cb_with_context trampoline;
+    bool has_trampoline = panda_lookup_cb_trampoline(type, &trampoline);
+    panda_cb_table *old = panda_cb_tables[type];
+    panda_cb_table *tbl = NULL;
+    size_t n = 0;
+
+    for (panda_cb_list *plist = panda_cbs[type]; plist != NULL; plist = plist->next) {
+        if (plist->enabled) {
+            n++;
+        }
+    }
+
+    if (n != 0) {
+        tbl = panda_cb_table_new(n);
+        for (panda_cb_list *plist = panda_cbs[type]; plist != NULL; plist = plist->next) {
+            if (!plist->enabled) {
+                continue;
+            }
+            panda_cb_meta *m = &tbl->meta[tbl->n];
+            panda_cb_entry *e = &tbl->entries[tbl->n++];
+            m->filter = plist->filter;
+            m->asids = plist->asids;
+            m->mode = plist->mode;
+            if (plist->asids || plist->mode != PANDA_CB_MODE_ANY) {
+                tbl->scoped = true;
+            }
+            m->prof_site = panda_cb_profile_site(panda_cb_owner_name(plist->owner),
+                                                 panda_cb_names[type]);
+            if (has_trampoline && plist->entry.cbaddr == trampoline.cbaddr) {
+                e->cb = *(panda_cb *)plist->context;
+                e->context = PANDA_CB_DIRECT;
+            } else {
+                e->cb_with_context = plist->entry;
+                e->context = plist->context;
+            }
+        }
+    }
+
+    qatomic_rcu_set(&panda_cb_tables[type], tbl);
+    if (old) {
+        g_free_rcu(old, rcu);
+    }
+    if ((old == NULL) != (tbl == NULL)) {
+        panda_instr_subscribers_changed(type);
+    }
+    switch (type) {
+    case PANDA_CB_VIRT_MEM_AFTER_READ:
+    case PANDA_CB_VIRT_MEM_AFTER_WRITE:
+    case PANDA_CB_PHYS_MEM_AFTER_READ:
+    case PANDA_CB_PHYS_MEM_AFTER_WRITE:
+        panda_mem_filters_changed();
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief Adds callback to the tail of the callback list and enables it.
+ *
+ * The order of callback registration will determine the order in which
+ * callbacks of the same type will be invoked.
+ *
+ * @note Registering a callback function twice from the same plugin will trigger
+ * an assertion error.
+ */
+void panda_register_callback(void *plugin, panda_cb_type type, panda_cb cb)
+{
+    panda_cb_with_context trampoline = panda_get_cb_trampoline(type);
+    panda_cb* cb_context = g_new(panda_cb, 1);
+    *cb_context = cb;
+
+    panda_register_callback_with_context(plugin, type, trampoline, cb_context);
+}
+
+/**
+ * @brief Adds callback to the tail of the callback list and enables it.
+ *
+ * The order of callback registration will determine the order in which
+ * callbacks of the same type will be invoked. Each callback will recieve the
+ * context variable it was passed.
+ *
+ * @note Registering a callback function twice from the same plugin will trigger
+ * an assertion error.
+ */
+void panda_register_callback_with_context(void *plugin, panda_cb_type type, panda_cb_with_context cb, void* context)
+{
+    panda_register_callback_asids_with_context(plugin, type, cb, context,
+                                               NULL, 0, PANDA_CB_MODE_ANY);
+}
+
+static panda_addr_filter *panda_asid_filter_new(const uint64_t *asids, size_t n);
+
+/**
+ * @brief Registers a callback that only fires in the given address spaces.
+ *
+ * The callback is added to the tail of the list already scoped, so no vCPU
+ * ever sees it fire out of scope.
+ */
+void panda_register_callback_asids(void *plugin, panda_cb_type type, panda_cb cb,
+                                   const uint64_t *asids, size_t n,
+                                   panda_cb_mode mode)
+{
+    panda_cb_with_context trampoline = panda_get_cb_trampoline(type);
+    panda_cb* cb_context = g_new(panda_cb, 1);
+    *cb_context = cb;
+
+    panda_register_callback_asids_with_context(plugin, type, trampoline,
+                                               cb_context, asids, n, mode);
+}
+
+/**
+ * @brief Registers a callback that only fires in the given address spaces.
+ *
+ * Same as panda_register_callback_asids, but with context.
+ */
+void panda_register_callback_asids_with_context(void *plugin, panda_cb_type type,
+                                                panda_cb_with_context cb, void *context,
+                                                const uint64_t *asids, size_t n,
+                                                panda_cb_mode mode)
+{
+    QEMU_LOCK_GUARD(&panda_cb_lock);
+    panda_cb_list *plist_last = NULL;
+
+    panda_cb_list *new_list = g_new0(panda_cb_list, 1);
+    new_list->entry = cb;
+    new_list->owner = plugin;
+    new_list->enabled = true;
+    new_list->context = context;
+    new_list->asids = panda_asid_filter_new(asids, n);
+    new_list->mode = mode;
+    assert(type < PANDA_CB_LAST);
+
+    if (panda_cbs[type] != NULL) {
+        for (panda_cb_list *plist = panda_cbs[type]; plist != NULL;
+             plist = plist->next) {
+            // the same plugin can register the same callback function only once
+            assert(!(plist->owner == plugin &&
+                     (plist->entry.cbaddr) == cb.cbaddr &&
+                     plist->context == context));
+            plist_last = plist;
+        }
+        plist_last->next = new_list;
+        new_list->prev = plist_last;
+    } else {
+        panda_cbs[type] = new_list;
+    }
+    panda_cb_table_rebuild(type);
+}
+
+/**
+ * @brief Determine if the specified callback is enabled
+ *
+ * @note Querying an unregistered callback returns false
+ */
+bool panda_is_callback_enabled(void *plugin, panda_cb_type type, panda_cb cb) {
+    assert(type < PANDA_CB_LAST);
+    if (panda_cbs[type] != NULL) {
+        for (panda_cb_list *plist = panda_cbs[type]; plist != NULL; plist = plist->next) {
+            if (plist->owner == plugin && (plist->entry.cbaddr) == cb.cbaddr) {
+                return plist->enabled;
+            }
+        }
+    }
+    return false;
+}
+
+#define TRAMP_CTXT(context) \
+    (*(panda_cb*)context).cbaddr
+
+/**
+ * @brief Disables the execution of the specified callback.
+ *
+ * This is done by setting the `enabled` flag to `false`. The callback remains
+ * in the callback list, so when it is enabled again it will execute in the same
+ * relative order.
+ *
+ * @note Disabling an unregistered callback will trigger an assertion error.
+ */
+void panda_disable_callback(void *plugin, panda_cb_type type, panda_cb cb) {
+    panda_cb_with_context trampoline = panda_get_cb_trampoline(type);
+    panda_disable_callback_with_context(plugin, type, trampoline, &cb);
+}
+
+/**
+ * @brief Disables the execution of the specified callback.
+ *
+ * This is done by setting the `enabled` flag to `false`. The callback remains
+ * in the callback list, so when it is enabled again it will execute in the same
+ * relative order.
+ *
+ * @note Disabling an unregistered callback will trigger an assertion error.
+ */
+void panda_disable_callback_with_context(void *plugin, panda_cb_type type, panda_cb_with_context cb, void* context)
+{
+    QEMU_LOCK_GUARD(&panda_cb_lock);
+    bool found = false;
+    assert(type < PANDA_CB_LAST);
+    if (panda_cbs[type] != NULL) {
+        panda_cb_with_context trampoline = panda_get_cb_trampoline(type);
+        for (panda_cb_list *plist = panda_cbs[type]; plist != NULL;
+             plist = plist->next) {
+            if (plist->owner == plugin &&
+                ((((plist->entry.cbaddr) == cb.cbaddr) && plist->context == context) ||
+                 (
+                     // if and only if it's a trampoline, it's safe to dereference the
+                     // context in order to do an equality check
+                     plist->entry.cbaddr == trampoline.cbaddr
+                     && TRAMP_CTXT(context) == TRAMP_CTXT(plist->context)
+                ))
+            ) {
+                found = true;
+                plist->enabled = false;
+
+                // break out of the loop - the same plugin can register the same
+                // callback only once
+                break;
+            }
+        }
+    }
+    // no callback found to disable
+    assert(found);
+    panda_cb_table_rebuild(type);
+}
+
+/**
+ * @brief Enables the execution of the specified callback.
+ *
+ * This is done by setting the `enabled` flag to `true`. After enabling the
+ * callback, it will execute in the same relative order as before having it
+ * disabled.
+ *
+ * @note Enabling an unregistered callback will trigger an assertion error.
+ */
+void panda_enable_callback(void *plugin, panda_cb_type type, panda_cb cb) {
+    panda_cb_with_context trampoline = panda_get_cb_trampoline(type);
+    panda_enable_callback_with_context(plugin, type, trampoline, &cb);
+}
+
+/**
+ * @brief Enables the execution of the specified callback.
+ *
+ * This is done by setting the `enabled` flag to `true`. After enabling the
+ * callback, it will execute in the same relative order as before having it
+ * disabled.
+ *
+ * @note Enabling an unregistered callback will trigger an assertion error.
+ */
+void panda_enable_callback_with_context(void *plugin, panda_cb_type type, panda_cb_with_context cb, void* context)
+{
+    QEMU_LOCK_GUARD(&panda_cb_lock);
+    bool found = false;
+    if (panda_cbs[type] != NULL) {
+        panda_cb_with_context trampoline = panda_get_cb_trampoline(type);
+        for (panda_cb_list *plist = panda_cbs[type]; plist != NULL; plist = plist->next)
+        {
+            if (plist->owner == plugin && ((
+                    (plist->entry.cbaddr) == cb.cbaddr && plist->context == context
+                ) ||
+                (
+                    // if and only if it's a trampoline, it's safe to dereference the
+                    // context in order to do an equality check
+                    plist->entry.cbaddr == trampoline.cbaddr
+                        && TRAMP_CTXT(plist->context) == TRAMP_CTXT(context)
+                ))
+            ) {
+                found = true;
+                plist->enabled = true;
+
+                // break out of the loop - the same plugin can register the same
+                // callback only once
+                break;
+            }
+        }
+    }
+    // no callback found to enable
+    assert(found);
+    panda_cb_table_rebuild(type);
+}
+
+/**
+ * @brief Restricts a registered memory callback to the given address ranges.
+ *
+ * Passing no ranges removes the filter. The previous filter is released once
+ * no dispatcher can be using it any more.
+ *
+ * @note Filtering an unregistered callback will trigger an assertion error.
+ */
+void panda_set_callback_ranges(void *plugin, panda_cb_type type, panda_cb cb,
+                               const panda_addr_range *ranges, size_t n)
+{
+    panda_cb_with_context trampoline = panda_get_cb_trampoline(type);
+    panda_set_callback_ranges_with_context(plugin, type, trampoline, &cb,
+                                           ranges, n);
+}
+
+/**
+ * @brief Restricts a registered memory callback to the given address ranges.
+ *
+ * Same as panda_set_callback_ranges, but with context.
+ */
+void panda_set_callback_ranges_with_context(void *plugin, panda_cb_type type,
+                                            panda_cb_with_context cb, void *context,
+                                            const panda_addr_range *ranges, size_t n)
+{
+    QEMU_LOCK_GUARD(&panda_cb_lock);
+    panda_cb_with_context trampoline = panda_get_cb_trampoline(type);
+    bool found = false;
+
+    assert(type == PANDA_CB_VIRT_MEM_AFTER_READ ||
+           type == PANDA_CB_VIRT_MEM_AFTER_WRITE ||
+           type == PANDA_CB_PHYS_MEM_AFTER_READ ||
+           type == PANDA_CB_PHYS_MEM_AFTER_WRITE ||
+           type == PANDA_CB_INSN_EXEC);
+    for (panda_cb_list *plist = panda_cbs[type]; plist != NULL; plist = plist->next) {
+        if (plist->owner == plugin &&
+            (((plist->entry.cbaddr == cb.cbaddr) && plist->context == context) ||
+             (plist->entry.cbaddr == trampoline.cbaddr
+              && TRAMP_CTXT(context) == TRAMP_CTXT(plist->context)))) {
+            panda_addr_filter *old = plist->filter;
+
+            plist->filter = panda_addr_filter_new(ranges, n);
+            panda_cb_table_rebuild(type);
+            if (type == PANDA_CB_INSN_EXEC) {
+                panda_insn_filters_changed(old, plist->filter);
+            }
+            if (old) {
+                g_free_rcu(old, rcu);
+            }
+            found = true;
+            break;
+        }
+    }
+    assert(found);
+}
+
+/*
+ * ASIDs as one-element ranges, so that a scope is a panda_addr_filter.
+ * UINT64_MAX has no such range and sets top instead.
+ */
+static panda_addr_filter *panda_asid_filter_new(const uint64_t *asids, size_t n)
+{
+    g_autofree panda_addr_range *ranges = g_new(panda_addr_range, n);
+    panda_addr_filter *f;
+    size_t nranges = 0;
+    bool top = false;
+
+    for (size_t i = 0; i < n; i++) {
+        if (asids[i] == UINT64_MAX) {
+            top = true;
+            continue;
+        }
+        ranges[nranges].start = asids[i];
+        ranges[nranges].end = asids[i] + 1;
+        nranges++;
+    }
+    f = panda_addr_filter_new(ranges, nranges);
+    if (top) {
+        if (f == NULL) {
+            f = g_malloc0(sizeof(panda_addr_filter));
+        }
+        f->top = true;
+    }
+    return f;
+}
+
+/**
+ * @brief Restricts a registered callback to the given address spaces.
+ *
+ * Passing no ASIDs and PANDA_CB_MODE_ANY removes the scope. vCPUs pick up
+ * the new scope at their next dispatch of @type.
+ *
+ * @note Scoping an unregistered callback will trigger an assertion error.
+ */
+void panda_set_callback_asids(void *plugin, panda_cb_type type, panda_cb cb,
+                              const uint64_t *asids, size_t n,
+                              panda_cb_mode mode)
+{
+    panda_cb_with_context trampoline = panda_get_cb_trampoline(type);
+    panda_set_callback_asids_with_context(plugin, type, trampoline, &cb,
+                                          asids, n, mode);
+}
+
+/**
+ * @brief Restricts a registered callback to the given address spaces.
+ *
+ * Same as panda_set_callback_asids, but with context.
+ */
+void panda_set_callback_asids_with_context(void *plugin, panda_cb_type type,
+                                           panda_cb_with_context cb, void *context,
+                                           const uint64_t *asids, size_t n,
+                                           panda_cb_mode mode)
+{
+    QEMU_LOCK_GUARD(&panda_cb_lock);
+    panda_cb_with_context trampoline = panda_get_cb_trampoline(type);
+    bool found = false;
+
+    assert(type < PANDA_CB_LAST);
+    for (panda_cb_list *plist = panda_cbs[type]; plist != NULL; plist = plist->next) {
+        if (plist->owner == plugin &&
+            (((plist->entry.cbaddr == cb.cbaddr) && plist->context == context) ||
+             (plist->entry.cbaddr == trampoline.cbaddr
+              && TRAMP_CTXT(context) == TRAMP_CTXT(plist->context)))) {
+            panda_addr_filter *old = plist->asids;
+
+            plist->asids = panda_asid_filter_new(asids, n);
+            plist->mode = mode;
+            panda_cb_table_rebuild(type);
+            if (old) {
+                g_free_rcu(old, rcu);
+            }
+            found = true;
+            break;
+        }
+    }
+    assert(found);
+}
+
+/**
+ * @brief Unregisters all callbacks owned by this plugin.
+ *
+ * The register callbacks are removed from their respective callback lists.
+ * This means that if they are registered again, their execution order may be
+ * different.
+ */
+void panda_unregister_callbacks(void *plugin)
+{
+    QEMU_LOCK_GUARD(&panda_cb_lock);
+    for (int i = 0; i < PANDA_CB_LAST; i++) {
+        panda_cb_with_context trampoline;
+        bool has_trampoline = panda_lookup_cb_trampoline(i, &trampoline);
+        bool changed = false;
+        panda_cb_list *plist;
+        plist = panda_cbs[i];
+        panda_cb_list *plist_head = plist;
+        while (plist != NULL) {
+            panda_cb_list *plist_next = plist->next;
+            if (plist->owner == plugin) {
+                // delete this entry -- it belongs to our plugin
+                panda_cb_list *del_plist = plist;
+                if (plist->next == NULL && plist->prev == NULL) {
+                    // its the only thing in the list -- list is now empty
+                    plist_head = NULL;
+                } else {
+                    // Unlink this entry
+                    if (plist->prev)
+                        plist->prev->next = plist->next;
+                    if (plist->next)
+                        plist->next->prev = plist->prev;
+                    // new head
+                    if (plist == plist_head)
+                        plist_head = plist->next;
+                }
+                // Free the entry we just unlinked. Dispatch tables hold a
+                // copy of the callback, so the trampoline context can go too.
+                if (has_trampoline && del_plist->entry.cbaddr == trampoline.cbaddr) {
+                    g_free(del_plist->context);
+                }
+                if (del_plist->filter) {
+                    g_free_rcu(del_plist->filter, rcu);
+                }
+                if (del_plist->asids) {
+                    g_free_rcu(del_plist->asids, rcu);
+                }
+                g_free(del_plist);
+                changed = true;
+            }
+            plist = plist_next;
+        }
+        // update head
+        panda_cbs[i] = plist_head;
+        if (changed) {
+            panda_cb_table_rebuild(i);
+        }
+    }
+}
+
+/**
+ * @brief Enables the specified plugin.
+ *
+ * This works by enabling all the callbacks previously registered by
+ * the plugin. This means that when execution order of the callbacks
+ * is preserved.
+ */
+void panda_enable_plugin(void *plugin)
+{
+    QEMU_LOCK_GUARD(&panda_cb_lock);
+    for (int i = 0; i < PANDA_CB_LAST; i++) {
+        bool changed = false;
+        panda_cb_list *plist;
+        plist = panda_cbs[i];
+        while (plist != NULL) {
+            if (plist->owner == plugin) {
+                plist->enabled = true;
+                changed = true;
+            }
+            plist = plist->next;
+        }
+        if (changed) {
+            panda_cb_table_rebuild(i);
+        }
+    }
+}
+
+/**
+ * @brief Disables the specified plugin.
+ *
+ * This works by disabling all the callbacks registered by the plugin.
+ * This means that when the plugin is re-enabled, the callback order
+ * is preserved.
+ */
+void panda_disable_plugin(void *plugin)
+{
+    QEMU_LOCK_GUARD(&panda_cb_lock);
+    for (int i = 0; i < PANDA_CB_LAST; i++) {
+        bool changed = false;
+        panda_cb_list *plist;
+        plist = panda_cbs[i];
+        while (plist != NULL) {
+            if (plist->owner == plugin) {
+                plist->enabled = false;
+                changed = true;
+            }
+            plist = plist->next;
+        }
+        if (changed) {
+            panda_cb_table_rebuild(i);
+        }
+    }
+}
+
+/**
+ * @brief Allows to navigate the callback linked list skipping disabled
+ * callbacks.
+ *
+ * @note Core dispatch uses panda_cb_tables instead. This is kept for
+ * plugins that walk panda_cbs themselves.
+ */
+panda_cb_list *panda_cb_list_next(panda_cb_list *plist)
+{
+    for (panda_cb_list *node = plist->next; node != NULL;
+         node = node->next) {
+        if (!node || node->enabled)
+            return node;
+    }
+    return NULL;
+}
+
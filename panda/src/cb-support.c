@@ -68,7 +68,7 @@ MAKE_CALLBACK(void, AFTER_CPU_EXEC_ENTER, after_cpu_exec_enter,
 MAKE_CALLBACK(void, BEFORE_CPU_EXEC_EXIT, before_cpu_exec_exit,
                     CPUState*, cpu, bool, ranBlock);
 
-MAKE_CALLBACK(void, AFTER_LOADVM, after_loadvm, CPUState*, env);
+MAKE_RCU_CALLBACK(void, AFTER_LOADVM, after_loadvm, CPUState*, env);
 
 // These are used in target-i386/translate.c
 MAKE_CALLBACK(bool, INSN_TRANSLATE, insn_translate,
@@ -83,12 +83,15 @@ MAKE_CALLBACK(bool, AFTER_INSN_TRANSLATE, after_insn_translate,
 MAKE_CALLBACK(void, END_BLOCK_EXEC, end_block_exec,
                     CPUState*, env, TranslationBlock*, tb)
 
+// Drained from the bridge plugin at TB exit or entry, inside cpu_exec.
+MAKE_CALLBACK(void, MEM_BATCH, mem_batch,
+                    CPUState*, env, const panda_mem_access*, accesses,
+                    size_t, n)
+
 // Non-macroized version for SBE - if panda_please_retranslate is set, we'll break
 void PCB(start_block_exec)(CPUState *cpu, TranslationBlock *tb) {
-    panda_cb_list *plist;
-    for (plist = panda_cbs[PANDA_CB_START_BLOCK_EXEC]; plist != NULL; plist = panda_cb_list_next(plist)) {
-        if (plist->enabled)
-            plist->entry.start_block_exec(plist->context, cpu, tb);
+    PANDA_CB_FOREACH(PANDA_CB_START_BLOCK_EXEC, e) {
+        PANDA_CB_INVOKE(e, start_block_exec, cpu, tb);
     }
 
     if (panda_break_exec()) {
@@ -101,11 +104,11 @@ void panda_cb_trampoline_start_block_exec(void* context, CPUState *cpu, Translat
 }
 
 // these aren't used
-MAKE_CALLBACK(void, HD_READ, hd_read, CPUState*, env);
-MAKE_CALLBACK(void, HD_WRITE, hd_write, CPUState*, env);
+MAKE_RCU_CALLBACK(void, HD_READ, hd_read, CPUState*, env);
+MAKE_RCU_CALLBACK(void, HD_WRITE, hd_write, CPUState*, env);
 
-MAKE_CALLBACK(int, MONITOR, monitor, Monitor*, mon, const char*, cmd);
-MAKE_CALLBACK(bool, QMP, qmp, char*, cmd, char*, args, char **, result);
+MAKE_RCU_CALLBACK(int, MONITOR, monitor, Monitor*, mon, const char*, cmd);
+MAKE_RCU_CALLBACK(bool, QMP, qmp, char*, cmd, char*, args, char **, result);
 
 #ifdef TARGET_LATER
 // Helper - get a physical address
@@ -140,10 +143,10 @@ MAKE_CALLBACK(void, MMIO_BEFORE_WRITE, mmio_before_write,
                     uint64_t*, val);
 
 // vl.c
-MAKE_CALLBACK(void, AFTER_MACHINE_INIT, after_machine_init,
+MAKE_RCU_CALLBACK(void, AFTER_MACHINE_INIT, after_machine_init,
                     CPUState*, env);
 
-MAKE_CALLBACK(void, DURING_MACHINE_INIT, during_machine_init,
+MAKE_RCU_CALLBACK(void, DURING_MACHINE_INIT, during_machine_init,
                     MachineState*, machine);
 
 // Returns true if any registered&enabled callback returns non-zero.
@@ -162,14 +165,30 @@ MAKE_CALLBACK(bool, UNASSIGNED_IO_READ, unassigned_io_read,
                     hwaddr, addr, size_t, size,
                    uint64_t*, val);
 
-MAKE_CALLBACK(void, TOP_LOOP, top_loop,
+MAKE_RCU_CALLBACK(void, TOP_LOOP, top_loop,
                     CPUState*, cpu);
 
 // Returns true if any registered + enabled callback returns nonzero.
 // If so, it doesn't let the asid change
-MAKE_CALLBACK(bool, ASID_CHANGED, asid_changed,
-                    CPUState*, env, uint64_t, old_asid,
-                    uint64_t, new_asid);
+// Non-macroized so an allowed change also invalidates the virt->phys cache:
+// its ASID tag can't tell a page-table base rewrite from the old mapping.
+// It also makes the vCPU pick the callbacks in scope for the new ASID at
+// its next dispatch.
+bool PCB(asid_changed)(CPUState *env, uint64_t old_asid, uint64_t new_asid) {
+    bool any_true = false;
+    PANDA_CB_FOREACH(PANDA_CB_ASID_CHANGED, e) {
+        any_true |= PANDA_CB_INVOKE(e, asid_changed, env, old_asid, new_asid);
+    }
+    if (!any_true) {
+        panda_v2p_cache_drop_asid(env, old_asid);
+        env->panda_cb_asid_dirty = true;
+    }
+    return any_true;
+}
+
+bool panda_cb_trampoline_asid_changed(void* context, CPUState *env, uint64_t old_asid, uint64_t new_asid) {
+    return (*(panda_cb*)context).asid_changed(env, old_asid, new_asid);
+}
 
 
 // target-i386/misc_helpers.c
@@ -202,40 +221,15 @@ MAKE_CALLBACK_NO_ARGS(void, PRE_SHUTDOWN, pre_shutdown);
 
 // Non-standard callbacks below here
 
-extern bool panda_plugin_to_unload;
-extern int nb_panda_plugins;
-extern panda_plugin panda_plugins[MAX_PANDA_PLUGINS];
-
-void PCB(before_find_fast)(void) {
-    if (panda_plugin_to_unload) {
-        panda_plugin_to_unload = false;
-        for (int i = 0; i < nb_panda_plugins;) {
-            if (panda_plugins[i].unload) {
-                panda_do_unload_plugin(i);
-            } else {
-                i++;
-            }
-        }
-    }
-    if (panda_flush_tb()) {
-        queue_tb_flush(current_cpu);
-        cpu_loop_exit(current_cpu);
-    }
-}
-
 bool panda_cb_trampoline_before_block_exec_invalidate_opt(void* context, CPUState *env, TranslationBlock *tb) {
     return (*(panda_cb*)context).before_block_exec_invalidate_opt(env, tb);
 }
 
 bool PCB(after_find_fast)(CPUState *cpu, TranslationBlock *tb,
                           bool bb_invalidate_done, bool *invalidate) {
-    panda_cb_list *plist;
     if (!bb_invalidate_done) {
-        for (plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT];
-             plist != NULL; plist = panda_cb_list_next(plist)) {
-            if (plist->enabled)
-              *invalidate |=
-                  plist->entry.before_block_exec_invalidate_opt(plist->context, cpu, tb);
+        PANDA_CB_FOREACH(PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT, e) {
+            *invalidate |= PANDA_CB_INVOKE(e, before_block_exec_invalidate_opt, cpu, tb);
         }
         return true;
     }
@@ -246,6 +240,18 @@ int32_t panda_cb_trampoline_before_handle_exception(void* context, CPUState *cpu
     return (*(panda_cb*)context).before_handle_exception(cpu, exception_index);
 }
     
+// Filtered entries only run for the PCs they asked for; the others run for
+// every instruction some insn_translate callback asked to instrument.
+int PCB(insn_exec)(CPUState *env, uint64_t pc) {
+    PANDA_CB_FOREACH(PANDA_CB_INSN_EXEC, e) {
+        const panda_addr_filter *f = PANDA_CB_META(e)->filter;
+        if (f == NULL || panda_addr_filter_match(f, pc)) {
+            PANDA_CB_INVOKE(e, insn_exec, env, pc);
+        }
+    }
+    return 0;
+}
+
 int panda_cb_trampoline_insn_exec(void* context, CPUState *env, uint64_t pc) {
     return (*(panda_cb*)context).insn_exec(env, pc);
 }
@@ -264,18 +270,14 @@ int panda_cb_trampoline_after_insn_exec(void* context, CPUState *env, uint64_t p
 // change the current cpu exception.  Sorry.
 
 int32_t PCB(before_handle_exception)(CPUState *cpu, int32_t exception_index) {
-    panda_cb_list *plist;
     bool got_new_exception = false;
     int32_t new_exception;
 
-    for (plist = panda_cbs[PANDA_CB_BEFORE_HANDLE_EXCEPTION]; plist != NULL;
-         plist = panda_cb_list_next(plist)) {
-        if (plist->enabled) {
-            int32_t new_e = plist->entry.before_handle_exception(plist->context, cpu, exception_index);
-            if (!got_new_exception && new_e != exception_index) {
-                got_new_exception = true;
-                new_exception = new_e;
-            }
+    PANDA_CB_FOREACH(PANDA_CB_BEFORE_HANDLE_EXCEPTION, e) {
+        int32_t new_e = PANDA_CB_INVOKE(e, before_handle_exception, cpu, exception_index);
+        if (!got_new_exception && new_e != exception_index) {
+            got_new_exception = true;
+            new_exception = new_e;
         }
     }
 
@@ -290,18 +292,14 @@ int32_t panda_cb_trampoline_before_handle_interrupt(void* context, CPUState *cpu
 }
 
 int32_t PCB(before_handle_interrupt)(CPUState *cpu, int32_t interrupt_request) {
-    panda_cb_list *plist;
     bool got_new_interrupt = false;
     int32_t new_interrupt;
 
-    for (plist = panda_cbs[PANDA_CB_BEFORE_HANDLE_INTERRUPT]; plist != NULL;
-         plist = panda_cb_list_next(plist)) {
-        if (plist->enabled) {
-            int32_t new_i = plist->entry.before_handle_interrupt(plist->context, cpu, interrupt_request);
-            if (!got_new_interrupt && new_i != interrupt_request) {
-                got_new_interrupt = true;
-                new_interrupt = new_i;
-            }
+    PANDA_CB_FOREACH(PANDA_CB_BEFORE_HANDLE_INTERRUPT, e) {
+        int32_t new_i = PANDA_CB_INVOKE(e, before_handle_interrupt, cpu, interrupt_request);
+        if (!got_new_interrupt && new_i != interrupt_request) {
+            got_new_interrupt = true;
+            new_interrupt = new_i;
         }
     }
 
@@ -328,24 +326,47 @@ int32_t PCB(before_handle_interrupt)(CPUState *cpu, int32_t interrupt_request) {
 MEM_CB_TRAMPOLINES(virt)
 MEM_CB_TRAMPOLINES(phys)
 
+// Called from the bridge plugin after each guest load/store that passed the
+// address range table. Filters are rechecked exactly here; physical
+// filters can only be checked here. paddr is -1 if unknown (e.g. MMIO).
+#define MEM_ACCESS_DISPATCH(type, name, addr) \
+    PANDA_CB_FOREACH(type, e) { \
+        const panda_addr_filter *f = PANDA_CB_META(e)->filter; \
+        if (f == NULL || panda_addr_filter_match(f, addr)) { \
+            PANDA_CB_INVOKE(e, name, env, pc, addr, size, (uint8_t *)&value); \
+        } \
+    }
+
+void PCB(mem_access)(CPUState *env, uint64_t pc, uint64_t vaddr, uint64_t paddr,
+                     size_t size, uint64_t value, bool is_write) {
+    if (is_write) {
+        MEM_ACCESS_DISPATCH(PANDA_CB_VIRT_MEM_AFTER_WRITE, virt_mem_after_write, vaddr);
+        if (paddr != -1) {
+            MEM_ACCESS_DISPATCH(PANDA_CB_PHYS_MEM_AFTER_WRITE, phys_mem_after_write, paddr);
+        }
+    } else {
+        MEM_ACCESS_DISPATCH(PANDA_CB_VIRT_MEM_AFTER_READ, virt_mem_after_read, vaddr);
+        if (paddr != -1) {
+            MEM_ACCESS_DISPATCH(PANDA_CB_PHYS_MEM_AFTER_READ, phys_mem_after_read, paddr);
+        }
+    }
+}
+
 #ifdef CONFIG_LATER
 // These are used in softmmu_template.h. They are distinct from MAKE_CALLBACK's standard form.
 // ram_ptr is a possible pointer into host memory from the TLB code. Can be NULL.
 void PCB(mem_before_read)(CPUState *env, uint64_t pc, uint64_t addr,
                           size_t data_size, void *ram_ptr) {
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_BEFORE_READ]; plist != NULL;
-        plist = panda_cb_list_next(plist)) {
-        if (plist->enabled) plist->entry.virt_mem_before_read(plist->context, env, panda_current_pc(env), addr,
-                                                              data_size);
+    PANDA_CB_FOREACH(PANDA_CB_VIRT_MEM_BEFORE_READ, e) {
+        PANDA_CB_INVOKE(e, virt_mem_before_read, env, panda_current_pc(env), addr,
+                        data_size);
     }
-    if (panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_READ]) {
+    if (qatomic_rcu_read(&panda_cb_tables[PANDA_CB_PHYS_MEM_BEFORE_READ])) {
         hwaddr paddr = get_paddr(env, addr, ram_ptr);
         if (paddr == -1) return;
-        for(plist = panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_READ]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-            if (plist->enabled) plist->entry.phys_mem_before_read(plist->context, env, panda_current_pc(env),
-                                                                  paddr, data_size);
+        PANDA_CB_FOREACH(PANDA_CB_PHYS_MEM_BEFORE_READ, e) {
+            PANDA_CB_INVOKE(e, phys_mem_before_read, env, panda_current_pc(env),
+                            paddr, data_size);
         }
     }
 }
@@ -353,21 +374,18 @@ void PCB(mem_before_read)(CPUState *env, uint64_t pc, uint64_t addr,
 
 void PCB(mem_after_read)(CPUState *env, uint64_t pc, uint64_t addr,
                          size_t data_size, uint64_t result, void *ram_ptr) {
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_AFTER_READ]; plist != NULL;
-        plist = panda_cb_list_next(plist)) {
+    PANDA_CB_FOREACH(PANDA_CB_VIRT_MEM_AFTER_READ, e) {
         /* mstamat: Passing &result as the last cb arg doesn't make much sense. */
-        if (plist->enabled) plist->entry.virt_mem_after_read(plist->context, env, panda_current_pc(env), addr,
-                                         data_size, (uint8_t *)&result);
+        PANDA_CB_INVOKE(e, virt_mem_after_read, env, panda_current_pc(env), addr,
+                        data_size, (uint8_t *)&result);
     }
-    if (panda_cbs[PANDA_CB_PHYS_MEM_AFTER_READ]) {
+    if (qatomic_rcu_read(&panda_cb_tables[PANDA_CB_PHYS_MEM_AFTER_READ])) {
         hwaddr paddr = get_paddr(env, addr, ram_ptr);
         if (paddr == -1) return;
-        for(plist = panda_cbs[PANDA_CB_PHYS_MEM_AFTER_READ]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
+        PANDA_CB_FOREACH(PANDA_CB_PHYS_MEM_AFTER_READ, e) {
             /* mstamat: Passing &result as the last cb arg doesn't make much sense. */
-            if (plist->enabled) plist->entry.phys_mem_after_read(plist->context, env, panda_current_pc(env), paddr,
-                                             data_size, (uint8_t *)&result);
+            PANDA_CB_INVOKE(e, phys_mem_after_read, env, panda_current_pc(env), paddr,
+                            data_size, (uint8_t *)&result);
         }
     }
 }
@@ -375,21 +393,18 @@ void PCB(mem_after_read)(CPUState *env, uint64_t pc, uint64_t addr,
 
 void PCB(mem_before_write)(CPUState *env, uint64_t pc, uint64_t addr,
                            size_t data_size, uint64_t val, void *ram_ptr) {
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_BEFORE_WRITE]; plist != NULL;
-        plist = panda_cb_list_next(plist)) {
+    PANDA_CB_FOREACH(PANDA_CB_VIRT_MEM_BEFORE_WRITE, e) {
         /* mstamat: Passing &val as the last arg doesn't make much sense. */
-        if (plist->enabled) plist->entry.virt_mem_before_write(plist->context, env, panda_current_pc(env), addr,
-                                           data_size, (uint8_t *)&val);
+        PANDA_CB_INVOKE(e, virt_mem_before_write, env, panda_current_pc(env), addr,
+                        data_size, (uint8_t *)&val);
     }
-    if (panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_WRITE]) {
+    if (qatomic_rcu_read(&panda_cb_tables[PANDA_CB_PHYS_MEM_BEFORE_WRITE])) {
         hwaddr paddr = get_paddr(env, addr, ram_ptr);
         if (paddr == -1) return;
-        for(plist = panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_WRITE]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
+        PANDA_CB_FOREACH(PANDA_CB_PHYS_MEM_BEFORE_WRITE, e) {
             /* mstamat: Passing &val as the last cb arg doesn't make much sense. */
-            if (plist->enabled) plist->entry.phys_mem_before_write(plist->context, env, panda_current_pc(env), paddr,
-                                               data_size, (uint8_t *)&val);
+            PANDA_CB_INVOKE(e, phys_mem_before_write, env, panda_current_pc(env), paddr,
+                            data_size, (uint8_t *)&val);
         }
     }
 }
@@ -397,21 +412,18 @@ void PCB(mem_before_write)(CPUState *env, uint64_t pc, uint64_t addr,
 
 void PCB(mem_after_write)(CPUState *env, uint64_t pc, uint64_t addr,
                           size_t data_size, uint64_t val, void *ram_ptr) {
-    panda_cb_list *plist;
-    for (plist = panda_cbs[PANDA_CB_VIRT_MEM_AFTER_WRITE]; plist != NULL;
-         plist = panda_cb_list_next(plist)) {
+    PANDA_CB_FOREACH(PANDA_CB_VIRT_MEM_AFTER_WRITE, e) {
         /* mstamat: Passing &val as the last cb arg doesn't make much sense. */
-        if (plist->enabled) plist->entry.virt_mem_after_write(plist->context, env, panda_current_pc(env), addr,
-                                          data_size, (uint8_t *)&val);
+        PANDA_CB_INVOKE(e, virt_mem_after_write, env, panda_current_pc(env), addr,
+                        data_size, (uint8_t *)&val);
     }
-    if (panda_cbs[PANDA_CB_PHYS_MEM_AFTER_WRITE]) {
+    if (qatomic_rcu_read(&panda_cb_tables[PANDA_CB_PHYS_MEM_AFTER_WRITE])) {
         hwaddr paddr = get_paddr(env, addr, ram_ptr);
         if (paddr == -1) return;
-        for (plist = panda_cbs[PANDA_CB_PHYS_MEM_AFTER_WRITE]; plist != NULL;
-             plist = panda_cb_list_next(plist)) {
+        PANDA_CB_FOREACH(PANDA_CB_PHYS_MEM_AFTER_WRITE, e) {
             /* mstamat: Passing &val as the last cb arg doesn't make much sense. */
-            if (plist->enabled) plist->entry.phys_mem_after_write(plist->context, env, panda_current_pc(env), paddr,
-                                              data_size, (uint8_t *)&val);
+            PANDA_CB_INVOKE(e, phys_mem_after_write, env, panda_current_pc(env), paddr,
+                            data_size, (uint8_t *)&val);
         }
     }
 }
@@ -0,0 +1,63 @@
+/* PANDABEGINCOMMENT
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+/*
+ * The target independent part of callback dispatch; see
+ * include/panda/cb-table.h. Tables are built and published by
+ * cb-register.c.
+ */
+#include "qemu/osdep.h"
+#include "panda/cb-table.h"
+
+/* Only its address matters: the context of callbacks stored directly */
+const char panda_cb_direct;
+
+panda_cb_table *panda_cb_table_new(size_t n)
+{
+    panda_cb_table *tbl = g_malloc0(sizeof(panda_cb_table) +
+                                    n * (sizeof(panda_cb_entry) +
+                                         sizeof(panda_cb_meta)));
+
+    tbl->meta = (panda_cb_meta *)(tbl->entries + n);
+    return tbl;
+}
+
+static int panda_addr_range_cmp(const void *a, const void *b)
+{
+    const panda_addr_range *ra = a, *rb = b;
+
+    return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+panda_addr_filter *panda_addr_filter_new(const panda_addr_range *ranges,
+                                         size_t n)
+{
+    panda_addr_filter *f;
+
+    if (n == 0) {
+        return NULL;
+    }
+    f = g_malloc0(sizeof(panda_addr_filter) + n * sizeof(panda_addr_range));
+    memcpy(f->ranges, ranges, n * sizeof(panda_addr_range));
+    qsort(f->ranges, n, sizeof(panda_addr_range), panda_addr_range_cmp);
+    for (size_t i = 0; i < n; i++) {
+        const panda_addr_range *r = &f->ranges[i];
+        if (r->start >= r->end) {
+            continue;
+        }
+        if (f->n && r->start <= f->ranges[f->n - 1].end) {
+            f->ranges[f->n - 1].end = MAX(f->ranges[f->n - 1].end, r->end);
+        } else {
+            f->ranges[f->n++] = *r;
+        }
+    }
+    if (f->n == 0) {
+        g_free(f);
+        return NULL;
+    }
+    return f;
+}
@@ -0,0 +1,40 @@
+/* PANDABEGINCOMMENT
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+/*
+ * The shape of the checkpoint tree, apart from guest RAM; see
+ * checkpoint.c.
+ */
+#include "qemu/osdep.h"
+#include "panda/checkpoint.h"
+
+int panda_checkpoint_path(Checkpoint *const *ckpts, int head, int target,
+                          int *path)
+{
+    bool on_path[MAX_CHECKPOINTS] = { false };
+    int lca, n = 0;
+
+    if (head < 0) {
+        return -1;
+    }
+    for (int i = target; i >= 0; i = ckpts[i]->parent) {
+        on_path[i] = true;
+    }
+    for (lca = head; lca >= 0 && !on_path[lca]; lca = ckpts[lca]->parent) {
+        if (ckpts[lca]->dirty == NULL) {
+            return -1;      /* a different root */
+        }
+        path[n++] = lca;
+    }
+    if (lca < 0) {
+        return -1;
+    }
+    for (int i = target; i != lca; i = ckpts[i]->parent) {
+        path[n++] = i;
+    }
+    return n;
+}
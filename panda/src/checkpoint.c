@@ -0,0 +1,692 @@
+/* PANDABEGINCOMMENT
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+/*
+ * In-memory checkpoints; see include/panda/checkpoint.h.
+ *
+ * Checkpoints form a tree: each one's pages are a delta to its parent,
+ * the checkpoint the guest was last at (taken or restored) when it was
+ * taken. The root holds all of RAM. To go from the current state to
+ * checkpoint C we must rewrite every page dirtied since the last
+ * checkpoint, plus every page in a delta between that checkpoint and
+ * C's common ancestor, plus every page in a delta on the way down to C.
+ * Each such page is read from the nearest checkpoint on C's path to the
+ * root that stored it.
+ *
+ * All of this runs with the BQL held and the vCPUs stopped.
+ */
+#include "qemu/osdep.h"
+#include "qemu/bitmap.h"
+#include "qemu/cutils.h"
+#include "qemu/main-loop.h"
+#include "qemu/memfd.h"
+#include "qemu/rcu.h"
+#include "qapi/error.h"
+#include "exec/cputlb.h"
+#include "exec/icount.h"
+#include "exec/target_page.h"
+#include "exec/tb-flush.h"
+#include "hw/core/cpu.h"
+#include "io/channel-buffer.h"
+#include "migration/blocker.h"
+#include "migration/qemu-file-types.h"
+#include "migration/qemu-file.h"
+#include "migration/savevm.h"
+#include "system/cpus.h"
+#include "system/memory.h"
+#include "system/physmem.h"
+#include "system/ramblock.h"
+#include "system/replay.h"
+#include "system/reset.h"
+#include "system/runstate.h"
+#include "system/tcg.h"
+#include "panda/debug.h"
+#include "panda/checkpoint.h"
+
+typedef struct PandaCkptBlock {
+    RAMBlock *rb;
+    ram_addr_t offset;
+    ram_addr_t used_length;
+    unsigned long pages;
+} PandaCkptBlock;
+
+Checkpoint *checkpoints[MAX_CHECKPOINTS];
+static size_t panda_num_checkpoints;
+static QemuMutex panda_ckpt_lock;   /* guards slot allocation only */
+
+/* RAM blocks checkpoints cover; fixed when the first one is taken. */
+static GArray *panda_ckpt_blocks;
+static ram_addr_t panda_ckpt_ram_end;
+static Error *panda_ckpt_blocker;
+
+/*
+ * Checkpoint the guest state is a delta to, as far as the migration
+ * dirty bitmap knows. -1 when that is unknown, in which case the next
+ * checkpoint is a full copy and the next restore rewrites all of RAM.
+ */
+static int panda_ckpt_head = -1;
+
+/* Pages panda_checkpoint_delete() copies per read */
+#define PANDA_CKPT_FOLD_RUN 256
+
+#define PANDA_CKPT_BLOCK(i) (&g_array_index(panda_ckpt_blocks, PandaCkptBlock, (i)))
+
+static void __attribute__((__constructor__)) panda_ckpt_lock_init(void)
+{
+    qemu_mutex_init(&panda_ckpt_lock);
+}
+
+static int panda_ckpt_io(int fd, void *buf, size_t len, off_t pos, bool write)
+{
+    while (len > 0) {
+        ssize_t n = write ? pwrite(fd, buf, len, pos) : pread(fd, buf, len, pos);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (n == 0) {
+            return -EIO;
+        }
+        buf = (uint8_t *)buf + n;
+        pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Byte range of pages [start, end) of @b, clamped to the block. */
+static void panda_ckpt_run(PandaCkptBlock *b, unsigned long start,
+                           unsigned long end, ram_addr_t *off, size_t *len)
+{
+    *off = (ram_addr_t)start << TARGET_PAGE_BITS;
+    *len = MIN((ram_addr_t)end << TARGET_PAGE_BITS, b->used_length) - *off;
+}
+
+/*
+ * loadvm resets the machine and then rewrites RAM behind the dirty
+ * bitmap's back, so the guest is no longer a known delta to any
+ * checkpoint. A runstate change handler would miss a loadvm while the
+ * VM is already stopped, e.g. a replay seek from the debugger.
+ */
+static void panda_ckpt_reset(void *opaque)
+{
+    panda_ckpt_head = -1;
+}
+
+static bool panda_ckpt_start(Error **errp)
+{
+    RAMBlock *rb;
+
+    error_setg(&panda_ckpt_blocker, "PANDA checkpoints are in use");
+    if (migrate_add_blocker(&panda_ckpt_blocker, errp) < 0) {
+        return false;
+    }
+    if (!memory_global_dirty_log_start(GLOBAL_DIRTY_MIGRATION, errp)) {
+        migrate_del_blocker(&panda_ckpt_blocker);
+        return false;
+    }
+
+    panda_ckpt_blocks = g_array_new(false, false, sizeof(PandaCkptBlock));
+    RCU_READ_LOCK_GUARD();
+    RAMBLOCK_FOREACH(rb) {
+        PandaCkptBlock b;
+
+        if (!qemu_ram_is_migratable(rb)) {
+            continue;
+        }
+        b.rb = rb;
+        b.offset = rb->offset;
+        b.used_length = rb->used_length;
+        b.pages = DIV_ROUND_UP(rb->used_length, TARGET_PAGE_SIZE);
+        g_array_append_val(panda_ckpt_blocks, b);
+        panda_ckpt_ram_end = MAX(panda_ckpt_ram_end, b.offset + b.used_length);
+    }
+    qemu_register_reset(panda_ckpt_reset, NULL);
+    return true;
+}
+
+/* Is RAM still laid out the way it was at the first checkpoint? */
+static bool panda_ckpt_blocks_match(void)
+{
+    RAMBlock *rb;
+    guint i = 0;
+
+    RCU_READ_LOCK_GUARD();
+    RAMBLOCK_FOREACH(rb) {
+        PandaCkptBlock *b;
+
+        if (!qemu_ram_is_migratable(rb)) {
+            continue;
+        }
+        if (i == panda_ckpt_blocks->len) {
+            return false;
+        }
+        b = PANDA_CKPT_BLOCK(i++);
+        if (b->rb != rb || b->offset != rb->offset ||
+            b->used_length != rb->used_length) {
+            return false;
+        }
+    }
+    return i == panda_ckpt_blocks->len;
+}
+
+/*
+ * Collect the pages dirtied since the last checkpoint into @c's memfd,
+ * or all non-zero pages if @c is a root. Clears the dirty bitmap.
+ */
+static int panda_ckpt_save_ram(Checkpoint *c)
+{
+    memory_global_dirty_log_sync(false);
+
+    for (guint i = 0; i < panda_ckpt_blocks->len; i++) {
+        PandaCkptBlock *b = PANDA_CKPT_BLOCK(i);
+        unsigned long *bmap = NULL;
+        unsigned long page = 0, end;
+
+        if (c->dirty) {
+            bmap = c->dirty[i] = bitmap_new(b->pages);
+        }
+        physical_memory_test_and_clear_dirty(b->offset, b->used_length,
+                                             DIRTY_MEMORY_MIGRATION, bmap);
+
+        for (;; page = end) {
+            ram_addr_t off;
+            size_t len;
+            int ret;
+
+            if (bmap) {
+                page = find_next_bit(bmap, b->pages, page);
+                if (page >= b->pages) {
+                    break;
+                }
+                end = find_next_zero_bit(bmap, b->pages, page);
+            } else {
+                // Full copy: skip zero pages, the memfd reads back zeros
+                while (page < b->pages &&
+                       buffer_is_zero(b->rb->host + ((ram_addr_t)page << TARGET_PAGE_BITS),
+                                      TARGET_PAGE_SIZE)) {
+                    page++;
+                }
+                if (page >= b->pages) {
+                    break;
+                }
+                end = page + 1;
+                while (end < b->pages &&
+                       !buffer_is_zero(b->rb->host + ((ram_addr_t)end << TARGET_PAGE_BITS),
+                                       TARGET_PAGE_SIZE)) {
+                    end++;
+                }
+            }
+            panda_ckpt_run(b, page, end, &off, &len);
+            ret = panda_ckpt_io(c->memfd, b->rb->host + off, len,
+                                b->offset + off, true);
+            if (ret < 0) {
+                return ret;
+            }
+            c->memfd_usage += len;
+        }
+    }
+    return 0;
+}
+
+static int panda_ckpt_save_devices(Checkpoint *c)
+{
+    QIOChannelBuffer *bioc = qio_channel_buffer_new(64 * KiB);
+    QEMUFile *f = qemu_file_new_output(QIO_CHANNEL(bioc));
+    int ret;
+
+    ret = qemu_save_device_state(f);
+    if (ret == 0) {
+        ret = qemu_fflush(f);
+    }
+    if (ret == 0) {
+        c->devstate = g_memdup2(bioc->data, bioc->usage);
+        c->devstate_len = bioc->usage;
+    }
+    // Closing a buffer channel frees its data, so copy it out first
+    qemu_fclose(f);
+    object_unref(OBJECT(bioc));
+    return ret;
+}
+
+static int panda_ckpt_load_devices(Checkpoint *c)
+{
+    QIOChannelBuffer *bioc = qio_channel_buffer_new(c->devstate_len);
+    Error *err = NULL;
+    QEMUFile *f;
+    int ret;
+
+    memcpy(bioc->data, c->devstate, c->devstate_len);
+    bioc->usage = c->devstate_len;
+    f = qemu_file_new_input(QIO_CHANNEL(bioc));
+
+    // qemu_save_device_state() writes a file header the loader doesn't want
+    if (qemu_get_be32(f) != QEMU_VM_FILE_MAGIC ||
+        qemu_get_be32(f) != QEMU_VM_FILE_VERSION) {
+        ret = -EINVAL;
+    } else {
+        ret = qemu_load_device_state(f, &err);
+    }
+    if (err) {
+        LOG_ERROR("checkpoint %d: %s", c->num, error_get_pretty(err));
+        error_free(err);
+    }
+    qemu_fclose(f);
+    object_unref(OBJECT(bioc));
+    return ret;
+}
+
+static void panda_ckpt_free(Checkpoint *c)
+{
+    if (c->memfd >= 0) {
+        close(c->memfd);
+    }
+    for (guint i = 0; c->dirty && i < panda_ckpt_blocks->len; i++) {
+        g_free(c->dirty[i]);
+    }
+    g_free(c->dirty);
+    g_free(c->devstate);
+    g_free(c);
+}
+
+static void panda_ckpt_take(Checkpoint *c)
+{
+    Error *err = NULL;
+    int ret;
+
+    if (!replay_can_snapshot()) {
+        LOG_ERROR("checkpoint %d: replay has pending events", c->num);
+        return;
+    }
+    if (panda_ckpt_blocks == NULL && !panda_ckpt_start(&err)) {
+        LOG_ERROR("checkpoint %d: %s", c->num, error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+    if (!panda_ckpt_blocks_match()) {
+        LOG_ERROR("checkpoint %d: guest RAM layout changed", c->num);
+        return;
+    }
+
+    c->memfd = qemu_memfd_create("panda-checkpoint", panda_ckpt_ram_end,
+                                 false, 0, 0, &err);
+    if (c->memfd < 0) {
+        LOG_ERROR("checkpoint %d: %s", c->num, error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+    c->guest_instr_count = icount_enabled() ? icount_get_raw() : 0;
+    c->parent = panda_ckpt_head;
+    if (c->parent >= 0) {
+        c->dirty = g_new0(unsigned long *, panda_ckpt_blocks->len);
+    }
+
+    ret = panda_ckpt_save_ram(c);
+    if (ret == 0) {
+        ret = panda_ckpt_save_devices(c);
+    }
+    if (ret < 0) {
+        LOG_ERROR("checkpoint %d failed: %s", c->num, strerror(-ret));
+        // The dirty bitmap was consumed, so nothing is a delta base now
+        panda_ckpt_head = -1;
+        return;
+    }
+    panda_ckpt_head = c->num;
+    qatomic_store_release(&c->ready, true);
+}
+
+static void panda_ckpt_or(unsigned long **need, Checkpoint *c)
+{
+    assert(c->dirty);
+    for (guint i = 0; i < panda_ckpt_blocks->len; i++) {
+        PandaCkptBlock *b = PANDA_CKPT_BLOCK(i);
+        bitmap_or(need[i], need[i], c->dirty[i], b->pages);
+    }
+}
+
+/* Copy the pages of @need that @src stored back into RAM. */
+static int panda_ckpt_load_pages(unsigned long **need, Checkpoint *src)
+{
+    for (guint i = 0; i < panda_ckpt_blocks->len; i++) {
+        PandaCkptBlock *b = PANDA_CKPT_BLOCK(i);
+        unsigned long *have = src->dirty ? src->dirty[i] : NULL;
+        unsigned long page = 0, end;
+
+        for (;; page = end) {
+            ram_addr_t off;
+            size_t len;
+            int ret;
+
+            page = find_next_bit(need[i], b->pages, page);
+            if (page >= b->pages) {
+                break;
+            }
+            if (have && !test_bit(page, have)) {
+                end = page + 1;
+                continue;
+            }
+            end = page + 1;
+            while (end < b->pages && test_bit(end, need[i]) &&
+                   (!have || test_bit(end, have))) {
+                end++;
+            }
+            panda_ckpt_run(b, page, end, &off, &len);
+            ret = panda_ckpt_io(src->memfd, b->rb->host + off, len,
+                                b->offset + off, false);
+            if (ret < 0) {
+                return ret;
+            }
+            bitmap_clear(need[i], page, end - page);
+            // Display models need to know; TBs are flushed wholesale
+            physical_memory_set_dirty_range(b->offset + off, len,
+                                            1 << DIRTY_MEMORY_VGA);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Pages that may differ between the guest, a delta to panda_ckpt_head,
+ * and @c: those dirtied since, plus those stored on either side of the
+ * tree below their common ancestor. Everything if there is no such
+ * ancestor, e.g. when a failed checkpoint left the head unknown and the
+ * next one became a second root.
+ */
+static bool panda_ckpt_diff(unsigned long **need, Checkpoint *c)
+{
+    int path[MAX_CHECKPOINTS];
+    int n = panda_checkpoint_path(checkpoints, panda_ckpt_head, c->num, path);
+
+    if (n < 0) {
+        return false;
+    }
+    for (int i = 0; i < n; i++) {
+        panda_ckpt_or(need, checkpoints[path[i]]);
+    }
+    return true;
+}
+
+static int panda_ckpt_restore_ram(Checkpoint *c)
+{
+    guint nblocks = panda_ckpt_blocks->len;
+    g_autofree unsigned long **need = g_new0(unsigned long *, nblocks);
+    int ret = 0;
+
+    memory_global_dirty_log_sync(false);
+    for (guint i = 0; i < nblocks; i++) {
+        PandaCkptBlock *b = PANDA_CKPT_BLOCK(i);
+        need[i] = bitmap_new(b->pages);
+        physical_memory_test_and_clear_dirty(b->offset, b->used_length,
+                                             DIRTY_MEMORY_MIGRATION, need[i]);
+    }
+    if (!panda_ckpt_diff(need, c)) {
+        for (guint i = 0; i < nblocks; i++) {
+            bitmap_set(need[i], 0, PANDA_CKPT_BLOCK(i)->pages);
+        }
+    }
+
+    for (int n = c->num; n >= 0 && ret == 0; n = checkpoints[n]->parent) {
+        ret = panda_ckpt_load_pages(need, checkpoints[n]);
+    }
+
+    for (guint i = 0; i < nblocks; i++) {
+        g_free(need[i]);
+    }
+    return ret;
+}
+
+static void panda_ckpt_restore(Checkpoint *c)
+{
+    CPUState *cpu;
+    int ret;
+
+    if (!qatomic_load_acquire(&c->ready)) {
+        LOG_ERROR("checkpoint %d was never taken", c->num);
+        return;
+    }
+    if (!panda_ckpt_blocks_match()) {
+        LOG_ERROR("can't restore checkpoint %d: guest RAM layout changed",
+                  c->num);
+        return;
+    }
+
+    ret = panda_ckpt_restore_ram(c);
+    if (ret == 0) {
+        ret = panda_ckpt_load_devices(c);
+    }
+    if (ret < 0) {
+        LOG_ERROR("restoring checkpoint %d failed: %s", c->num, strerror(-ret));
+        panda_ckpt_head = -1;
+        return;
+    }
+    panda_ckpt_head = c->num;
+
+    // Guest code and mappings may all have changed under us
+    if (tcg_enabled()) {
+        tb_flush__exclusive_or_serial();
+        CPU_FOREACH(cpu) {
+            tlb_flush(cpu);
+        }
+    }
+}
+
+static void panda_ckpt_take_work(CPUState *cpu, run_on_cpu_data data)
+{
+    bql_lock();
+    panda_ckpt_take(data.host_ptr);
+    bql_unlock();
+}
+
+static void panda_ckpt_restore_work(CPUState *cpu, run_on_cpu_data data)
+{
+    bql_lock();
+    panda_ckpt_restore(data.host_ptr);
+    bql_unlock();
+}
+
+/*
+ * Run @fn on @c with the vCPUs stopped. A vCPU can't stop the others
+ * from inside cpu_exec, so from there @work is queued as safe work.
+ */
+static void panda_ckpt_run_stopped(void (*fn)(Checkpoint *), run_on_cpu_func work,
+                                   Checkpoint *c)
+{
+    bool running;
+
+    if (current_cpu) {
+        async_safe_run_on_cpu(current_cpu, work, RUN_ON_CPU_HOST_PTR(c));
+        return;
+    }
+    assert(bql_locked());
+    running = runstate_is_running();
+    if (running) {
+        pause_all_vcpus();
+    }
+    fn(c);
+    if (running) {
+        resume_all_vcpus();
+    }
+}
+
+size_t get_num_checkpoints(void)
+{
+    return qatomic_load_acquire(&panda_num_checkpoints);
+}
+
+int get_closest_checkpoint_num(uint64_t instr_count)
+{
+    size_t n = get_num_checkpoints();
+    int best = -1;
+
+    for (size_t i = 0; i < n; i++) {
+        Checkpoint *c = checkpoints[i];
+        if (c && qatomic_load_acquire(&c->ready) &&
+            c->guest_instr_count <= instr_count &&
+            (best < 0 || c->guest_instr_count >= checkpoints[best]->guest_instr_count)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+Checkpoint *get_checkpoint(int num)
+{
+    if (num < 0 || (size_t)num >= get_num_checkpoints()) {
+        return NULL;
+    }
+    return checkpoints[num];
+}
+
+void *panda_checkpoint(void)
+{
+    Checkpoint *c = g_new0(Checkpoint, 1);
+
+    c->parent = -1;
+    c->memfd = -1;
+    c->num = -1;
+    WITH_QEMU_LOCK_GUARD(&panda_ckpt_lock) {
+        // Reuse the slot of a deleted checkpoint if there is one
+        for (size_t i = 0; i < panda_num_checkpoints; i++) {
+            if (checkpoints[i] == NULL) {
+                c->num = i;
+                break;
+            }
+        }
+        if (c->num < 0) {
+            if (panda_num_checkpoints == MAX_CHECKPOINTS) {
+                LOG_ERROR("can't take more than %d checkpoints", MAX_CHECKPOINTS);
+                g_free(c);
+                return NULL;
+            }
+            c->num = panda_num_checkpoints;
+            qatomic_store_release(&panda_num_checkpoints, c->num + 1);
+        }
+        qatomic_store_release(&checkpoints[c->num], c);
+    }
+
+    panda_ckpt_run_stopped(panda_ckpt_take, panda_ckpt_take_work, c);
+    if (current_cpu == NULL && !c->ready) {
+        // Failed on the spot; give the slot back
+        WITH_QEMU_LOCK_GUARD(&panda_ckpt_lock) {
+            checkpoints[c->num] = NULL;
+        }
+        panda_ckpt_free(c);
+        return NULL;
+    }
+    return c;
+}
+
+/*
+ * Make @c, a child of @d, self-sufficient: copy over the pages @d
+ * holds and @c doesn't, and reparent @c to @d's parent.
+ */
+static int panda_ckpt_fold(Checkpoint *d, Checkpoint *c)
+{
+    g_autofree uint8_t *buf = g_malloc(PANDA_CKPT_FOLD_RUN * TARGET_PAGE_SIZE);
+
+    for (guint i = 0; i < panda_ckpt_blocks->len; i++) {
+        PandaCkptBlock *b = PANDA_CKPT_BLOCK(i);
+        unsigned long *have = d->dirty ? d->dirty[i] : NULL;
+        unsigned long page = 0, end;
+
+        for (;; page = end) {
+            ram_addr_t off;
+            size_t len;
+            int ret;
+
+            if (have) {
+                page = find_next_bit(have, b->pages, page);
+            }
+            while (page < b->pages && test_bit(page, c->dirty[i])) {
+                page++;
+            }
+            if (page >= b->pages) {
+                break;
+            }
+            if (have && !test_bit(page, have)) {
+                end = page + 1;
+                continue;
+            }
+            end = page + 1;
+            while (end < b->pages && end - page < PANDA_CKPT_FOLD_RUN &&
+                   !test_bit(end, c->dirty[i]) && (!have || test_bit(end, have))) {
+                end++;
+            }
+            panda_ckpt_run(b, page, end, &off, &len);
+            ret = panda_ckpt_io(d->memfd, buf, len, b->offset + off, false);
+            if (ret == 0 && (have || !buffer_is_zero(buf, len))) {
+                ret = panda_ckpt_io(c->memfd, buf, len, b->offset + off, true);
+                c->memfd_usage += len;
+            }
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    // Only now, so a failure above leaves @c a valid delta to @d
+    for (guint i = 0; i < panda_ckpt_blocks->len; i++) {
+        if (d->dirty) {
+            bitmap_or(c->dirty[i], c->dirty[i], d->dirty[i],
+                      PANDA_CKPT_BLOCK(i)->pages);
+        } else {
+            g_free(c->dirty[i]);
+        }
+    }
+    if (d->dirty == NULL) {
+        g_free(c->dirty);
+        c->dirty = NULL;
+    }
+    c->parent = d->parent;
+    return 0;
+}
+
+bool panda_checkpoint_delete(int num)
+{
+    Checkpoint *d = get_checkpoint(num);
+
+    assert(bql_locked());
+    if (d == NULL || !qatomic_load_acquire(&d->ready) || num == panda_ckpt_head) {
+        return false;
+    }
+    for (size_t i = 0; i < get_num_checkpoints(); i++) {
+        Checkpoint *c = checkpoints[i];
+        int ret;
+
+        if (c == NULL || c == d || !c->ready || c->parent != num) {
+            continue;
+        }
+        ret = panda_ckpt_fold(d, c);
+        if (ret < 0) {
+            LOG_ERROR("can't delete checkpoint %d: %s", num, strerror(-ret));
+            return false;
+        }
+    }
+    WITH_QEMU_LOCK_GUARD(&panda_ckpt_lock) {
+        checkpoints[num] = NULL;
+    }
+    panda_ckpt_free(d);
+    return true;
+}
+
+void panda_restore_by_num(int num)
+{
+    Checkpoint *c = get_checkpoint(num);
+
+    if (c == NULL) {
+        LOG_ERROR("no checkpoint %d", num);
+        return;
+    }
+    panda_restore(c);
+}
+
+void panda_restore(void *opaque)
+{
+    panda_ckpt_run_stopped(panda_ckpt_restore, panda_ckpt_restore_work, opaque);
+}
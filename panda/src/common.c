@@ -6,7 +6,7 @@
 #include "panda/debug.h"
 #include "panda/plugin.h"
 #include "panda/common.h"
-// #include "panda/plog-cc-bridge.h"
+#include "panda/pandalog.h"
 
 #if defined(TARGET_ARM) && defined(CONFIG_SOFTMMU) && defined(TARGET_LATER)
 #include "target/arm/internals.h"
@@ -247,9 +247,7 @@ void panda_set_os_name(char *os_name) {
 void panda_cleanup(void) {
     // PANDA: unload plugins
     panda_unload_plugins();
-    // if (pandalog) {
-        // pandalog_cc_close();
-    // }
+    pandalog_close();
 }
 
 #ifdef NO_INCLUDE
@@ -0,0 +1,292 @@
+/* PANDABEGINCOMMENT
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+/*
+ * Shared-memory event export; see include/panda/export.h and, for the
+ * ring protocol, include/panda/export-abi.h.
+ *
+ * Each vCPU only ever writes its own ring, so producing an event is a
+ * few stores and one release store of head. The producer keeps its own
+ * copy of the consumer's tail and only rereads the shared one when the
+ * ring looks full, so the two sides don't bounce the tail's cache line
+ * on every record.
+ *
+ * The export is published with RCU: the callbacks run inside cpu_exec's
+ * read-side critical section, and panda_export_stop() frees the memory
+ * after a grace period.
+ *
+ * That is also why a blocking producer doesn't wait where it produces:
+ * sleeping there would hold up every grace period. Once its ring is
+ * three quarters full it queues work on its vCPU, which runs when the
+ * vCPU leaves cpu_exec at the end of the TB and waits, outside the
+ * read-side critical section and without the BQL, until the consumer
+ * has caught up. Only records that don't fit in the last quarter before
+ * then are dropped.
+ */
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "qemu/memfd.h"
+#include "qemu/rcu.h"
+#include "qemu/main-loop.h"
+#include "qapi/error.h"
+#include "exec/icount.h"
+#include "exec/translation-block.h"
+#include "hw/core/cpu.h"
+#include "panda/debug.h"
+#include "panda/plugin.h"
+#include "panda/common.h"
+#include "panda/export.h"
+
+/* How long a vCPU sleeps while its ring is full and a consumer is attached */
+#define PANDA_EXPORT_BACKOFF_US 20
+
+/* Largest ring we hand out, in records */
+#define PANDA_EXPORT_MAX_RECORDS (1u << 24)
+
+typedef struct PandaExportProducer {
+    PandaExportRing *ring;
+    uint64_t head;              /* as last published */
+    uint64_t tail;              /* as last read; may be behind */
+    bool waiting;               /* panda_export_wait() is queued */
+} PandaExportProducer;
+
+typedef struct PandaExport {
+    struct rcu_head rcu;
+    PandaExportHeader *hdr;
+    size_t size;
+    int fd;
+    uint64_t mask;
+    uint64_t high;              /* records in a ring that stall its vCPU */
+    uint32_t events;
+    bool block;
+    uint32_t nrings;
+    PandaExportProducer prod[];
+} PandaExport;
+
+static PandaExport *panda_export;
+
+/* Owner of the callbacks the export registers */
+static char panda_export_owner;
+
+static bool panda_export_stalls(PandaExport *x)
+{
+    return x->block && qatomic_read(&x->hdr->consumers) &&
+           !qatomic_read(&x->hdr->closed);
+}
+
+/* Whether the ring of @cpu has room again, or @cpu need not wait for it */
+static bool panda_export_room(CPUState *cpu)
+{
+    PandaExport *x;
+    PandaExportProducer *p;
+
+    RCU_READ_LOCK_GUARD();
+    x = qatomic_rcu_read(&panda_export);
+    if (!x || cpu->cpu_index >= x->nrings) {
+        return true;
+    }
+    p = &x->prod[cpu->cpu_index];
+    p->tail = qatomic_load_acquire(&p->ring->tail);
+    if (p->head - p->tail < x->high || !panda_export_stalls(x)) {
+        p->waiting = false;
+        return true;
+    }
+    return false;
+}
+
+/* Run by @cpu outside cpu_exec, with the BQL */
+static void panda_export_wait(CPUState *cpu, run_on_cpu_data data)
+{
+    bql_unlock();
+    while (!panda_export_room(cpu)) {
+        g_usleep(PANDA_EXPORT_BACKOFF_US);
+    }
+    bql_lock();
+}
+
+/* Slot for the next record of @p, or NULL to drop it. */
+static PandaExportRecord *panda_export_slot(CPUState *cpu, PandaExport *x,
+                                            PandaExportProducer *p)
+{
+    if (p->head - p->tail >= x->high) {
+        p->tail = qatomic_load_acquire(&p->ring->tail);
+        if (p->head - p->tail >= x->high && !p->waiting &&
+            panda_export_stalls(x)) {
+            p->waiting = true;
+            async_run_on_cpu(cpu, panda_export_wait, RUN_ON_CPU_NULL);
+        }
+        if (p->head - p->tail > x->mask) {
+            qatomic_set(&p->ring->dropped, p->ring->dropped + 1);
+            return NULL;
+        }
+    }
+    return &p->ring->rec[p->head & x->mask];
+}
+
+static void panda_export_put(CPUState *cpu, uint32_t type, uint32_t size,
+                             uint64_t pc, uint64_t a0, uint64_t a1,
+                             uint64_t a2, uint64_t a3)
+{
+    PandaExport *x = qatomic_rcu_read(&panda_export);
+    PandaExportProducer *p;
+    PandaExportRecord *r;
+
+    if (!x || !(x->events & PANDA_EXPORT_EVENT(type)) ||
+        cpu->cpu_index >= x->nrings) {
+        return;
+    }
+    p = &x->prod[cpu->cpu_index];
+    r = panda_export_slot(cpu, x, p);
+    if (!r) {
+        return;
+    }
+    r->type = type;
+    r->size = size;
+    r->icount = icount_enabled() ? icount_get_raw() : 0;
+    r->pc = pc;
+    r->asid = panda_current_asid(cpu);
+    r->arg[0] = a0;
+    r->arg[1] = a1;
+    r->arg[2] = a2;
+    r->arg[3] = a3;
+    qatomic_store_release(&p->ring->head, ++p->head);
+}
+
+static uint64_t panda_export_tb_pc(CPUState *cpu, TranslationBlock *tb)
+{
+    return tb_cflags(tb) & CF_PCREL ? panda_current_pc(cpu) : tb->pc;
+}
+
+static void panda_export_block_exec(CPUState *cpu, TranslationBlock *tb)
+{
+    panda_export_put(cpu, PANDA_EXPORT_BLOCK_EXEC, tb->size,
+                     panda_export_tb_pc(cpu, tb), tb->icount, 0, 0, 0);
+}
+
+static void panda_export_translate(CPUState *cpu, TranslationBlock *tb)
+{
+    panda_export_put(cpu, PANDA_EXPORT_TRANSLATE, tb->size,
+                     panda_export_tb_pc(cpu, tb), tb->icount,
+                     tb_page_addr0(tb), 0, 0);
+}
+
+static bool panda_export_asid(CPUState *cpu, uint64_t oldval, uint64_t newval)
+{
+    panda_export_put(cpu, PANDA_EXPORT_ASID, 0, panda_current_pc(cpu),
+                     oldval, newval, 0, 0);
+    return false;
+}
+
+void panda_export_syscall(CPUState *cpu, uint64_t no, const uint64_t *args,
+                          unsigned nargs)
+{
+    uint64_t a[4] = { 0 };
+
+    memcpy(a, args, MIN(nargs, ARRAY_SIZE(a)) * sizeof(a[0]));
+    panda_export_put(cpu, PANDA_EXPORT_SYSCALL, no, panda_current_pc(cpu),
+                     a[0], a[1], a[2], a[3]);
+}
+
+int panda_export_start(uint32_t ring_records, uint32_t events, bool block)
+{
+    Error *err = NULL;
+    PandaExportHeader *hdr;
+    PandaExport *x;
+    CPUState *cpu;
+    uint32_t nrings = 0;
+    size_t stride, size;
+    int fd;
+
+    CPU_FOREACH(cpu) {
+        nrings = MAX(nrings, cpu->cpu_index + 1);
+    }
+    events &= PANDA_EXPORT_ALL;
+    if (panda_export || nrings == 0 || events == 0) {
+        LOG_ERROR("export: %s", panda_export ? "already running" :
+                  nrings == 0 ? "no vCPUs yet" : "no events requested");
+        return -1;
+    }
+    ring_records = pow2ceil(MIN(MAX(ring_records, 2),
+                                PANDA_EXPORT_MAX_RECORDS));
+    stride = ROUND_UP(sizeof(PandaExportRing) +
+                      (size_t)ring_records * sizeof(PandaExportRecord),
+                      qemu_real_host_page_size());
+    size = PANDA_EXPORT_HEADER_SIZE + nrings * stride;
+
+    hdr = qemu_memfd_alloc("panda-export", size, 0, &fd, &err);
+    if (!hdr) {
+        LOG_ERROR("export: %s", error_get_pretty(err));
+        error_free(err);
+        return -1;
+    }
+
+    x = g_malloc0(sizeof(*x) + nrings * sizeof(x->prod[0]));
+    x->hdr = hdr;
+    x->size = size;
+    x->fd = fd;
+    x->mask = ring_records - 1;
+    x->high = block ? ring_records - ring_records / 4 : ring_records;
+    x->events = events;
+    x->block = block;
+    x->nrings = nrings;
+    for (uint32_t i = 0; i < nrings; i++) {
+        PandaExportRing *ring = (void *)((uint8_t *)hdr +
+                                         PANDA_EXPORT_HEADER_SIZE +
+                                         i * stride);
+        ring->cpu_index = i;
+        x->prod[i].ring = ring;
+    }
+    hdr->version = PANDA_EXPORT_VERSION;
+    hdr->record_size = sizeof(PandaExportRecord);
+    hdr->nrings = nrings;
+    hdr->ring_records = ring_records;
+    hdr->ring_stride = stride;
+    hdr->events = events;
+    hdr->flags = block ? PANDA_EXPORT_BLOCK : 0;
+    qatomic_store_release(&hdr->magic, PANDA_EXPORT_MAGIC);
+    qatomic_rcu_set(&panda_export, x);
+
+    if (events & PANDA_EXPORT_EVENT(PANDA_EXPORT_BLOCK_EXEC)) {
+        panda_register_callback(&panda_export_owner, PANDA_CB_BEFORE_BLOCK_EXEC,
+                                (panda_cb){ .before_block_exec =
+                                            panda_export_block_exec });
+    }
+    if (events & PANDA_EXPORT_EVENT(PANDA_EXPORT_TRANSLATE)) {
+        panda_register_callback(&panda_export_owner,
+                                PANDA_CB_AFTER_BLOCK_TRANSLATE,
+                                (panda_cb){ .after_block_translate =
+                                            panda_export_translate });
+    }
+    if (events & PANDA_EXPORT_EVENT(PANDA_EXPORT_ASID)) {
+        panda_register_callback(&panda_export_owner, PANDA_CB_ASID_CHANGED,
+                                (panda_cb){ .asid_changed =
+                                            panda_export_asid });
+    }
+
+    LOG_INFO("export: %u rings of %u events in /proc/%d/fd/%d",
+             nrings, ring_records, getpid(), fd);
+    return fd;
+}
+
+static void panda_export_free(PandaExport *x)
+{
+    qemu_memfd_free(x->hdr, x->size, x->fd);
+    g_free(x);
+}
+
+void panda_export_stop(void)
+{
+    PandaExport *x = panda_export;
+
+    if (!x) {
+        return;
+    }
+    panda_unregister_callbacks(&panda_export_owner);
+    qatomic_set(&x->hdr->closed, 1);
+    qatomic_rcu_set(&panda_export, NULL);
+    call_rcu(x, panda_export_free, rcu);
+}
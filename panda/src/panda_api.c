@@ -17,6 +17,7 @@
 #include "system/runstate.h"
 #include "panda/callbacks/cb-support.h"
 #include "panda/wrap_ops.h"
+#include "panda/pandalog.h"
 
 // call main_aux and run everything up to and including panda_callbacks_after_machine_init
 int panda_init(int argc, char **argv, char **envp) {
@@ -26,7 +27,6 @@ int panda_init(int argc, char **argv, char **envp) {
     return 0;
 }
 
-// extern void pandalog_cc_init_write(const char * fname);
 int panda_in_main_loop;
 
 // vl.c
@@ -58,11 +58,11 @@ void panda_stop(int code) {
 //     return 1;
 // }
 
-// void panda_start_pandalog(const char * name) {
-//     pandalog = 1;
-//     pandalog_cc_init_write(name);
-//     printf ("pandalogging to [%s]\n", name);
-// }
+void panda_start_pandalog(const char * name) {
+    if (pandalog_open(name)) {
+        printf ("pandalogging to [%s]\n", name);
+    }
+}
 
 // int panda_revert(char *snapshot_name) {
 //     int ret = load_vmstate(snapshot_name);
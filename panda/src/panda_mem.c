@@ -76,6 +76,153 @@ int panda_physical_memory_write(hwaddr addr,
 }
 
 
+/*
+ * Per-vCPU virt->phys translation cache.
+ *
+ * cpu_get_phys_page_debug() is a full guest page-table walk, and
+ * introspection plugins tend to read many small structures out of the
+ * same handful of pages. We remember recent page translations here,
+ * tagged with panda_current_asid() so that entries from one address
+ * space are never served to another.
+ *
+ * The cache is only touched from the vCPU's own thread (callbacks run
+ * there, as do TLB flushes), so it needs no locking. Callers on other
+ * threads simply walk the page tables as before.
+ *
+ * Entries are dropped whenever QEMU flushes any part of the softmmu TLB
+ * for this vCPU: the guest has to do that for any change in a present
+ * mapping. We can't see guest page sizes, so even a single-page flush
+ * drops everything (a generation bump, so it is cheap). The ASID tag
+ * can't see a page-table base write that keeps the same ASID, so
+ * panda_callbacks_asid_changed() drops the outgoing ASID's entries too.
+ */
+#define PANDA_V2P_SETS 64
+#define PANDA_V2P_WAYS 4
+
+typedef struct PandaV2PEntry {
+    target_ulong vpage;
+    target_ulong asid;
+    hwaddr ppage;
+    uint32_t gen;   /* valid iff equal to the cache generation */
+    bool priv;      /* only resolved after enter_priv() */
+} PandaV2PEntry;
+
+struct PandaV2PCache {
+    uint32_t gen;
+    uint8_t next_way[PANDA_V2P_SETS];
+    PandaV2PEntry set[PANDA_V2P_SETS][PANDA_V2P_WAYS];
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t flushes;
+};
+
+static PandaV2PCache *panda_v2p_cache(CPUState *cpu) {
+    if (!qemu_cpu_is_self(cpu)) {
+        return NULL;
+    }
+    if (unlikely(cpu->panda_v2p == NULL)) {
+        PandaV2PCache *c = g_new0(PandaV2PCache, 1);
+        c->gen = 1;
+        qatomic_set(&cpu->panda_v2p, c);
+    }
+    return cpu->panda_v2p;
+}
+
+static inline PandaV2PEntry *panda_v2p_set(PandaV2PCache *c, target_ulong vpage) {
+    return c->set[(vpage >> TARGET_PAGE_BITS) & (PANDA_V2P_SETS - 1)];
+}
+
+static hwaddr panda_v2p_lookup(PandaV2PCache *c, target_ulong asid,
+                               target_ulong vpage, bool allow_priv) {
+    PandaV2PEntry *set = panda_v2p_set(c, vpage);
+
+    for (int i = 0; i < PANDA_V2P_WAYS; i++) {
+        PandaV2PEntry *e = &set[i];
+        if (e->gen == c->gen && e->vpage == vpage && e->asid == asid &&
+            (allow_priv || !e->priv)) {
+            qatomic_set(&c->hits, c->hits + 1);
+            return e->ppage;
+        }
+    }
+    qatomic_set(&c->misses, c->misses + 1);
+    return -1;
+}
+
+static void panda_v2p_insert(PandaV2PCache *c, target_ulong asid,
+                             target_ulong vpage, hwaddr ppage, bool priv) {
+    unsigned idx = (vpage >> TARGET_PAGE_BITS) & (PANDA_V2P_SETS - 1);
+    PandaV2PEntry *e = &c->set[idx][c->next_way[idx]];
+
+    c->next_way[idx] = (c->next_way[idx] + 1) % PANDA_V2P_WAYS;
+    e->vpage = vpage;
+    e->asid = asid;
+    e->ppage = ppage;
+    e->priv = priv;
+    e->gen = c->gen;
+}
+
+/**
+ * panda_v2p_cache_flush() - Drop every cached translation of a vCPU.
+ * @cpu: Cpu state.
+ *
+ * Called from every softmmu TLB flush path; must run on @cpu's thread.
+ * The ASID can change without panda_callbacks_asid_changed() (loadvm,
+ * reset), but never without a flush, so this also has the vCPU recheck
+ * which ASID-scoped callbacks are in scope.
+ */
+void panda_v2p_cache_flush(CPUState *cpu) {
+    PandaV2PCache *c = cpu->panda_v2p;
+
+    cpu->panda_cb_asid_dirty = true;
+
+    if (c == NULL) {
+        return;
+    }
+    if (++c->gen == 0) {
+        memset(c->set, 0, sizeof(c->set));
+        c->gen = 1;
+    }
+    qatomic_set(&c->flushes, c->flushes + 1);
+}
+
+/**
+ * panda_v2p_cache_drop_asid() - Drop cached translations of one ASID.
+ * @cpu: Cpu state.
+ * @asid: ASID as returned by panda_current_asid().
+ */
+void panda_v2p_cache_drop_asid(CPUState *cpu, target_ulong asid) {
+    PandaV2PCache *c = cpu->panda_v2p;
+
+    if (c == NULL) {
+        return;
+    }
+    for (int s = 0; s < PANDA_V2P_SETS; s++) {
+        for (int i = 0; i < PANDA_V2P_WAYS; i++) {
+            if (c->set[s][i].asid == asid) {
+                c->set[s][i].gen = 0;
+            }
+        }
+    }
+}
+
+/**
+ * panda_v2p_cache_stats() - Read a vCPU's translation cache counters.
+ * @cpu: Cpu state.
+ * @stats: Filled in with the hit, miss and flush counts so far.
+ *
+ * May be called from any thread; the counts are a racy snapshot.
+ */
+void panda_v2p_cache_stats(CPUState *cpu, panda_v2p_stats *stats) {
+    PandaV2PCache *c = qatomic_read(&cpu->panda_v2p);
+
+    memset(stats, 0, sizeof(*stats));
+    if (c != NULL) {
+        stats->hits = qatomic_read(&c->hits);
+        stats->misses = qatomic_read(&c->misses);
+        stats->flushes = qatomic_read(&c->flushes);
+    }
+}
+
 /**
  * panda_virt_to_phys() - Translate guest virtual to physical address.
  * @env: Cpu state.
@@ -91,17 +238,55 @@ hwaddr panda_virt_to_phys(CPUState *env, target_ulong addr) {
     target_ulong page;
     hwaddr phys_addr;
     MemTxAttrs attrs = {};
+    PandaV2PCache *cache = panda_v2p_cache(env);
+    target_ulong asid = 0;
     attrs.user = false;
     page = addr & TARGET_PAGE_MASK;
-    phys_addr = cpu_get_phys_page_attrs_debug(env, page, &attrs);
+    phys_addr = -1;
+    if (cache) {
+        asid = panda_current_asid(env);
+        phys_addr = panda_v2p_lookup(cache, asid, page, false);
+    }
     if (phys_addr == -1) {
-        // no physical page mapped
-        return -1;
+        phys_addr = cpu_get_phys_page_attrs_debug(env, page, &attrs);
+        if (phys_addr == -1) {
+            // no physical page mapped
+            return -1;
+        }
+        if (cache) {
+            panda_v2p_insert(cache, asid, page, phys_addr, false);
+        }
     }
     phys_addr += (addr & ~TARGET_PAGE_MASK);
     return phys_addr;
 }
 
+/*
+ * Translate one guest virtual page, going through the vCPU's cache and
+ * entering privileged mode if that is what it takes. *changed_priv
+ * records whether we did; the caller must exit_priv() once it is done
+ * with the whole access.
+ */
+static hwaddr panda_virt_page_translate(CPUState *env, PandaV2PCache *cache,
+                                        target_ulong asid, target_ulong page,
+                                        bool *changed_priv) {
+    hwaddr phys_addr = cache ? panda_v2p_lookup(cache, asid, page, true) : -1;
+
+    if (phys_addr != -1) {
+        return phys_addr;
+    }
+    phys_addr = cpu_get_phys_page_debug(env, page);
+    // If we failed and we aren't in priv mode and we CAN go into it, toggle modes and try again
+    if (phys_addr == -1 && !*changed_priv && (*changed_priv = enter_priv(env))) {
+        phys_addr = cpu_get_phys_page_debug(env, page);
+        //if (phys_addr != -1) printf("[panda dbg] virt->phys failed until privileged mode\n");
+    }
+    if (phys_addr != -1 && cache) {
+        panda_v2p_insert(cache, asid, page, phys_addr, *changed_priv);
+    }
+    return phys_addr;
+}
+
 /* (not kernel-doc)
  * panda_virtual_memory_rw() - Copy data between host and guest.
  * @env: Cpu sate.
@@ -133,16 +318,13 @@ int panda_virtual_memory_rw(CPUState *env, target_ulong addr,
     hwaddr phys_addr;
     target_ulong page;
     bool changed_priv = false;
+    PandaV2PCache *cache = panda_v2p_cache(env);
+    target_ulong asid = cache ? panda_current_asid(env) : 0;
 
     while (len > 0) {
         page = addr & TARGET_PAGE_MASK;
-        phys_addr = cpu_get_phys_page_debug(env, page);
-        // If we failed and we aren't in priv mode and we CAN go into it, toggle modes and try again
-        if (phys_addr == -1  && !changed_priv && (changed_priv=enter_priv(env))) {
-            phys_addr = cpu_get_phys_page_debug(env, page);
-            //if (phys_addr != -1) printf("[panda dbg] virt->phys failed until privileged mode\n");
-        }
-
+        phys_addr = panda_virt_page_translate(env, cache, asid, page,
+                                              &changed_priv);
         // No physical page mapped, even after potential privileged switch, abort
         if (phys_addr == -1)  {
             if (changed_priv) exit_priv(env); // Cleanup mode if necessary
@@ -239,6 +421,321 @@ void *panda_map_virt_to_host(CPUState *env, target_ulong addr,
 }
 
 
+static void panda_mem_spans_push(panda_mem_spans *spans, const uint8_t *ptr,
+                                 size_t len, bool bounce) {
+    if (!bounce && spans->n > 0) {
+        panda_mem_span *last = &spans->span[spans->n - 1];
+        // Guest-contiguous RAM that is also host-contiguous: grow the span
+        if (!last->bounce && last->ptr + last->len == ptr) {
+            last->len += len;
+            return;
+        }
+    }
+    if (spans->n == spans->alloc) {
+        spans->alloc = MAX(8, spans->alloc * 2);
+        spans->span = g_renew(panda_mem_span, spans->span, spans->alloc);
+    }
+    spans->span[spans->n++] = (panda_mem_span) {
+        .ptr = ptr, .len = len, .bounce = bounce,
+    };
+}
+
+static int panda_physical_memory_spans_append(hwaddr addr, size_t len,
+                                              panda_mem_spans *spans) {
+    while (len > 0) {
+        hwaddr l = len;
+        hwaddr addr1;
+        MemoryRegion *mr = address_space_translate(&address_space_memory, addr,
+                                                   &addr1, &l, false,
+                                                   MEMTXATTRS_UNSPECIFIED);
+        if (l == 0) {
+            return MEMTX_ERROR;
+        }
+        if (memory_access_is_direct(mr, false, MEMTXATTRS_UNSPECIFIED)) {
+            panda_mem_spans_push(spans, qemu_map_ram_ptr(mr->ram_block, addr1),
+                                 l, false);
+        } else {
+            // MMIO has no host backing; read it once into a bounce buffer
+            uint8_t *bounce = g_malloc(l);
+            if (address_space_read(&address_space_memory, addr,
+                                   MEMTXATTRS_UNSPECIFIED, bounce, l) != MEMTX_OK) {
+                g_free(bounce);
+                return MEMTX_ERROR;
+            }
+            panda_mem_spans_push(spans, bounce, l, true);
+        }
+        addr += l;
+        len -= l;
+    }
+    return MEMTX_OK;
+}
+
+/**
+ * panda_physical_memory_spans() - Map a guest physical range into the host.
+ * @addr: Guest physical address of the start of the range.
+ * @len: Length of the range in bytes.
+ * @spans: Overwritten with host spans covering the range, in order.
+ *
+ * Returns read-only host pointers straight into guest RAM, so scanners
+ * can work on guest memory without copying it. Adjacent pages that are
+ * also adjacent on the host are merged into one span. Only parts of the
+ * range that are not RAM (MMIO) are copied, into bounce buffers.
+ *
+ * Must be called inside an RCU read-side critical section; the pointers
+ * are valid until it ends, and until panda_mem_spans_release().
+ *
+ * Return:
+ * * MEMTX_OK      - @spans covers the whole range
+ * * MEMTX_ERROR   - An error; @spans is left empty
+ */
+int panda_physical_memory_spans(hwaddr addr, size_t len,
+                                panda_mem_spans *spans) {
+    int ret;
+
+    memset(spans, 0, sizeof(*spans));
+    ret = panda_physical_memory_spans_append(addr, len, spans);
+    if (ret != MEMTX_OK) {
+        panda_mem_spans_release(spans);
+    }
+    return ret;
+}
+
+/**
+ * panda_virtual_memory_spans() - Map a guest virtual range into the host.
+ * @env: Cpu state.
+ * @addr: Guest virtual address of the start of the range.
+ * @len: Length of the range in bytes.
+ * @spans: Overwritten with host spans covering the range, in order.
+ *
+ * As panda_physical_memory_spans(), translating each page the same way
+ * panda_virtual_memory_rw() does.
+ *
+ * Return:
+ * * 0      - @spans covers the whole range
+ * * -1     - An error; @spans is left empty
+ */
+int panda_virtual_memory_spans(CPUState *env, target_ulong addr, size_t len,
+                               panda_mem_spans *spans) {
+    bool changed_priv = false;
+    PandaV2PCache *cache = panda_v2p_cache(env);
+    target_ulong asid = cache ? panda_current_asid(env) : 0;
+    int ret = 0;
+
+    memset(spans, 0, sizeof(*spans));
+    while (len > 0) {
+        target_ulong page = addr & TARGET_PAGE_MASK;
+        size_t l = MIN((size_t)((page + TARGET_PAGE_SIZE) - addr), len);
+        hwaddr phys_addr = panda_virt_page_translate(env, cache, asid, page,
+                                                     &changed_priv);
+        if (phys_addr == -1 ||
+            panda_physical_memory_spans_append(phys_addr + (addr & ~TARGET_PAGE_MASK),
+                                               l, spans) != MEMTX_OK) {
+            ret = -1;
+            break;
+        }
+        len -= l;
+        addr += l;
+    }
+    if (changed_priv) exit_priv(env);
+    if (ret != 0) {
+        panda_mem_spans_release(spans);
+    }
+    return ret;
+}
+
+/**
+ * panda_mem_spans_release() - Free a span list.
+ * @spans: Spans filled in by panda_physical_memory_spans() or
+ *    panda_virtual_memory_spans().
+ *
+ * Frees any bounce buffers and leaves @spans empty.
+ */
+void panda_mem_spans_release(panda_mem_spans *spans) {
+    for (size_t i = 0; i < spans->n; i++) {
+        if (spans->span[i].bounce) {
+            g_free((void *)spans->span[i].ptr);
+        }
+    }
+    g_free(spans->span);
+    memset(spans, 0, sizeof(*spans));
+}
+
+
+static int panda_mem_iov_cmp(const void *a, const void *b) {
+    const panda_mem_iov *x = *(panda_mem_iov * const *)a;
+    const panda_mem_iov *y = *(panda_mem_iov * const *)b;
+
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+/**
+ * panda_virtual_memory_read_iov() - Read many small guest ranges at once.
+ * @env: Cpu state.
+ * @iov: Requests; each entry's ret is set to 0 or -1.
+ * @n: Number of entries in @iov.
+ *
+ * Equivalent to calling panda_virtual_memory_read() on every entry, but
+ * the requests are visited in address order so that each guest page is
+ * translated once, and privileged mode is entered at most once for the
+ * whole batch. A failed entry does not stop the others.
+ *
+ * Return: The number of entries that failed.
+ */
+int panda_virtual_memory_read_iov(CPUState *env, panda_mem_iov *iov, size_t n) {
+    g_autofree panda_mem_iov **order = g_new(panda_mem_iov *, n);
+    bool changed_priv = false;
+    PandaV2PCache *cache = panda_v2p_cache(env);
+    target_ulong asid = cache ? panda_current_asid(env) : 0;
+    target_ulong last_page = 0;
+    hwaddr last_phys = -1;
+    bool have_last = false;
+    int failed = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        order[i] = &iov[i];
+    }
+    qsort(order, n, sizeof(*order), panda_mem_iov_cmp);
+
+    for (size_t i = 0; i < n; i++) {
+        panda_mem_iov *v = order[i];
+        target_ulong addr = v->addr;
+        uint8_t *buf = v->buf;
+        size_t len = v->len;
+
+        v->ret = 0;
+        while (len > 0) {
+            target_ulong page = addr & TARGET_PAGE_MASK;
+            size_t l = MIN((size_t)((page + TARGET_PAGE_SIZE) - addr), len);
+
+            if (!have_last || page != last_page) {
+                last_phys = panda_virt_page_translate(env, cache, asid, page,
+                                                      &changed_priv);
+                last_page = page;
+                have_last = true;
+            }
+            if (last_phys == -1 ||
+                panda_physical_memory_rw(last_phys + (addr & ~TARGET_PAGE_MASK),
+                                         buf, l, false) != MEMTX_OK) {
+                v->ret = -1;
+                failed++;
+                break;
+            }
+            len -= l;
+            buf += l;
+            addr += l;
+        }
+    }
+    if (changed_priv) exit_priv(env);
+    return failed;
+}
+
+/**
+ * panda_virtual_memory_read_string() - Read a NUL-terminated guest string.
+ * @env: Cpu state.
+ * @addr: Guest virtual address of the string.
+ * @buf: Host buffer of @size bytes; always NUL-terminated on success.
+ * @size: Size of @buf, including room for the terminator.
+ *
+ * Reads page by page directly out of guest RAM, finding the terminator
+ * with memchr() rather than copying a byte at a time. A string longer
+ * than @size - 1 is truncated.
+ *
+ * Return: The length of the string copied into @buf, or -1 if a page
+ * before the terminator is unmapped or not RAM.
+ */
+int panda_virtual_memory_read_string(CPUState *env, target_ulong addr,
+                                     char *buf, size_t size) {
+    bool changed_priv = false;
+    PandaV2PCache *cache = panda_v2p_cache(env);
+    target_ulong asid = cache ? panda_current_asid(env) : 0;
+    size_t got = 0;
+    int ret = -1;
+
+    if (size == 0 || size - 1 > INT_MAX) {
+        return -1;
+    }
+
+    RCU_READ_LOCK_GUARD();
+    while (got < size - 1) {
+        target_ulong page = addr & TARGET_PAGE_MASK;
+        hwaddr l = MIN((size_t)((page + TARGET_PAGE_SIZE) - addr), size - 1 - got);
+        hwaddr addr1;
+        hwaddr phys_addr = panda_virt_page_translate(env, cache, asid, page,
+                                                     &changed_priv);
+        MemoryRegion *mr;
+        const uint8_t *src, *nul;
+        size_t n;
+
+        if (phys_addr == -1) {
+            break;
+        }
+        mr = address_space_translate(&address_space_memory,
+                                     phys_addr + (addr & ~TARGET_PAGE_MASK),
+                                     &addr1, &l, false, MEMTXATTRS_UNSPECIFIED);
+        if (l == 0 || !memory_access_is_direct(mr, false, MEMTXATTRS_UNSPECIFIED)) {
+            break;
+        }
+        src = qemu_map_ram_ptr(mr->ram_block, addr1);
+        nul = memchr(src, 0, l);
+        n = nul ? nul - src : l;
+        memcpy(buf + got, src, n);
+        got += n;
+        addr += n;
+        if (nul || got == size - 1) {
+            buf[got] = 0;
+            ret = got;
+            break;
+        }
+    }
+    if (changed_priv) exit_priv(env);
+    return ret;
+}
+
+/**
+ * panda_virtual_memory_read_array() - Read an array of fixed-size structs.
+ * @env: Cpu state.
+ * @addr: Guest virtual address of the first element.
+ * @buf: Host buffer of at least @elem_size * @count bytes.
+ * @elem_size: Size of one element in bytes.
+ * @count: Number of elements to read.
+ *
+ * Elements may straddle page boundaries. Reading stops at the first
+ * unmapped page, so a caller walking a table of unknown extent gets
+ * every element that was readable.
+ *
+ * Return: The number of whole elements copied into @buf.
+ */
+size_t panda_virtual_memory_read_array(CPUState *env, target_ulong addr,
+                                       void *buf, size_t elem_size,
+                                       size_t count) {
+    bool changed_priv = false;
+    PandaV2PCache *cache = panda_v2p_cache(env);
+    target_ulong asid = cache ? panda_current_asid(env) : 0;
+    uint8_t *out = buf;
+    size_t len, done = 0;
+
+    if (elem_size == 0 || count > SIZE_MAX / elem_size) {
+        return 0;
+    }
+    len = elem_size * count;
+    while (done < len) {
+        target_ulong page = addr & TARGET_PAGE_MASK;
+        size_t l = MIN((size_t)((page + TARGET_PAGE_SIZE) - addr), len - done);
+        hwaddr phys_addr = panda_virt_page_translate(env, cache, asid, page,
+                                                     &changed_priv);
+
+        if (phys_addr == -1 ||
+            panda_physical_memory_rw(phys_addr + (addr & ~TARGET_PAGE_MASK),
+                                     out + done, l, false) != MEMTX_OK) {
+            break;
+        }
+        done += l;
+        addr += l;
+    }
+    if (changed_priv) exit_priv(env);
+    return done / elem_size;
+}
+
 /**
  * PandaPhysicalAddressToRamOffset() - Translate guest physical address to ram offset.
  * @out: A pointer to the ram_offset_t, which will be written by this function.
@@ -0,0 +1,321 @@
+/* PANDABEGINCOMMENT
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+/*
+ * Guest RAM dumps.
+ *
+ * A dump is a sparse raw image in which file offset == guest physical
+ * address, so offline tools (Volatility and friends) can mmap it
+ * directly. Zero pages and holes in the physical map are never written
+ * and cost no disk space. Next to it, <path>.layout lists the RAM
+ * ranges in the image, one "start size name" line each, so a reader can
+ * tell holes from zero-filled RAM.
+ *
+ * The RAM ranges come straight from the flat view of system memory, so
+ * each one is a span of some RAMBlock's host mapping. Ranges are cut
+ * into PANDA_MEMDUMP_UNIT pieces that a pool of threads claims, scans
+ * with buffer_is_zero() and writes with pwrite(). Streams that can't
+ * take pwrite() get the same image written sequentially, zeros included.
+ */
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/thread.h"
+#include "qemu/rcu.h"
+#include "exec/target_page.h"
+#include "system/memory.h"
+#include "system/address-spaces.h"
+#include "panda/debug.h"
+#include "panda/plugin.h"
+
+#define PANDA_MEMDUMP_UNIT          (2 * MiB)
+#define PANDA_MEMDUMP_MAX_THREADS   16
+
+typedef struct PandaMemDumpRange {
+    hwaddr start;
+    uint64_t size;
+    const uint8_t *host;
+    const char *name;
+} PandaMemDumpRange;
+
+typedef struct PandaMemDump {
+    int fd;
+    off_t base;                 /* file offset of guest physical 0 */
+    GArray *ranges;             /* PandaMemDumpRange */
+    uint64_t nunits;            /* total work units over all ranges */
+    uint64_t next_unit;         /* claimed with qatomic_fetch_inc */
+    int error;                  /* first -errno seen by a worker */
+} PandaMemDump;
+
+static bool panda_memdump_collect(Int128 start, Int128 len,
+                                  const MemoryRegion *mr,
+                                  hwaddr offset_in_region, void *opaque)
+{
+    PandaMemDump *d = opaque;
+    MemoryRegion *m = (MemoryRegion *)mr;
+    PandaMemDumpRange r;
+
+    if (!memory_region_is_ram(m) || memory_region_is_ram_device(m)) {
+        return false;
+    }
+    r.start = int128_get64(start);
+    r.size = int128_get64(len);
+    r.host = (const uint8_t *)memory_region_get_ram_ptr(m) + offset_in_region;
+    r.name = memory_region_name(m);
+    g_array_append_val(d->ranges, r);
+    d->nunits += DIV_ROUND_UP(r.size, PANDA_MEMDUMP_UNIT);
+    return false;
+}
+
+/* Write the non-zero pages of [host, host + len) to guest address gpa. */
+static int panda_memdump_unit(PandaMemDump *d, const uint8_t *host,
+                              hwaddr gpa, uint64_t len)
+{
+    uint64_t run = 0;       /* start of the current non-zero run */
+    bool in_run = false;
+
+    for (uint64_t off = 0; ; off += TARGET_PAGE_SIZE) {
+        bool at_end = off >= len;
+        bool zero = at_end ||
+                    buffer_is_zero(host + off, MIN(TARGET_PAGE_SIZE, len - off));
+
+        if (!zero && !in_run) {
+            run = off;
+            in_run = true;
+        } else if (zero && in_run) {
+            const uint8_t *p = host + run;
+            uint64_t n = MIN(off, len) - run;
+            off_t pos = d->base + gpa + run;
+
+            while (n > 0) {
+                ssize_t w = pwrite(d->fd, p, n, pos);
+                if (w < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return -errno;
+                }
+                p += w;
+                pos += w;
+                n -= w;
+            }
+            in_run = false;
+        }
+        if (at_end) {
+            return 0;
+        }
+    }
+}
+
+static void *panda_memdump_worker(void *opaque)
+{
+    PandaMemDump *d = opaque;
+
+    for (;;) {
+        uint64_t unit = qatomic_fetch_inc(&d->next_unit);
+        PandaMemDumpRange *r = NULL;
+        uint64_t off;
+        int ret;
+
+        if (unit >= d->nunits || qatomic_read(&d->error)) {
+            break;
+        }
+        // Find the range this unit falls in; there are only a handful
+        for (guint i = 0; i < d->ranges->len; i++) {
+            PandaMemDumpRange *c = &g_array_index(d->ranges, PandaMemDumpRange, i);
+            uint64_t n = DIV_ROUND_UP(c->size, PANDA_MEMDUMP_UNIT);
+            if (unit < n) {
+                r = c;
+                break;
+            }
+            unit -= n;
+        }
+        off = unit * PANDA_MEMDUMP_UNIT;
+        ret = panda_memdump_unit(d, r->host + off, r->start + off,
+                                 MIN(PANDA_MEMDUMP_UNIT, r->size - off));
+        if (ret < 0) {
+            qatomic_cmpxchg(&d->error, 0, ret);
+        }
+    }
+    return NULL;
+}
+
+static int panda_memdump_layout(PandaMemDump *d, const char *path)
+{
+    g_autofree char *layout = g_strdup_printf("%s.layout", path);
+    FILE *f = fopen(layout, "w");
+
+    if (f == NULL) {
+        return -errno;
+    }
+    for (guint i = 0; i < d->ranges->len; i++) {
+        PandaMemDumpRange *r = &g_array_index(d->ranges, PandaMemDumpRange, i);
+        fprintf(f, "0x%016" PRIx64 " 0x%016" PRIx64 " %s\n",
+                (uint64_t)r->start, r->size, r->name);
+    }
+    return fclose(f) == 0 ? 0 : -errno;
+}
+
+/*
+ * Collect the RAM ranges of system memory into d->ranges, in address
+ * order, and return the end of the highest one. Call with the RCU read
+ * lock held, and keep holding it while the ranges are in use.
+ */
+static uint64_t panda_memdump_ranges(PandaMemDump *d)
+{
+    uint64_t end = 0;
+
+    flatview_for_each_range(address_space_to_flatview(&address_space_memory),
+                            panda_memdump_collect, d);
+
+    for (guint i = 0; i < d->ranges->len; i++) {
+        PandaMemDumpRange *r = &g_array_index(d->ranges, PandaMemDumpRange, i);
+        end = MAX(end, r->start + r->size);
+    }
+    return end;
+}
+
+/*
+ * Dump guest RAM into d->fd starting at file offset d->base, and write
+ * the layout next to @path unless it is NULL. Returns 0 or -errno.
+ */
+static int panda_memdump_fd(PandaMemDump *d, const char *path,
+                            unsigned nthreads)
+{
+    QemuThread threads[PANDA_MEMDUMP_MAX_THREADS];
+    uint64_t end;
+
+    if (nthreads == 0) {
+        nthreads = MIN(sysconf(_SC_NPROCESSORS_ONLN), 8);
+    }
+    nthreads = MAX(1, MIN(nthreads, PANDA_MEMDUMP_MAX_THREADS));
+
+    // Hold the read lock until we are done: it keeps the flat view, and
+    // with it the RAM host mappings and region names, alive.
+    RCU_READ_LOCK_GUARD();
+    end = panda_memdump_ranges(d);
+
+    // Size the file up front so every skipped page is a hole
+    if (ftruncate(d->fd, d->base + end) < 0) {
+        return -errno;
+    }
+
+    for (unsigned i = 0; i < nthreads; i++) {
+        qemu_thread_create(&threads[i], "panda-memdump", panda_memdump_worker,
+                           d, QEMU_THREAD_JOINABLE);
+    }
+    for (unsigned i = 0; i < nthreads; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    if (d->error == 0 && path != NULL) {
+        return panda_memdump_layout(d, path);
+    }
+    return d->error;
+}
+
+/*
+ * Write the same image as panda_memdump_fd() to @f with plain sequential
+ * writes, holes and zero pages included, for streams we can't seek in:
+ * pipes, sockets, files opened for appending. Returns 0 or -errno.
+ */
+static int panda_memdump_stream(PandaMemDump *d, FILE *f)
+{
+    static const uint8_t zeros[64 * KiB];
+    uint64_t pos = 0;
+
+    RCU_READ_LOCK_GUARD();
+    panda_memdump_ranges(d);
+
+    for (guint i = 0; i < d->ranges->len; i++) {
+        PandaMemDumpRange *r = &g_array_index(d->ranges, PandaMemDumpRange, i);
+
+        while (pos < r->start) {
+            size_t n = MIN(sizeof(zeros), r->start - pos);
+            if (fwrite(zeros, 1, n, f) != n) {
+                return errno ? -errno : -EIO;
+            }
+            pos += n;
+        }
+        if (fwrite(r->host, 1, r->size, f) != r->size) {
+            return errno ? -errno : -EIO;
+        }
+        pos += r->size;
+    }
+    return fflush(f) == 0 ? 0 : -errno;
+}
+
+/**
+ * panda_memdump() - Write a sparse image of guest RAM.
+ * @path: Image file; created or truncated. The layout goes to
+ *    @path.layout.
+ * @nthreads: Worker threads, or 0 for a default based on host CPUs.
+ *
+ * Call with the guest stopped, or the image will not be consistent.
+ *
+ * Return: 0 on success, or a negative errno.
+ */
+int panda_memdump(const char *path, unsigned nthreads)
+{
+    PandaMemDump d = { .base = 0 };
+    int ret;
+
+    d.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (d.fd < 0) {
+        ret = -errno;
+        LOG_ERROR("can't create %s: %s", path, strerror(-ret));
+        return ret;
+    }
+    d.ranges = g_array_new(false, false, sizeof(PandaMemDumpRange));
+    ret = panda_memdump_fd(&d, path, nthreads);
+    if (close(d.fd) < 0 && ret == 0) {
+        ret = -errno;
+    }
+    if (ret < 0) {
+        LOG_ERROR("dumping guest RAM to %s failed: %s", path, strerror(-ret));
+    }
+    g_array_free(d.ranges, true);
+    return ret;
+}
+
+/**
+ * panda_memsavep() - Save RAM to a file.
+ * @f: An open and writeable file pointer.
+ *
+ * Writes the same sparse image as panda_memdump(), starting at the
+ * current position of @f, and leaves @f positioned after it. No layout
+ * file is written; use panda_memdump() for that.
+ *
+ * If @f can't be seeked (a pipe, say) or was opened for appending, the
+ * image is written sequentially instead, with holes and zero pages
+ * filled in: same layout, but no longer sparse.
+ */
+void panda_memsavep(FILE *f)
+{
+    PandaMemDump d;
+    int flags;
+    int ret;
+
+    if (!f) return;
+    fflush(f);
+    d = (PandaMemDump) {
+        .fd = fileno(f),
+        .base = ftello(f),
+        .ranges = g_array_new(false, false, sizeof(PandaMemDumpRange)),
+    };
+    flags = fcntl(d.fd, F_GETFL);
+    if (d.base < 0 || (flags >= 0 && (flags & O_APPEND))) {
+        // pwrite() would fail, or land at the end of the file regardless
+        // of the offset we ask for
+        ret = panda_memdump_stream(&d, f);
+    } else {
+        ret = panda_memdump_fd(&d, NULL, 0);
+        fseeko(f, 0, SEEK_END);
+    }
+    if (ret < 0) {
+        LOG_ERROR("dumping guest RAM failed: %s", strerror(-ret));
+    }
+    g_array_free(d.ranges, true);
+}
@@ -2,10 +2,17 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include "qemu/lockable.h"
 #include "panda/debug.h"
 #include "panda/plugin.h"
 #include "panda/common.h"
 #include "exec/translator.h"
+#include "qemu/plugin.h"
+#include "exec/translation-block.h"
+#include "exec/tb-flush.h"
+#include "hw/core/cpu.h"
+#include "system/tcg.h"
+#include "panda/callbacks/cb-support.h"
 #include "panda/panda_qemu_plugin_helpers.h"
 
 
@@ -23,23 +30,200 @@ TranslationBlock * panda_get_tb(struct qemu_plugin_tb *tb){
     return db->tb;
 }
 
+static uint32_t panda_instr_bit(panda_cb_type type){
+    switch (type) {
+    case PANDA_CB_START_BLOCK_EXEC:
+        return PANDA_INSTR_START_BLOCK_EXEC;
+    case PANDA_CB_END_BLOCK_EXEC:
+        return PANDA_INSTR_END_BLOCK_EXEC;
+    case PANDA_CB_INSN_EXEC:
+        return PANDA_INSTR_INSN_EXEC;
+    case PANDA_CB_MEM_BATCH:
+        return PANDA_INSTR_MEM_BATCH;
+    case PANDA_CB_VIRT_MEM_AFTER_READ:
+    case PANDA_CB_PHYS_MEM_AFTER_READ:
+        return PANDA_INSTR_MEM_READ;
+    case PANDA_CB_VIRT_MEM_AFTER_WRITE:
+    case PANDA_CB_PHYS_MEM_AFTER_WRITE:
+        return PANDA_INSTR_MEM_WRITE;
+    default:
+        return 0;
+    }
+}
+
+uint32_t panda_instr_wanted(void){
+    static const panda_cb_type types[] = {
+        PANDA_CB_START_BLOCK_EXEC,
+        PANDA_CB_END_BLOCK_EXEC,
+        PANDA_CB_INSN_EXEC,
+        PANDA_CB_MEM_BATCH,
+        PANDA_CB_VIRT_MEM_AFTER_READ,
+        PANDA_CB_PHYS_MEM_AFTER_READ,
+        PANDA_CB_VIRT_MEM_AFTER_WRITE,
+        PANDA_CB_PHYS_MEM_AFTER_WRITE,
+    };
+    uint32_t wanted = 0;
+
+    for (size_t i = 0; i < ARRAY_SIZE(types); i++) {
+        if (qatomic_read(&panda_cb_tables[types[i]]) != NULL) {
+            wanted |= panda_instr_bit(types[i]);
+        }
+    }
+    return wanted;
+}
+
+void panda_set_tb_instr(TranslationBlock *tb, uint32_t instr,
+                       uint64_t pc_lo, uint64_t pc_hi){
+    tb->panda_instr = instr;
+    tb->panda_pc_lo = pc_lo;
+    tb->panda_pc_hi = pc_hi;
+}
+
+static bool panda_tb_instr_stale(const TranslationBlock *tb, void *opaque){
+    uint32_t mask = (uintptr_t)opaque;
+    return ((tb->panda_instr ^ panda_instr_wanted()) & mask) != 0;
+}
+
+/* tb_phys_invalidate() also drops the TBs from every jump cache. */
+static void panda_do_retranslate(CPUState *cpu, run_on_cpu_data data){
+    tb_invalidate_matching__exclusive_or_serial(panda_tb_instr_stale,
+                                                data.host_ptr);
+}
+
+/*
+ * Called when @type gains its first or loses its last subscriber.
+ * Rather than flushing the whole code cache, drop only the TBs whose
+ * emitted instrumentation for @type no longer matches.
+ */
+void panda_instr_subscribers_changed(panda_cb_type type){
+    uint32_t bit = panda_instr_bit(type);
+
+    if (bit == 0 || !tcg_enabled() || first_cpu == NULL) {
+        return;
+    }
+    async_safe_run_on_cpu(first_cpu, panda_do_retranslate,
+                          RUN_ON_CPU_HOST_PTR((void *)(uintptr_t)bit));
+}
+
 static bool panda_has_callback_registered(panda_cb_type type){
-    return panda_cbs[type] != NULL;
+    return qatomic_read(&panda_cb_tables[type]) != NULL;
+}
+
+static panda_mem_ranges_hook_t panda_mem_ranges_hook;
+static panda_mem_range panda_mem_ranges[PANDA_MEM_RANGE_SLOTS];
+
+void panda_set_mem_ranges_hook(panda_mem_ranges_hook_t hook){
+    panda_mem_ranges_hook = hook;
+}
+
+void panda_get_mem_ranges(panda_mem_range *ranges){
+    for (int i = 0; i < PANDA_MEM_RANGE_SLOTS; i++) {
+        ranges[i].lo = qatomic_read(&panda_mem_ranges[i].lo);
+        ranges[i].hi = qatomic_read(&panda_mem_ranges[i].hi);
+    }
+}
+
+static int panda_mem_range_cmp(const void *a, const void *b){
+    const panda_mem_range *x = a, *y = b;
+    return x->lo < y->lo ? -1 : x->lo > y->lo;
+}
+
+/*
+ * Cover @n sorted ranges with at most PANDA_MEM_RANGE_SLOTS: merge the
+ * overlapping ones, then keep merging the two closest neighbours. The
+ * result may take in addresses no filter wants, which the exact check in
+ * panda_callbacks_mem_access() then rejects.
+ */
+static size_t panda_mem_ranges_fit(panda_mem_range *r, size_t n){
+    size_t m = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        if (m && r[i].lo <= r[m - 1].hi) {
+            r[m - 1].hi = MAX(r[m - 1].hi, r[i].hi);
+        } else {
+            r[m++] = r[i];
+        }
+    }
+    while (m > PANDA_MEM_RANGE_SLOTS) {
+        size_t best = 0;
+
+        for (size_t i = 1; i + 1 < m; i++) {
+            if (r[i + 1].lo - r[i].hi < r[best + 1].lo - r[best].hi) {
+                best = i;
+            }
+        }
+        r[best].hi = r[best + 1].hi;
+        memmove(&r[best + 1], &r[best + 2], (m - best - 2) * sizeof(r[0]));
+        m--;
+    }
+    return m;
+}
+
+/*
+ * The table covers every virtual address filter. Any unfiltered virtual
+ * subscriber, or any physical subscriber (physical addresses are not
+ * known until the helper runs), opens it up completely. Called with
+ * panda_cb_lock held.
+ */
+void panda_mem_filters_changed(void){
+    static const panda_cb_type virt[] = {
+        PANDA_CB_VIRT_MEM_AFTER_READ,
+        PANDA_CB_VIRT_MEM_AFTER_WRITE,
+    };
+    g_autoptr(GArray) all = g_array_new(false, false, sizeof(panda_mem_range));
+    panda_mem_range slots[PANDA_MEM_RANGE_SLOTS] = {};
+    bool open = false;
+    size_t n;
+
+    RCU_READ_LOCK_GUARD();
+    if (panda_has_callback_registered(PANDA_CB_PHYS_MEM_AFTER_READ) ||
+        panda_has_callback_registered(PANDA_CB_PHYS_MEM_AFTER_WRITE)) {
+        open = true;
+    }
+    /* All subscribers, not just those in scope on this thread */
+    for (size_t i = 0; i < ARRAY_SIZE(virt) && !open; i++) {
+        panda_cb_table *tbl = qatomic_rcu_read(&panda_cb_tables[virt[i]]);
+
+        for (size_t j = 0; tbl && j < tbl->n && !open; j++) {
+            const panda_addr_filter *f = tbl->meta[j].filter;
+
+            if (f == NULL) {
+                open = true;
+                break;
+            }
+            for (size_t k = 0; k < f->n; k++) {
+                panda_mem_range r = { f->ranges[k].start, f->ranges[k].end };
+                g_array_append_val(all, r);
+            }
+        }
+    }
+
+    if (open) {
+        slots[0] = (panda_mem_range) { 0, UINT64_MAX };
+    } else if (all->len) {
+        g_array_sort(all, panda_mem_range_cmp);
+        n = panda_mem_ranges_fit((panda_mem_range *)all->data, all->len);
+        memcpy(slots, all->data, n * sizeof(slots[0]));
+    }
+
+    for (int i = 0; i < PANDA_MEM_RANGE_SLOTS; i++) {
+        qatomic_set(&panda_mem_ranges[i].lo, slots[i].lo);
+        qatomic_set(&panda_mem_ranges[i].hi, slots[i].hi);
+    }
+    if (panda_mem_ranges_hook) {
+        panda_mem_ranges_hook(slots);
+    }
 }
 
 int panda_get_memcb_status(void){
     bool read = false;
     bool write = false;
-    if (panda_has_callback_registered(PANDA_CB_PHYS_MEM_BEFORE_READ) 
-    || panda_has_callback_registered(PANDA_CB_VIRT_MEM_BEFORE_READ)
-    || panda_has_callback_registered(PANDA_CB_PHYS_MEM_AFTER_READ)
+    if (panda_has_callback_registered(PANDA_CB_PHYS_MEM_AFTER_READ)
     || panda_has_callback_registered(PANDA_CB_VIRT_MEM_AFTER_READ))
     {
         read = true;
     }
-    if (panda_has_callback_registered(PANDA_CB_PHYS_MEM_BEFORE_WRITE) 
-    || panda_has_callback_registered(PANDA_CB_VIRT_MEM_BEFORE_WRITE)
-    || panda_has_callback_registered(PANDA_CB_PHYS_MEM_AFTER_WRITE)
+    if (panda_has_callback_registered(PANDA_CB_PHYS_MEM_AFTER_WRITE)
     || panda_has_callback_registered(PANDA_CB_VIRT_MEM_AFTER_WRITE))
     {
         write = true;
@@ -54,3 +238,273 @@ int panda_get_memcb_status(void){
         return 0;
     }
 }
+
+/*
+ * A filtered callback is decided by its filter alone; insn_translate is
+ * only asked, once, when an unfiltered callback needs its answer.
+ */
+bool panda_insn_exec_instrument(CPUState *cpu, uint64_t pc){
+    bool asked = false, requested = false;
+
+    PANDA_CB_FOREACH(PANDA_CB_INSN_EXEC, e) {
+        const panda_addr_filter *f = PANDA_CB_META(e)->filter;
+        if (f) {
+            if (panda_addr_filter_match(f, pc)) {
+                return true;
+            }
+            continue;
+        }
+        if (!asked) {
+            requested = panda_callbacks_insn_translate(cpu, pc);
+            asked = true;
+        }
+        if (requested) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * TBs to retranslate after the instructions that get instrumented
+ * changed: those spanning any of @pcs, plus, if @insn_exec, every TB with
+ * INSN_EXEC instrumentation (an unfiltered callback may be anywhere).
+ */
+typedef struct PandaPcChange {
+    panda_addr_filter *pcs;
+    bool insn_exec;
+} PandaPcChange;
+
+static bool panda_tb_spans(const TranslationBlock *tb, const panda_addr_filter *f){
+    size_t lo = 0, hi = f ? f->n : 0;
+
+    /* first range ending above the TB's first byte */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (f->ranges[mid].end <= tb->panda_pc_lo) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return f && lo < f->n && f->ranges[lo].start < tb->panda_pc_hi;
+}
+
+static bool panda_tb_pcs_stale(const TranslationBlock *tb, void *opaque){
+    const PandaPcChange *chg = opaque;
+
+    if (chg->insn_exec && (tb->panda_instr & PANDA_INSTR_INSN_EXEC)) {
+        return true;
+    }
+    return panda_tb_spans(tb, chg->pcs);
+}
+
+static void panda_pc_change_free(PandaPcChange *chg){
+    g_free(chg->pcs);
+    g_free(chg);
+}
+
+static void panda_do_retranslate_pcs(CPUState *cpu, run_on_cpu_data data){
+    tb_invalidate_matching__exclusive_or_serial(panda_tb_pcs_stale,
+                                                data.host_ptr);
+    panda_pc_change_free(data.host_ptr);
+}
+
+static void panda_retranslate_pcs(PandaPcChange *chg){
+    if (tcg_enabled() && first_cpu != NULL) {
+        async_safe_run_on_cpu(first_cpu, panda_do_retranslate_pcs,
+                              RUN_ON_CPU_HOST_PTR(chg));
+    } else {
+        panda_pc_change_free(chg);
+    }
+}
+
+void panda_insn_filters_changed(const panda_addr_filter *old,
+                                const panda_addr_filter *new){
+    PandaPcChange *chg = g_new0(PandaPcChange, 1);
+    size_t n_old = old ? old->n : 0, n_new = new ? new->n : 0;
+    g_autofree panda_addr_range *r = g_new(panda_addr_range, n_old + n_new + 1);
+
+    if (n_old) {
+        memcpy(r, old->ranges, n_old * sizeof(r[0]));
+    }
+    if (n_new) {
+        memcpy(r + n_old, new->ranges, n_new * sizeof(r[0]));
+    }
+    chg->pcs = panda_addr_filter_new(r, n_old + n_new);
+    chg->insn_exec = old == NULL || new == NULL;
+    panda_retranslate_pcs(chg);
+}
+
+/*
+ * Inline instruction counters. Each counter set owns a scoreboard with one
+ * uint64_t per watched PC. The sets are published as an RCU array that the
+ * bridge plugin consults while translating.
+ */
+struct panda_insn_counter {
+    struct qemu_plugin_scoreboard *score;
+    size_t n;
+    uint64_t pcs[];
+};
+
+typedef struct PandaInsnCounterSet {
+    struct rcu_head rcu;
+    size_t n;
+    panda_insn_counter *counters[];
+} PandaInsnCounterSet;
+
+static PandaInsnCounterSet *panda_insn_counters;
+
+static int panda_u64_cmp(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* The TBs a counter's increments were, or will be, emitted into */
+static PandaPcChange *panda_insn_counter_pcs(const panda_insn_counter *c){
+    PandaPcChange *chg = g_new0(PandaPcChange, 1);
+    g_autofree panda_addr_range *r = g_new(panda_addr_range, c->n + 1);
+
+    for (size_t i = 0; i < c->n; i++) {
+        r[i] = (panda_addr_range) { c->pcs[i], c->pcs[i] + 1 };
+    }
+    chg->pcs = panda_addr_filter_new(r, c->n);
+    return chg;
+}
+
+static ssize_t panda_insn_counter_index(const panda_insn_counter *c, uint64_t pc){
+    const uint64_t *p = bsearch(&pc, c->pcs, c->n, sizeof(uint64_t), panda_u64_cmp);
+    return p ? p - c->pcs : -1;
+}
+
+/* Publish the set of counters with @add added and @del removed. */
+static void panda_insn_counters_publish(panda_insn_counter *add,
+                                        panda_insn_counter *del){
+    QEMU_LOCK_GUARD(&panda_cb_lock);
+    PandaInsnCounterSet *old = panda_insn_counters;
+    size_t n = (old ? old->n : 0) + (add ? 1 : 0);
+    PandaInsnCounterSet *set = g_malloc0(sizeof(*set) + n * sizeof(set->counters[0]));
+
+    for (size_t i = 0; old && i < old->n; i++) {
+        if (old->counters[i] != del) {
+            set->counters[set->n++] = old->counters[i];
+        }
+    }
+    if (add) {
+        set->counters[set->n++] = add;
+    }
+    if (set->n == 0) {
+        g_free(set);
+        set = NULL;
+    }
+    qatomic_rcu_set(&panda_insn_counters, set);
+    if (old) {
+        g_free_rcu(old, rcu);
+    }
+}
+
+panda_insn_counter *panda_insn_counter_new(const uint64_t *pcs, size_t n){
+    panda_insn_counter *c = g_malloc0(sizeof(*c) + n * sizeof(uint64_t));
+
+    memcpy(c->pcs, pcs, n * sizeof(uint64_t));
+    qsort(c->pcs, n, sizeof(uint64_t), panda_u64_cmp);
+    for (size_t i = 0; i < n; i++) {
+        if (c->n == 0 || c->pcs[c->n - 1] != c->pcs[i]) {
+            c->pcs[c->n++] = c->pcs[i];
+        }
+    }
+    c->score = qemu_plugin_scoreboard_new(MAX(c->n, 1) * sizeof(uint64_t));
+
+    panda_insn_counters_publish(c, NULL);
+    panda_retranslate_pcs(panda_insn_counter_pcs(c));
+    return c;
+}
+
+uint64_t panda_insn_counter_read(panda_insn_counter *c, uint64_t pc){
+    ssize_t idx = panda_insn_counter_index(c, pc);
+    qemu_plugin_u64 entry = { .score = c->score, .offset = idx * sizeof(uint64_t) };
+
+    assert(idx >= 0);
+    return qemu_plugin_u64_sum(entry);
+}
+
+/* Translated code may still increment the counters until it is invalidated. */
+static void panda_insn_counter_retire(CPUState *cpu, run_on_cpu_data data){
+    panda_insn_counter *c = data.host_ptr;
+    PandaPcChange *chg = panda_insn_counter_pcs(c);
+
+    tb_invalidate_matching__exclusive_or_serial(panda_tb_pcs_stale, chg);
+    panda_pc_change_free(chg);
+    qemu_plugin_scoreboard_free(c->score);
+    g_free(c);
+}
+
+void panda_insn_counter_free(panda_insn_counter *c){
+    panda_insn_counters_publish(NULL, c);
+    if (tcg_enabled() && first_cpu != NULL) {
+        async_safe_run_on_cpu(first_cpu, panda_insn_counter_retire,
+                              RUN_ON_CPU_HOST_PTR(c));
+    } else {
+        qemu_plugin_scoreboard_free(c->score);
+        g_free(c);
+    }
+}
+
+size_t panda_insn_counters_at(uint64_t pc, qemu_plugin_u64 *entries, size_t max){
+    PandaInsnCounterSet *set = qatomic_rcu_read(&panda_insn_counters);
+    size_t found = 0;
+
+    for (size_t i = 0; set && i < set->n; i++) {
+        panda_insn_counter *c = set->counters[i];
+        ssize_t idx = panda_insn_counter_index(c, pc);
+        if (idx < 0) {
+            continue;
+        }
+        if (found < max) {
+            entries[found] = (qemu_plugin_u64) {
+                .score = c->score,
+                .offset = idx * sizeof(uint64_t),
+            };
+        }
+        found++;
+    }
+    return found;
+}
+
+static qemu_plugin_id_t panda_bridge_id;
+
+void panda_set_bridge_id(qemu_plugin_id_t id){
+    panda_bridge_id = id;
+}
+
+/*
+ * Would translating again emit the same instrumentation as a TB
+ * translated earlier with @instr? Not if the wanted set changed, nor if
+ * it depends on the guest code or on callbacks that watch translation.
+ * Other TCG plugins' translation callbacks may hand their inline code
+ * per-TB data, which a cached TB would carry over stale.
+ */
+bool panda_tb_reusable(uint32_t instr){
+    if (instr != panda_instr_wanted() || (instr & PANDA_INSTR_INSN_EXEC)) {
+        return false;
+    }
+    if (qemu_plugin_tb_trans_others(panda_bridge_id)) {
+        return false;
+    }
+    if (panda_has_callback_registered(PANDA_CB_BLOCK_TRANSLATE) ||
+        panda_has_callback_registered(PANDA_CB_INSN_TRANSLATE) ||
+        panda_has_callback_registered(PANDA_CB_AFTER_INSN_TRANSLATE)) {
+        return false;
+    }
+    return qatomic_read(&panda_insn_counters) == NULL;
+}
+
+/*
+ * Does anything expect to be called around the translation of each
+ * block? Such callbacks run on the vCPU, so TCG must not translate
+ * blocks on another thread behind their back.
+ */
+bool panda_translate_watched(void){
+    return panda_has_callback_registered(PANDA_CB_BEFORE_BLOCK_TRANSLATE) ||
+           panda_has_callback_registered(PANDA_CB_AFTER_BLOCK_TRANSLATE);
+}
@@ -0,0 +1,493 @@
+/* PANDABEGINCOMMENT
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+/*
+ * Writer and reader for the chunked log format in panda/pandalog.h.
+ *
+ * Each vCPU thread appends to its own arena without locking. Records
+ * from other threads (main loop, monitor, a CPUState passed from
+ * somewhere else) go to one shared arena under a mutex. A full chunk
+ * is queued for the writer thread. If the writer falls more than
+ * PANDALOG_MAX_QUEUED chunks behind, producers wait rather than
+ * buffering without bound.
+ */
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu/notify.h"
+#include "system/system.h"
+#include "hw/core/cpu.h"
+#include "panda/debug.h"
+#include "panda/pandalog.h"
+
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
+#define PANDALOG_CHUNK_SIZE     (1 << 20)
+#define PANDALOG_MAX_QUEUED     64
+#define PANDALOG_MAX_ARENAS     256
+#define PANDALOG_ZSTD_LEVEL     1
+
+typedef struct PandaLogChunk {
+    QSIMPLEQ_ENTRY(PandaLogChunk) next;
+    uint32_t vcpu;
+    uint32_t nrecords;
+    uint32_t used;
+    uint64_t first_instr;
+    uint64_t last_instr;
+    uint8_t data[PANDALOG_CHUNK_SIZE];
+} PandaLogChunk;
+
+static struct {
+    FILE *f;
+    bool failed;
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond room_cond;
+    QSIMPLEQ_HEAD(, PandaLogChunk) full;
+    unsigned queued;
+    bool closing;
+    GArray *index;          /* pandalog_index_entry, writer thread only */
+    PandaLogChunk *arenas[PANDALOG_MAX_ARENAS];
+    PandaLogChunk *shared;
+    QemuMutex shared_lock;
+    Notifier exit_notifier;
+} plog;
+
+bool pandalog = false;
+
+static bool pandalog_fwrite(const void *buf, size_t len)
+{
+    if (!plog.failed && fwrite(buf, 1, len, plog.f) != len) {
+        LOG_ERROR("pandalog write failed: %s", strerror(errno));
+        plog.failed = true;
+    }
+    return !plog.failed;
+}
+
+/* Compress and append one chunk. Writer thread only. */
+static void pandalog_write_chunk(PandaLogChunk *c)
+{
+    pandalog_chunk_header h = {
+        .codec = cpu_to_le32(PANDALOG_CODEC_NONE),
+        .vcpu = cpu_to_le32(c->vcpu),
+        .nrecords = cpu_to_le32(c->nrecords),
+        .raw_len = cpu_to_le32(c->used),
+        .first_instr = cpu_to_le64(c->first_instr),
+        .last_instr = cpu_to_le64(c->last_instr),
+    };
+    pandalog_index_entry ie;
+    const void *out = c->data;
+    size_t out_len = c->used;
+    g_autofree uint8_t *zbuf = NULL;
+    off_t offset;
+
+#ifdef CONFIG_ZSTD
+    size_t bound = ZSTD_compressBound(c->used);
+    size_t zlen;
+
+    zbuf = g_malloc(bound);
+    zlen = ZSTD_compress(zbuf, bound, c->data, c->used, PANDALOG_ZSTD_LEVEL);
+    if (!ZSTD_isError(zlen) && zlen < c->used) {
+        h.codec = cpu_to_le32(PANDALOG_CODEC_ZSTD);
+        out = zbuf;
+        out_len = zlen;
+    }
+#endif
+    h.stored_len = cpu_to_le64(out_len);
+
+    offset = ftello(plog.f);
+    if (!pandalog_fwrite(&h, sizeof(h)) || !pandalog_fwrite(out, out_len)) {
+        return;
+    }
+    ie = (pandalog_index_entry) {
+        .offset = cpu_to_le64(offset),
+        .first_instr = h.first_instr,
+        .last_instr = h.last_instr,
+        .vcpu = h.vcpu,
+        .nrecords = h.nrecords,
+    };
+    g_array_append_val(plog.index, ie);
+}
+
+static void *pandalog_writer(void *opaque)
+{
+    qemu_mutex_lock(&plog.lock);
+    for (;;) {
+        PandaLogChunk *c;
+
+        while (QSIMPLEQ_EMPTY(&plog.full) && !plog.closing) {
+            qemu_cond_wait(&plog.work_cond, &plog.lock);
+        }
+        c = QSIMPLEQ_FIRST(&plog.full);
+        if (c == NULL) {
+            break; /* closing, and everything is written */
+        }
+        QSIMPLEQ_REMOVE_HEAD(&plog.full, next);
+        plog.queued--;
+        qemu_cond_broadcast(&plog.room_cond);
+        qemu_mutex_unlock(&plog.lock);
+
+        pandalog_write_chunk(c);
+        g_free(c);
+
+        qemu_mutex_lock(&plog.lock);
+    }
+    qemu_mutex_unlock(&plog.lock);
+    return NULL;
+}
+
+static void pandalog_submit(PandaLogChunk *c)
+{
+    if (c == NULL || c->nrecords == 0) {
+        g_free(c);
+        return;
+    }
+    qemu_mutex_lock(&plog.lock);
+    while (plog.queued >= PANDALOG_MAX_QUEUED) {
+        qemu_cond_wait(&plog.room_cond, &plog.lock);
+    }
+    QSIMPLEQ_INSERT_TAIL(&plog.full, c, next);
+    plog.queued++;
+    qemu_cond_signal(&plog.work_cond);
+    qemu_mutex_unlock(&plog.lock);
+}
+
+static void pandalog_exit_notify(Notifier *n, void *data)
+{
+    pandalog_close();
+}
+
+/**
+ * pandalog_open() - Start logging to a file.
+ * @path: File to create; an existing file is truncated.
+ *
+ * The log is finished by pandalog_close(), or at the latest when QEMU
+ * exits.
+ *
+ * Return: true on success, false if the file can't be created or a log
+ * is already open.
+ */
+bool pandalog_open(const char *path)
+{
+    pandalog_file_header h = {
+        .magic = PANDALOG_MAGIC,
+        .version = cpu_to_le32(PANDALOG_VERSION),
+        .chunk_size = cpu_to_le32(PANDALOG_CHUNK_SIZE),
+    };
+
+    if (pandalog) {
+        LOG_ERROR("pandalog already open");
+        return false;
+    }
+    plog.f = fopen(path, "wb");
+    if (plog.f == NULL) {
+        LOG_ERROR("can't create pandalog %s: %s", path, strerror(errno));
+        return false;
+    }
+    plog.failed = false;
+    if (!pandalog_fwrite(&h, sizeof(h))) {
+        fclose(plog.f);
+        return false;
+    }
+    plog.index = g_array_new(false, false, sizeof(pandalog_index_entry));
+    plog.closing = false;
+    plog.queued = 0;
+    QSIMPLEQ_INIT(&plog.full);
+    qemu_mutex_init(&plog.lock);
+    qemu_mutex_init(&plog.shared_lock);
+    qemu_cond_init(&plog.work_cond);
+    qemu_cond_init(&plog.room_cond);
+    qemu_thread_create(&plog.thread, "pandalog", pandalog_writer, NULL,
+                       QEMU_THREAD_JOINABLE);
+    plog.exit_notifier.notify = pandalog_exit_notify;
+    qemu_add_exit_notifier(&plog.exit_notifier);
+    qatomic_set(&pandalog, true);
+    return true;
+}
+
+/**
+ * pandalog_write() - Append one record to the log.
+ * @cpu: vCPU the record is about; may be NULL.
+ * @instr: Guest instruction count to file the record under.
+ * @type: Plugin-defined record type.
+ * @data: Payload.
+ * @len: Payload size in bytes; at most the chunk size minus a header.
+ *
+ * From @cpu's own thread this only copies into the vCPU's chunk. From
+ * any other thread it takes a lock. Does nothing if no log is open.
+ */
+void pandalog_write(CPUState *cpu, uint64_t instr, uint32_t type,
+                    const void *data, uint32_t len)
+{
+    size_t need = ROUND_UP(sizeof(pandalog_record) + len, 8);
+    bool shared;
+    PandaLogChunk **arena;
+    PandaLogChunk *c;
+    pandalog_record *rec;
+
+    if (!qatomic_read(&pandalog)) {
+        return;
+    }
+    if (need > PANDALOG_CHUNK_SIZE) {
+        LOG_ERROR("pandalog record of %u bytes doesn't fit in a chunk", len);
+        return;
+    }
+
+    shared = cpu == NULL || cpu->cpu_index >= PANDALOG_MAX_ARENAS ||
+             !qemu_cpu_is_self(cpu);
+    if (shared) {
+        qemu_mutex_lock(&plog.shared_lock);
+        arena = &plog.shared;
+    } else {
+        arena = &plog.arenas[cpu->cpu_index];
+    }
+
+    c = *arena;
+    if (c != NULL && c->used + need > PANDALOG_CHUNK_SIZE) {
+        pandalog_submit(c);
+        c = NULL;
+    }
+    if (c == NULL) {
+        c = g_malloc(sizeof(*c));
+        c->vcpu = shared ? PANDALOG_NO_VCPU : cpu->cpu_index;
+        c->nrecords = 0;
+        c->used = 0;
+        c->first_instr = UINT64_MAX;
+        c->last_instr = 0;
+        *arena = c;
+    }
+
+    rec = (pandalog_record *)(c->data + c->used);
+    rec->instr = cpu_to_le64(instr);
+    rec->type = cpu_to_le32(type);
+    rec->len = cpu_to_le32(len);
+    memcpy(rec->data, data, len);
+    c->used += need;
+    c->nrecords++;
+    c->first_instr = MIN(c->first_instr, instr);
+    c->last_instr = MAX(c->last_instr, instr);
+
+    if (shared) {
+        qemu_mutex_unlock(&plog.shared_lock);
+    }
+}
+
+/**
+ * pandalog_close() - Flush everything and finish the log file.
+ *
+ * Writes the partially filled chunks, the chunk index and the trailer.
+ * Must not race with pandalog_write(), so call it with the vCPUs
+ * stopped.
+ */
+void pandalog_close(void)
+{
+    pandalog_trailer t = { .magic = PANDALOG_INDEX_MAGIC };
+    off_t index_offset;
+
+    if (!qatomic_read(&pandalog)) {
+        return;
+    }
+    qatomic_set(&pandalog, false);
+    qemu_remove_exit_notifier(&plog.exit_notifier);
+
+    for (int i = 0; i < PANDALOG_MAX_ARENAS; i++) {
+        pandalog_submit(plog.arenas[i]);
+        plog.arenas[i] = NULL;
+    }
+    pandalog_submit(plog.shared);
+    plog.shared = NULL;
+
+    qemu_mutex_lock(&plog.lock);
+    plog.closing = true;
+    qemu_cond_signal(&plog.work_cond);
+    qemu_mutex_unlock(&plog.lock);
+    qemu_thread_join(&plog.thread);
+
+    index_offset = ftello(plog.f);
+    t.index_offset = cpu_to_le64(index_offset);
+    t.nchunks = cpu_to_le64(plog.index->len);
+    pandalog_fwrite(plog.index->data,
+                    plog.index->len * sizeof(pandalog_index_entry));
+    pandalog_fwrite(&t, sizeof(t));
+    if (fclose(plog.f) != 0 && !plog.failed) {
+        LOG_ERROR("pandalog close failed: %s", strerror(errno));
+    }
+    plog.f = NULL;
+    g_array_free(plog.index, true);
+    plog.index = NULL;
+
+    qemu_cond_destroy(&plog.room_cond);
+    qemu_cond_destroy(&plog.work_cond);
+    qemu_mutex_destroy(&plog.shared_lock);
+    qemu_mutex_destroy(&plog.lock);
+}
+
+struct PandaLogReader {
+    FILE *f;
+    pandalog_index_entry *index;
+    uint64_t nchunks;
+    uint64_t next_chunk;    /* index of the next chunk to load */
+    uint64_t from;          /* skip records below this instr */
+    uint8_t *raw;           /* current chunk, decompressed */
+    uint32_t raw_len;
+    uint32_t pos;
+};
+
+/**
+ * pandalog_reader_open() - Open a log written by pandalog_open().
+ * @path: Log file.
+ *
+ * Reads only the trailer and chunk index; chunks are loaded as records
+ * are asked for.
+ *
+ * Return: A reader, or NULL if the file is missing, truncated (never
+ * closed) or not a pandalog.
+ */
+PandaLogReader *pandalog_reader_open(const char *path)
+{
+    g_autofree PandaLogReader *r = g_new0(PandaLogReader, 1);
+    pandalog_file_header h;
+    pandalog_trailer t;
+
+    r->f = fopen(path, "rb");
+    if (r->f == NULL) {
+        LOG_ERROR("can't open pandalog %s: %s", path, strerror(errno));
+        return NULL;
+    }
+    if (fread(&h, sizeof(h), 1, r->f) != 1 ||
+        memcmp(h.magic, PANDALOG_MAGIC, sizeof(h.magic)) != 0 ||
+        le32_to_cpu(h.version) != PANDALOG_VERSION ||
+        fseeko(r->f, -(off_t)sizeof(t), SEEK_END) != 0 ||
+        fread(&t, sizeof(t), 1, r->f) != 1 ||
+        memcmp(t.magic, PANDALOG_INDEX_MAGIC, sizeof(t.magic)) != 0) {
+        LOG_ERROR("%s is not a complete pandalog", path);
+        fclose(r->f);
+        return NULL;
+    }
+    r->nchunks = le64_to_cpu(t.nchunks);
+    r->index = g_new(pandalog_index_entry, r->nchunks);
+    if (fseeko(r->f, le64_to_cpu(t.index_offset), SEEK_SET) != 0 ||
+        fread(r->index, sizeof(*r->index), r->nchunks, r->f) != r->nchunks) {
+        LOG_ERROR("%s: can't read chunk index", path);
+        g_free(r->index);
+        fclose(r->f);
+        return NULL;
+    }
+    return g_steal_pointer(&r);
+}
+
+/**
+ * pandalog_reader_seek() - Skip to an instruction count.
+ * @r: Reader.
+ * @instr: pandalog_reader_next() will only return records at or after
+ *    this instruction count.
+ *
+ * Chunks whose whole range lies before @instr are skipped using the
+ * index, without being read or decompressed.
+ */
+void pandalog_reader_seek(PandaLogReader *r, uint64_t instr)
+{
+    r->from = instr;
+    r->next_chunk = 0;
+    r->pos = r->raw_len = 0;
+}
+
+static bool pandalog_reader_load(PandaLogReader *r)
+{
+    for (; r->next_chunk < r->nchunks; r->next_chunk++) {
+        pandalog_index_entry *ie = &r->index[r->next_chunk];
+        pandalog_chunk_header h;
+        g_autofree uint8_t *stored = NULL;
+        uint64_t stored_len;
+
+        if (le64_to_cpu(ie->last_instr) < r->from) {
+            continue;
+        }
+        if (fseeko(r->f, le64_to_cpu(ie->offset), SEEK_SET) != 0 ||
+            fread(&h, sizeof(h), 1, r->f) != 1) {
+            return false;
+        }
+        stored_len = le64_to_cpu(h.stored_len);
+        r->raw_len = le32_to_cpu(h.raw_len);
+        r->raw = g_realloc(r->raw, MAX(r->raw_len, 1));
+        r->pos = 0;
+        r->next_chunk++;
+
+        switch (le32_to_cpu(h.codec)) {
+        case PANDALOG_CODEC_NONE:
+            if (stored_len != r->raw_len ||
+                fread(r->raw, 1, r->raw_len, r->f) != r->raw_len) {
+                return false;
+            }
+            return true;
+#ifdef CONFIG_ZSTD
+        case PANDALOG_CODEC_ZSTD:
+            stored = g_malloc(stored_len);
+            if (fread(stored, 1, stored_len, r->f) != stored_len ||
+                ZSTD_decompress(r->raw, r->raw_len, stored,
+                                stored_len) != r->raw_len) {
+                return false;
+            }
+            return true;
+#endif
+        default:
+            LOG_ERROR("pandalog chunk uses unsupported codec %u",
+                      le32_to_cpu(h.codec));
+            return false;
+        }
+    }
+    return false;
+}
+
+/**
+ * pandalog_reader_next() - Return the next record.
+ * @r: Reader.
+ *
+ * Records come back in file order, with header fields in host byte
+ * order. The record stays valid until the next call.
+ *
+ * Return: The record, or NULL at the end of the log or on a read error.
+ */
+const pandalog_record *pandalog_reader_next(PandaLogReader *r)
+{
+    for (;;) {
+        pandalog_record *rec;
+
+        if (r->pos + sizeof(*rec) > r->raw_len) {
+            if (!pandalog_reader_load(r)) {
+                return NULL;
+            }
+            continue;
+        }
+        rec = (pandalog_record *)(r->raw + r->pos);
+        rec->instr = le64_to_cpu(rec->instr);
+        rec->type = le32_to_cpu(rec->type);
+        rec->len = le32_to_cpu(rec->len);
+        if (r->pos + sizeof(*rec) + rec->len > r->raw_len) {
+            return NULL; /* corrupt chunk */
+        }
+        r->pos += ROUND_UP(sizeof(*rec) + rec->len, 8);
+        if (rec->instr >= r->from) {
+            return rec;
+        }
+    }
+}
+
+void pandalog_reader_close(PandaLogReader *r)
+{
+    if (r == NULL) {
+        return;
+    }
+    fclose(r->f);
+    g_free(r->index);
+    g_free(r->raw);
+    g_free(r);
+}
@@ -0,0 +1,349 @@
+/* PANDABEGINCOMMENT
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+/*
+ * Registry behind the plugin-to-plugin (PPP) macros in plugin_plugin.h.
+ *
+ * Each point's current table is the authoritative list of its entries.
+ * Writers hold panda_ppp_lock, build a new sorted table and publish it
+ * with RCU. Dispatch (PPP_RUN_CB, through panda_ppp_iter_start() and
+ * panda_ppp_iter_next()) only reads the published table. An
+ * entry that is removed is freed after a grace period, so a concurrent
+ * dispatcher can finish calling it.
+ */
+#include <dlfcn.h>
+
+#include "qemu/osdep.h"
+#include "panda/plugin.h"
+
+static QemuMutex panda_ppp_lock;
+static panda_ppp_point *panda_ppp_points;
+static uint64_t panda_ppp_seq;
+
+static void __attribute__((__constructor__)) panda_ppp_lock_init(void)
+{
+    qemu_mutex_init(&panda_ppp_lock);
+}
+
+/* Name and load address of the shared object containing @addr. */
+static char *panda_ppp_object_of(const void *addr, void **base)
+{
+    Dl_info info;
+
+    if (dladdr(addr, &info) && info.dli_fname) {
+        *base = info.dli_fbase;
+        return g_path_get_basename(info.dli_fname);
+    }
+    *base = NULL;
+    return g_strdup("?");
+}
+
+static void panda_ppp_entry_free(panda_ppp_entry *e)
+{
+    g_free(e->consumer);
+    g_free(e);
+}
+
+static int panda_ppp_entry_cmp(const void *a, const void *b)
+{
+    const panda_ppp_entry *x = *(panda_ppp_entry * const *)a;
+    const panda_ppp_entry *y = *(panda_ppp_entry * const *)b;
+
+    if (x->priority != y->priority) {
+        return x->priority < y->priority ? -1 : 1;
+    }
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/*
+ * Publish a new table for @point holding the current entries minus
+ * @drop (if any) plus @add (if any). Called with panda_ppp_lock held.
+ */
+static void panda_ppp_publish(panda_ppp_point *point, panda_ppp_entry *add,
+                              panda_ppp_entry *drop)
+{
+    panda_ppp_table *old = point->table;
+    panda_ppp_table *t;
+    size_t n = 0;
+
+    t = g_malloc(sizeof(*t) + ((old ? old->n : 0) + 1) * sizeof(t->e[0]));
+    for (size_t i = 0; old && i < old->n; i++) {
+        if (old->e[i] != drop) {
+            t->e[n++] = old->e[i];
+        }
+    }
+    if (add) {
+        t->e[n++] = add;
+    }
+    qsort(t->e, n, sizeof(t->e[0]), panda_ppp_entry_cmp);
+    t->n = n;
+    if (n == 0) {
+        g_free(t);
+        t = NULL;
+    }
+    qatomic_rcu_set(&point->table, t);
+    if (old) {
+        g_free_rcu(old, rcu);
+    }
+    if (drop) {
+        call_rcu(drop, panda_ppp_entry_free, rcu);
+    }
+}
+
+static panda_ppp_entry *panda_ppp_find(panda_ppp_point *point, void *fn,
+                                       void *context, bool with_context)
+{
+    panda_ppp_table *t = point->table;
+
+    for (size_t i = 0; t && i < t->n; i++) {
+        panda_ppp_entry *e = t->e[i];
+        if (e->fn == fn && e->with_context == with_context &&
+            (!with_context || e->context == context)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * panda_ppp_add() - Attach a callback to a PPP point.
+ * @point: Point, as defined by PPP_CB_BOILERPLATE().
+ * @fn: Callback; cb_name##_with_context_t if @with_context is set,
+ *    otherwise cb_name##_t.
+ * @context: Passed as first argument when @with_context is set.
+ * @with_context: Which of the two callback flavours @fn is.
+ * @priority: Lower runs first; equal priorities run in attach order.
+ *
+ * The callback is enabled. Attaching the same callback twice makes it
+ * run twice, as it always has.
+ */
+void panda_ppp_add(panda_ppp_point *point, void *fn, void *context,
+                   bool with_context, int priority)
+{
+    panda_ppp_entry *e = g_new0(panda_ppp_entry, 1);
+
+    e->fn = fn;
+    e->context = context;
+    e->with_context = with_context;
+    e->enabled = true;
+    e->priority = priority;
+    e->consumer = panda_ppp_object_of(fn, &e->consumer_base);
+
+    QEMU_LOCK_GUARD(&panda_ppp_lock);
+    if (!point->listed) {
+        point->provider = panda_ppp_object_of(point, &point->provider_base);
+        point->next = panda_ppp_points;
+        panda_ppp_points = point;
+        point->listed = true;
+    }
+    e->seq = panda_ppp_seq++;
+    e->prof_site = panda_cb_profile_site(e->consumer, point->name);
+    panda_ppp_publish(point, e, NULL);
+}
+
+/**
+ * panda_ppp_remove() - Detach a callback from a PPP point.
+ * @point: Point, as defined by PPP_CB_BOILERPLATE().
+ * @fn: Callback passed to panda_ppp_add().
+ * @context: Context passed to panda_ppp_add(), if @with_context.
+ * @with_context: Which of the two callback flavours @fn is.
+ *
+ * Safe against concurrent dispatch; a dispatcher that already picked up
+ * the callback may still call it once.
+ *
+ * Return: true if the callback was attached.
+ */
+bool panda_ppp_remove(panda_ppp_point *point, void *fn, void *context,
+                      bool with_context)
+{
+    panda_ppp_entry *e;
+
+    QEMU_LOCK_GUARD(&panda_ppp_lock);
+    e = panda_ppp_find(point, fn, context, with_context);
+    if (e == NULL) {
+        return false;
+    }
+    panda_ppp_publish(point, NULL, e);
+    return true;
+}
+
+/**
+ * panda_ppp_set_enabled() - Pause or resume an attached callback.
+ * @point: Point, as defined by PPP_CB_BOILERPLATE().
+ * @fn: Callback passed to panda_ppp_add().
+ * @context: Context passed to panda_ppp_add(), if @with_context.
+ * @with_context: Which of the two callback flavours @fn is.
+ * @enabled: Whether dispatch should call it.
+ *
+ * Cheaper than detaching and reattaching: it only flips a flag.
+ *
+ * Return: true if the callback was attached.
+ */
+bool panda_ppp_set_enabled(panda_ppp_point *point, void *fn, void *context,
+                           bool with_context, bool enabled)
+{
+    panda_ppp_entry *e;
+
+    QEMU_LOCK_GUARD(&panda_ppp_lock);
+    e = panda_ppp_find(point, fn, context, with_context);
+    if (e == NULL) {
+        return false;
+    }
+    qatomic_set(&e->enabled, enabled);
+    return true;
+}
+
+/**
+ * panda_ppp_iter_start() - Begin dispatching a PPP point.
+ * @point: Point, as defined by PPP_CB_BOILERPLATE().
+ *
+ * vCPU threads dispatch from inside cpu_exec(), which already holds an
+ * RCU read lock; only callers outside a read-side section take one.
+ *
+ * Return: Iterator for panda_ppp_iter_next().
+ */
+panda_ppp_iter panda_ppp_iter_start(panda_ppp_point *point)
+{
+    panda_ppp_iter it = { 0 };
+
+    it.locked = get_ptr_rcu_reader()->depth == 0;
+    if (it.locked) {
+        rcu_read_lock();
+    }
+    it.tab = qatomic_rcu_read(&point->table);
+    it.prof = it.tab && qatomic_read(&panda_cb_profiling);
+    return it;
+}
+
+/**
+ * panda_ppp_iter_next() - Step to the next enabled callback.
+ * @it: Iterator from panda_ppp_iter_start().
+ *
+ * Charges the time since the previous step to the callback it returned.
+ *
+ * Return: false, having left the read-side section, once all are done.
+ */
+bool panda_ppp_iter_next(panda_ppp_iter *it)
+{
+    if (it->prof && it->e) {
+        panda_cb_profile_stop(it->e->prof_site, it->t0);
+    }
+    while (it->tab && it->i < it->tab->n) {
+        it->e = it->tab->e[it->i++];
+        if (qatomic_read(&it->e->enabled)) {
+            if (it->prof) {
+                it->t0 = panda_cb_profile_start();
+            }
+            return true;
+        }
+    }
+    it->e = NULL;
+    if (it->locked) {
+        it->locked = false;
+        rcu_read_unlock();
+    }
+    return false;
+}
+
+/**
+ * panda_ppp_attached() - Is anything attached to a PPP point?
+ * @point: Point, as defined by PPP_CB_BOILERPLATE().
+ */
+bool panda_ppp_attached(panda_ppp_point *point)
+{
+    return qatomic_read(&point->table) != NULL;
+}
+
+/**
+ * panda_ppp_set_profiling() - Count calls and time spent per PPP callback.
+ * @on: Whether dispatch should time callbacks from now on.
+ *
+ * Same as panda_cb_profile_set(): PPP and PANDA callbacks are profiled
+ * together.
+ */
+void panda_ppp_set_profiling(bool on)
+{
+    panda_cb_profile_set(on);
+}
+
+/**
+ * panda_ppp_dump() - Print every PPP point and what is attached to it.
+ * @out: Where to print.
+ *
+ * One line per point naming the plugin that provides it, then one line
+ * per attached callback with the plugin it belongs to, its priority,
+ * whether it is enabled and, if profiling was on, its call count and
+ * total time.
+ */
+void panda_ppp_dump(FILE *out)
+{
+    QEMU_LOCK_GUARD(&panda_ppp_lock);
+    for (panda_ppp_point *p = panda_ppp_points; p; p = p->next) {
+        panda_ppp_table *t = p->table;
+
+        fprintf(out, "%s (%s): %zu attached\n", p->name, p->provider,
+                t ? t->n : 0);
+        for (size_t i = 0; t && i < t->n; i++) {
+            panda_ppp_entry *e = t->e[i];
+            uint64_t calls, ns;
+
+            panda_cb_profile_totals(e->prof_site, &calls, &ns);
+            fprintf(out, "  %-24s prio %-4d %-8s %" PRIu64 " calls %" PRIu64
+                    " ns\n", e->consumer, e->priority,
+                    qatomic_read(&e->enabled) ? "enabled" : "disabled",
+                    calls, ns);
+        }
+    }
+}
+
+/**
+ * panda_ppp_forget_plugin() - Drop PPP state that lives in a plugin.
+ * @plugin: Handle of a plugin about to be dlclose()d.
+ *
+ * Detaches every callback whose code is in @plugin, and removes every
+ * point that @plugin provides from the registry. The caller must wait
+ * for a grace period before unmapping the plugin.
+ */
+void panda_ppp_forget_plugin(void *plugin)
+{
+    void *sym = dlsym(plugin, "init_plugin");
+    void *base;
+    Dl_info info;
+
+    if (sym == NULL || !dladdr(sym, &info)) {
+        return;
+    }
+    base = info.dli_fbase;
+
+    QEMU_LOCK_GUARD(&panda_ppp_lock);
+    for (panda_ppp_point **pp = &panda_ppp_points; *pp;) {
+        panda_ppp_point *p = *pp;
+        bool provided = p->provider_base == base;
+        panda_ppp_entry *e;
+
+        do {
+            panda_ppp_table *t = p->table;
+            e = NULL;
+            for (size_t i = 0; t && i < t->n; i++) {
+                if (provided || t->e[i]->consumer_base == base) {
+                    e = t->e[i];
+                    break;
+                }
+            }
+            if (e) {
+                panda_ppp_publish(p, NULL, e);
+            }
+        } while (e);
+
+        if (provided) {
+            *pp = p->next;
+            g_free(p->provider);
+        } else {
+            pp = &p->next;
+        }
+    }
+}
@@ -450,45 +450,90 @@ void plugin_register_dyn_cond_cb__udata(GArray **arr,
     dyn_cb->cond = cond_cb;
 }
 
+/*
+ * Expect that the underlying type for enum qemu_plugin_meminfo_t
+ * is either int32_t or uint32_t, aka int or unsigned int.
+ */
+QEMU_BUILD_BUG_ON(
+    !__builtin_types_compatible_p(qemu_plugin_meminfo_t, uint32_t) &&
+    !__builtin_types_compatible_p(qemu_plugin_meminfo_t, int32_t));
+
+static TCGHelperInfo vcpu_mem_cb_info[3] = {
+    [QEMU_PLUGIN_CB_NO_REGS].flags = TCG_CALL_NO_RWG,
+    [QEMU_PLUGIN_CB_R_REGS].flags = TCG_CALL_NO_WG,
+    [QEMU_PLUGIN_CB_RW_REGS].flags = 0,
+    /*
+     * Match qemu_plugin_vcpu_mem_cb_t:
+     *   void (*)(uint32_t, qemu_plugin_meminfo_t, uint64_t, void *)
+     */
+    [0 ... 2].typemask =
+        (dh_typemask(void, 0) |
+         dh_typemask(i32, 1) |
+         (__builtin_types_compatible_p(qemu_plugin_meminfo_t, uint32_t)
+          ? dh_typemask(i32, 2) : dh_typemask(s32, 2)) |
+         dh_typemask(i64, 3) |
+         dh_typemask(ptr, 4))
+};
+
 void plugin_register_vcpu_mem_cb(GArray **arr,
                                  void *cb,
                                  enum qemu_plugin_cb_flags flags,
                                  enum qemu_plugin_mem_rw rw,
                                  void *udata)
 {
+    assert((unsigned)flags < ARRAY_SIZE(vcpu_mem_cb_info));
+
+    struct qemu_plugin_dyn_cb *dyn_cb = plugin_get_dyn_cb(arr);
+    struct qemu_plugin_regular_cb regular_cb = {
+        .userp = udata,
+        .rw = rw,
+        .f.vcpu_mem = cb,
+        .info = &vcpu_mem_cb_info[flags] };
+    dyn_cb->type = PLUGIN_CB_MEM_REGULAR;
+    dyn_cb->regular = regular_cb;
+}
+
+static TCGHelperInfo vcpu_mem_range_cb_info[3] = {
+    [QEMU_PLUGIN_CB_NO_REGS].flags = TCG_CALL_NO_RWG,
+    [QEMU_PLUGIN_CB_R_REGS].flags = TCG_CALL_NO_WG,
+    [QEMU_PLUGIN_CB_RW_REGS].flags = 0,
     /*
-     * Expect that the underlying type for enum qemu_plugin_meminfo_t
-     * is either int32_t or uint32_t, aka int or unsigned int.
+     * Match plugin_vcpu_mem_range_cb:
+     *   void (*)(uint32_t, qemu_plugin_meminfo_t, uint64_t, void *,
+     *            void *, const uint64_t *, uint32_t)
      */
-    QEMU_BUILD_BUG_ON(
-        !__builtin_types_compatible_p(qemu_plugin_meminfo_t, uint32_t) &&
-        !__builtin_types_compatible_p(qemu_plugin_meminfo_t, int32_t));
+    [0 ... 2].typemask =
+        (dh_typemask(void, 0) |
+         dh_typemask(i32, 1) |
+         (__builtin_types_compatible_p(qemu_plugin_meminfo_t, uint32_t)
+          ? dh_typemask(i32, 2) : dh_typemask(s32, 2)) |
+         dh_typemask(i64, 3) |
+         dh_typemask(ptr, 4) |
+         dh_typemask(ptr, 5) |
+         dh_typemask(ptr, 6) |
+         dh_typemask(i32, 7))
+};
 
-    static TCGHelperInfo info[3] = {
-        [QEMU_PLUGIN_CB_NO_REGS].flags = TCG_CALL_NO_RWG,
-        [QEMU_PLUGIN_CB_R_REGS].flags = TCG_CALL_NO_WG,
-        [QEMU_PLUGIN_CB_RW_REGS].flags = 0,
-        /*
-         * Match qemu_plugin_vcpu_mem_cb_t:
-         *   void (*)(uint32_t, qemu_plugin_meminfo_t, uint64_t, void *)
-         */
-        [0 ... 2].typemask =
-            (dh_typemask(void, 0) |
-             dh_typemask(i32, 1) |
-             (__builtin_types_compatible_p(qemu_plugin_meminfo_t, uint32_t)
-              ? dh_typemask(i32, 2) : dh_typemask(s32, 2)) |
-             dh_typemask(i64, 3) |
-             dh_typemask(ptr, 4))
-    };
-    assert((unsigned)flags < ARRAY_SIZE(info));
+void plugin_register_vcpu_mem_range_cb(GArray **arr,
+                                       void *cb,
+                                       enum qemu_plugin_cb_flags flags,
+                                       enum qemu_plugin_mem_rw rw,
+                                       qemu_plugin_u64 ranges,
+                                       size_t n_ranges,
+                                       void *udata)
+{
+    assert((unsigned)flags < ARRAY_SIZE(vcpu_mem_range_cb_info));
 
     struct qemu_plugin_dyn_cb *dyn_cb = plugin_get_dyn_cb(arr);
-    struct qemu_plugin_regular_cb regular_cb = { .userp = udata,
-                                                 .rw = rw,
-                                                 .f.vcpu_mem = cb,
-                                                 .info = &info[flags] };
-    dyn_cb->type = PLUGIN_CB_MEM_REGULAR;
-    dyn_cb->regular = regular_cb;
+    struct qemu_plugin_mem_range_cb range_cb = {
+        .userp = udata,
+        .rw = rw,
+        .f.vcpu_mem = cb,
+        .info = &vcpu_mem_range_cb_info[flags],
+        .ranges = ranges,
+        .n = n_ranges };
+    dyn_cb->type = PLUGIN_CB_MEM_RANGE;
+    dyn_cb->mem_range = range_cb;
 }
 
 /*
@@ -513,6 +558,19 @@ void qemu_plugin_tb_trans_cb(CPUState *cpu, struct qemu_plugin_tb *tb)
     }
 }
 
+bool qemu_plugin_tb_trans_others(qemu_plugin_id_t id)
+{
+    struct qemu_plugin_cb *cb;
+
+    QLIST_FOREACH_RCU(cb, &plugin.cb_lists[QEMU_PLUGIN_EV_VCPU_TB_TRANS],
+                      entry) {
+        if (cb->ctx->id != id) {
+            return true;
+        }
+    }
+    return false;
+}
+
 /*
  * Disable CFI checks.
  * The callback function has been loaded from an external library so we do not
@@ -707,6 +765,44 @@ void exec_inline_op(enum plugin_dyn_cb_type type,
     }
 }
 
+/* Is @vaddr in one of the ranges of @cb for vCPU @cpu_index? */
+static bool mem_range_match(struct qemu_plugin_mem_range_cb *cb,
+                            unsigned int cpu_index, uint64_t vaddr)
+{
+    qemu_plugin_u64 lo = cb->ranges;
+    qemu_plugin_u64 hi = cb->ranges;
+
+    for (size_t i = 0; i < cb->n; i++) {
+        lo.offset = cb->ranges.offset + i * 2 * sizeof(uint64_t);
+        hi.offset = lo.offset + sizeof(uint64_t);
+        if (vaddr >= qemu_plugin_u64_get(lo, cpu_index) &&
+            vaddr < qemu_plugin_u64_get(hi, cpu_index)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Called from generated code for a range filtered memory callback, with
+ * @ranges the table of the vCPU: make the callback if @vaddr is in one of
+ * the @n ranges.
+ */
+QEMU_DISABLE_CFI
+void plugin_vcpu_mem_range_cb(uint32_t cpu_index, qemu_plugin_meminfo_t info,
+                              uint64_t vaddr, void *userp, void *f,
+                              const uint64_t *ranges, uint32_t n)
+{
+    qemu_plugin_vcpu_mem_cb_t cb = f;
+
+    for (uint32_t i = 0; i < n; i++) {
+        if (vaddr >= ranges[i * 2] && vaddr < ranges[i * 2 + 1]) {
+            cb(cpu_index, info, vaddr, userp);
+            return;
+        }
+    }
+}
+
 QEMU_DISABLE_CFI
 void qemu_plugin_vcpu_mem_cb(CPUState *cpu, uint64_t vaddr,
                              uint64_t value_low,
@@ -739,6 +835,19 @@ void qemu_plugin_vcpu_mem_cb(CPUState *cpu, uint64_t vaddr,
                 qemu_plugin_set_cb_flags(cpu, QEMU_PLUGIN_CB_NO_REGS);
             }
             break;
+        case PLUGIN_CB_MEM_RANGE:
+            if ((rw & cb->mem_range.rw) &&
+                mem_range_match(&cb->mem_range, cpu->cpu_index, vaddr)) {
+                qemu_plugin_set_cb_flags(cpu,
+                    tcg_call_to_qemu_plugin_cb_flags(
+                        cb->mem_range.info->flags));
+
+                cb->mem_range.f.vcpu_mem(cpu->cpu_index,
+                                         make_plugin_meminfo(oi, rw),
+                                         vaddr, cb->mem_range.userp);
+                qemu_plugin_set_cb_flags(cpu, QEMU_PLUGIN_CB_NO_REGS);
+            }
+            break;
         case PLUGIN_CB_INLINE_ADD_U64:
         case PLUGIN_CB_INLINE_STORE_U64:
             if (rw & cb->inline_insn.rw) {
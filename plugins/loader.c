@@ -75,6 +75,33 @@ void qemu_plugin_add_dyn_cb_arr(GArray *arr)
     g_assert(inserted);
 }
 
+/*
+ * Feed into @sum everything about the loaded plugins that generated code
+ * can depend on: which plugins with which arguments, where they were
+ * loaded, and where their scoreboards live.
+ */
+void qemu_plugin_layout_checksum(GChecksum *sum)
+{
+    struct qemu_plugin_ctx *ctx;
+    struct qemu_plugin_scoreboard *score;
+
+    QEMU_LOCK_GUARD(&plugin.lock);
+    QTAILQ_FOREACH(ctx, &plugin.ctxs, entry) {
+        gpointer install = NULL;
+
+        g_checksum_update(sum, (const guchar *)ctx->desc->path, -1);
+        for (int i = 0; i < ctx->desc->argc; i++) {
+            g_checksum_update(sum, (const guchar *)ctx->desc->argv[i], -1);
+        }
+        g_module_symbol(ctx->handle, "qemu_plugin_install", &install);
+        g_checksum_update(sum, (const guchar *)&install, sizeof(install));
+    }
+    QLIST_FOREACH(score, &plugin.scoreboards, entry) {
+        g_checksum_update(sum, (const guchar *)&score->data->data,
+                          sizeof(score->data->data));
+    }
+}
+
 static struct qemu_plugin_desc *plugin_find_desc(QemuPluginList *head,
                                                  const char *path)
 {
@@ -235,6 +235,11 @@ DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "                one-insn-per-tb=on|off (one guest instruction per TCG translation block)\n"
     "                split-wx=on|off (enable TCG split w^x mapping)\n"
     "                tb-size=n (TCG translation block cache size)\n"
+    "                tb-cache=file (keep TCG translated code in file between runs)\n"
+    "                tb-evict=on|off (evict oldest TCG translated code when full, default on)\n"
+    "                tb-trace=on|off (retranslate hot TCG code as superblocks, default off)\n"
+    "                tb-tiers=on|off (optimize TCG code fully only once hot, default off)\n"
+    "                tb-spec=on|off (translate TCG code ahead on a background thread, default off)\n"
     "                dirty-ring-size=n (KVM dirty ring GFN count, default 0)\n"
     "                eager-split-size=n (KVM Eager Page Split chunk size, default 0, disabled. ARM only)\n"
     "                notify-vmexit=run|internal-error|disable,notify-window=n (enable notify VM exit and set notify window, x86 only)\n"
@@ -278,6 +283,51 @@ SRST
     ``tb-size=n``
         Controls the size (in MiB) of the TCG translation block cache.
 
+    ``tb-cache=file``
+        Saves the TCG translated code to file when QEMU exits, and reuses
+        it in the next run instead of translating the same guest code
+        again. This speeds up repeated replays of one recording. The
+        saved code contains host addresses, so it is only used by a QEMU
+        started the same way: the same binary, plugins and command line,
+        with address space layout randomization disabled (for example
+        under ``setarch -R``). Otherwise it is ignored and replaced.
+        Requires ``thread=single`` and ``split-wx=off``.
+
+    ``tb-evict=on|off``
+        When the translation block cache fills up, only retire the
+        oldest part of it, a region at a time, and keep the rest of the
+        translated code. With ``off``, or when the cache is too small to
+        be split up, all translated code is flushed instead. Defaults to
+        ``on``.
+
+    ``tb-trace=on|off``
+        Count how often each translation block runs. Once one gets hot,
+        retranslate it together with the hot blocks it jumps to on the
+        same page as a single superblock, so that the code generator
+        optimizes across them. Only targets whose translator supports it
+        (currently x86) form superblocks, and not with icount or TCG
+        plugins. PANDA block callbacks then see superblocks rather than
+        basic blocks. Defaults to ``off``.
+
+    ``tb-tiers=on|off``
+        Translate code with the cheapest code generation first, and
+        count how often each translation block runs. Once one gets hot,
+        retranslate it with every optimization (and as a superblock, with
+        ``tb-trace=on``). Most code only ever runs a few times, so this
+        makes booting and the first run of a replay translate faster.
+        Works with icount. Defaults to ``off``.
+
+    ``tb-spec=on|off``
+        Translate the blocks that newly translated code jumps to directly
+        on a background thread, so that a vCPU reaching fresh code finds
+        it translated more often instead of stopping to translate it.
+        This uses a host core and some translation block cache for code
+        that may never run. It cannot be used with ``-plugin``, which
+        includes PANDA's plugin bridge, and nothing is translated in the
+        background while PANDA block translation callbacks are registered,
+        nor with ``tb-cache``. ``info jit`` shows how often and how long the vCPUs
+        still stopped. System emulation only. Defaults to ``off``.
+
     ``thread=single|multi``
         Controls number of TCG threads. When the TCG is multi-threaded
         there will be one thread per vCPU therefore taking advantage of
@@ -5142,13 +5192,14 @@ SRST
 ERST
 
 DEF("icount", HAS_ARG, QEMU_OPTION_icount, \
-    "-icount [shift=N|auto][,align=on|off][,sleep=on|off][,rr=record|replay,rrfile=<filename>[,rrsnapshot=<snapshot>]]\n" \
+    "-icount [shift=N|auto][,align=on|off][,sleep=on|off][,rr=record|replay,rrfile=<filename>[,rrsnapshot=<snapshot>]\n" \
+    "        [,rrmemsnapshot=<instructions>[,rrmemsnapshot-budget=<size>]][,rrend=<icount>]]\n" \
     "                enable virtual instruction counter with 2^N clock ticks per\n" \
     "                instruction, enable aligning the host and virtual clocks\n" \
     "                or disable real time cpu sleeping, and optionally enable\n" \
     "                record-and-replay mode\n", QEMU_ARCH_ALL)
 SRST
-``-icount [shift=N|auto][,align=on|off][,sleep=on|off][,rr=record|replay,rrfile=filename[,rrsnapshot=snapshot]]``
+``-icount [shift=N|auto][,align=on|off][,sleep=on|off][,rr=record|replay,rrfile=filename[,rrsnapshot=snapshot][,rrmemsnapshot=instructions[,rrmemsnapshot-budget=size]][,rrend=icount]]``
     Enable virtual instruction counter. The virtual cpu will execute one
     instruction every 2^N ns of virtual time. If ``auto`` is specified
     then the virtual cpu speed will be automatically adjusted to keep
@@ -5190,6 +5241,14 @@ SRST
     name. In record mode, a new VM snapshot with the given name is created
     at the start of execution recording. In replay mode this option
     specifies the snapshot name used to load the initial VM state.
+    In replay mode, ``rrmemsnapshot`` makes QEMU keep in-memory snapshots
+    roughly every given number of instructions, which ``replay_seek`` and
+    reverse debugging use before falling back to VM snapshots.
+    ``rrmemsnapshot-budget`` caps their memory use (default 1G); when it
+    is exceeded, snapshots are thinned out where they are closest together.
+    In replay mode, ``rrend`` makes QEMU exit when the given instruction
+    count is reached, so that a slice of a recording can be replayed on
+    its own.
 ERST
 
 DEF("watchdog-action", HAS_ARG, QEMU_OPTION_watchdog_action, \
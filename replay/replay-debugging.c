@@ -19,12 +19,15 @@
 #include "qapi/qapi-commands-replay.h"
 #include "qobject/qdict.h"
 #include "qemu/timer.h"
+#include "qemu/error-report.h"
 #include "block/snapshot.h"
 #include "migration/snapshot.h"
 
 static bool replay_is_debugging;
 static int64_t replay_last_breakpoint;
 static int64_t replay_last_snapshot;
+/* Instruction count at which QEMU exits, 0 to replay to the end */
+static uint64_t replay_end_request;
 
 bool replay_running_debug(void)
 {
@@ -89,6 +92,34 @@ static void replay_stop_vm(void *opaque)
     replay_delete_break();
 }
 
+static void replay_end_reached(void *opaque)
+{
+    replay_end_icount = -1ULL;
+    qemu_system_shutdown_request(SHUTDOWN_CAUSE_HOST_SIGNAL);
+}
+
+void replay_end_configure(uint64_t icount)
+{
+    replay_end_request = icount;
+}
+
+void replay_end_start(void)
+{
+    if (replay_mode != REPLAY_MODE_PLAY || !replay_end_request) {
+        return;
+    }
+    if (replay_end_request <= replay_get_current_icount()) {
+        error_report("rrend=%" PRIu64 " is not after the replay start"
+                     " at instruction %" PRId64,
+                     replay_end_request, replay_get_current_icount());
+        exit(1);
+    }
+    /* Nothing runs yet, so the replay mutex is not needed */
+    replay_end_icount = replay_end_request;
+    replay_end_timer = timer_new_ns(QEMU_CLOCK_REALTIME,
+                                    replay_end_reached, NULL);
+}
+
 void qmp_replay_break(int64_t icount, Error **errp)
 {
     if (replay_mode == REPLAY_MODE_PLAY) {
@@ -180,21 +211,34 @@ static void replay_seek(int64_t icount, QEMUTimerCB callback, Error **errp)
 {
     char *snapshot = NULL;
     int64_t snapshot_icount;
+    int memsnap;
+    int64_t memsnap_icount;
 
     if (replay_mode != REPLAY_MODE_PLAY) {
         error_setg(errp, "replay must be enabled to seek");
         return;
     }
 
+    memsnap = replay_memsnap_find(icount, &memsnap_icount);
     snapshot = replay_find_nearest_snapshot(icount, &snapshot_icount);
-    if (snapshot) {
+    if (memsnap >= 0 && memsnap_icount >= snapshot_icount) {
+        /* In-memory snapshots are much cheaper to restore */
+        if (icount < replay_get_current_icount()
+            || replay_get_current_icount() < memsnap_icount) {
+            vm_stop(RUN_STATE_RESTORE_VM);
+            if (!replay_memsnap_load(memsnap, errp)) {
+                g_free(snapshot);
+                return;
+            }
+        }
+    } else if (snapshot) {
         if (icount < replay_get_current_icount()
             || replay_get_current_icount() < snapshot_icount) {
             vm_stop(RUN_STATE_RESTORE_VM);
             load_snapshot(snapshot, NULL, false, NULL, errp);
         }
-        g_free(snapshot);
     }
+    g_free(snapshot);
     if (replay_get_current_icount() <= icount) {
         replay_break(icount, callback, NULL);
         vm_start();
@@ -316,14 +360,26 @@ void replay_breakpoint(void)
 
 void replay_gdb_attached(void)
 {
+    Error *err = NULL;
+
     /*
      * Create VM snapshot on temporary overlay to allow reverse
      * debugging even if snapshots were not enabled.
      */
     if (replay_mode == REPLAY_MODE_PLAY
         && !replay_snapshot) {
-        if (!save_snapshot("start_debugging", true, NULL, false, NULL, NULL)) {
+        if (!save_snapshot("start_debugging", true, NULL, false, NULL, &err)) {
             /* Can't create the snapshot. Continue conventional debugging. */
+            warn_report_err(err);
         }
     }
+
+    /*
+     * Gives reverse debugging a cheap way back to this point. Only taken
+     * without writable disks, so it can't get in the way of the VM
+     * snapshot above.
+     */
+    if (replay_mode == REPLAY_MODE_PLAY) {
+        replay_memsnap_save();
+    }
 }
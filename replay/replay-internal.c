@@ -10,6 +10,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/bswap.h"
 #include "system/replay.h"
 #include "system/runstate.h"
 #include "replay-internal.h"
@@ -27,9 +28,9 @@ static QemuMutex lock;
 static QemuCond mutex_cond;
 static unsigned long mutex_head, mutex_tail;
 
-/* File for replay writing */
+/* Log for replay writing or reading */
 static bool write_error;
-FILE *replay_file;
+ReplayLog *replay_file;
 
 static void replay_write_error(void)
 {
@@ -45,15 +46,20 @@ static void replay_read_error(void)
     exit(1);
 }
 
-static void replay_putc(uint8_t byte)
+static void replay_write(const void *buf, size_t size)
 {
     if (replay_file) {
-        if (putc(byte, replay_file) == EOF) {
+        if (!replay_log_write(replay_file, buf, size)) {
             replay_write_error();
         }
     }
 }
 
+static void replay_putc(uint8_t byte)
+{
+    replay_write(&byte, 1);
+}
+
 void replay_put_byte(uint8_t byte)
 {
     trace_replay_put_byte(byte);
@@ -70,51 +76,50 @@ void replay_put_event(uint8_t event)
 
 void replay_put_word(uint16_t word)
 {
+    uint16_t be = cpu_to_be16(word);
+
     trace_replay_put_word(word);
-    replay_putc(word >> 8);
-    replay_putc(word);
+    replay_write(&be, sizeof(be));
 }
 
 void replay_put_dword(uint32_t dword)
 {
-    int i;
+    uint32_t be = cpu_to_be32(dword);
 
     trace_replay_put_dword(dword);
-    for (i = 24; i >= 0; i -= 8) {
-        replay_putc(dword >> i);
-    }
+    replay_write(&be, sizeof(be));
 }
 
 void replay_put_qword(int64_t qword)
 {
-    int i;
+    uint64_t be = cpu_to_be64(qword);
 
     trace_replay_put_qword(qword);
-    for (i = 56; i >= 0; i -= 8) {
-        replay_putc(qword >> i);
-    }
+    replay_write(&be, sizeof(be));
 }
 
 void replay_put_array(const uint8_t *buf, size_t size)
 {
     if (replay_file) {
         replay_put_dword(size);
-        if (fwrite(buf, 1, size, replay_file) != size) {
-            replay_write_error();
-        }
+        replay_write(buf, size);
     }
 }
 
-static uint8_t replay_getc(void)
+static void replay_read(void *buf, size_t size)
 {
-    uint8_t byte = 0;
     if (replay_file) {
-        int r = getc(replay_file);
-        if (r == EOF) {
+        if (!replay_log_read(replay_file, buf, size)) {
             replay_read_error();
         }
-        byte = r;
     }
+}
+
+static uint8_t replay_getc(void)
+{
+    uint8_t byte = 0;
+
+    replay_read(&byte, 1);
     return byte;
 }
 
@@ -127,53 +132,36 @@ uint8_t replay_get_byte(void)
 
 uint16_t replay_get_word(void)
 {
-    uint16_t word = 0;
-    if (replay_file) {
-        word = replay_getc();
-        word = (word << 8) + replay_getc();
-    }
+    uint16_t be = 0;
 
-    trace_replay_get_word(word);
-    return word;
+    replay_read(&be, sizeof(be));
+    trace_replay_get_word(be16_to_cpu(be));
+    return be16_to_cpu(be);
 }
 
 uint32_t replay_get_dword(void)
 {
-    uint32_t dword = 0;
-    int i;
+    uint32_t be = 0;
 
-    if (replay_file) {
-        for (i = 24; i >= 0; i -= 8) {
-            dword |= replay_getc() << i;
-        }
-    }
-
-    trace_replay_get_dword(dword);
-    return dword;
+    replay_read(&be, sizeof(be));
+    trace_replay_get_dword(be32_to_cpu(be));
+    return be32_to_cpu(be);
 }
 
 int64_t replay_get_qword(void)
 {
-    uint64_t qword = 0;
-    int i;
+    uint64_t be = 0;
 
-    if (replay_file) {
-        for (i = 56; i >= 0; i -= 8) {
-            qword |= (uint64_t)replay_getc() << i;
-        }
-    }
-
-    trace_replay_get_qword(qword);
-    return qword;
+    replay_read(&be, sizeof(be));
+    trace_replay_get_qword(be64_to_cpu(be));
+    return be64_to_cpu(be);
 }
 
 void replay_get_array(uint8_t *buf, size_t *size)
 {
     if (replay_file) {
         *size = replay_get_dword();
-        if (fread(buf, 1, *size, replay_file) != *size) {
-            replay_read_error();
-        }
+        replay_read(buf, *size);
     }
 }
 
@@ -182,20 +170,18 @@ void replay_get_array_alloc(uint8_t **buf, size_t *size)
     if (replay_file) {
         *size = replay_get_dword();
         *buf = g_malloc(*size);
-        if (fread(*buf, 1, *size, replay_file) != *size) {
-            replay_read_error();
-        }
+        replay_read(*buf, *size);
     }
 }
 
 void replay_check_error(void)
 {
     if (replay_file) {
-        if (feof(replay_file)) {
+        if (replay_log_eof(replay_file)) {
             error_report("replay file is over");
             qemu_system_vmstop_request_prepare();
             qemu_system_vmstop_request(RUN_STATE_PAUSED);
-        } else if (ferror(replay_file)) {
+        } else if (replay_log_error(replay_file)) {
             error_report("replay file is over or something goes wrong");
             qemu_system_vmstop_request_prepare();
             qemu_system_vmstop_request(RUN_STATE_INTERNAL_ERROR);
@@ -302,6 +288,7 @@ void replay_advance_current_icount(uint64_t current_icount)
                     will be read from the log. */
                 qemu_notify_event();
             }
+            replay_memsnap_check();
         }
         /* Execution reached the break step */
         if (replay_break_icount == replay_state.current_icount) {
@@ -309,6 +296,10 @@ void replay_advance_current_icount(uint64_t current_icount)
             timer_mod_ns(replay_break_timer,
                 qemu_clock_get_ns(QEMU_CLOCK_REALTIME));
         }
+        if (replay_end_icount == replay_state.current_icount) {
+            timer_mod_ns(replay_end_timer,
+                qemu_clock_get_ns(QEMU_CLOCK_REALTIME));
+        }
     }
 }
 
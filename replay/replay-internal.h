@@ -99,12 +99,17 @@ typedef struct ReplayState {
 } ReplayState;
 extern ReplayState replay_state;
 
-/* File for replay writing */
-extern FILE *replay_file;
+/* Replay log, see replay-log.c */
+typedef struct ReplayLog ReplayLog;
+extern ReplayLog *replay_file;
 /* Instruction count of the replay breakpoint */
 extern uint64_t replay_break_icount;
 /* Timer for the replay breakpoint callback */
 extern QEMUTimer *replay_break_timer;
+/* Instruction count at which rrend shuts QEMU down, separate from the
+   breakpoint so that seeks and the debugger leave it alone */
+extern uint64_t replay_end_icount;
+extern QEMUTimer *replay_end_timer;
 
 void replay_put_byte(uint8_t byte);
 void replay_put_event(uint8_t event);
@@ -120,6 +125,27 @@ int64_t replay_get_qword(void);
 void replay_get_array(uint8_t *buf, size_t *size);
 void replay_get_array_alloc(uint8_t **buf, size_t *size);
 
+/* Log container */
+
+/*! Opens the log for recording or playing back.
+    \return NULL with @errp set on failure */
+ReplayLog *replay_log_open(const char *fname, ReplayMode mode,
+                           uint32_t version, Error **errp);
+/*! Flushes the log, writes its index and closes it. */
+void replay_log_close(ReplayLog *log);
+bool replay_log_write(ReplayLog *log, const void *buf, size_t len);
+bool replay_log_read(ReplayLog *log, void *buf, size_t len);
+/*! Returns the current offset in the uncompressed event stream. */
+uint64_t replay_log_tell(ReplayLog *log);
+/*! Moves playback to an offset returned by replay_log_tell(). */
+bool replay_log_seek(ReplayLog *log, uint64_t offset);
+/*! Finds the stream offset and icount of the last chunk
+    started at or before @icount. */
+bool replay_log_find_icount(ReplayLog *log, uint64_t icount,
+                            uint64_t *offset, uint64_t *chunk_icount);
+bool replay_log_eof(ReplayLog *log);
+bool replay_log_error(ReplayLog *log);
+
 /* Mutex functions for protecting replay log file and ensuring
  * synchronisation between vCPU and main-loop threads. */
 
@@ -212,4 +238,28 @@ G_NORETURN void replay_sync_error(const char *error);
    to make cached timers available for post_load functions. */
 void replay_vmstate_register(void);
 
+/* Segment end */
+
+/*! Sets the instruction count at which replay shuts QEMU down,
+    0 to replay the whole log. */
+void replay_end_configure(uint64_t icount);
+/*! Arms the shutdown at the configured instruction count. */
+void replay_end_start(void);
+
+/* In-memory snapshots */
+
+/*! Sets the interval (0 to disable) and memory budget of
+    in-memory snapshots taken while replaying. */
+void replay_memsnap_configure(uint64_t interval, uint64_t budget);
+/*! Sets up periodic in-memory snapshots, if configured. */
+void replay_memsnap_start(void);
+/*! Schedules an in-memory snapshot if one is due. */
+void replay_memsnap_check(void);
+/*! Takes an in-memory snapshot now, if they are enabled. */
+void replay_memsnap_save(void);
+/*! Finds the latest in-memory snapshot at or before @icount. */
+int replay_memsnap_find(int64_t icount, int64_t *snapshot_icount);
+/*! Restores in-memory snapshot @num. */
+bool replay_memsnap_load(int num, Error **errp);
+
 #endif
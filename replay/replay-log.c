@@ -0,0 +1,707 @@
+/*
+ * replay-log.c
+ *
+ * Chunked, compressed and indexed container for the replay log.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * The replay log is a byte stream produced by replay_put_*() and
+ * consumed by replay_get_*(). On disk the stream is cut into chunks of
+ * at most chunk_size bytes, each compressed on its own:
+ *
+ *   ReplayLogHeader
+ *   { ReplayLogChunkHeader, stored_len bytes } ...
+ *   ReplayLogIndexEntry[nchunks]
+ *
+ * Every chunk records the stream offset of its first byte and the
+ * instruction count when it was started, and the index at the end
+ * lists all chunks, so a stream offset or an icount maps to a chunk
+ * without reading the ones before it. A log whose index was never
+ * written (QEMU died while recording) is indexed by walking the chunk
+ * headers.
+ *
+ * In record mode full chunks go to a writer thread that compresses and
+ * writes them, so the vCPU thread only copies bytes. In play mode a
+ * reader thread reads and decompresses chunks ahead of the consumer.
+ * All integers are little-endian.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "qemu/thread.h"
+#include "system/replay.h"
+#include "replay-internal.h"
+
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
+#define REPLAY_LOG_MAGIC        "QEMURRLG"
+#define REPLAY_LOG_CHUNK_SIZE   (256 * KiB)
+/* Chunks that may wait for the writer before the vCPU blocks */
+#define REPLAY_LOG_WRITE_QUEUE  16
+/* Chunks the reader decompresses ahead of the consumer */
+#define REPLAY_LOG_READ_AHEAD   4
+#define REPLAY_LOG_ZSTD_LEVEL   1
+
+#define REPLAY_LOG_CODEC_NONE   0
+#define REPLAY_LOG_CODEC_ZSTD   1
+
+typedef struct QEMU_PACKED ReplayLogHeader {
+    char magic[8];
+    uint32_t version;       /* REPLAY_VERSION of the event stream */
+    uint32_t chunk_size;
+    uint64_t index_pos;     /* 0 until the log is closed */
+    uint64_t nchunks;
+} ReplayLogHeader;
+
+typedef struct QEMU_PACKED ReplayLogChunkHeader {
+    uint32_t codec;
+    uint32_t raw_len;
+    uint32_t stored_len;
+    uint32_t reserved;
+    uint64_t offset;        /* stream offset of the first byte */
+    uint64_t icount;        /* replay_state.current_icount at the first byte */
+} ReplayLogChunkHeader;
+
+typedef struct QEMU_PACKED ReplayLogIndexEntry {
+    uint64_t pos;           /* file position of the chunk header */
+    uint64_t offset;
+    uint64_t icount;
+} ReplayLogIndexEntry;
+
+typedef struct ReplayLogChunk {
+    uint64_t offset;
+    uint64_t icount;
+    uint32_t len;
+    uint32_t idx;           /* position in the index, play mode only */
+    uint64_t gen;           /* seek generation it was read for */
+    bool error;
+    uint8_t data[];
+} ReplayLogChunk;
+
+struct ReplayLog {
+    int fd;
+    ReplayMode mode;
+    uint32_t version;
+    uint32_t chunk_size;
+
+    /* Chunk being filled (record) or consumed (play), owned by the caller */
+    ReplayLogChunk *cur;
+    uint32_t pos;
+    bool eof;
+    bool error;
+
+    /*
+     * Index of chunks in host byte order. The writer thread appends to
+     * it; in play mode it is fixed once the log is open.
+     */
+    GArray *index;
+    uint64_t file_end;
+
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond work;          /* signalled to the thread */
+    QemuCond done;          /* signalled by the thread */
+    GQueue queue;           /* chunks to write, or chunks read ahead */
+    bool quit;
+    uint64_t gen;           /* bumped by each seek in play mode */
+    uint32_t next;          /* next chunk the reader thread fetches */
+};
+
+static ReplayLogChunk *replay_log_chunk_new(uint32_t size)
+{
+    return g_malloc0(sizeof(ReplayLogChunk) + size);
+}
+
+static bool replay_log_pwrite(int fd, const void *buf, size_t len, off_t pos)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, pos);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf = (const uint8_t *)buf + n;
+        pos += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool replay_log_pread(int fd, void *buf, size_t len, off_t pos)
+{
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, pos);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (n == 0) {
+            return false;
+        }
+        buf = (uint8_t *)buf + n;
+        pos += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* Record mode */
+
+static bool replay_log_store(ReplayLog *log, ReplayLogChunk *c)
+{
+    ReplayLogChunkHeader h = {
+        .codec = cpu_to_le32(REPLAY_LOG_CODEC_NONE),
+        .raw_len = cpu_to_le32(c->len),
+        .stored_len = cpu_to_le32(c->len),
+        .offset = cpu_to_le64(c->offset),
+        .icount = cpu_to_le64(c->icount),
+    };
+    ReplayLogIndexEntry e = {
+        .pos = log->file_end,
+        .offset = c->offset,
+        .icount = c->icount,
+    };
+    g_autofree uint8_t *zbuf = NULL;
+    const uint8_t *data = c->data;
+    size_t len = c->len;
+
+#ifdef CONFIG_ZSTD
+    {
+        size_t bound = ZSTD_compressBound(c->len);
+        size_t zlen;
+
+        zbuf = g_malloc(bound);
+        zlen = ZSTD_compress(zbuf, bound, c->data, c->len,
+                             REPLAY_LOG_ZSTD_LEVEL);
+        if (!ZSTD_isError(zlen) && zlen < c->len) {
+            h.codec = cpu_to_le32(REPLAY_LOG_CODEC_ZSTD);
+            h.stored_len = cpu_to_le32(zlen);
+            data = zbuf;
+            len = zlen;
+        }
+    }
+#endif
+
+    if (!replay_log_pwrite(log->fd, &h, sizeof(h), log->file_end) ||
+        !replay_log_pwrite(log->fd, data, len, log->file_end + sizeof(h))) {
+        return false;
+    }
+    log->file_end += sizeof(h) + len;
+    g_array_append_val(log->index, e);
+    return true;
+}
+
+static void *replay_log_writer(void *opaque)
+{
+    ReplayLog *log = opaque;
+
+    qemu_mutex_lock(&log->lock);
+    for (;;) {
+        ReplayLogChunk *c;
+
+        while (g_queue_is_empty(&log->queue) && !log->quit) {
+            qemu_cond_wait(&log->work, &log->lock);
+        }
+        c = g_queue_peek_head(&log->queue);
+        if (c == NULL) {
+            break;
+        }
+        qemu_mutex_unlock(&log->lock);
+
+        if (!qatomic_read(&log->error) && !replay_log_store(log, c)) {
+            error_report("replay write error: %s", strerror(errno));
+            qatomic_set(&log->error, true);
+        }
+
+        qemu_mutex_lock(&log->lock);
+        /* Dequeue only now, so close waits for the write to finish */
+        g_queue_pop_head(&log->queue);
+        qemu_cond_signal(&log->done);
+        g_free(c);
+    }
+    qemu_mutex_unlock(&log->lock);
+    return NULL;
+}
+
+/* Hand the current chunk to the writer and start a new one. */
+static void replay_log_submit(ReplayLog *log)
+{
+    ReplayLogChunk *c = log->cur;
+    uint64_t next = c->offset + log->pos;
+
+    c->len = log->pos;
+    qemu_mutex_lock(&log->lock);
+    while (g_queue_get_length(&log->queue) >= REPLAY_LOG_WRITE_QUEUE) {
+        qemu_cond_wait(&log->done, &log->lock);
+    }
+    g_queue_push_tail(&log->queue, c);
+    qemu_cond_signal(&log->work);
+    qemu_mutex_unlock(&log->lock);
+
+    log->cur = replay_log_chunk_new(log->chunk_size);
+    log->cur->offset = next;
+    log->cur->icount = replay_state.current_icount;
+    log->pos = 0;
+}
+
+/*! Appends @len bytes to the log. Returns false after a write error. */
+bool replay_log_write(ReplayLog *log, const void *buf, size_t len)
+{
+    assert(log->mode == REPLAY_MODE_RECORD);
+    while (len > 0) {
+        size_t n = MIN(len, log->chunk_size - log->pos);
+
+        memcpy(log->cur->data + log->pos, buf, n);
+        log->pos += n;
+        buf = (const uint8_t *)buf + n;
+        len -= n;
+        if (log->pos == log->chunk_size) {
+            replay_log_submit(log);
+        }
+    }
+    return !qatomic_read(&log->error);
+}
+
+/* Play mode */
+
+static ReplayLogChunk *replay_log_load(ReplayLog *log, uint32_t idx)
+{
+    ReplayLogIndexEntry *e = &g_array_index(log->index, ReplayLogIndexEntry, idx);
+    ReplayLogChunkHeader h;
+    g_autofree uint8_t *stored = NULL;
+    ReplayLogChunk *c;
+    uint32_t raw_len, stored_len;
+
+    if (!replay_log_pread(log->fd, &h, sizeof(h), e->pos)) {
+        goto fail;
+    }
+    raw_len = le32_to_cpu(h.raw_len);
+    stored_len = le32_to_cpu(h.stored_len);
+    if (raw_len > log->chunk_size) {
+        goto fail;
+    }
+    c = replay_log_chunk_new(raw_len);
+    c->offset = e->offset;
+    c->icount = e->icount;
+    c->len = raw_len;
+    c->idx = idx;
+
+    switch (le32_to_cpu(h.codec)) {
+    case REPLAY_LOG_CODEC_NONE:
+        if (stored_len != raw_len ||
+            !replay_log_pread(log->fd, c->data, raw_len, e->pos + sizeof(h))) {
+            goto fail_chunk;
+        }
+        break;
+#ifdef CONFIG_ZSTD
+    case REPLAY_LOG_CODEC_ZSTD:
+        stored = g_malloc(stored_len);
+        if (!replay_log_pread(log->fd, stored, stored_len, e->pos + sizeof(h)) ||
+            ZSTD_decompress(c->data, raw_len, stored, stored_len) != raw_len) {
+            goto fail_chunk;
+        }
+        break;
+#endif
+    default:
+        goto fail_chunk;
+    }
+    return c;
+
+fail_chunk:
+    g_free(c);
+fail:
+    c = replay_log_chunk_new(0);
+    c->idx = idx;
+    c->error = true;
+    return c;
+}
+
+static void *replay_log_reader(void *opaque)
+{
+    ReplayLog *log = opaque;
+
+    qemu_mutex_lock(&log->lock);
+    for (;;) {
+        ReplayLogChunk *c;
+        uint32_t idx;
+        uint64_t gen;
+
+        while (!log->quit &&
+               (log->next >= log->index->len ||
+                g_queue_get_length(&log->queue) >= REPLAY_LOG_READ_AHEAD)) {
+            qemu_cond_wait(&log->work, &log->lock);
+        }
+        if (log->quit) {
+            break;
+        }
+        idx = log->next++;
+        gen = log->gen;
+        qemu_mutex_unlock(&log->lock);
+
+        c = replay_log_load(log, idx);
+        c->gen = gen;
+
+        qemu_mutex_lock(&log->lock);
+        if (c->gen == log->gen) {
+            g_queue_push_tail(&log->queue, c);
+            qemu_cond_signal(&log->done);
+        } else {
+            g_free(c);      /* a seek overtook us */
+        }
+    }
+    qemu_mutex_unlock(&log->lock);
+    return NULL;
+}
+
+/* Make chunk @idx current, taking it from the reader thread. */
+static bool replay_log_next_chunk(ReplayLog *log, uint32_t idx)
+{
+    ReplayLogChunk *c;
+
+    if (idx >= log->index->len) {
+        log->eof = true;
+        return false;
+    }
+    qemu_mutex_lock(&log->lock);
+    while (g_queue_is_empty(&log->queue)) {
+        qemu_cond_wait(&log->done, &log->lock);
+    }
+    c = g_queue_pop_head(&log->queue);
+    qemu_cond_signal(&log->work);
+    qemu_mutex_unlock(&log->lock);
+
+    assert(c->idx == idx);
+    g_free(log->cur);
+    log->cur = c;
+    log->pos = 0;
+    if (c->error) {
+        log->error = true;
+        return false;
+    }
+    return true;
+}
+
+/*! Reads @len bytes from the log. Returns false at the end or on error. */
+bool replay_log_read(ReplayLog *log, void *buf, size_t len)
+{
+    assert(log->mode == REPLAY_MODE_PLAY);
+    while (len > 0) {
+        size_t n;
+
+        if (log->cur == NULL || log->pos == log->cur->len) {
+            if (log->error ||
+                !replay_log_next_chunk(log, log->cur ? log->cur->idx + 1 : 0)) {
+                return false;
+            }
+            continue;
+        }
+        n = MIN(len, log->cur->len - log->pos);
+        memcpy(buf, log->cur->data + log->pos, n);
+        log->pos += n;
+        buf = (uint8_t *)buf + n;
+        len -= n;
+    }
+    return true;
+}
+
+/* Last chunk whose first byte is at or before @offset in the stream. */
+static uint32_t replay_log_chunk_at(ReplayLog *log, uint64_t offset)
+{
+    uint32_t lo = 0, hi = log->index->len;
+
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (g_array_index(log->index, ReplayLogIndexEntry, mid).offset <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*! Current position in the stream. */
+uint64_t replay_log_tell(ReplayLog *log)
+{
+    return log->cur ? log->cur->offset + log->pos : 0;
+}
+
+/*! Moves the play position to stream offset @offset. */
+bool replay_log_seek(ReplayLog *log, uint64_t offset)
+{
+    uint32_t idx;
+
+    if (log->mode != REPLAY_MODE_PLAY || log->index->len == 0) {
+        return false;
+    }
+    if (log->cur && offset >= log->cur->offset &&
+        offset <= log->cur->offset + log->cur->len && !log->cur->error) {
+        log->pos = offset - log->cur->offset;
+        log->eof = false;
+        return true;
+    }
+
+    idx = replay_log_chunk_at(log, offset);
+    qemu_mutex_lock(&log->lock);
+    log->gen++;
+    while (!g_queue_is_empty(&log->queue)) {
+        g_free(g_queue_pop_head(&log->queue));
+    }
+    log->next = idx;
+    qemu_cond_signal(&log->work);
+    qemu_mutex_unlock(&log->lock);
+
+    log->eof = false;
+    log->error = false;
+    if (!replay_log_next_chunk(log, idx) || offset > log->cur->offset + log->cur->len) {
+        return false;
+    }
+    log->pos = offset - log->cur->offset;
+    return true;
+}
+
+/*!
+ * Finds the last chunk started at or before instruction @icount, and
+ * returns its stream offset and starting icount. Play mode only.
+ */
+bool replay_log_find_icount(ReplayLog *log, uint64_t icount,
+                            uint64_t *offset, uint64_t *chunk_icount)
+{
+    ReplayLogIndexEntry *e = NULL;
+    uint32_t lo = 0, hi;
+
+    if (log->mode != REPLAY_MODE_PLAY || log->index->len == 0) {
+        return false;
+    }
+    hi = log->index->len;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (g_array_index(log->index, ReplayLogIndexEntry, mid).icount <= icount) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return false;
+    }
+    e = &g_array_index(log->index, ReplayLogIndexEntry, lo - 1);
+    *offset = e->offset;
+    *chunk_icount = e->icount;
+    return true;
+}
+
+bool replay_log_eof(ReplayLog *log)
+{
+    return log->eof;
+}
+
+bool replay_log_error(ReplayLog *log)
+{
+    return qatomic_read(&log->error);
+}
+
+/* Build the index from the chunk headers of a log that wasn't closed. */
+static bool replay_log_scan(ReplayLog *log, off_t size)
+{
+    uint64_t pos = sizeof(ReplayLogHeader);
+
+    while (pos + sizeof(ReplayLogChunkHeader) <= size) {
+        ReplayLogChunkHeader h;
+        ReplayLogIndexEntry e;
+        uint64_t next;
+
+        if (!replay_log_pread(log->fd, &h, sizeof(h), pos)) {
+            return false;
+        }
+        next = pos + sizeof(h) + le32_to_cpu(h.stored_len);
+        if (next > size) {
+            break;  /* torn final chunk */
+        }
+        e.pos = pos;
+        e.offset = le64_to_cpu(h.offset);
+        e.icount = le64_to_cpu(h.icount);
+        g_array_append_val(log->index, e);
+        pos = next;
+    }
+    warn_report("replay log was not closed; recovered %u chunks",
+                log->index->len);
+    return true;
+}
+
+static bool replay_log_open_play(ReplayLog *log, uint32_t version, Error **errp)
+{
+    ReplayLogHeader h;
+    struct stat st;
+    uint64_t index_pos, nchunks;
+
+    if (fstat(log->fd, &st) < 0 ||
+        !replay_log_pread(log->fd, &h, sizeof(h), 0) ||
+        memcmp(h.magic, REPLAY_LOG_MAGIC, sizeof(h.magic))) {
+        error_setg(errp, "not a replay log");
+        return false;
+    }
+    if (le32_to_cpu(h.version) != version) {
+        error_setg(errp, "invalid input log file version");
+        return false;
+    }
+    log->chunk_size = le32_to_cpu(h.chunk_size);
+    index_pos = le64_to_cpu(h.index_pos);
+    nchunks = le64_to_cpu(h.nchunks);
+
+    if (index_pos == 0) {
+        if (!replay_log_scan(log, st.st_size)) {
+            error_setg_errno(errp, errno, "can't read replay log");
+            return false;
+        }
+    } else {
+        g_autofree ReplayLogIndexEntry *raw = NULL;
+
+        if (index_pos > st.st_size ||
+            nchunks > (st.st_size - index_pos) / sizeof(*raw)) {
+            error_setg(errp, "corrupt replay log index");
+            return false;
+        }
+        raw = g_new(ReplayLogIndexEntry, nchunks);
+        if (!replay_log_pread(log->fd, raw, nchunks * sizeof(*raw), index_pos)) {
+            error_setg_errno(errp, errno, "can't read replay log index");
+            return false;
+        }
+        for (uint64_t i = 0; i < nchunks; i++) {
+            ReplayLogIndexEntry e = {
+                .pos = le64_to_cpu(raw[i].pos),
+                .offset = le64_to_cpu(raw[i].offset),
+                .icount = le64_to_cpu(raw[i].icount),
+            };
+            g_array_append_val(log->index, e);
+        }
+    }
+    qemu_thread_create(&log->thread, "replay-read", replay_log_reader, log,
+                       QEMU_THREAD_JOINABLE);
+    return true;
+}
+
+/*!
+ * Opens @fname for recording (truncating it) or for playing back.
+ * @version is the event stream version stored in the header and
+ * checked on play.
+ */
+ReplayLog *replay_log_open(const char *fname, ReplayMode mode,
+                           uint32_t version, Error **errp)
+{
+    ReplayLog *log = g_new0(ReplayLog, 1);
+
+    log->mode = mode;
+    log->version = version;
+    log->index = g_array_new(false, false, sizeof(ReplayLogIndexEntry));
+    qemu_mutex_init(&log->lock);
+    qemu_cond_init(&log->work);
+    qemu_cond_init(&log->done);
+    g_queue_init(&log->queue);
+
+    if (mode == REPLAY_MODE_RECORD) {
+        log->fd = qemu_create(fname, O_WRONLY | O_TRUNC | O_BINARY, 0666, errp);
+    } else {
+        log->fd = qemu_open(fname, O_RDONLY | O_BINARY, errp);
+    }
+    if (log->fd < 0) {
+        goto fail;
+    }
+
+    if (mode == REPLAY_MODE_RECORD) {
+        ReplayLogHeader h = {
+            .version = cpu_to_le32(version),
+            .chunk_size = cpu_to_le32(REPLAY_LOG_CHUNK_SIZE),
+        };
+
+        memcpy(h.magic, REPLAY_LOG_MAGIC, sizeof(h.magic));
+        if (!replay_log_pwrite(log->fd, &h, sizeof(h), 0)) {
+            error_setg_errno(errp, errno, "can't write replay log header");
+            goto fail;
+        }
+        log->chunk_size = REPLAY_LOG_CHUNK_SIZE;
+        log->file_end = sizeof(h);
+        log->cur = replay_log_chunk_new(log->chunk_size);
+        qemu_thread_create(&log->thread, "replay-write", replay_log_writer,
+                           log, QEMU_THREAD_JOINABLE);
+    } else if (!replay_log_open_play(log, version, errp)) {
+        goto fail;
+    }
+    return log;
+
+fail:
+    if (log->fd >= 0) {
+        close(log->fd);
+    }
+    qemu_cond_destroy(&log->work);
+    qemu_cond_destroy(&log->done);
+    qemu_mutex_destroy(&log->lock);
+    g_array_free(log->index, true);
+    g_free(log->cur);
+    g_free(log);
+    return NULL;
+}
+
+/*! Flushes a recorded log, writes its index and closes it. */
+void replay_log_close(ReplayLog *log)
+{
+    if (log->mode == REPLAY_MODE_RECORD && log->pos > 0) {
+        replay_log_submit(log);
+    }
+
+    qemu_mutex_lock(&log->lock);
+    log->quit = true;
+    qemu_cond_signal(&log->work);
+    qemu_mutex_unlock(&log->lock);
+    qemu_thread_join(&log->thread);
+
+    if (log->mode == REPLAY_MODE_RECORD && !log->error) {
+        uint64_t index_pos = log->file_end;
+        ReplayLogHeader h = {
+            .version = cpu_to_le32(log->version),
+            .chunk_size = cpu_to_le32(log->chunk_size),
+            .index_pos = cpu_to_le64(index_pos),
+            .nchunks = cpu_to_le64(log->index->len),
+        };
+        bool ok = true;
+
+        for (guint i = 0; i < log->index->len && ok; i++) {
+            ReplayLogIndexEntry *e = &g_array_index(log->index, ReplayLogIndexEntry, i);
+            ReplayLogIndexEntry raw = {
+                .pos = cpu_to_le64(e->pos),
+                .offset = cpu_to_le64(e->offset),
+                .icount = cpu_to_le64(e->icount),
+            };
+            ok = replay_log_pwrite(log->fd, &raw, sizeof(raw),
+                                   index_pos + i * sizeof(raw));
+        }
+        memcpy(h.magic, REPLAY_LOG_MAGIC, sizeof(h.magic));
+        ok = ok && replay_log_pwrite(log->fd, &h, sizeof(h), 0);
+        if (!ok) {
+            error_report("replay write error: %s", strerror(errno));
+        }
+    }
+
+    close(log->fd);
+    while (!g_queue_is_empty(&log->queue)) {
+        g_free(g_queue_pop_head(&log->queue));
+    }
+    qemu_cond_destroy(&log->work);
+    qemu_cond_destroy(&log->done);
+    qemu_mutex_destroy(&log->lock);
+    g_array_free(log->index, true);
+    g_free(log->cur);
+    g_free(log);
+}
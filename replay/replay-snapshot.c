@@ -18,11 +18,26 @@
 #include "qemu/error-report.h"
 #include "migration/vmstate.h"
 #include "migration/snapshot.h"
+#include "qemu/timer.h"
+#include "system/block-backend.h"
+#include "panda/checkpoint.h"
+
+/* In-memory snapshots beyond this many are thinned out like over budget */
+#define REPLAY_MEMSNAP_MAX      (MAX_CHECKPOINTS / 2)
+
+/* Instructions between in-memory snapshots, 0 if they are off */
+static uint64_t replay_memsnap_interval;
+static uint64_t replay_memsnap_budget;
+/* Instruction count at which the next one is due */
+static uint64_t replay_memsnap_next;
+static QEMUTimer *replay_memsnap_timer;
+/* Checkpoint numbers of the snapshots, oldest first */
+static GArray *replay_memsnaps;
 
 static int replay_pre_save(void *opaque)
 {
     ReplayState *state = opaque;
-    state->file_offset = ftell(replay_file);
+    state->file_offset = replay_log_tell(replay_file);
 
     return 0;
 }
@@ -31,7 +46,11 @@ static int replay_post_load(void *opaque, int version_id)
 {
     ReplayState *state = opaque;
     if (replay_mode == REPLAY_MODE_PLAY) {
-        fseek(replay_file, state->file_offset, SEEK_SET);
+        if (!replay_log_seek(replay_file, state->file_offset)) {
+            error_report("replay: can't seek to log offset %" PRIu64,
+                         state->file_offset);
+            return -EINVAL;
+        }
         /* If this was a vmstate, saved in recording mode,
            we need to initialize replay data fields. */
         replay_fetch_data_kind();
@@ -90,6 +109,7 @@ void replay_vmstate_init(void)
             }
         }
     }
+    replay_end_start();
 }
 
 bool replay_can_snapshot(void)
@@ -97,3 +117,185 @@ bool replay_can_snapshot(void)
     return replay_mode == REPLAY_MODE_NONE
         || !replay_has_events();
 }
+
+void replay_memsnap_configure(uint64_t interval, uint64_t budget)
+{
+    replay_memsnap_interval = interval;
+    replay_memsnap_budget = budget;
+    replay_memsnap_next = 0;
+}
+
+static int replay_memsnap_num(guint i)
+{
+    return g_array_index(replay_memsnaps, int, i);
+}
+
+static uint64_t replay_memsnap_icount(guint i)
+{
+    Checkpoint *c = get_checkpoint(replay_memsnap_num(i));
+    return c ? c->guest_instr_count : 0;
+}
+
+static bool replay_memsnap_over_budget(void)
+{
+    uint64_t total = 0;
+
+    if (replay_memsnaps->len > REPLAY_MEMSNAP_MAX) {
+        return true;
+    }
+    for (guint i = 0; i < replay_memsnaps->len; i++) {
+        Checkpoint *c = get_checkpoint(replay_memsnap_num(i));
+        if (c) {
+            total += c->memfd_usage + c->devstate_len;
+        }
+    }
+    return total > replay_memsnap_budget;
+}
+
+/*
+ * Drop snapshots until we are within budget. The first and the last are
+ * kept; of the others, the one whose neighbours are closest together
+ * goes first, so the remaining ones stay evenly spread.
+ */
+static void replay_memsnap_evict(void)
+{
+    int keep = -1;  /* a snapshot that can't be dropped right now */
+
+    while (replay_memsnap_over_budget()) {
+        uint64_t best = UINT64_MAX;
+        guint victim = 0;
+
+        for (guint i = 1; i + 1 < replay_memsnaps->len; i++) {
+            uint64_t gap = replay_memsnap_icount(i + 1) -
+                           replay_memsnap_icount(i - 1);
+            if (replay_memsnap_num(i) != keep && gap < best) {
+                best = gap;
+                victim = i;
+            }
+        }
+        if (victim == 0) {
+            break;
+        }
+        if (!panda_checkpoint_delete(replay_memsnap_num(victim))) {
+            if (keep >= 0) {
+                break;
+            }
+            keep = replay_memsnap_num(victim);
+            continue;
+        }
+        g_array_remove_index(replay_memsnaps, victim);
+    }
+}
+
+/*
+ * In-memory snapshots hold RAM and devices but not disks, so restoring one
+ * with a disk that the guest may have written since would leave the two
+ * out of step. VM snapshots cover disks too; use only those then.
+ */
+static bool replay_memsnap_disks_writable(void)
+{
+    for (BlockBackend *blk = blk_all_next(NULL); blk; blk = blk_all_next(blk)) {
+        if (blk_is_inserted(blk) && blk_is_writable(blk)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void replay_memsnap_disable(const char *why)
+{
+    warn_report("replay: %s, disabling in-memory snapshots", why);
+    replay_memsnap_next = UINT64_MAX;
+    timer_del(replay_memsnap_timer);
+}
+
+/* The next one is due an interval after the latest one we have */
+static void replay_memsnap_rearm(void)
+{
+    guint n = replay_memsnaps->len;
+
+    if (replay_memsnap_next != UINT64_MAX && n > 0) {
+        replay_memsnap_next = replay_memsnap_icount(n - 1) +
+                              replay_memsnap_interval;
+    }
+}
+
+/*! Takes an in-memory snapshot now, if they are enabled and one is useful. */
+void replay_memsnap_save(void)
+{
+    guint n = replay_memsnaps ? replay_memsnaps->len : 0;
+    Checkpoint *c;
+
+    if (!replay_memsnaps || replay_memsnap_next == UINT64_MAX ||
+        !replay_can_snapshot()) {
+        return;
+    }
+    /* After a seek backwards we replay states we already have */
+    if (n > 0 && replay_get_current_icount() <= replay_memsnap_icount(n - 1)) {
+        replay_memsnap_rearm();
+        return;
+    }
+    if (replay_memsnap_disks_writable()) {
+        replay_memsnap_disable("a writable disk is attached");
+        return;
+    }
+    c = panda_checkpoint();
+    if (c == NULL) {
+        replay_memsnap_disable("can't take in-memory snapshots");
+        return;
+    }
+    g_array_append_val(replay_memsnaps, c->num);
+    replay_memsnap_next = c->guest_instr_count + replay_memsnap_interval;
+    replay_memsnap_evict();
+}
+
+static void replay_memsnap_timer_cb(void *opaque)
+{
+    replay_memsnap_save();
+}
+
+void replay_memsnap_start(void)
+{
+    if (replay_mode != REPLAY_MODE_PLAY || replay_memsnap_interval == 0) {
+        return;
+    }
+    replay_memsnaps = g_array_new(false, false, sizeof(int));
+    replay_memsnap_timer = timer_new_ns(QEMU_CLOCK_REALTIME,
+                                        replay_memsnap_timer_cb, NULL);
+}
+
+/*! Called from the vCPU thread as instructions are replayed. */
+void replay_memsnap_check(void)
+{
+    if (replay_memsnap_timer &&
+        replay_state.current_icount >= replay_memsnap_next) {
+        /* Cannot take the snapshot directly from the vCPU thread */
+        timer_mod_ns(replay_memsnap_timer,
+                     qemu_clock_get_ns(QEMU_CLOCK_REALTIME));
+    }
+}
+
+/*!
+ * Finds the latest in-memory snapshot at or before @icount.
+ * \return its number, or -1 with @snapshot_icount set to -1
+ */
+int replay_memsnap_find(int64_t icount, int64_t *snapshot_icount)
+{
+    int num = get_closest_checkpoint_num(icount);
+
+    *snapshot_icount = num >= 0 ? get_checkpoint(num)->guest_instr_count : -1;
+    return num;
+}
+
+bool replay_memsnap_load(int num, Error **errp)
+{
+    Checkpoint *c = get_checkpoint(num);
+
+    panda_restore_by_num(num);
+    if (c == NULL || replay_get_current_icount() != c->guest_instr_count) {
+        error_setg(errp, "could not restore in-memory snapshot %d", num);
+        return false;
+    }
+    replay_memsnap_rearm();
+    return true;
+}
@@ -17,14 +17,13 @@
 #include "replay-internal.h"
 #include "qemu/main-loop.h"
 #include "qemu/option.h"
+#include "qemu/units.h"
 #include "system/cpus.h"
 #include "qemu/error-report.h"
 
 /* Current version of the replay mechanism.
    Increase it when file format changes. */
-#define REPLAY_VERSION              0xe0200c
-/* Size of replay log header */
-#define HEADER_SIZE                 (sizeof(uint32_t) + sizeof(uint64_t))
+#define REPLAY_VERSION              0xe0200d
 
 ReplayMode replay_mode = REPLAY_MODE_NONE;
 char *replay_snapshot;
@@ -37,6 +36,8 @@ static GSList *replay_blockers;
 /* Replay breakpoints */
 uint64_t replay_break_icount = -1ULL;
 QEMUTimer *replay_break_timer;
+uint64_t replay_end_icount = -1ULL;
+QEMUTimer *replay_end_timer;
 
 /* Pretty print event names */
 
@@ -177,14 +178,20 @@ int replay_get_instructions(void)
     int res = 0;
     g_assert(replay_mutex_locked());
     if (replay_next_event_is(EVENT_INSTRUCTION)) {
+        uint64_t current = replay_get_current_icount();
         res = replay_state.instruction_count;
         if (replay_break_icount != -1LL) {
-            uint64_t current = replay_get_current_icount();
             assert(replay_break_icount >= current);
             if (current + res > replay_break_icount) {
                 res = replay_break_icount - current;
             }
         }
+        /* A seek may have gone past rrend; then it never fires */
+        if (replay_end_icount != -1LL && replay_end_icount >= current) {
+            if (current + res > replay_end_icount) {
+                res = replay_end_icount - current;
+            }
+        }
     }
     return res;
 }
@@ -340,26 +347,19 @@ G_NORETURN void replay_sync_error(const char *error)
 
 static void replay_enable(const char *fname, int mode)
 {
-    const char *fmode = NULL;
+    Error *err = NULL;
     assert(!replay_file);
 
-    switch (mode) {
-    case REPLAY_MODE_RECORD:
-        fmode = "wb";
-        break;
-    case REPLAY_MODE_PLAY:
-        fmode = "rb";
-        break;
-    default:
+    if (mode != REPLAY_MODE_RECORD && mode != REPLAY_MODE_PLAY) {
         fprintf(stderr, "Replay: internal error: invalid replay mode\n");
         exit(1);
     }
 
     atexit(replay_finish);
 
-    replay_file = fopen(fname, fmode);
+    replay_file = replay_log_open(fname, mode, REPLAY_VERSION, &err);
     if (replay_file == NULL) {
-        fprintf(stderr, "Replay: open %s: %s\n", fname, strerror(errno));
+        error_reportf_err(err, "Replay: %s: ", fname);
         exit(1);
     }
 
@@ -373,17 +373,7 @@ static void replay_enable(const char *fname, int mode)
     replay_state.current_event = 0;
     replay_state.has_unread_data = 0;
 
-    /* skip file header for RECORD and check it for PLAY */
-    if (replay_mode == REPLAY_MODE_RECORD) {
-        fseek(replay_file, HEADER_SIZE, SEEK_SET);
-    } else if (replay_mode == REPLAY_MODE_PLAY) {
-        unsigned int version = replay_get_dword();
-        if (version != REPLAY_VERSION) {
-            fprintf(stderr, "Replay: invalid input log file version\n");
-            exit(1);
-        }
-        /* go to the beginning */
-        fseek(replay_file, HEADER_SIZE, SEEK_SET);
+    if (replay_mode == REPLAY_MODE_PLAY) {
         replay_fetch_data_kind();
     }
 
@@ -428,6 +418,12 @@ void replay_configure(QemuOpts *opts)
     replay_snapshot = g_strdup(qemu_opt_get(opts, "rrsnapshot"));
     replay_vmstate_register();
     replay_enable(fname, mode);
+    if (mode == REPLAY_MODE_PLAY) {
+        replay_memsnap_configure(
+            qemu_opt_get_number(opts, "rrmemsnapshot", 0),
+            qemu_opt_get_size(opts, "rrmemsnapshot-budget", 1 * GiB));
+        replay_end_configure(qemu_opt_get_number(opts, "rrend", 0));
+    }
 
 out:
     loc_pop(&loc);
@@ -448,7 +444,7 @@ void replay_start(void)
         exit(1);
     }
 
-    /* Timer for snapshotting will be set up here. */
+    replay_memsnap_start();
 
     replay_enable_events();
 }
@@ -471,13 +467,9 @@ void replay_finish(void)
             replay_shutdown_request(SHUTDOWN_CAUSE_HOST_SIGNAL);
             /* write end event */
             replay_put_event(EVENT_END);
-
-            /* write header */
-            fseek(replay_file, 0, SEEK_SET);
-            replay_put_dword(REPLAY_VERSION);
         }
 
-        fclose(replay_file);
+        replay_log_close(replay_file);
         replay_file = NULL;
     }
     g_free(replay_filename);
@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+#
+# Consume the PANDA shared-memory event export of a running QEMU
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+#
+# QEMU exports events into per-vCPU rings in a memfd once something calls
+# panda_export_start(); see include/panda/export-abi.h for the layout.
+# This script maps the memfd through /proc, drains the rings in bulk and
+# either prints every event or counts them.
+#
+#   panda-export-read.py --pid 1234 --fd 17 --count
+#
+# It is also a reference for writing a consumer: records are plain
+# structs, so an analysis can hand whole slices of a ring to numpy with
+# numpy.frombuffer(mm, dtype, count, offset) instead of unpacking them
+# one by one.
+
+import argparse
+import collections
+import mmap
+import os
+import struct
+import sys
+import time
+
+MAGIC = 0x50584541444e4150
+VERSION = 1
+HEADER = struct.Struct('=QIIIIQIIII')
+HEADER_SIZE = 4096
+CONSUMERS_OFF = 40
+CLOSED_OFF = 44
+RING_HEAD = 0
+RING_TAIL = 64
+RING_DROPPED = 128
+RING_RECORDS = 192
+RECORD = struct.Struct('=IIQQQ4Q')
+U64 = struct.Struct('=Q')
+U32 = struct.Struct('=I')
+
+TYPES = ['block_exec', 'translate', 'asid', 'syscall']
+
+
+class Export:
+    def __init__(self, path):
+        fd = os.open(path, os.O_RDWR)
+        try:
+            self.mm = mmap.mmap(fd, 0, mmap.MAP_SHARED,
+                                mmap.PROT_READ | mmap.PROT_WRITE)
+        finally:
+            os.close(fd)
+        (magic, version, record_size, self.nrings, self.ring_records,
+         self.stride, self.events, self.flags, _, _) = \
+            HEADER.unpack_from(self.mm, 0)
+        if magic != MAGIC or version != VERSION or record_size != RECORD.size:
+            sys.exit(f'{path}: not a version {VERSION} PANDA export')
+        self.mask = self.ring_records - 1
+
+    # Python has no atomic add on shared memory. With one consumer at a
+    # time, which is all a ring supports, a plain update is enough.
+    def attach(self, delta=1):
+        n = U32.unpack_from(self.mm, CONSUMERS_OFF)[0]
+        U32.pack_into(self.mm, CONSUMERS_OFF, n + delta)
+
+    def closed(self):
+        return U32.unpack_from(self.mm, CLOSED_OFF)[0] != 0
+
+    def ring(self, i):
+        return HEADER_SIZE + i * self.stride
+
+    def dropped(self, i):
+        return U64.unpack_from(self.mm, self.ring(i) + RING_DROPPED)[0]
+
+    def drain(self, i):
+        """Yield the pending records of ring i and free their slots."""
+        base = self.ring(i)
+        head = U64.unpack_from(self.mm, base + RING_HEAD)[0]
+        tail = U64.unpack_from(self.mm, base + RING_TAIL)[0]
+        for n in range(tail, head):
+            off = base + RING_RECORDS + (n & self.mask) * RECORD.size
+            yield RECORD.unpack_from(self.mm, off)
+        U64.pack_into(self.mm, base + RING_TAIL, head)
+
+
+def main():
+    ap = argparse.ArgumentParser(
+        description='Consume the PANDA shared-memory event export')
+    ap.add_argument('--pid', type=int, required=True, help='QEMU process')
+    ap.add_argument('--fd', type=int, required=True,
+                    help='memfd returned by panda_export_start()')
+    ap.add_argument('--count', action='store_true',
+                    help='print counts per vCPU and event type every second '
+                    'instead of every event')
+    args = ap.parse_args()
+
+    x = Export(f'/proc/{args.pid}/fd/{args.fd}')
+    counts = collections.Counter()
+    last = time.monotonic()
+    x.attach()
+    try:
+        while True:
+            busy = False
+            for i in range(x.nrings):
+                for t, size, icount, pc, asid, *arg in x.drain(i):
+                    busy = True
+                    if args.count:
+                        counts[i, t] += 1
+                    else:
+                        print(f'cpu{i} {icount} {TYPES[t]} pc={pc:#x} '
+                              f'asid={asid:#x} size={size} '
+                              + ' '.join(f'{a:#x}' for a in arg))
+            if args.count and time.monotonic() - last >= 1:
+                last = time.monotonic()
+                for (i, t), n in sorted(counts.items()):
+                    print(f'cpu{i} {TYPES[t]:<10} {n:>12} '
+                          f'(dropped {x.dropped(i)})')
+            if not busy:
+                if x.closed():
+                    break
+                time.sleep(0.001)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        x.attach(-1)
+
+
+if __name__ == '__main__':
+    main()
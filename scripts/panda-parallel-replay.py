@@ -0,0 +1,473 @@
+#!/usr/bin/env python3
+#
+# Replay a recording as segments in parallel QEMU processes
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+#
+# A replay runs on one host thread, so analysing a long recording under
+# heavy plugins takes a long time. This script cuts the recording at the
+# VM snapshots stored in the disk image (each one carries the icount it
+# was taken at), and replays every segment in its own QEMU process:
+#
+#   split  replay once without plugins and save snapshots seg1..segN-1
+#          at evenly spaced instruction counts
+#   run    replay all segments at once, each from its snapshot to the
+#          next one (rrsnapshot=, rrend=), on a private copy of the image
+#   merge  combine per-segment pandalogs into one, in icount order
+#
+# The QEMU command line follows "--" and must replay with rr=replay and
+# rrfile=; "run" replaces {seg} in it with the segment number, so each
+# process can be pointed at its own output file.
+#
+#   panda-parallel-replay.py split -n 8 -- \
+#       qemu-system-x86_64 ... -icount shift=auto,rr=replay,rrfile=r.bin,rrsnapshot=init
+#   panda-parallel-replay.py run --image disk.qcow2 --merge out.plog \
+#       --pandalog 'seg{seg}.plog' -- qemu-system-x86_64 ... (plugins writing seg{seg}.plog)
+
+import argparse
+import heapq
+import json
+import os
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+# replay/replay-log.c
+RR_HEADER = struct.Struct('<8sIIQQ')
+RR_CHUNK = struct.Struct('<IIIIQQ')
+RR_INDEX = struct.Struct('<QQQ')
+
+# include/panda/pandalog.h
+PLOG_MAGIC = b'PANDALG2'
+PLOG_INDEX_MAGIC = b'PLOGIDX2'
+PLOG_VERSION = 2
+PLOG_CODEC_NONE = 0
+PLOG_CODEC_ZSTD = 1
+PLOG_NO_VCPU = 0xffffffff
+PLOG_HEADER = struct.Struct('<8sII')
+PLOG_CHUNK = struct.Struct('<IIIIQQQ')
+PLOG_INDEX = struct.Struct('<QQQII')
+PLOG_TRAILER = struct.Struct('<QQ8s')
+PLOG_RECORD = struct.Struct('<QII')
+
+SNAPSHOT_PREFIX = 'seg'
+
+
+def die(msg):
+    sys.exit('panda-parallel-replay: ' + msg)
+
+
+#
+# QEMU command line
+#
+
+def icount_arg(cmd):
+    "Index of the -icount value in cmd"
+    for i, arg in enumerate(cmd[:-1]):
+        if arg in ('-icount', '--icount'):
+            return i + 1
+    die('the QEMU command has no -icount option')
+
+
+def icount_opts(cmd):
+    "The -icount suboptions as a dict; later keys win like in QemuOpts"
+    opts = {}
+    for opt in cmd[icount_arg(cmd)].split(','):
+        key, _, val = opt.partition('=')
+        opts[key] = val
+    return opts
+
+
+def with_icount_opts(cmd, **opts):
+    "Copy of cmd with suboptions appended to -icount"
+    cmd = list(cmd)
+    i = icount_arg(cmd)
+    cmd[i] += ''.join(',%s=%s' % kv for kv in opts.items())
+    return cmd
+
+
+def check_replay_cmd(cmd):
+    opts = icount_opts(cmd)
+    if opts.get('rr') != 'replay' or not opts.get('rrfile'):
+        die('the QEMU command must replay: -icount ...,rr=replay,rrfile=...')
+    return opts
+
+
+#
+# Replay log
+#
+
+def replay_log_icount(path):
+    "Instruction count at which the last chunk of a replay log starts"
+    with open(path, 'rb') as f:
+        magic, _, _, index_pos, nchunks = RR_HEADER.unpack(
+            f.read(RR_HEADER.size))
+        if magic != b'QEMURRLG':
+            die('%s is not a chunked replay log' % path)
+        if index_pos and nchunks:
+            f.seek(index_pos + (nchunks - 1) * RR_INDEX.size)
+            return RR_INDEX.unpack(f.read(RR_INDEX.size))[2]
+        # Never closed: walk the chunk headers
+        icount = 0
+        while True:
+            hdr = f.read(RR_CHUNK.size)
+            if len(hdr) < RR_CHUNK.size:
+                return icount
+            _, _, stored_len, _, _, icount = RR_CHUNK.unpack(hdr)
+            f.seek(stored_len, os.SEEK_CUR)
+
+
+#
+# Snapshots
+#
+
+def image_snapshots(image):
+    "[(icount, name)] of the VM snapshots in image, by icount"
+    out = subprocess.run(['qemu-img', 'info', '--force-share',
+                          '--output=json', image],
+                         check=True, capture_output=True, text=True).stdout
+    snaps = {}
+    for s in json.loads(out).get('snapshots', []):
+        if 'icount' in s and s.get('vm-state-size', 0):
+            snaps.setdefault(s['icount'], s['name'])
+    return sorted(snaps.items())
+
+
+class QMP:
+    "Just enough of a synchronous QMP client"
+
+    def __init__(self, path, proc, timeout=30):
+        deadline = time.monotonic() + timeout
+        while True:
+            try:
+                self.sock = socket.socket(socket.AF_UNIX)
+                self.sock.connect(path)
+                break
+            except OSError:
+                self.sock.close()
+                if proc.poll() is not None or time.monotonic() > deadline:
+                    die('cannot connect to QMP at %s' % path)
+                time.sleep(0.1)
+        self.f = self.sock.makefile('rw')
+        self.events = []
+        self.read()
+        self.cmd('qmp_capabilities')
+
+    def read(self):
+        line = self.f.readline()
+        if not line:
+            die('QEMU closed the QMP connection')
+        return json.loads(line)
+
+    def cmd(self, name, **args):
+        self.f.write(json.dumps({'execute': name, 'arguments': args}) + '\n')
+        self.f.flush()
+        while True:
+            msg = self.read()
+            if 'event' in msg:
+                self.events.append(msg)
+            elif 'error' in msg:
+                raise RuntimeError(msg['error']['desc'])
+            else:
+                return msg['return']
+
+    def hmp(self, line):
+        out = self.cmd('human-monitor-command', **{'command-line': line})
+        if out.strip():
+            raise RuntimeError(out.strip())
+
+    def wait_event(self, name):
+        while True:
+            for i, ev in enumerate(self.events):
+                if ev['event'] == name:
+                    return self.events.pop(i)
+            self.events.append(self.read())
+
+
+def split(args):
+    opts = check_replay_cmd(args.cmd)
+    total = replay_log_icount(opts['rrfile'])
+    if args.segments < 2:
+        die('need at least two segments')
+
+    with tempfile.TemporaryDirectory() as tmp:
+        sock = os.path.join(tmp, 'qmp')
+        cmd = args.cmd + ['-S', '-qmp', 'unix:%s,server=on,wait=off' % sock]
+        proc = subprocess.Popen(cmd)
+        try:
+            qmp = QMP(sock, proc)
+            # Replay starts wherever rrsnapshot= left it
+            start = qmp.cmd('query-replay')['icount']
+            targets = [start + (total - start) * k // args.segments
+                       for k in range(1, args.segments)]
+            if targets[0] <= start:
+                qmp.cmd('quit')
+                die('the recording is too short to split %d ways'
+                    % args.segments)
+            for k, icount in enumerate(targets, 1):
+                name = '%s%d' % (SNAPSHOT_PREFIX, k)
+                # Replay refuses to snapshot while events are pending;
+                # step on a little until it can.
+                for _ in range(args.retries):
+                    qmp.cmd('replay-break', icount=icount)
+                    qmp.cmd('cont')
+                    qmp.wait_event('STOP')
+                    try:
+                        qmp.hmp('savevm ' + name)
+                        break
+                    except RuntimeError as e:
+                        err = e
+                        icount = qmp.cmd('query-replay')['icount'] + args.step
+                else:
+                    die('cannot save %s near icount %d: %s'
+                        % (name, targets[k - 1], err))
+                print('%s at icount %d' % (name, icount))
+            qmp.cmd('quit')
+        finally:
+            proc.wait()
+
+
+#
+# Segments
+#
+
+def run(args):
+    check_replay_cmd(args.cmd)
+    snaps = image_snapshots(args.image[0])
+    if args.prefix is not None:
+        snaps = [s for s in snaps if s[1].startswith(args.prefix)]
+    if not snaps:
+        die('%s has no VM snapshots with an icount' % args.image[0])
+    jobs = args.jobs or os.cpu_count()
+    workdir = args.workdir or tempfile.mkdtemp(prefix='panda-replay-')
+    os.makedirs(workdir, exist_ok=True)
+
+    segments = []
+    for seg, (icount, name) in enumerate(snaps):
+        end = snaps[seg + 1][0] if seg + 1 < len(snaps) else None
+        cmd = [a.replace('{seg}', str(seg)) for a in args.cmd]
+        # Replay writes to the disk and loadvm needs the image for
+        # itself, so every process gets a copy (cheap with reflinks).
+        for image in args.image:
+            copy = os.path.join(workdir, '%d-%s' % (seg, os.path.basename(image)))
+            subprocess.run(['cp', '--reflink=auto', '--sparse=always',
+                            image, copy], check=True)
+            cmd = [a.replace(image, copy) for a in cmd]
+        extra = {'rrsnapshot': name}
+        if end is not None:
+            extra['rrend'] = end
+        segments.append((seg, icount, end, with_icount_opts(cmd, **extra)))
+
+    pending = list(segments)
+    running = {}
+    failed = []
+    while pending or running:
+        while pending and len(running) < jobs:
+            seg, icount, end, cmd = pending.pop(0)
+            log = open(os.path.join(workdir, '%d.log' % seg), 'w')
+            print('segment %d: icount %d..%s' % (seg, icount,
+                                                 end if end is not None else 'end'))
+            running[subprocess.Popen(cmd, stdin=subprocess.DEVNULL,
+                                     stdout=log, stderr=log)] = (seg, log)
+        pid, status = os.wait()
+        for proc, (seg, log) in list(running.items()):
+            if proc.pid == pid:
+                proc.returncode = os.waitstatus_to_exitcode(status)
+                log.close()
+                del running[proc]
+                if proc.returncode != 0:
+                    failed.append(seg)
+                    print('segment %d failed (%d), see %s'
+                          % (seg, proc.returncode, log.name))
+
+    if not args.keep:
+        for seg, _, _, _ in segments:
+            for image in args.image:
+                os.unlink(os.path.join(workdir, '%d-%s'
+                                       % (seg, os.path.basename(image))))
+    if failed:
+        die('%d of %d segments failed' % (len(failed), len(segments)))
+    if args.merge:
+        if not args.pandalog:
+            die('--merge needs --pandalog')
+        inputs = [(args.pandalog.replace('{seg}', str(seg)), icount, end)
+                  for seg, icount, end, _ in segments]
+        merge_pandalogs(inputs, args.merge)
+
+
+#
+# Pandalog merge
+#
+
+class PandalogChunks:
+    "Lazily decoded chunks of one pandalog, limited to [lo, hi)"
+
+    def __init__(self, path, lo=0, hi=None):
+        self.path = path
+        self.lo = lo
+        self.hi = hi
+        self.f = open(path, 'rb')
+        magic, version, self.chunk_size = PLOG_HEADER.unpack(
+            self.f.read(PLOG_HEADER.size))
+        if magic != PLOG_MAGIC or version != PLOG_VERSION:
+            die('%s is not a version %d pandalog' % (path, PLOG_VERSION))
+        self.f.seek(-PLOG_TRAILER.size, os.SEEK_END)
+        index_offset, nchunks, magic = PLOG_TRAILER.unpack(
+            self.f.read(PLOG_TRAILER.size))
+        if magic != PLOG_INDEX_MAGIC:
+            die('%s has no index; was it closed?' % path)
+        self.f.seek(index_offset)
+        self.index = [PLOG_INDEX.unpack(self.f.read(PLOG_INDEX.size))
+                      for _ in range(nchunks)]
+
+    def wanted(self):
+        "(first_instr, offset) of the chunks overlapping [lo, hi)"
+        return [(first, off) for off, first, last, _, _ in self.index
+                if last >= self.lo and (self.hi is None or first < self.hi)]
+
+    def records(self, offset):
+        "The records of the chunk at offset as (instr, type, payload)"
+        self.f.seek(offset)
+        codec, _, nrecords, raw_len, stored_len, _, _ = PLOG_CHUNK.unpack(
+            self.f.read(PLOG_CHUNK.size))
+        data = self.f.read(stored_len)
+        if codec == PLOG_CODEC_ZSTD:
+            import zstandard
+            data = zstandard.ZstdDecompressor().decompress(
+                data, max_output_size=raw_len)
+        elif codec != PLOG_CODEC_NONE:
+            die('%s: unknown codec %d' % (self.path, codec))
+        pos = 0
+        for _ in range(nrecords):
+            instr, rtype, length = PLOG_RECORD.unpack_from(data, pos)
+            start = pos + PLOG_RECORD.size
+            pos = start + ((length + 7) & ~7)
+            if instr >= self.lo and (self.hi is None or instr < self.hi):
+                yield instr, rtype, data[start:start + length]
+
+
+class PandalogWriter:
+    "Uncompressed pandalog whose chunks belong to no vCPU"
+
+    def __init__(self, path, chunk_size):
+        self.f = open(path, 'wb')
+        self.chunk_size = chunk_size
+        self.f.write(PLOG_HEADER.pack(PLOG_MAGIC, PLOG_VERSION, chunk_size))
+        self.index = []
+        self.buf = bytearray()
+        self.nrecords = 0
+
+    def write(self, instr, rtype, payload):
+        size = PLOG_RECORD.size + ((len(payload) + 7) & ~7)
+        if self.buf and len(self.buf) + size > self.chunk_size:
+            self.flush()
+        if not self.buf:
+            self.first = instr
+        self.buf += PLOG_RECORD.pack(instr, rtype, len(payload)) + payload
+        self.buf += bytes(-len(payload) % 8)
+        self.last = instr
+        self.nrecords += 1
+
+    def flush(self):
+        if not self.buf:
+            return
+        offset = self.f.tell()
+        self.f.write(PLOG_CHUNK.pack(PLOG_CODEC_NONE, PLOG_NO_VCPU,
+                                     self.nrecords, len(self.buf),
+                                     len(self.buf), self.first, self.last))
+        self.f.write(self.buf)
+        self.index.append(PLOG_INDEX.pack(offset, self.first, self.last,
+                                          PLOG_NO_VCPU, self.nrecords))
+        self.buf = bytearray()
+        self.nrecords = 0
+
+    def close(self):
+        self.flush()
+        index_offset = self.f.tell()
+        self.f.write(b''.join(self.index))
+        self.f.write(PLOG_TRAILER.pack(index_offset, len(self.index),
+                                       PLOG_INDEX_MAGIC))
+        self.f.close()
+
+
+def merge_pandalogs(inputs, output):
+    """Merge [(path, lo, hi)] into output. Records are kept in [lo, hi)
+    of their input, so overlapping segments are not counted twice."""
+    logs = [PandalogChunks(path, lo, hi) for path, lo, hi in inputs]
+    out = PandalogWriter(output, max(log.chunk_size for log in logs))
+
+    # Chunks by their lowest icount; a chunk is only decoded once the
+    # merge reaches it, so memory holds the overlapping chunks only.
+    chunks = [(first, n, off) for n, log in enumerate(logs)
+              for first, off in log.wanted()]
+    heapq.heapify(chunks)
+    records = []
+    seq = 0
+    while chunks or records:
+        while chunks and (not records or chunks[0][0] <= records[0][0]):
+            _, n, off = heapq.heappop(chunks)
+            for instr, rtype, payload in logs[n].records(off):
+                # seq keeps records with equal icounts in file order
+                heapq.heappush(records, (instr, n, seq, rtype, payload))
+                seq += 1
+        if records:
+            instr, _, _, rtype, payload = heapq.heappop(records)
+            out.write(instr, rtype, payload)
+    out.close()
+
+
+def merge(args):
+    merge_pandalogs([(path, 0, None) for path in args.inputs], args.output)
+
+
+def parse_arguments():
+    "Grab arguments for script"
+    parser = argparse.ArgumentParser(
+        description='Replay a recording as parallel segments')
+    sub = parser.add_subparsers(dest='command', required=True)
+
+    p = sub.add_parser('split', help='save snapshots to split the replay at')
+    p.add_argument('-n', '--segments', type=int, required=True)
+    p.add_argument('--retries', type=int, default=20,
+                   help='attempts to find a point where a snapshot is allowed')
+    p.add_argument('--step', type=int, default=10000,
+                   help='instructions to move on between attempts')
+    p.add_argument('cmd', nargs=argparse.REMAINDER)
+    p.set_defaults(func=split)
+
+    p = sub.add_parser('run', help='replay all segments in parallel')
+    p.add_argument('--image', action='append', required=True,
+                   help='disk image used by the command; the first one '
+                   'holds the snapshots')
+    p.add_argument('--prefix', help='only split at snapshots named so')
+    p.add_argument('-j', '--jobs', type=int,
+                   help='processes at a time (default: host CPUs)')
+    p.add_argument('--workdir', help='image copies and logs go here')
+    p.add_argument('--keep', action='store_true', help='keep image copies')
+    p.add_argument('--pandalog', help='per-segment pandalog, with {seg}')
+    p.add_argument('--merge', metavar='OUTPUT',
+                   help='merge the segment pandalogs into OUTPUT')
+    p.add_argument('cmd', nargs=argparse.REMAINDER)
+    p.set_defaults(func=run)
+
+    p = sub.add_parser('merge', help='merge pandalogs in icount order')
+    p.add_argument('-o', '--output', required=True)
+    p.add_argument('inputs', nargs='+')
+    p.set_defaults(func=merge)
+
+    args = parser.parse_args()
+    if hasattr(args, 'cmd'):
+        if args.cmd[:1] == ['--']:
+            args.cmd = args.cmd[1:]
+        if not args.cmd:
+            parser.error('missing QEMU command after --')
+    return args
+
+
+if __name__ == '__main__':
+    args = parse_arguments()
+    args.func(args)
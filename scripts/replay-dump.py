@@ -18,6 +18,7 @@
 # License along with this library; if not, see <http://www.gnu.org/licenses/>.
 
 import argparse
+import io
 import struct
 import os
 import sys
@@ -402,18 +403,44 @@ def parse_arguments():
                         required=True)
     return parser.parse_args()
 
+def read_chunked_log(fin):
+    """Return the event stream of a chunked log (REPLAY_VERSION 0xe0200d+)
+    and its version; see replay/replay-log.c for the layout."""
+    (magic, version, chunk_size,
+     index_pos, nchunks) = struct.unpack('<8sIIQQ', fin.read(32))
+    stream = bytearray()
+    while True:
+        hdr = fin.read(32)
+        if len(hdr) < 32 or (index_pos and fin.tell() - 32 >= index_pos):
+            break
+        (codec, raw_len, stored_len, _,
+         offset, icount) = struct.unpack('<IIIIQQ', hdr)
+        data = fin.read(stored_len)
+        if codec == 1:
+            import zstandard
+            data = zstandard.ZstdDecompressor().decompress(
+                data, max_output_size=raw_len)
+        stream += data
+    return version, io.BytesIO(bytes(stream))
+
 def decode_file(filename):
     "Decode a record/replay dump"
     dumpfile = open(filename, "rb")
     dumpsize = path.getsize(filename)
-    # read and throwaway the header
-    version = read_dword(dumpfile)
-    junk = read_qword(dumpfile)
+    if dumpfile.read(8) == b"QEMURRLG":
+        dumpfile.seek(0)
+        version, dumpfile = read_chunked_log(dumpfile)
+        dumpsize = len(dumpfile.getbuffer())
+    else:
+        # read and throwaway the header
+        dumpfile.seek(0)
+        version = read_dword(dumpfile)
+        junk = read_qword(dumpfile)
 
     # see REPLAY_VERSION
     print("HEADER: version 0x%x" % (version))
 
-    if version == 0xe0200c:
+    if version in (0xe0200c, 0xe0200d):
         event_decode_table = v12_event_table
         replay_state.checkpoint_start = 30
     elif version == 0xe02007:
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+#
+# Benchmark speculative translation (-accel tcg,tb-spec=on)
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+"""Run a guest to completion with tb-spec off and on, and compare both how
+long the run took and how long the vCPUs stalled translating TB misses
+themselves.
+
+The guest must shut itself down: a replay that runs to its end, say, or a
+kernel and initrd that power off. GUEST_ARG must not include -accel. The
+first run of fresh code is what tb-spec speeds up, so each run starts a
+new QEMU.
+
+Usage: bench_tb_spec.py QEMU_BINARY GUEST_ARG...
+"""
+
+import os
+import re
+import sys
+import time
+
+sys.path.append(os.path.join(os.path.dirname(__file__), '..', '..', 'python'))
+from qemu.machine import QEMUMachine
+
+import simplebench
+from results_to_text import results_to_text
+
+
+def bench_tb_spec(qemu_binary, guest_args, tb_spec):
+    """Run the guest once.
+
+    Returns {'seconds': float, 'stall-seconds': float, 'misses': int} on
+    success and {'error': str} on failure; compatible with simplebench.
+    """
+    vm = QEMUMachine(qemu_binary,
+                     args=['-accel', 'tcg,tb-spec=' + tb_spec,
+                           '-action', 'shutdown=pause'] + guest_args)
+    try:
+        start = time.monotonic()
+        vm.launch()
+        vm.event_wait('SHUTDOWN', timeout=True)
+        seconds = time.monotonic() - start
+        jit = vm.cmd('x-query-jit')['human-readable-text']
+    except Exception as e:
+        return {'error': 'qemu failed: ' + str(e), 'vm-log': vm.get_log()}
+    finally:
+        vm.shutdown()
+
+    misses = re.search(r'TB miss count\s+(\d+)', jit)
+    stall = re.search(r'TB miss stall\s+(\d+) us', jit)
+    if not misses or not stall:
+        return {'error': 'unexpected "info jit" output: ' + jit}
+    return {'seconds': seconds,
+            'stall-seconds': int(stall.group(1)) / 1000000.0,
+            'misses': int(misses.group(1))}
+
+
+def bench_func(env, case):
+    res = bench_tb_spec(env['qemu-binary'], env['guest-args'], env['tb-spec'])
+    if 'error' not in res and case['measure'] == 'stall':
+        res['run-seconds'] = res['seconds']
+        res['seconds'] = res['stall-seconds']
+    return res
+
+
+def main():
+    if len(sys.argv) < 3:
+        print(__doc__)
+        sys.exit(1)
+
+    test_cases = [
+        {'id': 'run', 'measure': 'run'},
+        {'id': 'miss stall', 'measure': 'stall'},
+    ]
+    test_envs = [
+        {
+            'id': 'tb-spec=' + tb_spec,
+            'qemu-binary': sys.argv[1],
+            'guest-args': sys.argv[2:],
+            'tb-spec': tb_spec,
+        }
+        for tb_spec in ('off', 'on')
+    ]
+
+    result = simplebench.bench(bench_func, test_envs, test_cases, count=3)
+    print(results_to_text(result))
+
+
+if __name__ == '__main__':
+    main()
@@ -457,6 +457,15 @@ static QemuOptsList qemu_icount_opts = {
         }, {
             .name = "rrsnapshot",
             .type = QEMU_OPT_STRING,
+        }, {
+            .name = "rrmemsnapshot",
+            .type = QEMU_OPT_NUMBER,
+        }, {
+            .name = "rrmemsnapshot-budget",
+            .type = QEMU_OPT_SIZE,
+        }, {
+            .name = "rrend",
+            .type = QEMU_OPT_NUMBER,
         },
         { /* end of list */ }
     },
@@ -2708,6 +2717,17 @@ static void qemu_init_board(void)
 {
     MachineClass *machine_class = MACHINE_GET_CLASS(current_machine);
 
+    /*
+     * Plugin translation callbacks run on the vCPU, so the background
+     * translator would never get to translate anything; PANDA's go
+     * through its bridge plugin too.
+     */
+    if (!QTAILQ_EMPTY(&plugin_list) && tcg_enabled() &&
+        object_property_get_bool(OBJECT(current_accel()), "tb-spec", NULL)) {
+        error_report("-accel tcg,tb-spec=on cannot be used with -plugin");
+        exit(1);
+    }
+
     /* process plugin before CPUs are created, but once -smp has been parsed */
     qemu_plugin_load_list(&plugin_list, &error_fatal);
 
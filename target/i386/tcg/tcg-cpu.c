@@ -114,17 +114,28 @@ static void x86_restore_state_to_opc(CPUState *cs,
     }
 }
 
-int x86_mmu_index_pl(CPUX86State *env, unsigned pl)
+static int x86_mmu_index(uint32_t hflags, uint32_t eflags, unsigned pl)
 {
-    int mmu_index_32 = (env->hflags & HF_CS64_MASK) ? 0 : 1;
+    int mmu_index_32 = (hflags & HF_CS64_MASK) ? 0 : 1;
     int mmu_index_base =
         pl == 3 ? MMU_USER64_IDX :
-        !(env->hflags & HF_SMAP_MASK) ? MMU_KNOSMAP64_IDX :
-        (env->eflags & AC_MASK) ? MMU_KNOSMAP64_IDX : MMU_KSMAP64_IDX;
+        !(hflags & HF_SMAP_MASK) ? MMU_KNOSMAP64_IDX :
+        (eflags & AC_MASK) ? MMU_KNOSMAP64_IDX : MMU_KSMAP64_IDX;
 
     return mmu_index_base + mmu_index_32;
 }
 
+int x86_mmu_index_pl(CPUX86State *env, unsigned pl)
+{
+    return x86_mmu_index(env->hflags, env->eflags, pl);
+}
+
+int x86_mmu_index_tb_flags(uint32_t flags)
+{
+    /* The flags of a TB are hflags, with AC among the eflags bits added */
+    return x86_mmu_index(flags, flags, flags & HF_CPL_MASK);
+}
+
 static int x86_cpu_mmu_index(CPUState *cs, bool ifetch)
 {
     CPUX86State *env = cpu_env(cs);
@@ -164,6 +175,7 @@ const TCGCPUOps x86_tcg_ops = {
      * The x86 has a strong memory model with some store-after-load re-ordering
      */
     .guest_default_memory_order = TCG_MO_ALL & ~TCG_MO_ST_LD,
+    .translate_from_tb = true,
     .initialize = tcg_x86_init,
     .translate_code = x86_translate_code,
     .get_tb_cpu_state = x86_get_tb_cpu_state,
@@ -84,4 +84,7 @@ bool tcg_cpu_realizefn(CPUState *cs, Error **errp);
 
 int x86_mmu_index_pl(CPUX86State *env, unsigned pl);
 
+/* The data mmu index of code translated for TB flags @flags */
+int x86_mmu_index_tb_flags(uint32_t flags);
+
 #endif /* TCG_CPU_H */
@@ -20,7 +20,6 @@
 
 #include "qemu/host-utils.h"
 #include "cpu.h"
-#include "accel/tcg/cpu-mmu-index.h"
 #include "exec/translation-block.h"
 #include "tcg/tcg-op.h"
 #include "tcg/tcg-op-gvec.h"
@@ -31,6 +30,7 @@
 #include "exec/helper-proto.h"
 #include "exec/helper-gen.h"
 #include "helper-tcg.h"
+#include "tcg-cpu.h"
 #include "decode-new.h"
 
 #include "exec/log.h"
@@ -252,6 +252,8 @@ STUB_HELPER(write_crN, TCGv_env env, TCGv_i32 reg, TCGv val)
 
 static void gen_jmp_rel(DisasContext *s, MemOp ot, int diff, int tb_num);
 static void gen_jmp_rel_csize(DisasContext *s, int diff, int tb_num);
+static bool trace_jmp_rel(DisasContext *s, MemOp ot, int diff,
+                          target_ulong *dest);
 static void gen_exception_gpf(DisasContext *s);
 
 /* i386 shift ops */
@@ -1708,6 +1710,34 @@ static void gen_st_modrm(DisasContext *s, X86DecodedInsn *decode, MemOp ot)
 static void gen_conditional_jump_labels(DisasContext *s, target_long diff,
                                         TCGLabel *not_taken, TCGLabel *taken)
 {
+    target_ulong dest;
+
+    if (trace_jmp_rel(s, s->dflag, diff, &dest)) {
+        /* The trace goes on with the branch taken; exit if it isn't. */
+        if (not_taken) {
+            gen_set_label(not_taken);
+        }
+        gen_jmp_rel_csize(s, 0, 1);
+        gen_set_label(taken);
+        s->pc = dest;
+        s->base.is_jmp = DISAS_NEXT;
+        return;
+    }
+    if (trace_jmp_rel(s, CODE32(s) ? MO_32 : MO_16, 0, &dest)) {
+        /* The trace goes on with the branch not taken; exit if it is. */
+        TCGLabel *cont = gen_new_label();
+
+        if (not_taken) {
+            gen_set_label(not_taken);
+        }
+        tcg_gen_br(cont);
+        gen_set_label(taken);
+        gen_jmp_rel(s, s->dflag, diff, 0);
+        gen_set_label(cont);
+        s->base.is_jmp = DISAS_NEXT;
+        return;
+    }
+
     if (not_taken) {
         gen_set_label(not_taken);
     }
@@ -2078,6 +2108,30 @@ static void gen_jmp_rel_csize(DisasContext *s, int diff, int tb_num)
     gen_jmp_rel(s, CODE32(s) ? MO_32 : MO_16, diff, tb_num);
 }
 
+/*
+ * Return true if the hot trace being translated continues at eip+diff,
+ * truncated to OT, and store that pc in *dest.
+ */
+static bool trace_jmp_rel(DisasContext *s, MemOp ot, int diff,
+                          target_ulong *dest)
+{
+    target_ulong new_pc = s->pc + diff;
+
+    /* Leave data16 branches in code32 to gen_jmp_rel. */
+    if (!s->jmp_opt || (!CODE64(s) && CODE32(s) && ot == MO_16)) {
+        return false;
+    }
+    if (!CODE64(s)) {
+        target_ulong mask = ot == MO_16 ? 0xffff : 0xffffffff;
+        new_pc = (uint32_t)(((new_pc - s->cs_base) & mask) + s->cs_base);
+    }
+    if (!translator_trace_follow(&s->base, new_pc)) {
+        return false;
+    }
+    *dest = new_pc;
+    return true;
+}
+
 static inline void gen_ldq_env_A0(DisasContext *s, int offset)
 {
     TCGv_i64 t = tcg_temp_new_i64();
@@ -3468,7 +3522,7 @@ static void i386_tr_init_disas_context(DisasContextBase *dcbase, CPUState *cpu)
     dc->cc_op = CC_OP_DYNAMIC;
     dc->cc_op_dirty = false;
     /* select memory access functions */
-    dc->mem_index = cpu_mmu_index(cpu, false);
+    dc->mem_index = x86_mmu_index_tb_flags(flags);
     dc->cpuid_features = env->features[FEAT_1_EDX];
     dc->cpuid_ext_features = env->features[FEAT_1_ECX];
     dc->cpuid_ext2_features = env->features[FEAT_8000_0001_EDX];
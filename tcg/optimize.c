@@ -2782,6 +2782,28 @@ static bool fold_xor(OptContext *ctx, TCGOp *op)
     return fold_masks_zos(ctx, op, z_mask, o_mask, s_mask);
 }
 
+/*
+ * Can fast_gen leave @op alone? Backends rely on the optimizer only to
+ * fold and canonicalize ops with constant inputs, and an op without
+ * one can't become one later. Ops that do more than define their
+ * outputs still go through the folders, which track state across ops.
+ */
+static bool fast_gen_skips(TCGOp *op, const TCGOpDef *def)
+{
+    if (def->nb_oargs == 0 ||
+        (def->flags & (TCG_OPF_BB_EXIT | TCG_OPF_BB_END |
+                       TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS |
+                       TCG_OPF_CARRY_IN | TCG_OPF_CARRY_OUT))) {
+        return false;
+    }
+    for (int i = def->nb_oargs; i < def->nb_oargs + def->nb_iargs; i++) {
+        if (arg_is_const(op->args[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
 /* Propagate constants and copies, fold constant expressions. */
 void tcg_optimize(TCGContext *s)
 {
@@ -2814,6 +2836,10 @@ void tcg_optimize(TCGContext *s)
 
         def = &tcg_op_defs[opc];
         init_arguments(&ctx, op, def->nb_oargs + def->nb_iargs);
+        if (s->fast_gen && fast_gen_skips(op, def)) {
+            finish_folding(&ctx, op);
+            continue;
+        }
         copy_propagate(&ctx, op, def->nb_oargs, def->nb_iargs);
 
         /* Pre-compute the type of the operation. */
@@ -2900,7 +2926,8 @@ void tcg_optimize(TCGContext *s)
             break;
         case INDEX_op_ld:
         case INDEX_op_ld_vec:
-            done = fold_tcg_ld_memcopy(&ctx, op);
+            done = s->fast_gen ? finish_folding(&ctx, op)
+                               : fold_tcg_ld_memcopy(&ctx, op);
             break;
         case INDEX_op_st8:
         case INDEX_op_st16:
@@ -2909,7 +2936,8 @@ void tcg_optimize(TCGContext *s)
             break;
         case INDEX_op_st:
         case INDEX_op_st_vec:
-            done = fold_tcg_st_memcopy(&ctx, op);
+            done = s->fast_gen ? fold_tcg_st(&ctx, op)
+                               : fold_tcg_st_memcopy(&ctx, op);
             break;
         case INDEX_op_mb:
             done = fold_mb(&ctx, op);
@@ -0,0 +1,45 @@
+/*
+ * Choice of the code regions to evict when the buffer is full.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "tcg/region-evict.h"
+
+size_t tcg_region_pick_oldest(const uint64_t *gen, size_t n,
+                              const size_t *busy, size_t n_busy,
+                              size_t *idx, size_t max)
+{
+    size_t picked = 0;
+
+    g_assert(max > 0);
+    for (size_t i = 0; i < n; i++) {
+        size_t j;
+
+        if (gen[i] == 0) {
+            continue;
+        }
+        for (j = 0; j < n_busy; j++) {
+            if (busy[j] == i) {
+                break;
+            }
+        }
+        if (j < n_busy) {
+            continue;
+        }
+        /* Insertion sort by age, keeping the @max oldest */
+        if (picked == max) {
+            if (gen[idx[picked - 1]] < gen[i]) {
+                continue;
+            }
+            picked--;
+        }
+        for (j = picked; j > 0 && gen[idx[j - 1]] > gen[i]; j--) {
+            idx[j] = idx[j - 1];
+        }
+        idx[j] = i;
+        picked++;
+    }
+    return picked;
+}
@@ -31,6 +31,7 @@
 #include "qemu/qtree.h"
 #include "qapi/error.h"
 #include "tcg/tcg.h"
+#include "tcg/region-evict.h"
 #include "exec/translation-block.h"
 #include "tcg-internal.h"
 #include "host/cpuinfo.h"
@@ -70,12 +71,21 @@ struct tcg_region_state {
     size_t total_size; /* size of entire buffer, >= n * stride */
 
     /* fields protected by the lock */
-    size_t current; /* current region index */
+    size_t current; /* next region not allocated since the last reset */
     size_t agg_size_full; /* aggregate size of full regions */
+    uint64_t seq; /* region allocations so far */
+    uint64_t *gen; /* per region: seq when allocated, 0 if unallocated */
+    size_t *full; /* per region: its share of agg_size_full */
+    size_t *free; /* evicted regions, ready for reuse */
+    size_t nb_free;
+    size_t nb_evicted; /* regions evicted since startup */
 };
 
 static struct tcg_region_state region;
 
+/* Where the buffer should go, if somewhere in particular */
+static void *region_wanted_addr;
+
 /*
  * This is an array of struct tcg_region_tree's, with padding.
  * We use void * to simplify the computation of region_trees[i]; each
@@ -191,10 +201,23 @@ static void tcg_region_trees_init(void)
     }
 }
 
-static struct tcg_region_tree *tc_ptr_to_region_tree(const void *p)
+/* Index of the region holding @p, a pointer into the rw buffer */
+static size_t tcg_region_index(const void *p)
 {
-    size_t region_idx;
+    if (p < region.start_aligned) {
+        return 0;
+    } else {
+        ptrdiff_t offset = p - region.start_aligned;
 
+        if (offset > region.stride * (region.n - 1)) {
+            return region.n - 1;
+        }
+        return offset / region.stride;
+    }
+}
+
+static struct tcg_region_tree *tc_ptr_to_region_tree(const void *p)
+{
     /*
      * Like tcg_splitwx_to_rw, with no assert.  The pc may come from
      * a signal handler over which the caller has no control.
@@ -205,19 +228,7 @@ static struct tcg_region_tree *tc_ptr_to_region_tree(const void *p)
             return NULL;
         }
     }
-
-    if (p < region.start_aligned) {
-        region_idx = 0;
-    } else {
-        ptrdiff_t offset = p - region.start_aligned;
-
-        if (offset > region.stride * (region.n - 1)) {
-            region_idx = region.n - 1;
-        } else {
-            region_idx = offset / region.stride;
-        }
-    }
-    return region_trees + region_idx * tree_size;
+    return region_trees + tcg_region_index(p) * tree_size;
 }
 
 void tcg_tb_insert(TranslationBlock *tb)
@@ -296,6 +307,15 @@ void tcg_tb_foreach(GTraverseFunc func, gpointer user_data)
     tcg_region_tree_unlock_all();
 }
 
+void tcg_region_tb_foreach(size_t i, GTraverseFunc func, gpointer user_data)
+{
+    struct tcg_region_tree *rt = region_trees + i * tree_size;
+
+    qemu_mutex_lock(&rt->lock);
+    q_tree_foreach(rt->tree, func, user_data);
+    qemu_mutex_unlock(&rt->lock);
+}
+
 size_t tcg_nb_tbs(void)
 {
     size_t nb_tbs = 0;
@@ -359,11 +379,17 @@ static void tcg_region_assign(TCGContext *s, size_t curr_region)
 
 static bool tcg_region_alloc__locked(TCGContext *s)
 {
-    if (region.current == region.n) {
+    size_t i;
+
+    if (region.nb_free) {
+        i = region.free[--region.nb_free];
+    } else if (region.current < region.n) {
+        i = region.current++;
+    } else {
         return true;
     }
-    tcg_region_assign(s, region.current);
-    region.current++;
+    tcg_region_assign(s, i);
+    region.gen[i] = ++region.seq;
     return false;
 }
 
@@ -374,13 +400,15 @@ static bool tcg_region_alloc__locked(TCGContext *s)
 bool tcg_region_alloc(TCGContext *s)
 {
     bool err;
-    /* read the region size now; alloc__locked will overwrite it on success */
+    /* read the region now; alloc__locked will overwrite it on success */
     size_t size_full = s->code_gen_buffer_size;
+    size_t old = tcg_region_index(s->code_gen_buffer);
 
     qemu_mutex_lock(&region.lock);
     err = tcg_region_alloc__locked(s);
     if (!err) {
-        region.agg_size_full += size_full - TCG_HIGHWATER;
+        region.full[old] = size_full - TCG_HIGHWATER;
+        region.agg_size_full += region.full[old];
     }
     qemu_mutex_unlock(&region.lock);
     return err;
@@ -412,6 +440,9 @@ void tcg_region_reset_all(void)
     qemu_mutex_lock(&region.lock);
     region.current = 0;
     region.agg_size_full = 0;
+    region.nb_free = 0;
+    memset(region.gen, 0, region.n * sizeof(region.gen[0]));
+    memset(region.full, 0, region.n * sizeof(region.full[0]));
 
     for (i = 0; i < n_ctxs; i++) {
         TCGContext *s = qatomic_read(&tcg_ctxs[i]);
@@ -422,6 +453,138 @@ void tcg_region_reset_all(void)
     tcg_region_tree_reset_all();
 }
 
+/*
+ * Ask tcg_region_init() to map the buffer at @addr. This is only a hint:
+ * the buffer goes elsewhere if @addr is taken.
+ */
+void tcg_region_request_addr(void *addr)
+{
+    region_wanted_addr = addr;
+}
+
+/* Returns the buffer start, and describes how it is cut into regions. */
+void *tcg_region_layout(size_t *prologue_size, size_t *stride,
+                        size_t *n, size_t *total_size)
+{
+    *prologue_size = region.after_prologue - region.start_aligned;
+    *stride = region.stride;
+    *n = region.n;
+    *total_size = region.total_size;
+    return region.start_aligned;
+}
+
+/*
+ * The part of region @i that holds code. Call while no context is
+ * generating code.
+ */
+void tcg_region_used(size_t i, void **pstart, size_t *psize)
+{
+    unsigned int n_ctxs = qatomic_read(&tcg_cur_ctxs);
+    void *start, *end;
+
+    tcg_region_bounds(i, &start, &end);
+    for (unsigned int j = 0; j < n_ctxs; j++) {
+        TCGContext *s = qatomic_read(&tcg_ctxs[j]);
+        if (s->code_gen_buffer == start) {
+            end = s->code_gen_ptr;
+        }
+    }
+    *pstart = start;
+    *psize = end - start;
+}
+
+/*
+ * Keep regions [0, @n) away from code generation, so that code copied
+ * there stays put, and move every context on to a fresh region. Call
+ * from a safe-work context right after a flush, before the contexts
+ * generate anything (see tb_cache_load_work()). Returns false if no
+ * region would be left for them.
+ */
+bool tcg_region_reserve(size_t n)
+{
+    unsigned int n_ctxs = qatomic_read(&tcg_cur_ctxs);
+    unsigned int i;
+
+    qemu_mutex_lock(&region.lock);
+    if (n + n_ctxs > region.n) {
+        qemu_mutex_unlock(&region.lock);
+        return false;
+    }
+    region.current = n;
+    region.nb_free = 0;
+    /* The copied code is the oldest there is, should it have to go */
+    for (i = 0; i < n; i++) {
+        region.gen[i] = ++region.seq;
+    }
+    for (i = 0; i < n_ctxs; i++) {
+        TCGContext *s = qatomic_read(&tcg_ctxs[i]);
+        tcg_region_initial_alloc__locked(s);
+    }
+    qemu_mutex_unlock(&region.lock);
+    return true;
+}
+
+/*
+ * Pick up to @max regions to evict, oldest first, into @idx. Regions a
+ * context is generating code into are never picked. Call from a
+ * safe-work context. Returns the number of regions picked.
+ */
+size_t tcg_region_oldest(size_t *idx, size_t max)
+{
+    unsigned int n_ctxs = qatomic_read(&tcg_cur_ctxs);
+    g_autofree size_t *busy = g_new(size_t, n_ctxs);
+    size_t n;
+
+    for (unsigned int i = 0; i < n_ctxs; i++) {
+        busy[i] = tcg_region_index(qatomic_read(&tcg_ctxs[i])->code_gen_buffer);
+    }
+    qemu_mutex_lock(&region.lock);
+    n = tcg_region_pick_oldest(region.gen, region.n, busy, n_ctxs, idx, max);
+    qemu_mutex_unlock(&region.lock);
+    return n;
+}
+
+/*
+ * Make region @i, whose translation blocks have all been invalidated,
+ * available for code generation again. Call from a safe-work context.
+ */
+void tcg_region_free(size_t i)
+{
+    struct tcg_region_tree *rt = region_trees + i * tree_size;
+
+    qemu_mutex_lock(&region.lock);
+    g_assert(region.gen[i] != 0);
+    region.gen[i] = 0;
+    region.agg_size_full -= region.full[i];
+    region.full[i] = 0;
+    region.free[region.nb_free++] = i;
+    region.nb_evicted++;
+    qemu_mutex_unlock(&region.lock);
+
+    qemu_mutex_lock(&rt->lock);
+    /* Increment the refcount first so that destroy acts as a reset */
+    q_tree_ref(rt->tree);
+    q_tree_destroy(rt->tree);
+    qemu_mutex_unlock(&rt->lock);
+}
+
+/* Number of regions evicted since startup */
+size_t tcg_region_nb_evicted(void)
+{
+    size_t n;
+
+    qemu_mutex_lock(&region.lock);
+    n = region.nb_evicted;
+    qemu_mutex_unlock(&region.lock);
+    return n;
+}
+
+/* Number of regions the buffer is cut into */
+size_t tcg_region_count(void)
+{
+    return region.n;
+}
+
 static size_t tcg_n_regions(size_t tb_size, unsigned max_threads)
 {
 #ifdef CONFIG_USER_ONLY
@@ -435,11 +598,9 @@ static size_t tcg_n_regions(size_t tb_size, unsigned max_threads)
      * being of reasonable size. If that's not possible we make do by evenly
      * dividing the code_gen_buffer among the vCPUs.
      *
-     * Use a single region if all we have is one vCPU thread.
+     * A single vCPU thread gets several regions too: when the buffer
+     * fills up, the oldest code is evicted a region at a time.
      */
-    if (max_threads == 1) {
-        return 1;
-    }
 
     /*
      * Try to have more regions than threads, with each region being >= 2 MB.
@@ -545,7 +706,7 @@ static int alloc_code_gen_buffer_anon(size_t size, int prot,
 {
     void *buf;
 
-    buf = mmap(NULL, size, prot, flags, -1, 0);
+    buf = mmap(region_wanted_addr, size, prot, flags, -1, 0);
     if (buf == MAP_FAILED) {
         error_setg_errno(errp, errno,
                          "allocate %zu bytes for jit buffer", size);
@@ -839,6 +1000,9 @@ void tcg_region_init(size_t tb_size, int splitwx, unsigned max_threads)
     }
 
     tcg_region_trees_init();
+    region.gen = g_new0(uint64_t, region.n);
+    region.full = g_new0(size_t, region.n);
+    region.free = g_new(size_t, region.n);
 
     /*
      * Leave the initial context initialized to the first region.
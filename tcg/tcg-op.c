@@ -2645,6 +2645,8 @@ void tcg_gen_exit_tb(const TranslationBlock *tb, unsigned idx)
 
     if (tb == NULL) {
         tcg_debug_assert(idx == 0);
+        /* The other exits follow goto_tb, or no instruction at all. */
+        plugin_gen_disable_mem_helpers();
     } else if (idx <= TB_EXIT_IDXMAX) {
 #ifdef CONFIG_DEBUG_TCG
         /* This is an exit following a goto_tb.  Verify that we have
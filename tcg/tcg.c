@@ -1942,6 +1942,7 @@ void tcg_func_start(TCGContext *s)
 
     s->nb_ops = 0;
     s->nb_labels = 0;
+    s->fast_gen = false;
     s->current_frame_offset = s->frame_start;
 
 #ifdef CONFIG_DEBUG_TCG
@@ -6583,7 +6584,9 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb, uint64_t pc_start)
     tcg_optimize(s);
 
     reachable_code_pass(s);
-    liveness_pass_0(s);
+    if (!s->fast_gen) {
+        liveness_pass_0(s);
+    }
     liveness_pass_1(s);
 
     if (s->nb_indirects > 0) {
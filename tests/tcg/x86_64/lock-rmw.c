@@ -0,0 +1,124 @@
+/*
+ * Check the results of locked read-modify-write instructions.
+ *
+ * Run with a range filtered memory callback (see run-plugin-lock-rmw-
+ * with-libmem.so): in a single-threaded process they are translated
+ * non-atomically, with the loaded value kept in temps across the
+ * instrumentation of the load.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <assert.h>
+#include <stdint.h>
+
+static uint64_t mem;
+
+static uint64_t lock_add(uint64_t orig, uint64_t val)
+{
+    mem = orig;
+    asm volatile("lock addq %1, %0" : "+m"(mem) : "r"(val));
+    return mem;
+}
+
+static uint64_t lock_xadd(uint64_t orig, uint64_t *val)
+{
+    mem = orig;
+    asm volatile("lock xaddq %1, %0" : "+m"(mem), "+r"(*val));
+    return mem;
+}
+
+static uint32_t lock_or(uint32_t orig, uint32_t val)
+{
+    uint32_t *p = (uint32_t *)&mem;
+
+    *p = orig;
+    asm volatile("lock orl %1, %0" : "+m"(*p) : "r"(val));
+    return *p;
+}
+
+static uint16_t lock_sub(uint16_t orig, uint16_t val)
+{
+    uint16_t *p = (uint16_t *)&mem;
+
+    *p = orig;
+    asm volatile("lock subw %1, %0" : "+m"(*p) : "r"(val));
+    return *p;
+}
+
+static uint64_t xchg(uint64_t orig, uint64_t *val)
+{
+    mem = orig;
+    asm volatile("xchgq %1, %0" : "+m"(mem), "+r"(*val));
+    return mem;
+}
+
+/* Returns the accumulator, which holds the old value on failure */
+static uint64_t lock_cmpxchg(uint64_t orig, uint64_t cmp, uint64_t new)
+{
+    uint64_t ret;
+
+    mem = orig;
+    asm volatile("lock cmpxchgq %2, %0"
+                 : "+m"(mem), "=a"(ret) : "r"(new), "a"(cmp));
+    return ret;
+}
+
+static uint32_t lock_cmpxchgl(uint32_t orig, uint32_t cmp, uint32_t new)
+{
+    uint32_t *p = (uint32_t *)&mem;
+    uint32_t ret;
+
+    *p = orig;
+    asm volatile("lock cmpxchgl %2, %0"
+                 : "+m"(*p), "=a"(ret) : "r"(new), "a"(cmp));
+    return ret;
+}
+
+static uint64_t lock_cmpxchg8b(uint64_t orig, uint64_t cmp, uint64_t new)
+{
+    uint32_t lo = cmp, hi = cmp >> 32;
+
+    mem = orig;
+    asm volatile("lock cmpxchg8b %0"
+                 : "+m"(mem), "+a"(lo), "+d"(hi)
+                 : "b"((uint32_t)new), "c"((uint32_t)(new >> 32)));
+    return (uint64_t)hi << 32 | lo;
+}
+
+int main(void)
+{
+    uint64_t a = 0x0123456789abcdefull, b = 0xfedcba9876543210ull;
+    uint64_t r;
+
+    for (int i = 0; i < 1000; i++, a += b >> 7, b ^= a << 3) {
+        assert(lock_add(a, b) == a + b);
+
+        r = b;
+        assert(lock_xadd(a, &r) == a + b);
+        assert(r == a);
+
+        assert(lock_or(a, b) == (uint32_t)(a | b));
+        assert(lock_sub(a, b) == (uint16_t)(a - b));
+
+        r = b;
+        assert(xchg(a, &r) == b);
+        assert(r == a);
+
+        assert(lock_cmpxchg(a, a, b) == a);
+        assert(mem == b);
+        assert(lock_cmpxchg(a, b, ~a) == a);
+        assert(mem == a);
+
+        assert(lock_cmpxchgl(a, a, b) == (uint32_t)a);
+        assert((uint32_t)mem == (uint32_t)b);
+        assert(lock_cmpxchgl(a, b, ~a) == (uint32_t)a);
+        assert((uint32_t)mem == (uint32_t)a);
+
+        assert(lock_cmpxchg8b(a, a, b) == a);
+        assert(mem == b);
+        assert(lock_cmpxchg8b(a, b, ~a) == a);
+        assert(mem == a);
+    }
+    return 0;
+}
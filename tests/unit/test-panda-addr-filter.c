@@ -0,0 +1,124 @@
+/*
+ * Test PANDA callback address filters
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "panda/cb-table.h"
+
+static void test_empty(void)
+{
+    static const panda_addr_range empty[] = {
+        { 10, 10 }, { 20, 5 },
+    };
+
+    g_assert_null(panda_addr_filter_new(NULL, 0));
+    g_assert_null(panda_addr_filter_new(empty, ARRAY_SIZE(empty)));
+}
+
+static void test_coalesce(void)
+{
+    static const panda_addr_range ranges[] = {
+        { 100, 110 },
+        { 0, 10 },
+        { 10, 20 },         /* adjacent to [0, 10) */
+        { 105, 108 },       /* inside [100, 110) */
+        { 50, 50 },         /* empty */
+        { 40, 60 },
+        { 55, 70 },         /* overlaps [40, 60) */
+    };
+    g_autofree panda_addr_filter *f =
+        panda_addr_filter_new(ranges, ARRAY_SIZE(ranges));
+
+    g_assert_nonnull(f);
+    g_assert_cmpint(f->n, ==, 3);
+    g_assert_false(f->top);
+    g_assert_cmpuint(f->ranges[0].start, ==, 0);
+    g_assert_cmpuint(f->ranges[0].end, ==, 20);
+    g_assert_cmpuint(f->ranges[1].start, ==, 40);
+    g_assert_cmpuint(f->ranges[1].end, ==, 70);
+    g_assert_cmpuint(f->ranges[2].start, ==, 100);
+    g_assert_cmpuint(f->ranges[2].end, ==, 110);
+}
+
+static void test_match(void)
+{
+    static const panda_addr_range ranges[] = {
+        { 0x2000, 0x3000 },
+        { 0x1000, 0x1001 },
+        { UINT64_MAX - 0x10, UINT64_MAX },
+    };
+    g_autofree panda_addr_filter *f =
+        panda_addr_filter_new(ranges, ARRAY_SIZE(ranges));
+
+    g_assert_false(panda_addr_filter_match(f, 0));
+    g_assert_false(panda_addr_filter_match(f, 0xfff));
+    g_assert_true(panda_addr_filter_match(f, 0x1000));
+    g_assert_false(panda_addr_filter_match(f, 0x1001));
+    g_assert_false(panda_addr_filter_match(f, 0x1fff));
+    g_assert_true(panda_addr_filter_match(f, 0x2000));
+    g_assert_true(panda_addr_filter_match(f, 0x2fff));
+    g_assert_false(panda_addr_filter_match(f, 0x3000));
+    g_assert_true(panda_addr_filter_match(f, UINT64_MAX - 0x10));
+    g_assert_true(panda_addr_filter_match(f, UINT64_MAX - 1));
+
+    /* Half-open ranges never hold UINT64_MAX; only top matches it */
+    g_assert_false(panda_addr_filter_match(f, UINT64_MAX));
+    f->top = true;
+    g_assert_true(panda_addr_filter_match(f, UINT64_MAX));
+    g_assert_false(panda_addr_filter_match(f, 0));
+}
+
+static void test_top_only(void)
+{
+    g_autofree panda_addr_filter *f = g_malloc0(sizeof(panda_addr_filter));
+
+    f->top = true;
+    g_assert_true(panda_addr_filter_match(f, UINT64_MAX));
+    g_assert_false(panda_addr_filter_match(f, 0));
+    g_assert_false(panda_addr_filter_match(f, UINT64_MAX - 1));
+}
+
+/* Compare with a linear search over the ranges as given */
+static void test_random(void)
+{
+    for (int iter = 0; iter < 200; iter++) {
+        size_t n = g_test_rand_int_range(1, 16);
+        g_autofree panda_addr_range *ranges = g_new(panda_addr_range, n);
+        g_autofree panda_addr_filter *f = NULL;
+
+        for (size_t i = 0; i < n; i++) {
+            ranges[i].start = g_test_rand_int_range(0, 1000);
+            ranges[i].end = ranges[i].start + g_test_rand_int_range(0, 100);
+        }
+        f = panda_addr_filter_new(ranges, n);
+
+        for (size_t i = 0; f && i + 1 < f->n; i++) {
+            g_assert_cmpuint(f->ranges[i].end, <, f->ranges[i + 1].start);
+        }
+        for (uint64_t addr = 0; addr < 1200; addr++) {
+            bool want = false;
+
+            for (size_t i = 0; i < n; i++) {
+                want |= addr >= ranges[i].start && addr < ranges[i].end;
+            }
+            g_assert_cmpint(f && panda_addr_filter_match(f, addr), ==, want);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/panda/addr-filter/empty", test_empty);
+    g_test_add_func("/panda/addr-filter/coalesce", test_coalesce);
+    g_test_add_func("/panda/addr-filter/match", test_match);
+    g_test_add_func("/panda/addr-filter/top-only", test_top_only);
+    g_test_add_func("/panda/addr-filter/random", test_random);
+
+    return g_test_run();
+}
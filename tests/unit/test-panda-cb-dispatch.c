@@ -0,0 +1,593 @@
+/*
+ * Test dispatch of PANDA callbacks from published tables
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/notify.h"
+#include "system/system.h"
+#include "panda/cb-register.h"
+
+static panda_cb_table *scoped_view;
+static int scoped_calls;
+
+/* Normally defined by panda/src/callbacks.c */
+panda_cb_table *panda_cb_table_scoped(panda_cb_type type, panda_cb_table *tbl)
+{
+    scoped_calls++;
+    return scoped_view;
+}
+
+static void bbe_trampoline(void *context, CPUState *cpu, TranslationBlock *tb)
+{
+    (*(panda_cb *)context).before_block_exec(cpu, tb);
+}
+
+static int insn_exec_trampoline(void *context, CPUState *cpu, uint64_t pc)
+{
+    return (*(panda_cb *)context).insn_exec(cpu, pc);
+}
+
+bool panda_lookup_cb_trampoline(panda_cb_type type,
+                                panda_cb_with_context *trampoline_cb)
+{
+    switch (type) {
+    case PANDA_CB_BEFORE_BLOCK_EXEC:
+        trampoline_cb->before_block_exec = bbe_trampoline;
+        return true;
+    case PANDA_CB_INSN_EXEC:
+        trampoline_cb->insn_exec = insn_exec_trampoline;
+        return true;
+    default:
+        return false;
+    }
+}
+
+const char *panda_cb_owner_name(void *owner)
+{
+    return owner;
+}
+
+/* Normally defined by panda/src/panda_qemu_plugin_helpers.c */
+static int subscribers_changed[PANDA_CB_LAST];
+static int insn_filters_changed;
+
+void panda_instr_subscribers_changed(panda_cb_type type)
+{
+    subscribers_changed[type]++;
+}
+
+void panda_mem_filters_changed(void)
+{
+}
+
+void panda_insn_filters_changed(const panda_addr_filter *old,
+                                const panda_addr_filter *new)
+{
+    insn_filters_changed++;
+}
+
+void qemu_add_exit_notifier(Notifier *notify)
+{
+}
+
+/* Which callbacks ran, in order, and what they were passed */
+static GString *calls;
+static CPUState *const test_cpu = (CPUState *)0x1000;
+static TranslationBlock *const test_tb = (TranslationBlock *)0x2000;
+
+static void bbe_direct(CPUState *cpu, TranslationBlock *tb)
+{
+    g_assert(cpu == test_cpu);
+    g_assert(tb == test_tb);
+    g_string_append_c(calls, 'd');
+}
+
+static void bbe_context(void *context, CPUState *cpu, TranslationBlock *tb)
+{
+    g_assert(cpu == test_cpu);
+    g_assert(tb == test_tb);
+    g_string_append(calls, context);
+}
+
+static bool translate_yes(CPUState *cpu, uint64_t pc)
+{
+    g_string_append_c(calls, 'y');
+    return pc == 0x1234;
+}
+
+static bool translate_no(void *context, CPUState *cpu, uint64_t pc)
+{
+    g_string_append_c(calls, 'n');
+    return false;
+}
+
+static void main_loop_wait_direct(void)
+{
+    g_string_append_c(calls, 'w');
+}
+
+static void main_loop_wait_context(void *context)
+{
+    g_string_append(calls, context);
+}
+
+static panda_cb_table *table_new(size_t n)
+{
+    panda_cb_table *tbl = panda_cb_table_new(n);
+
+    tbl->n = n;
+    return tbl;
+}
+
+static void set_direct(panda_cb_entry *e, panda_cb cb)
+{
+    e->cb = cb;
+    e->context = PANDA_CB_DIRECT;
+}
+
+static void set_context(panda_cb_entry *e, panda_cb_with_context cb,
+                        void *context)
+{
+    e->cb_with_context = cb;
+    e->context = context;
+}
+
+static void publish(panda_cb_type type, panda_cb_table *tbl)
+{
+    g_free(panda_cb_tables[type]);
+    qatomic_rcu_set(&panda_cb_tables[type], tbl);
+}
+
+static void dispatch_bbe(void)
+{
+    RCU_READ_LOCK_GUARD();
+    PANDA_CB_FOREACH(PANDA_CB_BEFORE_BLOCK_EXEC, e) {
+        PANDA_CB_INVOKE(e, before_block_exec, test_cpu, test_tb);
+    }
+}
+
+static void setup(void)
+{
+    if (calls) {
+        g_string_free(calls, true);
+    }
+    calls = g_string_new("");
+    for (int i = 0; i < PANDA_CB_LAST; i++) {
+        publish(i, NULL);
+    }
+    g_free(scoped_view);
+    scoped_view = NULL;
+    scoped_calls = 0;
+    memset(subscribers_changed, 0, sizeof(subscribers_changed));
+    insn_filters_changed = 0;
+    panda_cb_profile_set(false);
+}
+
+static void test_empty(void)
+{
+    setup();
+    dispatch_bbe();
+    g_assert_cmpstr(calls->str, ==, "");
+}
+
+static void test_order(void)
+{
+    panda_cb_table *tbl = table_new(3);
+
+    setup();
+    set_context(&tbl->entries[0],
+                (panda_cb_with_context){ .before_block_exec = bbe_context },
+                (void *)"a");
+    set_direct(&tbl->entries[1],
+               (panda_cb){ .before_block_exec = bbe_direct });
+    set_context(&tbl->entries[2],
+                (panda_cb_with_context){ .before_block_exec = bbe_context },
+                (void *)"b");
+    publish(PANDA_CB_BEFORE_BLOCK_EXEC, tbl);
+
+    dispatch_bbe();
+    g_assert_cmpstr(calls->str, ==, "adb");
+
+    /* Other types don't see it */
+    {
+        RCU_READ_LOCK_GUARD();
+        PANDA_CB_FOREACH(PANDA_CB_AFTER_BLOCK_EXEC, e) {
+            g_assert_not_reached();
+        }
+    }
+}
+
+static void test_result(void)
+{
+    panda_cb_table *tbl = table_new(2);
+    bool ret = false;
+
+    setup();
+    set_context(&tbl->entries[0],
+                (panda_cb_with_context){ .insn_translate = translate_no },
+                NULL);
+    set_direct(&tbl->entries[1],
+               (panda_cb){ .insn_translate = translate_yes });
+    publish(PANDA_CB_INSN_TRANSLATE, tbl);
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        PANDA_CB_FOREACH(PANDA_CB_INSN_TRANSLATE, e) {
+            ret |= PANDA_CB_INVOKE(e, insn_translate, test_cpu, 0x1234);
+        }
+    }
+    g_assert_cmpstr(calls->str, ==, "ny");
+    g_assert_true(ret);
+}
+
+static void test_no_args(void)
+{
+    panda_cb_table *tbl = table_new(2);
+
+    setup();
+    set_direct(&tbl->entries[0],
+               (panda_cb){ .main_loop_wait = main_loop_wait_direct });
+    set_context(&tbl->entries[1],
+                (panda_cb_with_context){ .main_loop_wait = main_loop_wait_context },
+                (void *)"c");
+    publish(PANDA_CB_MAIN_LOOP_WAIT, tbl);
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        PANDA_CB_FOREACH(PANDA_CB_MAIN_LOOP_WAIT, e) {
+            PANDA_CB_INVOKE0(e, main_loop_wait);
+        }
+    }
+    g_assert_cmpstr(calls->str, ==, "wc");
+}
+
+static void test_scoped(void)
+{
+    panda_cb_table *tbl = table_new(2);
+
+    setup();
+    set_context(&tbl->entries[0],
+                (panda_cb_with_context){ .before_block_exec = bbe_context },
+                (void *)"a");
+    set_context(&tbl->entries[1],
+                (panda_cb_with_context){ .before_block_exec = bbe_context },
+                (void *)"b");
+    tbl->scoped = true;
+    publish(PANDA_CB_BEFORE_BLOCK_EXEC, tbl);
+
+    /* A scoped table is dispatched from the view of the current vCPU */
+    scoped_view = table_new(1);
+    scoped_view->entries[0] = tbl->entries[1];
+    scoped_view->meta[0] = tbl->meta[1];
+    dispatch_bbe();
+    g_assert_cmpstr(calls->str, ==, "b");
+    g_assert_cmpint(scoped_calls, ==, 1);
+
+    /* Nothing in scope */
+    g_free(scoped_view);
+    scoped_view = NULL;
+    dispatch_bbe();
+    g_assert_cmpstr(calls->str, ==, "b");
+    g_assert_cmpint(scoped_calls, ==, 2);
+}
+
+static void bbe_republish(void *context, CPUState *cpu, TranslationBlock *tb)
+{
+    panda_cb_table *tbl = table_new(1);
+    panda_cb_table *old = panda_cb_tables[PANDA_CB_BEFORE_BLOCK_EXEC];
+
+    g_string_append_c(calls, 'r');
+    set_direct(&tbl->entries[0],
+               (panda_cb){ .before_block_exec = bbe_direct });
+    /* Freed after the dispatch, like g_free_rcu() would */
+    *(panda_cb_table **)context = old;
+    qatomic_rcu_set(&panda_cb_tables[PANDA_CB_BEFORE_BLOCK_EXEC], tbl);
+}
+
+static void test_republish(void)
+{
+    panda_cb_table *tbl = table_new(2);
+    panda_cb_table *retired = NULL;
+
+    setup();
+    set_context(&tbl->entries[0],
+                (panda_cb_with_context){ .before_block_exec = bbe_republish },
+                &retired);
+    set_context(&tbl->entries[1],
+                (panda_cb_with_context){ .before_block_exec = bbe_context },
+                (void *)"a");
+    publish(PANDA_CB_BEFORE_BLOCK_EXEC, tbl);
+
+    /* A callback that changes the table doesn't disturb this dispatch... */
+    dispatch_bbe();
+    g_assert_cmpstr(calls->str, ==, "ra");
+    g_assert(retired == tbl);
+    g_free(retired);
+
+    /* ...but the next one uses the new table */
+    dispatch_bbe();
+    g_assert_cmpstr(calls->str, ==, "rad");
+}
+
+static void test_profile(void)
+{
+    panda_cb_table *tbl = table_new(3);
+    uint32_t sites[3];
+    uint64_t count, ns;
+
+    setup();
+    for (int i = 0; i < 3; i++) {
+        g_autofree char *cb = g_strdup_printf("dispatch-%d", i);
+
+        sites[i] = panda_cb_profile_site("test-panda-cb-dispatch", cb);
+        set_context(&tbl->entries[i],
+                    (panda_cb_with_context){ .before_block_exec = bbe_context },
+                    (void *)"x");
+        tbl->meta[i].prof_site = sites[i];
+    }
+    g_assert_cmpint(sites[0], !=, sites[1]);
+    g_assert_cmpint(sites[1], ==,
+                    panda_cb_profile_site("test-panda-cb-dispatch",
+                                          "dispatch-1"));
+    publish(PANDA_CB_BEFORE_BLOCK_EXEC, tbl);
+
+    /* Nothing is counted while profiling is off */
+    dispatch_bbe();
+    panda_cb_profile_totals(sites[0], &count, &ns);
+    g_assert_cmpint(count, ==, 0);
+
+    /* Only entries that were invoked are charged */
+    panda_cb_profile_set(true);
+    for (int n = 0; n < 2; n++) {
+        RCU_READ_LOCK_GUARD();
+        PANDA_CB_FOREACH(PANDA_CB_BEFORE_BLOCK_EXEC, e) {
+            if (e == &tbl->entries[1]) {
+                continue;
+            }
+            PANDA_CB_INVOKE(e, before_block_exec, test_cpu, test_tb);
+        }
+    }
+    panda_cb_profile_totals(sites[0], &count, &ns);
+    g_assert_cmpint(count, ==, 2);
+    panda_cb_profile_totals(sites[1], &count, &ns);
+    g_assert_cmpint(count, ==, 0);
+    panda_cb_profile_totals(sites[2], &count, &ns);
+    g_assert_cmpint(count, ==, 2);
+    g_assert_cmpstr(calls->str, ==, "xxxxxxx");
+
+    panda_cb_profile_reset();
+    panda_cb_profile_totals(sites[0], &count, &ns);
+    g_assert_cmpint(count, ==, 0);
+    g_assert_cmpint(ns, ==, 0);
+}
+
+/*
+ * The rest registers through the API and checks what gets published.
+ * Plugin handles double as plugin names; see panda_cb_owner_name().
+ */
+static char plugin_a[] = "plugin-a";
+static char plugin_b[] = "plugin-b";
+
+static const panda_cb bbe_cb = { .before_block_exec = bbe_direct };
+static const panda_cb_with_context bbe_ctx_cb = {
+    .before_block_exec = bbe_context
+};
+
+static panda_cb_table *published(panda_cb_type type)
+{
+    return qatomic_rcu_read(&panda_cb_tables[type]);
+}
+
+static void assert_context(const panda_cb_entry *e, const char *context)
+{
+    g_assert(e->cb_with_context.before_block_exec == bbe_context);
+    g_assert(e->context == context);
+}
+
+static void assert_direct(const panda_cb_entry *e)
+{
+    g_assert(e->context == PANDA_CB_DIRECT);
+    g_assert(e->cb.before_block_exec == bbe_direct);
+}
+
+static void test_register(void)
+{
+    static const char a[] = "a", b[] = "b";
+    panda_cb_table *tbl;
+
+    setup();
+    panda_register_callback_with_context(plugin_a, PANDA_CB_BEFORE_BLOCK_EXEC,
+                                         bbe_ctx_cb, (void *)a);
+    g_assert_cmpint(subscribers_changed[PANDA_CB_BEFORE_BLOCK_EXEC], ==, 1);
+    panda_register_callback(plugin_b, PANDA_CB_BEFORE_BLOCK_EXEC, bbe_cb);
+    panda_register_callback_with_context(plugin_a, PANDA_CB_BEFORE_BLOCK_EXEC,
+                                         bbe_ctx_cb, (void *)b);
+
+    /* In registration order, with the trampoline unwrapped */
+    tbl = published(PANDA_CB_BEFORE_BLOCK_EXEC);
+    g_assert_nonnull(tbl);
+    g_assert_cmpuint(tbl->n, ==, 3);
+    g_assert_false(tbl->scoped);
+    assert_context(&tbl->entries[0], a);
+    assert_direct(&tbl->entries[1]);
+    assert_context(&tbl->entries[2], b);
+    for (int i = 0; i < 3; i++) {
+        g_assert_null(tbl->meta[i].filter);
+        g_assert_null(tbl->meta[i].asids);
+        g_assert_cmpint(tbl->meta[i].mode, ==, PANDA_CB_MODE_ANY);
+    }
+    g_assert_cmpint(tbl->meta[0].prof_site, ==,
+                    panda_cb_profile_site("plugin-a", "before_block_exec"));
+    g_assert_cmpint(tbl->meta[1].prof_site, ==,
+                    panda_cb_profile_site("plugin-b", "before_block_exec"));
+    dispatch_bbe();
+    g_assert_cmpstr(calls->str, ==, "adb");
+    g_assert_null(published(PANDA_CB_AFTER_BLOCK_EXEC));
+
+    panda_unregister_callbacks(plugin_a);
+    panda_unregister_callbacks(plugin_b);
+    g_assert_null(published(PANDA_CB_BEFORE_BLOCK_EXEC));
+    g_assert_cmpint(subscribers_changed[PANDA_CB_BEFORE_BLOCK_EXEC], ==, 2);
+}
+
+static void test_register_enable(void)
+{
+    static const char a[] = "a", b[] = "b";
+    panda_cb_table *tbl;
+
+    setup();
+    panda_register_callback_with_context(plugin_a, PANDA_CB_BEFORE_BLOCK_EXEC,
+                                         bbe_ctx_cb, (void *)a);
+    panda_register_callback(plugin_b, PANDA_CB_BEFORE_BLOCK_EXEC, bbe_cb);
+    panda_register_callback_with_context(plugin_a, PANDA_CB_BEFORE_BLOCK_EXEC,
+                                         bbe_ctx_cb, (void *)b);
+    tbl = published(PANDA_CB_BEFORE_BLOCK_EXEC);
+
+    /* Disabled entries are left out of a new table */
+    panda_disable_callback(plugin_b, PANDA_CB_BEFORE_BLOCK_EXEC, bbe_cb);
+    g_assert(published(PANDA_CB_BEFORE_BLOCK_EXEC) != tbl);
+    tbl = published(PANDA_CB_BEFORE_BLOCK_EXEC);
+    g_assert_cmpuint(tbl->n, ==, 2);
+    assert_context(&tbl->entries[0], a);
+    assert_context(&tbl->entries[1], b);
+
+    /* and come back in their place */
+    panda_enable_callback(plugin_b, PANDA_CB_BEFORE_BLOCK_EXEC, bbe_cb);
+    tbl = published(PANDA_CB_BEFORE_BLOCK_EXEC);
+    g_assert_cmpuint(tbl->n, ==, 3);
+    assert_direct(&tbl->entries[1]);
+
+    panda_disable_callback_with_context(plugin_a, PANDA_CB_BEFORE_BLOCK_EXEC,
+                                        bbe_ctx_cb, (void *)a);
+    dispatch_bbe();
+    g_assert_cmpstr(calls->str, ==, "db");
+
+    /* A type with nothing enabled publishes no table */
+    panda_disable_plugin(plugin_a);
+    panda_disable_plugin(plugin_b);
+    g_assert_null(published(PANDA_CB_BEFORE_BLOCK_EXEC));
+    g_assert_cmpint(subscribers_changed[PANDA_CB_BEFORE_BLOCK_EXEC], ==, 2);
+    dispatch_bbe();
+    g_assert_cmpstr(calls->str, ==, "db");
+
+    panda_enable_plugin(plugin_b);
+    panda_enable_plugin(plugin_a);
+    dispatch_bbe();
+    g_assert_cmpstr(calls->str, ==, "dbadb");
+
+    panda_unregister_callbacks(plugin_a);
+    panda_unregister_callbacks(plugin_b);
+}
+
+static void test_register_unregister(void)
+{
+    static const char a[] = "a", b[] = "b";
+    panda_cb_table *tbl;
+
+    setup();
+    panda_register_callback_with_context(plugin_a, PANDA_CB_BEFORE_BLOCK_EXEC,
+                                         bbe_ctx_cb, (void *)a);
+    panda_register_callback(plugin_b, PANDA_CB_BEFORE_BLOCK_EXEC, bbe_cb);
+    panda_register_callback_with_context(plugin_a, PANDA_CB_BEFORE_BLOCK_EXEC,
+                                         bbe_ctx_cb, (void *)b);
+
+    /* Only the other plugin's entries are left */
+    panda_unregister_callbacks(plugin_a);
+    tbl = published(PANDA_CB_BEFORE_BLOCK_EXEC);
+    g_assert_cmpuint(tbl->n, ==, 1);
+    assert_direct(&tbl->entries[0]);
+
+    /* Registering again goes to the end */
+    panda_register_callback_with_context(plugin_a, PANDA_CB_BEFORE_BLOCK_EXEC,
+                                         bbe_ctx_cb, (void *)a);
+    dispatch_bbe();
+    g_assert_cmpstr(calls->str, ==, "da");
+
+    panda_unregister_callbacks(plugin_b);
+    tbl = published(PANDA_CB_BEFORE_BLOCK_EXEC);
+    g_assert_cmpuint(tbl->n, ==, 1);
+    assert_context(&tbl->entries[0], a);
+    panda_unregister_callbacks(plugin_a);
+    g_assert_null(published(PANDA_CB_BEFORE_BLOCK_EXEC));
+}
+
+static int insn_exec_direct(CPUState *cpu, uint64_t pc)
+{
+    return 0;
+}
+
+static void test_register_meta(void)
+{
+    static const char a[] = "a";
+    const uint64_t asids[] = { 0x1000 };
+    const panda_addr_range ranges[] = { { 0x100, 0x200 } };
+    const panda_cb insn_cb = { .insn_exec = insn_exec_direct };
+    panda_cb_table *tbl;
+
+    setup();
+    panda_register_callback_with_context(plugin_a, PANDA_CB_BEFORE_BLOCK_EXEC,
+                                         bbe_ctx_cb, (void *)a);
+    panda_register_callback_asids(plugin_b, PANDA_CB_BEFORE_BLOCK_EXEC, bbe_cb,
+                                  asids, 1, PANDA_CB_MODE_USER);
+
+    /* The scope goes to the metadata, next to the unscoped entry */
+    tbl = published(PANDA_CB_BEFORE_BLOCK_EXEC);
+    g_assert_cmpuint(tbl->n, ==, 2);
+    g_assert_true(tbl->scoped);
+    assert_context(&tbl->entries[0], a);
+    assert_direct(&tbl->entries[1]);
+    g_assert_null(tbl->meta[0].asids);
+    g_assert_cmpint(tbl->meta[0].mode, ==, PANDA_CB_MODE_ANY);
+    g_assert_nonnull(tbl->meta[1].asids);
+    g_assert_true(panda_addr_filter_match(tbl->meta[1].asids, 0x1000));
+    g_assert_false(panda_addr_filter_match(tbl->meta[1].asids, 0x2000));
+    g_assert_cmpint(tbl->meta[1].mode, ==, PANDA_CB_MODE_USER);
+
+    panda_set_callback_asids(plugin_b, PANDA_CB_BEFORE_BLOCK_EXEC, bbe_cb,
+                             NULL, 0, PANDA_CB_MODE_ANY);
+    tbl = published(PANDA_CB_BEFORE_BLOCK_EXEC);
+    g_assert_false(tbl->scoped);
+    g_assert_null(tbl->meta[1].asids);
+    g_assert_cmpint(tbl->meta[1].mode, ==, PANDA_CB_MODE_ANY);
+
+    /* So does an address filter */
+    panda_register_callback(plugin_a, PANDA_CB_INSN_EXEC, insn_cb);
+    g_assert_null(published(PANDA_CB_INSN_EXEC)->meta[0].filter);
+    panda_set_callback_ranges(plugin_a, PANDA_CB_INSN_EXEC, insn_cb,
+                              ranges, 1);
+    g_assert_cmpint(insn_filters_changed, ==, 1);
+    tbl = published(PANDA_CB_INSN_EXEC);
+    g_assert_cmpuint(tbl->n, ==, 1);
+    g_assert(tbl->entries[0].context == PANDA_CB_DIRECT);
+    g_assert(tbl->entries[0].cb.insn_exec == insn_exec_direct);
+    g_assert_nonnull(tbl->meta[0].filter);
+    g_assert_true(panda_addr_filter_match(tbl->meta[0].filter, 0x150));
+    g_assert_false(panda_addr_filter_match(tbl->meta[0].filter, 0x200));
+
+    panda_unregister_callbacks(plugin_a);
+    panda_unregister_callbacks(plugin_b);
+    g_assert_null(published(PANDA_CB_BEFORE_BLOCK_EXEC));
+    g_assert_null(published(PANDA_CB_INSN_EXEC));
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/panda/cb-dispatch/empty", test_empty);
+    g_test_add_func("/panda/cb-dispatch/order", test_order);
+    g_test_add_func("/panda/cb-dispatch/result", test_result);
+    g_test_add_func("/panda/cb-dispatch/no-args", test_no_args);
+    g_test_add_func("/panda/cb-dispatch/scoped", test_scoped);
+    g_test_add_func("/panda/cb-dispatch/republish", test_republish);
+    g_test_add_func("/panda/cb-dispatch/profile", test_profile);
+    g_test_add_func("/panda/cb-dispatch/register", test_register);
+    g_test_add_func("/panda/cb-dispatch/register-enable", test_register_enable);
+    g_test_add_func("/panda/cb-dispatch/register-unregister",
+                    test_register_unregister);
+    g_test_add_func("/panda/cb-dispatch/register-meta", test_register_meta);
+
+    return g_test_run();
+}
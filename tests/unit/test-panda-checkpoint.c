@@ -0,0 +1,266 @@
+/*
+ * Test restoring PANDA checkpoints across branches of the tree
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "panda/checkpoint.h"
+
+/*
+ * A model of guest RAM and of checkpoint.c: the guest's dirty pages are
+ * tracked like the migration bitmap does, a root stores every page and
+ * any other checkpoint only the pages dirtied since its parent.
+ */
+#define PAGES 64
+
+typedef struct TestCkpt {
+    Checkpoint c;
+    bool stored[PAGES];
+    uint32_t data[PAGES];
+    uint32_t ram[PAGES];        /* the guest when it was taken */
+} TestCkpt;
+
+static Checkpoint *ckpts[MAX_CHECKPOINTS];
+static TestCkpt tckpts[MAX_CHECKPOINTS];
+static int nckpts;
+static int head;
+static uint32_t ram[PAGES];
+static bool dirty[PAGES];
+static unsigned long *dirty_mark[1];    /* Checkpoint.dirty of deltas */
+
+static void model_reset(void)
+{
+    memset(ckpts, 0, sizeof(ckpts));
+    memset(tckpts, 0, sizeof(tckpts));
+    memset(dirty, 0, sizeof(dirty));
+    nckpts = 0;
+    head = -1;
+    for (int p = 0; p < PAGES; p++) {
+        ram[p] = p;
+    }
+}
+
+static void guest_write(int page, uint32_t val)
+{
+    ram[page] = val;
+    dirty[page] = true;
+}
+
+/* loadvm or a machine reset: RAM changes behind the dirty bitmap's back */
+static void guest_loadvm(uint32_t val)
+{
+    for (int p = 0; p < PAGES; p += 3) {
+        ram[p] = val;
+    }
+    head = -1;
+}
+
+static int take(void)
+{
+    TestCkpt *t = &tckpts[nckpts];
+
+    t->c.num = nckpts;
+    t->c.parent = head;
+    t->c.dirty = head < 0 ? NULL : dirty_mark;
+    for (int p = 0; p < PAGES; p++) {
+        t->stored[p] = head < 0 || dirty[p];
+        t->data[p] = ram[p];
+        t->ram[p] = ram[p];
+        dirty[p] = false;
+    }
+    ckpts[nckpts] = &t->c;
+    head = nckpts;
+    return nckpts++;
+}
+
+/* Restore @target; returns the number of pages rewritten. */
+static int restore(int target)
+{
+    int path[MAX_CHECKPOINTS];
+    bool need[PAGES];
+    int n = panda_checkpoint_path(ckpts, head, target, path);
+    int loaded = 0;
+
+    for (int p = 0; p < PAGES; p++) {
+        need[p] = n < 0 || dirty[p];
+        dirty[p] = false;
+    }
+    for (int i = 0; i < n; i++) {
+        TestCkpt *t = &tckpts[path[i]];
+
+        g_assert(ckpts[path[i]]->dirty != NULL);
+        for (int p = 0; p < PAGES; p++) {
+            need[p] |= t->stored[p];
+        }
+    }
+    for (int i = target; i >= 0; i = ckpts[i]->parent) {
+        TestCkpt *t = &tckpts[i];
+
+        for (int p = 0; p < PAGES; p++) {
+            if (need[p] && t->stored[p]) {
+                ram[p] = t->data[p];
+                need[p] = false;
+                loaded++;
+            }
+        }
+    }
+    for (int p = 0; p < PAGES; p++) {
+        g_assert_false(need[p]);
+        g_assert_cmpuint(ram[p], ==, tckpts[target].ram[p]);
+    }
+    head = target;
+    return loaded;
+}
+
+static void test_path_linear(void)
+{
+    int path[MAX_CHECKPOINTS];
+    int a, b, c;
+
+    model_reset();
+    a = take();
+    b = take();
+    c = take();
+
+    /* Back up the chain: the deltas of the checkpoints we leave */
+    g_assert_cmpint(panda_checkpoint_path(ckpts, c, a, path), ==, 2);
+    g_assert_cmpint(path[0], ==, c);
+    g_assert_cmpint(path[1], ==, b);
+
+    /* Down the chain: the deltas on the way */
+    g_assert_cmpint(panda_checkpoint_path(ckpts, a, c, path), ==, 2);
+    g_assert_cmpint(path[0], ==, c);
+    g_assert_cmpint(path[1], ==, b);
+
+    g_assert_cmpint(panda_checkpoint_path(ckpts, b, b, path), ==, 0);
+    g_assert_cmpint(panda_checkpoint_path(ckpts, -1, b, path), ==, -1);
+}
+
+static void test_path_branches(void)
+{
+    int path[MAX_CHECKPOINTS];
+    int root, a1, a2, b1, b2;
+
+    /*
+     * root - a1 - a2
+     *    \
+     *     b1 - b2
+     */
+    model_reset();
+    root = take();
+    a1 = take();
+    a2 = take();
+    restore(root);
+    b1 = take();
+    b2 = take();
+
+    g_assert_cmpint(ckpts[b1]->parent, ==, root);
+    g_assert_cmpint(panda_checkpoint_path(ckpts, b2, a2, path), ==, 4);
+    g_assert_cmpint(path[0], ==, b2);
+    g_assert_cmpint(path[1], ==, b1);
+    g_assert_cmpint(path[2], ==, a2);
+    g_assert_cmpint(path[3], ==, a1);
+
+    g_assert_cmpint(panda_checkpoint_path(ckpts, a1, b1, path), ==, 2);
+    g_assert_cmpint(path[0], ==, a1);
+    g_assert_cmpint(path[1], ==, b1);
+}
+
+static void test_path_two_roots(void)
+{
+    int path[MAX_CHECKPOINTS];
+    int r1, a, r2, b;
+
+    model_reset();
+    r1 = take();
+    a = take();
+    guest_loadvm(1);
+    r2 = take();
+    b = take();
+
+    g_assert_null(ckpts[r2]->dirty);
+    g_assert_cmpint(panda_checkpoint_path(ckpts, b, a, path), ==, -1);
+    g_assert_cmpint(panda_checkpoint_path(ckpts, a, b, path), ==, -1);
+    g_assert_cmpint(panda_checkpoint_path(ckpts, b, r1, path), ==, -1);
+    g_assert_cmpint(panda_checkpoint_path(ckpts, b, r2, path), ==, 1);
+}
+
+static void test_restore_branches(void)
+{
+    int root, a, b;
+
+    model_reset();
+    guest_write(1, 100);
+    root = take();
+    guest_write(2, 200);
+    guest_write(3, 300);
+    a = take();
+    restore(root);
+    guest_write(3, 301);
+    guest_write(4, 400);
+    b = take();
+    guest_write(5, 500);
+
+    /* Pages 2-5, not all of RAM */
+    g_assert_cmpint(restore(a), ==, 4);
+    g_assert_cmpuint(ram[3], ==, 300);
+    g_assert_cmpuint(ram[4], ==, 4);
+    g_assert_cmpint(restore(b), ==, 3);
+    g_assert_cmpuint(ram[3], ==, 301);
+    g_assert_cmpint(restore(root), ==, 2);
+}
+
+static void test_restore_after_loadvm(void)
+{
+    int a, b;
+
+    model_reset();
+    take();
+    guest_write(1, 100);
+    a = take();
+    guest_write(2, 200);
+    b = take();
+
+    /* The guest is a delta to nothing known: rewrite everything */
+    guest_loadvm(7);
+    g_assert_cmpint(restore(a), ==, PAGES);
+    g_assert_cmpint(restore(b), ==, 1);
+}
+
+static void test_restore_random(void)
+{
+    model_reset();
+    take();
+    for (int i = 0; i < 2000; i++) {
+        int op = g_test_rand_int_range(0, 100);
+
+        if (op < 70) {
+            guest_write(g_test_rand_int_range(0, PAGES), i);
+        } else if (op < 80 && nckpts < MAX_CHECKPOINTS) {
+            take();
+        } else if (op < 98) {
+            restore(g_test_rand_int_range(0, nckpts));
+        } else {
+            guest_loadvm(i);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/panda/checkpoint/path-linear", test_path_linear);
+    g_test_add_func("/panda/checkpoint/path-branches", test_path_branches);
+    g_test_add_func("/panda/checkpoint/path-two-roots", test_path_two_roots);
+    g_test_add_func("/panda/checkpoint/restore-branches",
+                    test_restore_branches);
+    g_test_add_func("/panda/checkpoint/restore-after-loadvm",
+                    test_restore_after_loadvm);
+    g_test_add_func("/panda/checkpoint/restore-random", test_restore_random);
+
+    return g_test_run();
+}
@@ -0,0 +1,257 @@
+/*
+ * Test the replay log container
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+#include "system/replay.h"
+#include "../../replay/replay-internal.h"
+
+/* Normally defined by replay/replay.c */
+ReplayState replay_state;
+
+#define TEST_VERSION    0xe0020042
+#define TEST_LEN        (1300 * KiB)
+
+/* Offset of ReplayLogHeader.index_pos */
+#define TEST_INDEX_POS  16
+
+typedef struct TestMark {
+    uint64_t offset;
+    uint64_t icount;
+} TestMark;
+
+static uint8_t *stream;
+static GArray *marks;
+
+static void stream_init(void)
+{
+    if (stream) {
+        return;
+    }
+    stream = g_malloc(TEST_LEN);
+    for (size_t i = 0; i < TEST_LEN; i++) {
+        /* Some runs compress and some don't */
+        stream[i] = (i / 4096) % 2 ? i % 7 : g_test_rand_int();
+    }
+}
+
+/*
+ * Record the stream to a new file in writes of varying size, one
+ * larger than a chunk, advancing the instruction count as it goes.
+ */
+static char *record(void)
+{
+    g_autofree char *path = NULL;
+    ReplayLog *log;
+    size_t pos = 0;
+    int fd;
+
+    stream_init();
+    fd = g_file_open_tmp("test-replay-log-XXXXXX", &path, NULL);
+    g_assert_cmpint(fd, >=, 0);
+    close(fd);
+
+    if (marks) {
+        g_array_free(marks, true);
+    }
+    marks = g_array_new(false, false, sizeof(TestMark));
+    replay_state.current_icount = 0;
+    log = replay_log_open(path, REPLAY_MODE_RECORD, TEST_VERSION,
+                          &error_abort);
+    for (int i = 0; pos < TEST_LEN; i++) {
+        size_t len = MIN(i == 5 ? 300 * KiB : 1 + i * 997 % 5000,
+                         TEST_LEN - pos);
+        TestMark m = { replay_log_tell(log), replay_state.current_icount };
+
+        g_assert_cmpuint(m.offset, ==, pos);
+        g_array_append_val(marks, m);
+        g_assert_true(replay_log_write(log, stream + pos, len));
+        pos += len;
+        replay_state.current_icount += 1 + i % 3;
+    }
+    g_assert_cmpuint(replay_log_tell(log), ==, TEST_LEN);
+    replay_log_close(log);
+    return g_steal_pointer(&path);
+}
+
+static ReplayLog *play(const char *path)
+{
+    return replay_log_open(path, REPLAY_MODE_PLAY, TEST_VERSION,
+                           &error_abort);
+}
+
+static void check_read(ReplayLog *log, uint64_t offset, size_t len)
+{
+    g_autofree uint8_t *buf = g_malloc(len);
+
+    g_assert_cmpuint(replay_log_tell(log), ==, offset);
+    g_assert_true(replay_log_read(log, buf, len));
+    g_assert(memcmp(buf, stream + offset, len) == 0);
+    g_assert_cmpuint(replay_log_tell(log), ==, offset + len);
+}
+
+static void test_roundtrip(void)
+{
+    g_autofree char *path = record();
+    ReplayLog *log = play(path);
+    uint64_t pos = 0;
+    uint8_t byte;
+
+    for (int i = 0; pos < TEST_LEN; i++) {
+        size_t len = MIN(1 + i * 7919 % 100000, TEST_LEN - pos);
+
+        check_read(log, pos, len);
+        pos += len;
+    }
+    g_assert_false(replay_log_read(log, &byte, 1));
+    g_assert_true(replay_log_eof(log));
+    g_assert_false(replay_log_error(log));
+    replay_log_close(log);
+    unlink(path);
+}
+
+static void test_seek(void)
+{
+    g_autofree char *path = record();
+    ReplayLog *log = play(path);
+    uint64_t chunk = 256 * KiB;
+    static const uint64_t offsets[] = {
+        1000 * KiB, 10, 256 * KiB, 256 * KiB - 1, 0, 512 * KiB + 3,
+        TEST_LEN - 100,
+    };
+
+    for (size_t i = 0; i < ARRAY_SIZE(offsets); i++) {
+        g_assert_true(replay_log_seek(log, offsets[i]));
+        check_read(log, offsets[i], MIN(chunk, TEST_LEN - offsets[i]));
+    }
+
+    /* Every position a write started at, backwards */
+    for (int i = marks->len - 1; i >= 0; i -= 7) {
+        TestMark *m = &g_array_index(marks, TestMark, i);
+
+        g_assert_true(replay_log_seek(log, m->offset));
+        check_read(log, m->offset, MIN(4096, TEST_LEN - m->offset));
+    }
+
+    /* The end of the stream is a valid position */
+    g_assert_true(replay_log_seek(log, TEST_LEN));
+    g_assert_false(replay_log_seek(log, TEST_LEN + 1));
+    g_assert_true(replay_log_seek(log, 0));
+    check_read(log, 0, 100);
+    replay_log_close(log);
+    unlink(path);
+}
+
+/*
+ * Instruction count a chunk was started at: that of the write which
+ * filled the chunk before it.
+ */
+static uint64_t chunk_icount(uint64_t offset)
+{
+    uint64_t icount = 0;
+
+    for (guint i = 0; offset && i < marks->len; i++) {
+        TestMark *m = &g_array_index(marks, TestMark, i);
+
+        if (m->offset < offset) {
+            icount = m->icount;
+        }
+    }
+    return icount;
+}
+
+static void test_find_icount(void)
+{
+    g_autofree char *path = record();
+    ReplayLog *log = play(path);
+    uint64_t chunk = 256 * KiB;
+    uint64_t last = marks->len ?
+        g_array_index(marks, TestMark, marks->len - 1).icount : 0;
+
+    for (uint64_t icount = 0; icount <= last + 1; icount++) {
+        uint64_t want = 0, offset, start;
+
+        /* The last chunk started at or before @icount */
+        for (uint64_t o = chunk; o < TEST_LEN; o += chunk) {
+            if (chunk_icount(o) <= icount) {
+                want = o;
+            }
+        }
+        g_assert_true(replay_log_find_icount(log, icount, &offset, &start));
+        g_assert_cmpuint(offset, ==, want);
+        g_assert_cmpuint(start, ==, chunk_icount(want));
+
+        g_assert_true(replay_log_seek(log, offset));
+        check_read(log, offset, MIN(4096, TEST_LEN - offset));
+    }
+    replay_log_close(log);
+    unlink(path);
+}
+
+/* A log whose writer died before it wrote the index */
+static void test_unclosed(void)
+{
+    g_autofree char *path = record();
+    uint64_t zero = 0, index_pos;
+    uint64_t chunk = 256 * KiB;
+    uint64_t whole = TEST_LEN / chunk * chunk;
+    ReplayLog *log;
+    uint8_t byte;
+    int fd;
+
+    fd = open(path, O_RDWR);
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(pread(fd, &index_pos, 8, TEST_INDEX_POS), ==, 8);
+    index_pos = le64_to_cpu(index_pos);
+    /* Drop the index and tear the final, partial chunk */
+    g_assert_cmpint(pwrite(fd, &zero, 8, TEST_INDEX_POS), ==, 8);
+    g_assert_cmpint(ftruncate(fd, index_pos - 1), ==, 0);
+    close(fd);
+
+    log = play(path);
+    check_read(log, 0, whole);
+    g_assert_false(replay_log_read(log, &byte, 1));
+    g_assert_true(replay_log_eof(log));
+    replay_log_close(log);
+    unlink(path);
+}
+
+static void test_bad_file(void)
+{
+    g_autofree char *path = record();
+    Error *err = NULL;
+    int fd;
+
+    g_assert_null(replay_log_open(path, REPLAY_MODE_PLAY, TEST_VERSION + 1,
+                                  &err));
+    g_assert_nonnull(err);
+    error_free(err);
+    err = NULL;
+
+    fd = open(path, O_WRONLY);
+    g_assert_cmpint(pwrite(fd, "NOTALOG!", 8, 0), ==, 8);
+    close(fd);
+    g_assert_null(replay_log_open(path, REPLAY_MODE_PLAY, TEST_VERSION, &err));
+    g_assert_nonnull(err);
+    error_free(err);
+    unlink(path);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/replay/log/roundtrip", test_roundtrip);
+    g_test_add_func("/replay/log/seek", test_seek);
+    g_test_add_func("/replay/log/find-icount", test_find_icount);
+    g_test_add_func("/replay/log/unclosed", test_unclosed);
+    g_test_add_func("/replay/log/bad-file", test_bad_file);
+
+    return g_test_run();
+}
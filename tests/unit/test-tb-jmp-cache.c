@@ -0,0 +1,254 @@
+/*
+ * Test the TranslationBlock jump cache
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+
+/* As when built into libsystem, for the hashing that TLB flushes rely on */
+#define CONFIG_SOFTMMU
+#include "../../accel/tcg/tb-jmp-cache.h"
+
+/* Normally defined by page-vary-common.c */
+const TargetPageBits target_page = {
+    .decided = true, .bits = 12, .mask = -1ull << 12,
+};
+
+#define TEST_TBS 64
+
+static TranslationBlock tbs[TEST_TBS];
+
+static CPUJumpCache *jc_new(unsigned bits)
+{
+    CPUJumpCache *jc;
+
+    jc = g_malloc0(sizeof(*jc) + sizeof(jc->set[0]) * ((size_t)1 << bits));
+    jc->bits = bits;
+    return jc;
+}
+
+static TranslationBlock *tb_at(int i, vaddr pc)
+{
+    TranslationBlock *tb = &tbs[i];
+
+    tb->pc = pc;
+    tb->cs_base = i;
+    tb->flags = i * 3;
+    tb->cflags = i % 5;
+    return tb;
+}
+
+static TCGTBCPUState state_of(const TranslationBlock *tb)
+{
+    return (TCGTBCPUState) {
+        .pc = tb->pc, .cs_base = tb->cs_base,
+        .flags = tb->flags, .cflags = tb->cflags,
+    };
+}
+
+static bool hit(CPUJumpCache *jc, const TranslationBlock *tb)
+{
+    return tb_jmp_cache_get(jc, state_of(tb)) == tb;
+}
+
+/* Fill @pc with @n pcs, from @start on, that share a set */
+static void same_set(unsigned bits, vaddr start, vaddr *pc, int n)
+{
+    unsigned set = tb_jmp_cache_hash_func(start, bits);
+
+    for (vaddr p = start; n; p += 4) {
+        if (tb_jmp_cache_hash_func(p, bits) == set) {
+            *pc++ = p;
+            n--;
+        }
+    }
+}
+
+static void test_hit_miss(void)
+{
+    g_autofree CPUJumpCache *jc = jc_new(TB_JMP_CACHE_MIN_BITS);
+    TranslationBlock *tb = tb_at(1, 0x1000);
+    TCGTBCPUState s = state_of(tb);
+
+    g_assert_false(hit(jc, tb));
+    tb_jmp_cache_put(jc, tb->pc, tb);
+    g_assert_true(hit(jc, tb));
+
+    /* Any difference in the CPU state is a miss */
+    s.flags++;
+    g_assert_null(tb_jmp_cache_get(jc, s));
+    s = state_of(tb);
+    s.cs_base++;
+    g_assert_null(tb_jmp_cache_get(jc, s));
+    s = state_of(tb);
+    s.cflags++;
+    g_assert_null(tb_jmp_cache_get(jc, s));
+    s = state_of(tb);
+    s.pc += 4;
+    g_assert_null(tb_jmp_cache_get(jc, s));
+
+    g_assert_cmpuint(jc->hits, ==, 1);
+    g_assert_cmpuint(jc->misses, ==, 5);
+    g_assert_cmpuint(jc->window_lookups, ==, 6);
+    g_assert_cmpuint(jc->evictions, ==, 0);
+}
+
+static void test_lru(void)
+{
+    g_autofree CPUJumpCache *jc = jc_new(TB_JMP_CACHE_MIN_BITS);
+    TranslationBlock *tb[TB_JMP_CACHE_WAYS + 1];
+    vaddr pc[TB_JMP_CACHE_WAYS + 1];
+
+    same_set(jc->bits, 0x4000, pc, ARRAY_SIZE(pc));
+    for (int i = 0; i < TB_JMP_CACHE_WAYS; i++) {
+        tb[i] = tb_at(i, pc[i]);
+        tb_jmp_cache_put(jc, pc[i], tb[i]);
+    }
+    g_assert_cmpuint(jc->evictions, ==, 0);
+
+    /* Using the oldest entry makes the next one the least recently used */
+    g_assert_true(hit(jc, tb[0]));
+    tb[4] = tb_at(4, pc[4]);
+    tb_jmp_cache_put(jc, pc[4], tb[4]);
+    g_assert_cmpuint(jc->evictions, ==, 1);
+    g_assert_cmpuint(jc->window_evictions, ==, 1);
+
+    g_assert_false(hit(jc, tb[1]));
+    g_assert_true(hit(jc, tb[0]));
+    g_assert_true(hit(jc, tb[2]));
+    g_assert_true(hit(jc, tb[3]));
+    g_assert_true(hit(jc, tb[4]));
+}
+
+static void test_inval_tb(void)
+{
+    g_autofree CPUJumpCache *jc = jc_new(TB_JMP_CACHE_MIN_BITS);
+    TranslationBlock *tb[TB_JMP_CACHE_WAYS + 1];
+    vaddr pc[TB_JMP_CACHE_WAYS + 1];
+
+    same_set(jc->bits, 0x8000, pc, ARRAY_SIZE(pc));
+    for (int i = 0; i < TB_JMP_CACHE_WAYS; i++) {
+        tb[i] = tb_at(i, pc[i]);
+        tb_jmp_cache_put(jc, pc[i], tb[i]);
+    }
+
+    /* Only that TB goes, even if another one is cached for its pc */
+    tb_jmp_cache_inval(jc, pc[1], &tbs[TEST_TBS - 1]);
+    g_assert_true(hit(jc, tb[1]));
+    tb_jmp_cache_inval(jc, pc[1], tb[1]);
+    g_assert_false(hit(jc, tb[1]));
+    g_assert_true(hit(jc, tb[0]));
+
+    /* Its way is reused before anything else is evicted */
+    tb[4] = tb_at(4, pc[4]);
+    tb_jmp_cache_put(jc, pc[4], tb[4]);
+    g_assert_cmpuint(jc->evictions, ==, 0);
+    for (int i = 0; i <= TB_JMP_CACHE_WAYS; i++) {
+        g_assert_cmpint(hit(jc, tb[i]), ==, i != 1);
+    }
+}
+
+/* Every pc on a page hashes to the sets that a page flush clears */
+static void test_page_sets(void)
+{
+    for (unsigned bits = TB_JMP_CACHE_MIN_BITS;
+         bits <= TB_JMP_CACHE_MAX_BITS; bits++) {
+        unsigned pbits = tb_jmp_cache_page_bits(bits);
+
+        for (int iter = 0; iter < 16; iter++) {
+            vaddr page = (vaddr)g_test_rand_int() << TARGET_PAGE_BITS;
+            unsigned i0 = tb_jmp_cache_hash_page(page, bits);
+
+            g_assert_cmpuint(i0 + (1u << pbits), <=, 1u << bits);
+            for (vaddr pc = page; pc < page + TARGET_PAGE_SIZE; pc++) {
+                unsigned i = tb_jmp_cache_hash_func(pc, bits);
+
+                g_assert_cmpuint(i, >=, i0);
+                g_assert_cmpuint(i, <, i0 + (1u << pbits));
+            }
+        }
+    }
+}
+
+static void test_inval_page(void)
+{
+    g_autofree CPUJumpCache *jc = jc_new(TB_JMP_CACHE_BITS);
+    vaddr page = 0x7f0000, other = page + TARGET_PAGE_SIZE;
+    int n = 0;
+
+    /* Another page whose sets don't overlap */
+    while (tb_jmp_cache_hash_page(other, jc->bits) ==
+           tb_jmp_cache_hash_page(page, jc->bits)) {
+        other += TARGET_PAGE_SIZE;
+    }
+    for (int i = 0; i < TEST_TBS / 2; i++) {
+        vaddr offset = i * 0x7c;
+
+        tb_jmp_cache_put(jc, page + offset, tb_at(n++, page + offset));
+        tb_jmp_cache_put(jc, other + offset, tb_at(n++, other + offset));
+    }
+
+    tb_jmp_cache_inval_page(jc, page);
+    for (int i = 0; i < n; i++) {
+        g_assert_cmpint(hit(jc, &tbs[i]), ==, i % 2);
+    }
+}
+
+/* Compare with a per-set LRU list */
+static void test_random(void)
+{
+    g_autofree CPUJumpCache *jc = jc_new(TB_JMP_CACHE_MIN_BITS);
+    GQueue lru = G_QUEUE_INIT;     /* of the TBs in one set, MRU first */
+    vaddr pc[TEST_TBS];
+    uint64_t evictions = 0;
+
+    same_set(jc->bits, 0, pc, ARRAY_SIZE(pc));
+    for (int i = 0; i < TEST_TBS; i++) {
+        tb_at(i, pc[i]);
+    }
+    for (int iter = 0; iter < 20000; iter++) {
+        TranslationBlock *tb = &tbs[g_test_rand_int_range(0, 12)];
+        int op = g_test_rand_int_range(0, 10);
+        bool cached = g_queue_find(&lru, tb) != NULL;
+
+        if (op < 5) {
+            g_assert_cmpint(hit(jc, tb), ==, cached);
+            if (cached) {
+                g_queue_remove(&lru, tb);
+                g_queue_push_head(&lru, tb);
+            }
+        } else if (op < 9) {
+            if (cached) {
+                continue;
+            }
+            tb_jmp_cache_put(jc, tb->pc, tb);
+            g_queue_push_head(&lru, tb);
+            if (g_queue_get_length(&lru) > TB_JMP_CACHE_WAYS) {
+                g_queue_pop_tail(&lru);
+                evictions++;
+            }
+        } else {
+            tb_jmp_cache_inval(jc, tb->pc, tb);
+            g_queue_remove(&lru, tb);
+        }
+        g_assert_cmpuint(jc->evictions, ==, evictions);
+    }
+    g_queue_clear(&lru);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/tcg/jmp-cache/hit-miss", test_hit_miss);
+    g_test_add_func("/tcg/jmp-cache/lru", test_lru);
+    g_test_add_func("/tcg/jmp-cache/inval-tb", test_inval_tb);
+    g_test_add_func("/tcg/jmp-cache/page-sets", test_page_sets);
+    g_test_add_func("/tcg/jmp-cache/inval-page", test_inval_page);
+    g_test_add_func("/tcg/jmp-cache/random", test_random);
+
+    return g_test_run();
+}
@@ -0,0 +1,169 @@
+/*
+ * Test the choice of code regions to evict
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "tcg/region-evict.h"
+
+#define REGIONS 32
+
+static void test_oldest_first(void)
+{
+    static const uint64_t gen[] = { 5, 0, 2, 9, 1, 7, 0, 3 };
+    size_t idx[8];
+
+    g_assert_cmpuint(tcg_region_pick_oldest(gen, ARRAY_SIZE(gen), NULL, 0,
+                                            idx, 3), ==, 3);
+    g_assert_cmpuint(idx[0], ==, 4);
+    g_assert_cmpuint(idx[1], ==, 2);
+    g_assert_cmpuint(idx[2], ==, 7);
+
+    /* Unallocated regions are never picked */
+    g_assert_cmpuint(tcg_region_pick_oldest(gen, ARRAY_SIZE(gen), NULL, 0,
+                                            idx, 8), ==, 6);
+    g_assert_cmpuint(idx[5], ==, 3);
+}
+
+static void test_busy(void)
+{
+    static const uint64_t gen[] = { 1, 2, 3, 4 };
+    static const size_t busy[] = { 0, 2 };
+    static const size_t all_busy[] = { 3, 1, 0, 2 };
+    size_t idx[4];
+
+    g_assert_cmpuint(tcg_region_pick_oldest(gen, ARRAY_SIZE(gen),
+                                            busy, ARRAY_SIZE(busy),
+                                            idx, 4), ==, 2);
+    g_assert_cmpuint(idx[0], ==, 1);
+    g_assert_cmpuint(idx[1], ==, 3);
+
+    g_assert_cmpuint(tcg_region_pick_oldest(gen, ARRAY_SIZE(gen),
+                                            all_busy, ARRAY_SIZE(all_busy),
+                                            idx, 4), ==, 0);
+}
+
+/*
+ * A model of the allocator in tcg/region.c: evicted regions are reused
+ * before untouched ones, and a region is as old as its last allocation.
+ */
+typedef struct TestRegions {
+    uint64_t gen[REGIONS];
+    uint64_t seq;
+    size_t current;
+    size_t free[REGIONS];
+    size_t nb_free;
+} TestRegions;
+
+static size_t test_alloc(TestRegions *r)
+{
+    size_t i;
+
+    if (r->nb_free) {
+        i = r->free[--r->nb_free];
+    } else {
+        g_assert_cmpuint(r->current, <, REGIONS);
+        i = r->current++;
+    }
+    r->gen[i] = ++r->seq;
+    return i;
+}
+
+static void test_evict(TestRegions *r, size_t i)
+{
+    r->gen[i] = 0;
+    r->free[r->nb_free++] = i;
+}
+
+/* With one context, regions go in the order they were filled */
+static void test_fifo(void)
+{
+    TestRegions r = { 0 };
+    GQueue order = G_QUEUE_INIT;
+    size_t busy = test_alloc(&r);
+
+    for (int round = 0; round < 200; round++) {
+        size_t idx[REGIONS / 8];
+        size_t n;
+
+        /* Fill the buffer */
+        while (r.current < REGIONS || r.nb_free) {
+            g_queue_push_tail(&order, GSIZE_TO_POINTER(busy));
+            busy = test_alloc(&r);
+        }
+        n = tcg_region_pick_oldest(r.gen, REGIONS, &busy, 1,
+                                   idx, ARRAY_SIZE(idx));
+        g_assert_cmpuint(n, ==, ARRAY_SIZE(idx));
+        for (size_t i = 0; i < n; i++) {
+            g_assert_cmpuint(idx[i], ==,
+                             GPOINTER_TO_SIZE(g_queue_pop_head(&order)));
+            test_evict(&r, idx[i]);
+        }
+    }
+    g_queue_clear(&order);
+}
+
+/* Compare with sorting every candidate by age */
+static void test_random(void)
+{
+    TestRegions r = { 0 };
+
+    for (int iter = 0; iter < 2000; iter++) {
+        size_t n_busy = g_test_rand_int_range(0, 4);
+        size_t max = g_test_rand_int_range(1, REGIONS + 2);
+        size_t busy[4], idx[REGIONS + 2], want[REGIONS];
+        size_t n = 0, picked;
+
+        while (r.current < REGIONS || r.nb_free) {
+            test_alloc(&r);
+        }
+        for (size_t i = 0; i < n_busy; i++) {
+            busy[i] = g_test_rand_int_range(0, REGIONS);
+        }
+        for (size_t i = 0; i < REGIONS; i++) {
+            bool is_busy = false;
+
+            for (size_t j = 0; j < n_busy; j++) {
+                is_busy |= busy[j] == i;
+            }
+            if (r.gen[i] && !is_busy) {
+                size_t j;
+
+                for (j = n; j > 0 && r.gen[want[j - 1]] > r.gen[i]; j--) {
+                    want[j] = want[j - 1];
+                }
+                want[j] = i;
+                n++;
+            }
+        }
+
+        picked = tcg_region_pick_oldest(r.gen, REGIONS, busy, n_busy,
+                                        idx, max);
+        g_assert_cmpuint(picked, ==, MIN(n, max));
+        for (size_t i = 0; i < picked; i++) {
+            g_assert_cmpuint(idx[i], ==, want[i]);
+        }
+
+        /* Evict some of them, not necessarily the oldest */
+        for (size_t i = 0; i < picked; i++) {
+            if (g_test_rand_bit()) {
+                test_evict(&r, idx[i]);
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/tcg/region-evict/oldest-first", test_oldest_first);
+    g_test_add_func("/tcg/region-evict/busy", test_busy);
+    g_test_add_func("/tcg/region-evict/fifo", test_fifo);
+    g_test_add_func("/tcg/region-evict/random", test_random);
+
+    return g_test_run();
+}